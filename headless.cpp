@@ -0,0 +1,867 @@
+#include <algorithm>
+#include <cerrno>
+#include <chrono>
+#include <cmath>
+#include <cstdlib>
+#include <cstring>
+#include <iostream>
+#include <random>
+#include <string>
+#include <sys/mman.h>
+#include <sys/wait.h>
+#include <thread>
+#include <unistd.h>
+
+#ifdef USE_EGL
+#include <EGL/egl.h>
+#include <EGL/eglext.h>
+#endif
+
+#include <glm/glm.hpp>
+
+#include "physics/numa.hpp"
+#include "physics/physics.hpp"
+#include "physics/slab_worker.hpp"
+
+// Runs the solver without a window, and by default without a GL context, so
+// it works on nodes with no GPU at all (e.g. against pocl, or on the CPU
+// backend).
+//
+// Usage:
+//   headless [steps]
+//            [cpu|cl|gl|clcheck|glcheck|verify|hash|emit|obstacles|bodies|
+//             broadphase|3d|slabs|numa]
+//            [sph|pbf|iisph|granular] [particles] [workers]
+//   gl runs the GL backend on a surfaceless EGL context, e.g. Mesa's
+//   llvmpipe, when built with -DUSE_EGL.
+//   clcheck and glcheck step the OpenCL or GL backend from a CPU reference's
+//   state every step, and report how far the two drift apart, for the
+//   chosen solver. The check fails, with a non-zero exit, when the GPU
+//   kernels don't match the CPU ones.
+//   verify runs the CPU backend for 'steps' steps and then checks every SIMD
+//   kernel variant against the scalar reference.
+//   hash runs 'steps' steps and then reports bucket occupancy, grid query
+//   time and wasted neighbour candidates for each CellKeyMode, with the fluid
+//   as is and moved far from the origin.
+//   emit adds an emitter pouring into the tank and a sink in the far bottom
+//   corner, and reports how many particles came and went.
+//   obstacles drops the fluid onto a ramp and a post, and reports how many
+//   particles ended up inside the boundary.
+//   bodies drops a light and a heavy box into the fluid (CPU SPH only), and
+//   reports where each ended up.
+//   granular drops discs rather than fluid, and reports how far they still
+//   overlap. The world grows to fit 'particles' (2500 by default), e.g. a
+//   million discs for throughput. GRANULAR_BROADPHASE=sap or levels finds
+//   contacts by sweep and prune or the multi-level grid rather than the grid.
+//   broadphase times the grid against sweep and prune and the multi-level
+//   grid at finding contacts among 'particles' discs for size ratios from
+//   1:1 to 1:50, over 'steps' frames of small random motion (20 by
+//   default), without running a solver.
+//   3d runs the CPU SPH passes in 3D on a cube of 'particles' instead, and
+//   reports the same state. SPH_MORTON=0 turns its Morton ordering off for
+//   comparison.
+//   slabs splits 2D CPU SPH along x over 'workers' processes (4 by
+//   default), which swap halos and migrants over shared memory rings and
+//   rebalance their borders by particle count, and reports each slab and
+//   the fluid as a whole. One worker runs the same solver undivided. With
+//   SPH_PIN=1 each worker is pinned to a NUMA node, slabs spread evenly over
+//   the nodes, before it allocates anything, so its particles are on its
+//   node and only the halo crosses between nodes.
+//   numa reports the read bandwidth of each node's CPUs from each node's
+//   memory, over 'steps' passes of a 256 MiB buffer (5 by default).
+// On the CPU backend it also reports the compression left in the fluid, and
+// the neighbour evaluations and solver iterations each solver spent to get
+// there, or for SPH how much of the fluid was evaluated each step.
+// SPH_PIN=1 pins each spawned solver thread to its own CPU, node by node.
+// SPH_SLEEP=1 and SPH_TIME_BINS=n turn on sleeping and multi-rate stepping
+// over n bins. SPH_BOUNDARY_PARTICLES=0 turns boundary particles off for
+// comparison, and SPH_CELL_KEYS=hash32 or blocks picks the grid's
+// CellKeyMode.
+// SPH_UNCHECKED_CL=1 lets cl run the OpenCL kernels, which are off until
+// clcheck has passed on them.
+
+// Time 'iterations' grid rebuilds plus a 3x3 cell query per particle.
+static double timeGridQueries(SpatialGrid &grid, const uint32_t iterations) {
+  uint64_t visited = 0;
+  const auto start = std::chrono::steady_clock::now();
+  for (uint32_t i = 0; i < iterations; i++) {
+    grid.update();
+    for (const glm::vec2 &position : grid.positions) {
+      const glm::ivec2 cell_coord = grid.positionToCellCoord(position);
+      for (int32_t y = -1; y <= 1; y++) {
+        for (int32_t x = -1; x <= 1; x++) {
+          int32_t start, end;
+          grid.cellRange(cell_coord + glm::ivec2(x, y), start, end);
+          visited += end - start;
+        }
+      }
+    }
+  }
+  const std::chrono::duration<double, std::milli> elapsed =
+      std::chrono::steady_clock::now() - start;
+  std::cout << "  " << visited / iterations / grid.positions.size()
+            << " candidates per particle, " << elapsed.count() / iterations
+            << " ms per rebuild + query\n";
+  return elapsed.count();
+}
+
+static void reportHashModes(PhysicSolver &solver) {
+  for (const float offset : {0.f, 1.0e6f, -1.0e6f}) {
+    std::vector<glm::vec2> positions = solver.particles.positions;
+    for (glm::vec2 &position : positions) {
+      position += offset;
+    }
+    std::cout << "World offset " << offset << ":\n";
+
+    for (const CellKeyMode mode : {CellKeyMode::Hash32, CellKeyMode::Packed64,
+                                   CellKeyMode::Blocks}) {
+      SpatialGrid grid(positions, solver.smoothing_radius, mode);
+      std::cout << "  ";
+      grid.reportHashQuality();
+      timeGridQueries(grid, 100);
+      std::cout << "  ";
+      grid.reportQueryWaste();
+    }
+  }
+}
+
+// Mean and worst overlap left between discs, as a fraction of the distance
+// they should be apart.
+static void reportOverlap(PhysicSolver &solver) {
+  SpatialGrid &grid = *solver.spatial_grid;
+  const Particles &p = solver.particles;
+  grid.update();
+  double total = 0.0;
+  float worst = 0.f;
+  uint64_t contacts = 0;
+  for (uint32_t p_i = 0; p_i < solver.particle_count; p_i++) {
+    const glm::vec2 position = grid.positions[p_i];
+    const glm::ivec2 cell_coord = grid.positionToCellCoord(position);
+    for (int32_t y = -1; y <= 1; y++) {
+      for (int32_t x = -1; x <= 1; x++) {
+        int32_t start, end;
+        grid.cellRange(cell_coord + glm::ivec2(x, y), start, end);
+        for (int32_t i = start; i < end; i++) {
+          const int32_t n_i = grid.spatial_indicies[i];
+          const float contact = p.radii[p_i] + p.radii[n_i];
+          const float r = glm::length(position - grid.positions[n_i]);
+          if (n_i != (int32_t)p_i && r < contact) {
+            total += 1.f - r / contact;
+            worst = std::max(worst, 1.f - r / contact);
+            contacts++;
+          }
+        }
+      }
+    }
+  }
+  std::cout << contacts / 2 << " overlapping pairs, mean overlap "
+            << 100.0 * total / std::max<uint64_t>(contacts, 1)
+            << "%, worst " << 100.f * worst << "%\n";
+}
+
+// Grid, sweep and prune and multi-level grid finding the same contacts
+// among discs of radii
+// spread log-uniformly over [r, ratio * r], packed to about 60% cover and
+// jittered a little each frame. The grid's cells fit the biggest disc, so
+// small discs search cells full of other small discs.
+static void reportBroadphases(const uint32_t frames, const uint32_t count) {
+  const float r = 4.f;
+  for (const float ratio : {1.f, 2.f, 5.f, 10.f, 20.f, 50.f}) {
+    std::mt19937 random(7);
+    std::uniform_real_distribution<float> unit(0.f, 1.f);
+    std::vector<float> radii(count);
+    double area = 0.0;
+    for (float &radius : radii) {
+      radius = r * std::pow(ratio, unit(random));
+      area += 3.14159265359 * radius * radius;
+    }
+    const float side = std::sqrt(area / 0.6);
+    std::vector<glm::vec2> positions(count);
+    std::vector<float> pos_x(count), pos_y(count);
+    for (glm::vec2 &position : positions) {
+      position = side * glm::vec2(unit(random), unit(random));
+    }
+
+    SpatialGrid grid(positions, r * ratio);
+    SweepAndPrune sweep_and_prune;
+    MultiLevelGrid multi_level_grid;
+    uint64_t grid_candidates = 0, grid_contacts = 0;
+    uint64_t sap_candidates = 0, sap_contacts = 0, swaps = 0;
+    uint64_t level_candidates = 0, level_contacts = 0;
+    double grid_ms = 0.0, sap_ms = 0.0, level_ms = 0.0;
+    for (uint32_t frame = 0; frame < frames; frame++) {
+      for (uint32_t i = 0; i < count; i++) {
+        positions[i] += 0.1f * r * glm::vec2(unit(random) - 0.5f,
+                                             unit(random) - 0.5f);
+        pos_x[i] = positions[i].x;
+        pos_y[i] = positions[i].y;
+      }
+
+      auto start = std::chrono::steady_clock::now();
+      grid.update();
+      for (uint32_t a = 0; a < count; a++) {
+        const glm::ivec2 cell_coord = grid.positionToCellCoord(positions[a]);
+        for (int32_t y = -1; y <= 1; y++) {
+          for (int32_t x = -1; x <= 1; x++) {
+            int32_t begin, end;
+            grid.cellRange(cell_coord + glm::ivec2(x, y), begin, end);
+            grid_candidates += end - begin;
+            for (int32_t i = begin; i < end; i++) {
+              const uint32_t b = grid.spatial_indicies[i];
+              const glm::vec2 d = positions[a] - positions[b];
+              const float contact = radii[a] + radii[b];
+              grid_contacts += a < b && glm::dot(d, d) < contact * contact;
+            }
+          }
+        }
+      }
+      std::chrono::duration<double, std::milli> elapsed =
+          std::chrono::steady_clock::now() - start;
+      grid_ms += elapsed.count();
+
+      start = std::chrono::steady_clock::now();
+      sweep_and_prune.update(pos_x.data(), radii.data(), count, 0.f);
+      sap_candidates += sweep_and_prune.forEachPair(
+          pos_x.data(), pos_y.data(), radii.data(), 0.f,
+          [&](uint32_t, uint32_t) { sap_contacts++; });
+      elapsed = std::chrono::steady_clock::now() - start;
+      sap_ms += elapsed.count();
+      swaps += sweep_and_prune.swaps;
+
+      start = std::chrono::steady_clock::now();
+      multi_level_grid.update(pos_x.data(), pos_y.data(), radii.data(),
+                              count);
+      level_candidates += multi_level_grid.forEachPair(
+          pos_x.data(), pos_y.data(), radii.data(), 0.f,
+          [&](uint32_t, uint32_t) { level_contacts++; });
+      elapsed = std::chrono::steady_clock::now() - start;
+      level_ms += elapsed.count();
+    }
+
+    std::cout << "Size ratio 1:" << ratio << ", contacts per frame "
+              << grid_contacts / frames << " by grid, "
+              << sap_contacts / frames << " by sweep and prune, "
+              << level_contacts / frames << " by multi-level grid\n";
+    std::cout << "  grid: " << grid_ms / frames << " ms per frame, "
+              << (float)grid_candidates / frames / count
+              << " candidates per disc\n";
+    std::cout << "  sweep and prune: " << sap_ms / frames
+              << " ms per frame, " << (float)sap_candidates / frames / count
+              << " candidates per disc, " << swaps / frames
+              << " swaps per frame\n";
+    std::cout << "  multi-level grid (" << multi_level_grid.levels.size()
+              << " levels): " << level_ms / frames << " ms per frame, "
+              << (float)level_candidates / frames / count
+              << " candidates per disc\n";
+  }
+}
+
+// 3D SPH, CpuCompute's passes on a cube of particles in the corner of a box.
+static void run3d(const uint32_t steps, const uint32_t count) {
+  const float spacing = 2 * 4.f + 5;
+  const float block = std::ceil(std::cbrt((float)count)) * spacing;
+  const glm::vec3 world_size = glm::max(glm::vec3(400.f, 300.f, 300.f),
+                                        glm::vec3(2.f, 1.2f, 1.2f) * block);
+  // 2D's mass per spacing^2 as mass per spacing^3, so the lattice starts at
+  // the same density and the density-scaled forces come out alike.
+  const float particle_mass = 2.5f * spacing;
+  const float step_dt = 0.0007f;
+  // Every 32 steps, or never with SPH_MORTON=0.
+  const uint32_t morton_interval = mortonOrderFromEnv() ? 32 : 0;
+  if (morton_interval == 0) {
+    std::cout << "Morton ordering disabled\n";
+  }
+  JobSystem job_system;
+  ParticlesT<3> p(count, ParticleLayout::SoA);
+  p.fillLattice(spacing);
+  SpatialGridT<3> grid(p.positions, 16.f);
+  CpuCompute compute(p.capacity, Dimension<3>::stencil_cells);
+  const FluidParams params{16.f, particle_mass};
+
+  const auto start = std::chrono::steady_clock::now();
+  for (uint32_t i = 0; i < steps; i++) {
+    p.storePositions();
+    if (morton_interval > 0 && i % morton_interval == 0) {
+      p.sortByMorton(grid.cell_width, count);
+    }
+    grid.update();
+    compute.calcDensities(p, grid, params, step_dt, count, job_system);
+    compute.applyFluidForces(p, grid, params, step_dt, count, job_system);
+    compute.integrateInBox(p, world_size, 0.5f, step_dt, count, job_system);
+  }
+  const std::chrono::duration<double> elapsed =
+      std::chrono::steady_clock::now() - start;
+
+  p.storePositions();
+  float max_speed = 0.f, total_density = 0.f;
+  uint32_t outside = 0;
+  for (uint32_t i = 0; i < p.particle_count; i++) {
+    max_speed = std::max(
+        max_speed, glm::length(glm::vec3(p.vel_x[i], p.vel_y[i], p.vel_z[i])));
+    total_density += p.density[i];
+    const glm::vec3 position = p.positions[i];
+    outside += glm::any(glm::lessThan(position, glm::vec3(0.f))) ||
+               glm::any(glm::greaterThan(position, world_size));
+  }
+  std::cout << steps << " steps in " << elapsed.count() << "s ("
+            << steps / elapsed.count() << " steps/s)\n";
+  std::cout << "Simulated " << steps * step_dt << "s, max speed "
+            << max_speed << ", average density "
+            << total_density / p.particle_count << ", " << outside
+            << " particles outside the box\n";
+}
+
+// Read bandwidth from each node's memory by each node's CPUs: a buffer is
+// first touched from the memory's node, then read by one thread per CPU of
+// the reading node, each over its own slice.
+static void reportNumaBandwidth(const uint32_t passes) {
+  const NumaTopology topology;
+  const size_t words = (256u << 20) / sizeof(uint64_t);
+  std::cout << topology.nodeCount() << " NUMA nodes\n";
+  for (uint32_t memory_node = 0; memory_node < topology.nodeCount();
+       memory_node++) {
+    // Large enough to come straight from the OS, untouched.
+    uint64_t *buffer = (uint64_t *)std::malloc(words * sizeof(uint64_t));
+    std::thread toucher([&] {
+      pinCurrentThread(topology.node_cpus[memory_node]);
+      for (size_t i = 0; i < words; i++) {
+        buffer[i] = i;
+      }
+    });
+    toucher.join();
+
+    for (uint32_t cpu_node = 0; cpu_node < topology.nodeCount(); cpu_node++) {
+      const std::vector<uint32_t> &cpus = topology.node_cpus[cpu_node];
+      std::vector<uint64_t> sums(cpus.size());
+      std::vector<std::thread> readers;
+      const auto start = std::chrono::steady_clock::now();
+      for (uint32_t t = 0; t < cpus.size(); t++) {
+        readers.emplace_back([&, t] {
+          pinCurrentThread({cpus[t]});
+          const size_t begin = words * t / cpus.size();
+          const size_t end = words * (t + 1) / cpus.size();
+          uint64_t sum = 0;
+          for (uint32_t pass = 0; pass < passes; pass++) {
+            for (size_t i = begin; i < end; i++) {
+              sum += buffer[i];
+            }
+          }
+          sums[t] = sum;
+        });
+      }
+      for (std::thread &reader : readers) {
+        reader.join();
+      }
+      const std::chrono::duration<double> elapsed =
+          std::chrono::steady_clock::now() - start;
+
+      // Checked so the reads cannot be optimised away.
+      uint64_t sum = 0;
+      for (const uint64_t part : sums) {
+        sum += part;
+      }
+      const uint64_t expected = (uint64_t)passes * (words * (words - 1) / 2);
+      std::cout << "Memory on node " << memory_node << ", read by node "
+                << cpu_node << " (" << cpus.size() << " CPUs): "
+                << passes * words * sizeof(uint64_t) / elapsed.count() / 1e9
+                << " GB/s" << (sum == expected ? "" : " (bad sum)") << "\n";
+    }
+    std::free(buffer);
+  }
+}
+
+// What each slabs worker reports back, in memory shared with the parent.
+struct SlabResult {
+  uint32_t owned_count;
+  float x_min, x_max;
+  double seconds;
+  uint64_t migrated_count, halo_total, bytes_sent;
+  float max_speed, total_density;
+  // -1 when not pinned.
+  int32_t node;
+  int32_t ok;
+};
+
+// SlabWorkers in 'workers' processes, on the fluid block the 2D modes drop.
+static int runSlabs(const uint32_t steps, const uint32_t count,
+                    const uint32_t workers) {
+  const float spacing = 2 * 4.f + 5;
+  const float block = std::ceil(std::sqrt((float)count)) * spacing;
+  const glm::vec2 world_size =
+      glm::max(glm::vec2(1200.0f, 800.0f), glm::vec2(1.5f, 1.2f) * block);
+  const float h = 16.f;
+  if (workers == 0 || world_size.x / workers < 2.f * h) {
+    std::cerr << "Need at least one worker and slabs 2h wide\n";
+    return -1;
+  }
+
+  SlabResult *results = (SlabResult *)mmap(
+      nullptr, workers * sizeof(SlabResult), PROT_READ | PROT_WRITE,
+      MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+  if (results == MAP_FAILED) {
+    std::cerr << "Cannot map the results\n";
+    return -1;
+  }
+  const std::string prefix = "/sph-slabs-" + std::to_string(getpid());
+  // Room for many times the largest message, a halo of a full column.
+  std::vector<ShmRing *> rings =
+      SlabWorker::ringsFor(prefix, workers, 16 << 20);
+
+  // Equal slabs to start with; the fluid is all in the first few.
+  const NumaTopology topology;
+  const bool pin = threadPinningFromEnv();
+  bool ok = true;
+  uint32_t running = 0;
+  for (uint32_t rank = 0; rank < workers; rank++) {
+    const pid_t pid = fork();
+    if (pid < 0) {
+      std::cerr << "Cannot start slab " << rank << ": "
+                << std::strerror(errno) << "\n";
+      ok = false;
+      break;
+    }
+    if (pid != 0) {
+      running++;
+      continue;
+    }
+    SlabResult &result = results[rank];
+    result.ok = 0;
+    result.node = -1;
+    if (pin) {
+      // Contiguous slabs share a node, so only the borders between nodes'
+      // groups of slabs send halos across.
+      const uint32_t node = rank * topology.nodeCount() / workers;
+      if (pinCurrentThread(topology.node_cpus[node])) {
+        result.node = node;
+      }
+    }
+    try {
+      const float width = world_size.x / workers;
+      JobSystem job_system(std::max(
+          1u, std::thread::hardware_concurrency() / workers));
+      SlabWorker worker(rank, workers, rank * width, (rank + 1) * width,
+                        world_size, count, spacing, h, 2.5f, job_system,
+                        prefix);
+      const auto start = std::chrono::steady_clock::now();
+      for (uint32_t i = 0; i < steps; i++) {
+        worker.step();
+      }
+      const std::chrono::duration<double> elapsed =
+          std::chrono::steady_clock::now() - start;
+
+      const Particles &p = worker.particles;
+      result = SlabResult{worker.ownedCount(), worker.x_min, worker.x_max,
+                          elapsed.count(), worker.migrated_count,
+                          worker.halo_total, worker.bytes_sent, 0.f, 0.f,
+                          result.node, 1};
+      for (uint32_t i = 0; i < worker.ownedCount(); i++) {
+        result.max_speed = std::max(
+            result.max_speed, glm::length(glm::vec2(p.vel_x[i], p.vel_y[i])));
+        result.total_density += p.density[i];
+      }
+    } catch (const std::exception &error) {
+      std::cerr << "Slab " << rank << ": " << error.what() << "\n";
+    }
+    // Skips the parent's destructors, which own the rings.
+    _exit(result.ok ? 0 : 1);
+  }
+
+  // Once one slab has failed, or not started, its neighbours would wait on
+  // it forever, so every ring is aborted and the rest fail too.
+  auto abort_rings = [&] {
+    for (ShmRing *ring : rings) {
+      ring->abort();
+    }
+  };
+  if (!ok) {
+    abort_rings();
+  }
+  for (; running > 0; running--) {
+    int status;
+    if (waitpid(-1, &status, 0) < 0) {
+      std::cerr << "Lost track of the slabs: " << std::strerror(errno)
+                << "\n";
+      ok = false;
+      break;
+    }
+    if (ok && !(WIFEXITED(status) && WEXITSTATUS(status) == 0)) {
+      ok = false;
+      abort_rings();
+    }
+  }
+  for (ShmRing *ring : rings) {
+    delete ring;
+  }
+  if (!ok) {
+    munmap(results, workers * sizeof(SlabResult));
+    return -1;
+  }
+
+  uint32_t total_count = 0;
+  float max_speed = 0.f, total_density = 0.f;
+  double seconds = 0.0;
+  for (uint32_t rank = 0; rank < workers; rank++) {
+    const SlabResult &result = results[rank];
+    std::cout << "Slab " << rank;
+    if (result.node >= 0) {
+      std::cout << " on node " << result.node;
+    }
+    std::cout << " [" << result.x_min << ", " << result.x_max
+              << "): " << result.owned_count << " particles, "
+              << (float)result.halo_total / steps << " halo a step, " << result.migrated_count << " migrated, "
+              << (float)result.bytes_sent / steps / 1024.f
+              << " KiB sent a step\n";
+    total_count += result.owned_count;
+    max_speed = std::max(max_speed, result.max_speed);
+    total_density += result.total_density;
+    seconds = std::max(seconds, result.seconds);
+  }
+  munmap(results, workers * sizeof(SlabResult));
+  std::cout << steps << " steps in " << seconds << "s ("
+            << steps / seconds << " steps/s) on " << workers
+            << " workers\n";
+  std::cout << total_count << " of " << count
+            << " particles owned, max speed " << max_speed
+            << ", average density " << total_density / total_count << "\n";
+  return total_count == count ? 0 : -1;
+}
+
+#ifdef USE_EGL
+// A GL 4.3 core context with no window or display, e.g. on Mesa's llvmpipe,
+// so the GL backend runs where the CPU one does. Current until exit.
+static bool makeHeadlessGlContext() {
+  EGLDisplay display = EGL_NO_DISPLAY;
+  const auto getPlatformDisplay =
+      (PFNEGLGETPLATFORMDISPLAYEXTPROC)eglGetProcAddress(
+          "eglGetPlatformDisplayEXT");
+  if (getPlatformDisplay != nullptr) {
+    display = getPlatformDisplay(EGL_PLATFORM_SURFACELESS_MESA,
+                                 EGL_DEFAULT_DISPLAY, nullptr);
+  }
+  if (display == EGL_NO_DISPLAY) {
+    display = eglGetDisplay(EGL_DEFAULT_DISPLAY);
+  }
+  EGLint major, minor;
+  if (!eglInitialize(display, &major, &minor) || !eglBindAPI(EGL_OPENGL_API)) {
+    return false;
+  }
+  const EGLint attributes[] = {EGL_CONTEXT_MAJOR_VERSION,
+                               4,
+                               EGL_CONTEXT_MINOR_VERSION,
+                               3,
+                               EGL_CONTEXT_OPENGL_PROFILE_MASK,
+                               EGL_CONTEXT_OPENGL_CORE_PROFILE_BIT,
+                               EGL_NONE};
+  const EGLContext context =
+      eglCreateContext(display, nullptr, EGL_NO_CONTEXT, attributes);
+  if (context == EGL_NO_CONTEXT ||
+      !eglMakeCurrent(display, EGL_NO_SURFACE, EGL_NO_SURFACE, context)) {
+    return false;
+  }
+  if (!gladLoadGLLoader((GLADloadproc)eglGetProcAddress)) {
+    return false;
+  }
+  std::cout << "GL " << glGetString(GL_VERSION) << " on "
+            << glGetString(GL_RENDERER) << "\n";
+  return true;
+}
+#endif
+
+// Gives 'to' the particles of 'from', as a GPU backend uploads them each
+// step.
+static void copyParticles(const PhysicSolver &from, PhysicSolver &to) {
+  const Particles &a = from.particles;
+  Particles &b = to.particles;
+  b.pos_x = a.pos_x;
+  b.pos_y = a.pos_y;
+  b.vel_x = a.vel_x;
+  b.vel_y = a.vel_y;
+  b.force_x = a.force_x;
+  b.force_y = a.force_y;
+  b.density = a.density;
+  b.positions = a.positions;
+  b.radii = a.radii;
+}
+
+// Steps 'gpu' from the CPU reference's state every step and reports how far
+// its particles end up from the reference's, in smoothing radii. Starting
+// each step from the same state keeps the chaos of the fluid out of it, so
+// what is left is the kernels' own error, which float reordering keeps tiny.
+// A step can still amplify it: PBF's constraint clamps at rest density, and
+// a last-bit difference either side of it moves a particle a long way. So a
+// backend matches when under 1% of the steps drift beyond 1e-3h.
+static bool checkAgainstCpu(PhysicSolver &gpu, PhysicSolver &cpu,
+                            const uint32_t steps) {
+  // The GPU backends have none of the CPU path's extras.
+  cpu.cpu_compute->sleep_params.enabled = false;
+  cpu.cpu_compute->time_bin_params.bin_count = 1;
+  cpu.cpu_compute->boundary_particles = nullptr;
+  const float h = cpu.smoothing_radius;
+  float worst = 0.f;
+  uint32_t worst_step = 0;
+  uint32_t drifted_steps = 0;
+  for (uint32_t step = 1; step <= steps; step++) {
+    copyParticles(cpu, gpu);
+    gpu.update(0.f);
+    cpu.update(0.f);
+
+    float max_drift = 0.f, total_drift = 0.f;
+    for (uint32_t i = 0; i < cpu.particle_count; i++) {
+      const glm::vec2 drift(gpu.particles.pos_x[i] - cpu.particles.pos_x[i],
+                            gpu.particles.pos_y[i] - cpu.particles.pos_y[i]);
+      const float length = glm::length(drift);
+      // NaN counts as the worst.
+      max_drift = length > max_drift || length != length ? length : max_drift;
+      total_drift += length;
+    }
+    // Written so NaN counts as drifted.
+    if (!(max_drift <= 1e-3f * h)) {
+      drifted_steps++;
+    }
+    if (max_drift > worst || max_drift != max_drift) {
+      worst = max_drift;
+      worst_step = step;
+    }
+    if ((step & (step - 1)) == 0 || step == steps) {
+      std::cout << "Step " << step << ": drift max " << max_drift / h
+                << "h, mean " << total_drift / cpu.particle_count / h
+                << "h\n";
+    }
+  }
+  const bool ok = worst == worst && 100 * drifted_steps <= steps;
+  std::cout << drifted_steps << " of " << steps
+            << " steps drifted past 1e-3h, worst " << worst / h
+            << "h at step " << worst_step
+            << (ok ? ", GPU matches the CPU reference\n"
+                   : ", GPU does NOT match the CPU reference\n");
+  return ok;
+}
+
+// Simulated time against wall time, and whether the fluid has stayed sane.
+static void reportState(PhysicSolver &solver, const uint32_t steps,
+                        const double wall_seconds) {
+  const Particles &p = solver.particles;
+  float max_speed = 0.f;
+  bool finite = true;
+  for (uint32_t i = 0; i < solver.particle_count; i++) {
+    const glm::vec2 velocity(p.vel_x[i], p.vel_y[i]);
+    max_speed = std::max(max_speed, glm::length(velocity));
+    finite = finite && std::isfinite(p.pos_x[i]) && std::isfinite(p.pos_y[i]);
+  }
+
+  const double simulated = (double)steps * solver.sub_steps * solver.step_dt;
+  std::cout << "Simulated " << simulated << "s ("
+            << simulated / wall_seconds << " simulated s per wall s), max speed "
+            << max_speed << ", average density " << solver.average_density;
+  if (solver.mode == SolverMode::PBF) {
+    std::cout << " (rest " << solver.pbf_params.rest_density << ")";
+  }
+  std::cout << (finite ? "" : ", NOT FINITE") << "\n";
+
+  if (solver.mode == SolverMode::Granular) {
+    reportOverlap(solver);
+  }
+  if (solver.cpu_compute == nullptr) {
+    return;
+  }
+  const CpuCompute &cpu = *solver.cpu_compute;
+  if (solver.mode == SolverMode::Granular) {
+    std::cout << cpu.neighbour_evaluations / simulated
+              << " pair evaluations per simulated s, "
+              << (double)cpu.solver_iterations / steps / solver.sub_steps
+              << " iterations per step\n";
+    return;
+  }
+  // Measured against the lattice rest density whatever the mode, so the
+  // solvers are comparable.
+  const float rest_density = solver.pbf_params.rest_density;
+  double compression = 0.0;
+  for (uint32_t i = 0; i < solver.particle_count; i++) {
+    compression += std::max(p.density[i] / rest_density - 1.f, 0.f);
+  }
+  std::cout << "Average compression "
+            << 100.0 * compression / solver.particle_count << "%, "
+            << cpu.neighbour_evaluations / simulated
+            << " neighbour evaluations per simulated s";
+  if (solver.mode == SolverMode::SPH) {
+    std::cout << ", "
+              << 100.0 * cpu.active_particle_steps / cpu.particle_steps
+              << "% of particles evaluated per step";
+  } else {
+    std::cout << ", "
+              << (double)cpu.solver_iterations / steps / solver.sub_steps
+              << " iterations per step";
+  }
+  std::cout << "\n";
+}
+
+int main(int argc, char **argv) {
+  const uint32_t steps = argc > 1 ? std::atoi(argv[1]) : 1000;
+  const char *mode = argc > 2 ? argv[2] : "cpu";
+  SolverMode solver_mode = SolverMode::SPH;
+  if (argc > 3 && std::strcmp(argv[3], "pbf") == 0) {
+    solver_mode = SolverMode::PBF;
+  } else if (argc > 3 && std::strcmp(argv[3], "iisph") == 0) {
+    solver_mode = SolverMode::IISPH;
+  } else if (argc > 3 && std::strcmp(argv[3], "granular") == 0) {
+    solver_mode = SolverMode::Granular;
+  }
+  const uint32_t particle_count = argc > 4 ? std::atoi(argv[4]) : 50 * 50;
+
+  if (std::strcmp(mode, "broadphase") == 0) {
+    reportBroadphases(steps > 0 ? steps : 20, particle_count);
+    return 0;
+  }
+
+  if (std::strcmp(mode, "3d") == 0) {
+    run3d(steps, particle_count);
+    return 0;
+  }
+
+  if (std::strcmp(mode, "numa") == 0) {
+    reportNumaBandwidth(steps > 0 ? steps : 5);
+    return 0;
+  }
+
+  if (std::strcmp(mode, "slabs") == 0) {
+    return runSlabs(steps, particle_count, argc > 5 ? std::atoi(argv[5]) : 4);
+  }
+
+  ComputeBackend backend = ComputeBackend::CPU;
+  const bool check = std::strcmp(mode, "clcheck") == 0 ||
+                     std::strcmp(mode, "glcheck") == 0;
+  if (std::strcmp(mode, "cl") == 0 || std::strcmp(mode, "clcheck") == 0) {
+#ifdef USE_OPENCL
+    backend = ComputeBackend::OpenCL;
+    // Checking the unchecked kernels is the point.
+    if (check) {
+      setenv("SPH_UNCHECKED_CL", "1", 0);
+    }
+#else
+    std::cerr << "Built without USE_OPENCL\n";
+    return -1;
+#endif
+  }
+  if (std::strcmp(mode, "gl") == 0 || std::strcmp(mode, "glcheck") == 0) {
+#ifdef USE_EGL
+    if (!makeHeadlessGlContext()) {
+      std::cerr << "No headless GL 4.3 context\n";
+      return -1;
+    }
+    backend = ComputeBackend::OpenGL;
+#else
+    std::cerr << "Built without USE_EGL\n";
+    return -1;
+#endif
+  }
+
+  const float particle_radius = 4.f;
+  const float particle_mass = 2.5f;
+  // Particles spawn in a square block, 2 radii plus 5 apart.
+  const float block =
+      std::ceil(std::sqrt((float)particle_count)) * (2 * particle_radius + 5);
+  const glm::vec2 world_size =
+      glm::max(glm::vec2(1200.0f, 800.0f), glm::vec2(1.5f, 1.2f) * block);
+  const uint8_t sub_steps = 1;
+  const float smoothing_radius = 16.f;
+
+  PhysicSolver physic_solver(world_size, particle_count, particle_radius,
+                             particle_mass, sub_steps, smoothing_radius,
+                             backend, ParticleLayout::SoA, solver_mode);
+
+  if (check) {
+    PhysicSolver reference(world_size, particle_count, particle_radius,
+                           particle_mass, sub_steps, smoothing_radius,
+                           ComputeBackend::CPU, ParticleLayout::SoA,
+                           solver_mode);
+    return checkAgainstCpu(physic_solver, reference, steps) ? 0 : 1;
+  }
+
+  if (std::strcmp(mode, "emit") == 0) {
+    ParticleEmitter emitter;
+    emitter.position = glm::vec2(100.f, 300.f);
+    emitter.velocity = glm::vec2(300.f, 0.f);
+    physic_solver.addEmitter(emitter);
+    physic_solver.addSink({glm::vec2(1100.f, 0.f), glm::vec2(1200.f, 100.f)});
+  }
+
+  if (std::strcmp(mode, "obstacles") == 0) {
+    // Clear of the block the fluid spawns in, at x < 660 and y > 140.
+    physic_solver.addObstacle({glm::vec2(300.f, 0.f), glm::vec2(360.f, 0.f),
+                               glm::vec2(360.f, 120.f),
+                               glm::vec2(300.f, 120.f)});
+    physic_solver.addObstacle({glm::vec2(700.f, 0.f),
+                               glm::vec2(1200.f, 0.f),
+                               glm::vec2(1200.f, 250.f)});
+  }
+
+  if (std::strcmp(mode, "bodies") == 0) {
+    // A quarter and three times the lattice rest density, beside the block
+    // the fluid spawns in. The settled fluid sits at about half of it.
+    const float rest_density = physic_solver.pbf_params.rest_density;
+    for (const float scale : {0.25f, 3.f}) {
+      const float x = scale < 1.f ? 760.f : 960.f;
+      physic_solver.addRigidBody(
+          {glm::vec2(x, 400.f), glm::vec2(x + 120.f, 400.f),
+           glm::vec2(x + 120.f, 460.f), glm::vec2(x, 460.f)},
+          scale * rest_density);
+    }
+  }
+
+  const auto start = std::chrono::steady_clock::now();
+  for (uint32_t i = 0; i < steps; i++) {
+    physic_solver.update(0.f);
+  }
+  const std::chrono::duration<double> elapsed =
+      std::chrono::steady_clock::now() - start;
+
+  std::cout << steps << " steps in " << elapsed.count() << "s ("
+            << steps / elapsed.count() << " steps/s)\n";
+  reportState(physic_solver, steps, elapsed.count());
+  if (std::strcmp(mode, "emit") == 0) {
+    std::cout << physic_solver.emitted_count << " particles emitted, "
+              << physic_solver.drained_count << " drained, "
+              << physic_solver.particle_count << " live in a capacity of "
+              << physic_solver.particles.capacity << "\n";
+  }
+
+#ifdef USE_OPENCL
+  if (backend == ComputeBackend::OpenCL) {
+    physic_solver.gpu_compute->reportProfile();
+  }
+#endif
+
+  if (std::strcmp(mode, "obstacles") == 0) {
+    const Particles &p = physic_solver.particles;
+    uint32_t inside = 0;
+    for (uint32_t i = 0; i < physic_solver.particle_count; i++) {
+      glm::vec2 gradient;
+      const glm::vec2 position(p.pos_x[i], p.pos_y[i]);
+      inside += physic_solver.boundary.sample(position, gradient) < 0.f;
+    }
+    std::cout << inside << " particles inside the boundary\n";
+  }
+
+  if (std::strcmp(mode, "bodies") == 0) {
+    for (const RigidBody &body : physic_solver.rigid_bodies) {
+      std::cout << "Body of mass " << body.mass << " at (" << body.position.x
+                << ", " << body.position.y << "), velocity ("
+                << body.velocity.x << ", " << body.velocity.y << "), angle "
+                << body.angle << "\n";
+    }
+  }
+
+  if (std::strcmp(mode, "hash") == 0) {
+    reportHashModes(physic_solver);
+  }
+
+  if (std::strcmp(mode, "verify") == 0) {
+    physic_solver.spatial_grid->update();
+    const bool ok = physic_solver.cpu_compute->verifyKernels(
+        physic_solver.particles, *physic_solver.spatial_grid,
+        physic_solver.fluid_params);
+    return ok ? 0 : 1;
+  }
+
+  return 0;
+}
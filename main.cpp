@@ -6,6 +6,7 @@
 #include <iostream>
 
 #include "physics/physics.hpp"
+#include "physics/sim_thread.hpp"
 // #include "renderer/compute_shader.hpp"
 #include "renderer/renderer.hpp"
 
@@ -27,7 +28,7 @@ int main() {
   // GLFW: Init and config
   glfwInit();
   glfwWindowHint(GLFW_CONTEXT_VERSION_MAJOR, 4);
-  glfwWindowHint(GLFW_CONTEXT_VERSION_MINOR, 3);
+  glfwWindowHint(GLFW_CONTEXT_VERSION_MINOR, 4);
   glfwWindowHint(GLFW_OPENGL_PROFILE, GLFW_OPENGL_CORE_PROFILE);
   // glfwWindowHint(GLFW_TRANSPARENT_FRAMEBUFFER, 1);
 
@@ -57,11 +58,20 @@ int main() {
   const uint32_t particle_count = 50 * 50;
   const uint8_t sub_steps = 1;
   const float smoothing_radius = 16.f;
+  const ComputeBackend backend = ComputeBackend::CPU;
 
   PhysicSolver physic_solver(screen_size, particle_count, particle_radius,
-                             particle_mass, sub_steps, smoothing_radius);
+                             particle_mass, sub_steps, smoothing_radius,
+                             backend, ParticleLayout::SoA);
   Renderer renderer(physic_solver);
 
+  // The GL backend has to be stepped from this thread; anything else gets its
+  // own thread and hands frames over through physic_solver.frames.
+  SimThread *sim_thread = nullptr;
+  if (backend != ComputeBackend::OpenGL) {
+    sim_thread = new SimThread(physic_solver);
+  }
+
   // Render loop
   while (!glfwWindowShouldClose(window)) {
     // Update delta time
@@ -77,7 +87,9 @@ int main() {
     glClearColor(0.9f, 0.9f, 0.9f, 1.0f); // Set the clearing colour
     glClear(GL_COLOR_BUFFER_BIT);         // Use the clearing colour
 
-    physic_solver.update(dt);
+    if (sim_thread == nullptr) {
+      physic_solver.update(dt);
+    }
     renderer.drawParticles();
 
     glfwSwapBuffers(window); // Double buffering: swap current OpenGL colour
@@ -89,6 +101,7 @@ int main() {
   }
 
   // Clean up
+  delete sim_thread;
   glfwTerminate();
   return 0;
 }
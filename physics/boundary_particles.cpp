@@ -0,0 +1,115 @@
+#include "boundary_particles.hpp"
+
+#include <cmath>
+
+#include "fluid_params.hpp"
+
+BoundaryParticles::BoundaryParticles(const float _h)
+    : h(_h), grid(positions, _h), moving_grid(moving_positions, _h) {}
+
+void BoundaryParticles::build(const SdfGrid &sdf, const glm::vec2 world_size,
+                              const float spacing,
+                              const float rest_density) {
+  this->positions.clear();
+
+  // Lattice rows sit on the world box walls. The field is clamped outside
+  // its grid, which still reads as solid, so the band carries on to just
+  // under h past the walls.
+  const int32_t extent = (int32_t)std::ceil(this->h / spacing) - 1;
+  const int32_t columns = (int32_t)std::ceil(world_size.x / spacing);
+  const int32_t rows = (int32_t)std::ceil(world_size.y / spacing);
+  for (int32_t y = -extent; y <= rows + extent; y++) {
+    for (int32_t x = -extent; x <= columns + extent; x++) {
+      const glm::vec2 position = spacing * glm::vec2(x, y);
+      glm::vec2 gradient;
+      const float distance = sdf.sample(position, gradient);
+      if (distance <= 0.f && distance > -this->h) {
+        this->positions.push_back(position);
+      }
+    }
+  }
+
+  this->static_count = this->positions.size();
+  this->moving_positions.clear();
+  this->grid.update();
+  this->pos_x.resize(this->static_count);
+  this->pos_y.resize(this->static_count);
+  this->psi.resize(this->static_count);
+  this->indicies = this->grid.spatial_indicies;
+  for (uint32_t b = 0; b < this->static_count; b++) {
+    this->pos_x[b] = this->positions[b].x;
+    this->pos_y[b] = this->positions[b].y;
+  }
+  this->updateMoving();
+  this->computePsi(0, this->static_count, rest_density);
+}
+
+uint32_t BoundaryParticles::addMoving(const std::vector<glm::vec2> &samples,
+                                      const float rest_density) {
+  const uint32_t first = this->count();
+  this->moving_positions.insert(this->moving_positions.end(),
+                                samples.begin(), samples.end());
+  this->updateMoving();
+  this->computePsi(first, this->count(), rest_density);
+  return first;
+}
+
+void BoundaryParticles::updateMoving() {
+  const uint32_t count = this->count();
+  this->pos_x.resize(count);
+  this->pos_y.resize(count);
+  this->psi.resize(count);
+  this->indicies.resize(count);
+  this->moving_grid.update();
+  for (uint32_t i = 0; i < this->moving_positions.size(); i++) {
+    const uint32_t b = this->static_count + i;
+    this->pos_x[b] = this->moving_positions[i].x;
+    this->pos_y[b] = this->moving_positions[i].y;
+    this->indicies[b] =
+        this->static_count + this->moving_grid.spatial_indicies[i];
+  }
+}
+
+void BoundaryParticles::cellRanges(const glm::ivec2 cell_coord,
+                                   int32_t *ranges) {
+  this->grid.cellRange(cell_coord, ranges[0], ranges[1]);
+  this->moving_grid.cellRange(cell_coord, ranges[2], ranges[3]);
+  ranges[2] += this->static_count;
+  ranges[3] += this->static_count;
+}
+
+void BoundaryParticles::computePsi(const uint32_t begin, const uint32_t end,
+                                   const float rest_density) {
+  // Same 2D poly6 as the density pass, without the mass.
+  const float h2 = this->h * this->h;
+  const float poly6 =
+      KernelConstants<2>::poly6 / (3.14159265359f * std::pow(this->h, 8.f));
+  const bool moving = begin >= this->static_count;
+  for (uint32_t b = begin; b < end; b++) {
+    const glm::vec2 sample(this->pos_x[b], this->pos_y[b]);
+    const glm::ivec2 cell_coord = this->grid.positionToCellCoord(sample);
+    float kernel_sum = 0.f;
+    for (int32_t y = -1; y <= 1; y++) {
+      for (int32_t x = -1; x <= 1; x++) {
+        int32_t ranges[4];
+        this->cellRanges(cell_coord + glm::ivec2(x, y), ranges);
+        for (int32_t i = ranges[moving ? 2 : 0]; i < ranges[moving ? 3 : 1];
+             i++) {
+          const int32_t k = this->indicies[i];
+          if (k < (int32_t)begin || k >= (int32_t)end) {
+            continue;
+          }
+          const glm::vec2 d =
+              sample - glm::vec2(this->pos_x[k], this->pos_y[k]);
+          const float r2 = glm::dot(d, d);
+          if (r2 < h2) {
+            const float q = h2 - r2;
+            kernel_sum += poly6 * q * q * q;
+          }
+        }
+      }
+    }
+    // kernel_sum includes the sample itself, so is never zero.
+    this->psi[b] = rest_density / kernel_sum;
+  }
+}
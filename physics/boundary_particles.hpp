@@ -0,0 +1,76 @@
+#pragma once
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <vector>
+
+#include <glm/glm.hpp>
+
+#include "particles.hpp"
+#include "sdf.hpp"
+#include "spatial_grid.hpp"
+
+// Boundary samples (Akinci et al. 2012) for the CPU SPH passes. They add
+// density to the fluid around them and push back with each fluid particle's
+// own pressure. The static ones fill the solid band within h of the
+// boundary surface, so a particle at a wall sees full kernel support instead
+// of a density deficit. Each sample's volume comes from the samples around
+// it, so uneven sampling at corners doesn't over- or under-count:
+//   V_b = 1 / sum_k W(x_b - x_k),  psi_b = rest_density * V_b
+// The static samples never move, so their grid is built once per change of
+// the boundary and nothing about them is integrated or uploaded per step.
+// Samples of rigid bodies (see RigidBody) follow them, in a grid of their
+// own, so moving a body only re-buckets the bodies' samples.
+struct BoundaryParticles {
+  float h;
+  // The static samples, and the moving ones, for their grids, which read AoS
+  // positions; the kernels read the streams, which hold both.
+  std::vector<glm::vec2> positions;
+  std::vector<glm::vec2> moving_positions;
+  AlignedVector<float> pos_x, pos_y;
+  // psi_b, the mass each sample stands in for.
+  AlignedVector<float> psi;
+  SpatialGrid grid;
+  SpatialGrid moving_grid;
+  // Samples [0, static_count) are the static boundary, the rest move.
+  uint32_t static_count = 0;
+  // Both grids' spatial_indicies as sample indices, the static grid's then
+  // the moving grid's, so one set of ranges covers either (see cellRanges).
+  std::vector<int32_t> indicies;
+
+  BoundaryParticles(const float _h);
+
+  uint32_t count() const {
+    return this->static_count + this->moving_positions.size();
+  }
+
+  // Replaces every sample with a lattice of 'spacing' over the band
+  // -h < distance <= 0 of 'sdf', and works out their volumes.
+  void build(const SdfGrid &sdf, const glm::vec2 world_size,
+             const float spacing, const float rest_density);
+
+  // Appends samples that move with a rigid body. Their volumes only count
+  // each other, so they stay right wherever the body goes. Returns the
+  // index of the first.
+  uint32_t addMoving(const std::vector<glm::vec2> &samples,
+                     const float rest_density);
+
+  // Copies the moving samples into the streams and rebuilds their grid,
+  // after bodies have moved. The static samples are left alone.
+  void updateMoving();
+
+  // [start, end) into 'indicies' of the samples in 'cell_coord': the static
+  // ones in ranges[0, 1] and the moving ones in ranges[2, 3].
+  void cellRanges(const glm::ivec2 cell_coord, int32_t *ranges);
+
+  // psi for samples [begin, end), which are all static or all moving,
+  // counting only each other.
+  void computePsi(const uint32_t begin, const uint32_t end,
+                  const float rest_density);
+};
+
+// On unless SPH_BOUNDARY_PARTICLES=0.
+inline bool boundaryParticlesFromEnv() {
+  const char *requested = std::getenv("SPH_BOUNDARY_PARTICLES");
+  return requested == nullptr || std::strcmp(requested, "0") != 0;
+}
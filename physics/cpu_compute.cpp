@@ -0,0 +1,710 @@
+#include "cpu_compute.hpp"
+
+#include <algorithm>
+#include <cmath>
+#include <cstdlib>
+#include <cstring>
+#include <iostream>
+#include <stdexcept>
+
+bool cpuSupportsKernels(const CpuKernelTable &kernels) {
+  if (&kernels == &avx512_kernels) {
+    return __builtin_cpu_supports("avx512f");
+  }
+  if (&kernels == &avx2_kernels) {
+    return __builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma");
+  }
+  if (&kernels == &sse4_kernels) {
+    return __builtin_cpu_supports("sse4.1");
+  }
+  return true;
+}
+
+const CpuKernelTable &selectCpuKernels() {
+  const CpuKernelTable *all_kernels[] = {&avx512_kernels, &avx2_kernels,
+                                         &sse4_kernels, &scalar_kernels};
+
+  const char *requested = std::getenv("SPH_CPU_KERNELS");
+  if (requested != nullptr) {
+    for (const CpuKernelTable *kernels : all_kernels) {
+      if (std::strcmp(kernels->name, requested) == 0 &&
+          cpuSupportsKernels(*kernels)) {
+        return *kernels;
+      }
+    }
+    std::cerr << "SPH_CPU_KERNELS=" << requested
+              << " is unknown or unsupported, picking automatically\n";
+  }
+
+  for (const CpuKernelTable *kernels : all_kernels) {
+    if (cpuSupportsKernels(*kernels)) {
+      return *kernels;
+    }
+  }
+  return scalar_kernels;
+}
+
+CpuCompute::CpuCompute(const uint32_t capacity,
+                       const uint32_t _stencil_cells)
+    : kernels(selectCpuKernels()), stencil_cells(_stencil_cells),
+      sleep_params(sleepParamsFromEnv()),
+      time_bin_params(timeBinParamsFromEnv()) {
+  this->reserve(capacity);
+  std::cout << "Using CPU kernels: " << this->kernels.name << "\n";
+}
+
+void CpuCompute::reserve(const uint32_t capacity) {
+  if (capacity <= this->capacity) {
+    return;
+  }
+  this->capacity = capacity;
+
+  this->neighbour_ranges.resize(2 * this->stencil_cells * capacity);
+  this->boundary_stencils.resize(capacity);
+  this->boundary_ranges.resize(36 * capacity);
+  for (AlignedVector<float> *stream :
+       {&this->sleep_pos_x, &this->sleep_pos_y, &this->sleep_density,
+        &this->pbf_lambda, &this->iisph_pressure, &this->iisph_pressure_next,
+        &this->iisph_d_ii_x, &this->iisph_d_ii_y, &this->iisph_d_ij_p_x,
+        &this->iisph_d_ij_p_y, &this->iisph_a_ii, &this->iisph_density_adv,
+        &this->held_force_x, &this->held_force_y, &this->force_change_x,
+        &this->force_change_y}) {
+    stream->resize(capacity);
+  }
+  for (std::vector<uint8_t> *flags :
+       {&this->still_steps, &this->frozen, &this->cell_awake,
+        &this->time_bins, &this->cell_min_bin}) {
+    flags->resize(capacity);
+  }
+  this->force_steps.resize(capacity, UINT64_MAX);
+  this->force_intervals.resize(capacity);
+  this->active_particles.resize(capacity);
+  this->neighbour_list.resize(max_neighbours * capacity);
+  this->neighbour_counts.resize(capacity);
+  this->iisph_error_partials.resize((capacity + cpu_compute_chunk - 1) /
+                                    cpu_compute_chunk);
+}
+
+void CpuCompute::addParticle(const uint32_t p_i, const glm::vec2 position) {
+  this->sleep_pos_x[p_i] = position.x;
+  this->sleep_pos_y[p_i] = position.y;
+  this->sleep_density[p_i] = 0.f;
+  this->still_steps[p_i] = 0;
+  this->frozen[p_i] = 0;
+  this->time_bins[p_i] = 0;
+  this->force_steps[p_i] = UINT64_MAX;
+  this->force_intervals[p_i] = 0;
+  this->iisph_pressure[p_i] = 0.f;
+}
+
+void CpuCompute::moveParticle(const uint32_t from, const uint32_t to) {
+  this->sleep_pos_x[to] = this->sleep_pos_x[from];
+  this->sleep_pos_y[to] = this->sleep_pos_y[from];
+  this->sleep_density[to] = this->sleep_density[from];
+  this->still_steps[to] = this->still_steps[from];
+  this->frozen[to] = this->frozen[from];
+  this->time_bins[to] = this->time_bins[from];
+  this->held_force_x[to] = this->held_force_x[from];
+  this->held_force_y[to] = this->held_force_y[from];
+  this->force_change_x[to] = this->force_change_x[from];
+  this->force_change_y[to] = this->force_change_y[from];
+  this->force_steps[to] = this->force_steps[from];
+  this->force_intervals[to] = this->force_intervals[from];
+  this->iisph_pressure[to] = this->iisph_pressure[from];
+}
+
+template <int D>
+uint64_t CpuCompute::gatherNeighbourRanges(SpatialGridT<D> &spatial_grid,
+                                           const uint32_t begin,
+                                           const uint32_t end) {
+  constexpr uint32_t stride = 2 * Dimension<D>::stencil_cells;
+  const std::vector<uint64_t> &keys = spatial_grid.spatial_keys;
+  const std::vector<int32_t> &indicies = spatial_grid.spatial_indicies;
+
+  // Every particle in a cell has the same stencil, so look it up once per
+  // cell. Cells are contiguous runs of spatial_indicies; this call handles
+  // the runs that start in [begin, end).
+  uint32_t i = begin;
+  while (i > 0 && i < end && keys[i] == keys[i - 1]) {
+    i++;
+  }
+
+  // Every grid has 2h cells, so the boundary samples around a particle are
+  // in the same 9 cells of both the boundary's grids.
+  BoundaryParticles *boundary = nullptr;
+  if constexpr (D == 2) {
+    boundary = this->boundary_particles;
+  }
+
+  uint64_t candidates = 0;
+  while (i < end) {
+    const uint64_t key = keys[i];
+    const typename Dimension<D>::ivec cell_coord =
+        SpatialGridT<D>::keyToCellCoord(key);
+
+    int32_t ranges[stride];
+    int32_t boundary_ranges[36];
+    uint32_t cell_candidates = 0, boundary_candidates = 0;
+    for (uint32_t cell = 0, range = 0; cell < Dimension<D>::stencil_cells;
+         cell++, range += 2) {
+      const typename Dimension<D>::ivec coord =
+          cell_coord + Dimension<D>::stencilOffset(cell);
+      spatial_grid.cellRange(coord, ranges[range], ranges[range + 1]);
+      cell_candidates += ranges[range + 1] - ranges[range];
+      if constexpr (D == 2) {
+        if (boundary != nullptr) {
+          // Static ranges first, then the moving ones.
+          int32_t cell_ranges[4];
+          boundary->cellRanges(coord, cell_ranges);
+          boundary_ranges[range] = cell_ranges[0];
+          boundary_ranges[range + 1] = cell_ranges[1];
+          boundary_ranges[18 + range] = cell_ranges[2];
+          boundary_ranges[18 + range + 1] = cell_ranges[3];
+          boundary_candidates += cell_ranges[1] - cell_ranges[0] +
+                                 cell_ranges[3] - cell_ranges[2];
+        }
+      }
+    }
+    cell_candidates += boundary_candidates;
+
+    // Runs don't overlap, so the run's first slot is this cell's alone.
+    int32_t stencil = -1;
+    if (boundary_candidates > 0) {
+      stencil = i;
+      std::memcpy(&this->boundary_ranges[36 * i], boundary_ranges,
+                  sizeof(boundary_ranges));
+    }
+
+    for (; i < indicies.size() && keys[i] == key; i++) {
+      std::memcpy(&this->neighbour_ranges[stride * indicies[i]], ranges,
+                  sizeof(ranges));
+      this->boundary_stencils[indicies[i]] = stencil;
+      candidates += cell_candidates;
+    }
+  }
+  return candidates;
+}
+
+uint64_t CpuCompute::buildNeighbourLists(Particles &particles,
+                                         SpatialGrid &spatial_grid,
+                                         const float radius,
+                                         JobSystem &job_system) {
+  const uint32_t count = particles.particle_count;
+  const int32_t *indicies = spatial_grid.spatial_indicies.data();
+  const float *pos_x = particles.pos_x.data();
+  const float *pos_y = particles.pos_y.data();
+  const float radius2 = radius * radius;
+  std::atomic<uint64_t> candidates{0}, listed{0};
+
+  auto gather_pass = [&](const uint32_t begin, const uint32_t end) {
+    candidates.fetch_add(
+        this->gatherNeighbourRanges(spatial_grid, begin, end),
+        std::memory_order_relaxed);
+  };
+  auto list_pass = [&](const uint32_t begin, const uint32_t end) {
+    uint64_t chunk_listed = 0;
+    for (uint32_t p_i = begin; p_i < end; p_i++) {
+      const int32_t *ranges = &this->neighbour_ranges[18 * p_i];
+      int32_t *list = &this->neighbour_list[max_neighbours * p_i];
+      uint32_t n = 0;
+      for (uint32_t cell = 0; cell < 9; cell++) {
+        for (int32_t i = ranges[2 * cell]; i < ranges[2 * cell + 1]; i++) {
+          const int32_t n_i = indicies[i];
+          const float dx = pos_x[p_i] - pos_x[n_i];
+          const float dy = pos_y[p_i] - pos_y[n_i];
+          if (dx * dx + dy * dy < radius2 && n < max_neighbours) {
+            list[n++] = n_i;
+          }
+        }
+      }
+      this->neighbour_counts[p_i] = n;
+      chunk_listed += n;
+    }
+    listed.fetch_add(chunk_listed, std::memory_order_relaxed);
+  };
+  job_system.parallelFor(0, count, cpu_compute_chunk, gather_pass);
+  job_system.parallelFor(0, count, cpu_compute_chunk, list_pass);
+
+  this->neighbour_evaluations += candidates;
+  return listed;
+}
+
+template <int D>
+CpuKernelArgs CpuCompute::kernelArgs(ParticlesT<D> &particles,
+                                     SpatialGridT<D> &spatial_grid,
+                                     const FluidParams &params) {
+  CpuKernelArgs args;
+  args.pos_x = particles.pos_x.data();
+  args.pos_y = particles.pos_y.data();
+  args.vel_x = particles.vel_x.data();
+  args.vel_y = particles.vel_y.data();
+  args.density = particles.density.data();
+  args.force_x = particles.force_x.data();
+  args.force_y = particles.force_y.data();
+  args.pos_z = args.vel_z = args.force_z = nullptr;
+  if constexpr (D == 3) {
+    args.pos_z = particles.pos_z.data();
+    args.vel_z = particles.vel_z.data();
+    args.force_z = particles.force_z.data();
+  }
+  args.spatial_indicies = spatial_grid.spatial_indicies.data();
+  args.neighbour_ranges = this->neighbour_ranges.data();
+  args.active_particles = nullptr;
+  args.boundary_stencils = nullptr;
+  if (D == 2 && this->boundary_particles != nullptr) {
+    args.boundary_x = this->boundary_particles->pos_x.data();
+    args.boundary_y = this->boundary_particles->pos_y.data();
+    args.boundary_psi = this->boundary_particles->psi.data();
+    args.boundary_indicies = this->boundary_particles->indicies.data();
+    args.boundary_stencils = this->boundary_stencils.data();
+    args.boundary_ranges = this->boundary_ranges.data();
+  }
+  args.params = params;
+  return args;
+}
+
+void CpuCompute::calcDensitiesAndApplyPressureForce(
+    Particles &particles, SpatialGrid &spatial_grid, const FluidParams &params,
+    const float step_dt, JobSystem &job_system) {
+  const uint32_t count = particles.particle_count;
+  this->calcDensities(particles, spatial_grid, params, step_dt, count,
+                      job_system);
+  this->applyFluidForces(particles, spatial_grid, params, step_dt, count,
+                         job_system);
+}
+
+// Sleeping and time bins pick which particles the 2D passes evaluate.
+template <int D> static bool selectsActive(const CpuCompute &compute) {
+  return D == 2 && (compute.sleep_params.enabled ||
+                    compute.time_bin_params.bin_count > 1);
+}
+
+template <int D>
+void CpuCompute::calcDensities(ParticlesT<D> &particles,
+                               SpatialGridT<D> &spatial_grid,
+                               const FluidParams &params, const float step_dt,
+                               const uint32_t count, JobSystem &job_system) {
+  if (Dimension<D>::stencil_cells != this->stencil_cells) {
+    throw std::invalid_argument("CpuCompute: made for another dimension");
+  }
+  if (selectsActive<D>(*this) && count != particles.particle_count) {
+    throw std::invalid_argument(
+        "CpuCompute: sleeping and time bins need every particle evaluated");
+  }
+  CpuKernelArgs args = this->kernelArgs(particles, spatial_grid, params);
+
+  // Each pass reads what the previous one wrote for other particles, so they
+  // need a full barrier in between; parallelFor returning gives us that.
+  // Ranges are gathered over the whole grid, since the particles after
+  // 'count' share cells with the ones before.
+  std::atomic<uint64_t> candidates{0};
+  auto gather_pass = [&](const uint32_t begin, const uint32_t end) {
+    candidates.fetch_add(
+        this->gatherNeighbourRanges(spatial_grid, begin, end),
+        std::memory_order_relaxed);
+  };
+  job_system.parallelFor(0, particles.particle_count, cpu_compute_chunk,
+                         gather_pass);
+
+  this->active_count = count;
+  if constexpr (D == 2) {
+    if (selectsActive<D>(*this)) {
+      candidates = this->selectActiveParticles(particles, spatial_grid,
+                                               step_dt, job_system);
+      args.active_particles = this->active_particles.data();
+    }
+  }
+  this->active_candidates = candidates;
+
+  const auto calc_density =
+      D == 3 ? this->kernels.calcDensity3d : this->kernels.calcDensity;
+  auto density_pass = [&](const uint32_t begin, const uint32_t end) {
+    calc_density(args, begin, end);
+  };
+  job_system.parallelFor(0, this->active_count, cpu_compute_chunk,
+                         density_pass);
+}
+
+template <int D>
+void CpuCompute::applyFluidForces(ParticlesT<D> &particles,
+                                  SpatialGridT<D> &spatial_grid,
+                                  const FluidParams &params,
+                                  const float step_dt, const uint32_t count,
+                                  JobSystem &job_system) {
+  CpuKernelArgs args = this->kernelArgs(particles, spatial_grid, params);
+  if (selectsActive<D>(*this)) {
+    args.active_particles = this->active_particles.data();
+  }
+
+  const auto apply_fluid_forces = D == 3 ? this->kernels.applyFluidForces3d
+                                         : this->kernels.applyFluidForces;
+  auto force_pass = [&](const uint32_t begin, const uint32_t end) {
+    apply_fluid_forces(args, begin, end);
+  };
+  job_system.parallelFor(0, this->active_count, cpu_compute_chunk,
+                         force_pass);
+  if constexpr (D == 2) {
+    if (this->time_bin_params.bin_count > 1) {
+      this->assignTimeBins(particles, params, step_dt, job_system);
+    }
+  }
+
+  // Both passes visit every candidate.
+  this->neighbour_evaluations += 2 * this->active_candidates;
+  this->active_particle_steps += this->active_count;
+  this->particle_steps += count;
+  this->base_step++;
+}
+
+template <int D>
+void CpuCompute::integrateInBox(ParticlesT<D> &particles,
+                                const typename Dimension<D>::vec world_size,
+                                const float wall_damp, const float step_dt,
+                                const uint32_t count, JobSystem &job_system) {
+  auto integrate_range = [&](const uint32_t begin, const uint32_t end) {
+    float *pos[3] = {particles.pos_x.data(), particles.pos_y.data()};
+    float *vel[3] = {particles.vel_x.data(), particles.vel_y.data()};
+    const float *force[3] = {particles.force_x.data(),
+                             particles.force_y.data()};
+    if constexpr (D == 3) {
+      pos[2] = particles.pos_z.data();
+      vel[2] = particles.vel_z.data();
+      force[2] = particles.force_z.data();
+    }
+    for (uint32_t i = begin; i < end; i++) {
+      const float inv_density = 1.f / particles.density[i];
+      for (int32_t axis = 0; axis < D; axis++) {
+        float &x = pos[axis][i];
+        float &v = vel[axis][i];
+        v += force[axis][i] * inv_density * step_dt;
+        x += v * step_dt;
+        if (x < 0.f || x > world_size[axis]) {
+          x = glm::clamp(x, 0.f, world_size[axis]);
+          v *= -wall_damp;
+        }
+      }
+    }
+  };
+  job_system.parallelFor(0, count, 4096, integrate_range);
+}
+
+glm::vec3 CpuCompute::boundaryReaction(Particles &particles,
+                                       SpatialGrid &spatial_grid,
+                                       const FluidParams &params,
+                                       const uint32_t begin,
+                                       const uint32_t end,
+                                       const glm::vec2 centre) {
+  const BoundaryParticles &boundary = *this->boundary_particles;
+  const float h = params.h;
+  const float h5 = h * h * h * h * h;
+  const float spiky = -KernelConstants<2>::spiky / (h5 * 3.14159265359f);
+
+  glm::vec3 total(0.f);
+  for (uint32_t b = begin; b < end; b++) {
+    const glm::vec2 sample(boundary.pos_x[b], boundary.pos_y[b]);
+    const glm::ivec2 cell_coord = spatial_grid.positionToCellCoord(sample);
+    glm::vec2 force(0.f);
+
+    for (int32_t y = -1; y <= 1; y++) {
+      for (int32_t x = -1; x <= 1; x++) {
+        int32_t start, stop;
+        spatial_grid.cellRange(cell_coord + glm::ivec2(x, y), start, stop);
+        for (int32_t i = start; i < stop; i++) {
+          const int32_t p_i = spatial_grid.spatial_indicies[i];
+          const glm::vec2 d =
+              sample - glm::vec2(particles.pos_x[p_i], particles.pos_y[p_i]);
+          const float r2 = glm::dot(d, d);
+          if (r2 >= h * h || r2 == 0.f) {
+            continue;
+          }
+          // The force pass's boundary term, as a force on p_i (times
+          // m / rho_i), turned around.
+          const float r = std::sqrt(r2);
+          const float q = h - r;
+          const float density = particles.density[p_i];
+          const float pressure = (density - params.target_density) *
+                                 params.pressure_multiplier;
+          const float term = -spiky * q * q * q * pressure / density *
+                             boundary.psi[b] / r;
+          force -= params.particle_mass / density * term * d;
+        }
+      }
+    }
+
+    const glm::vec2 arm = sample - centre;
+    total += glm::vec3(force, arm.x * force.y - arm.y * force.x);
+  }
+  return total;
+}
+
+uint64_t CpuCompute::selectActiveParticles(Particles &particles,
+                                           SpatialGrid &spatial_grid,
+                                           const float step_dt,
+                                           JobSystem &job_system) {
+  const SleepParams &sleep = this->sleep_params;
+  const uint32_t count = particles.particle_count;
+  const float max_move = sleep.speed * step_dt;
+
+  auto still_pass = [&](const uint32_t begin, const uint32_t end) {
+    for (uint32_t i = begin; i < end; i++) {
+      const float dx = particles.pos_x[i] - this->sleep_pos_x[i];
+      const float dy = particles.pos_y[i] - this->sleep_pos_y[i];
+      const float density = particles.density[i];
+      // Frozen particles had their velocity zeroed, so any velocity now was
+      // set from outside.
+      const bool poked = this->frozen[i] && (particles.vel_x[i] != 0.f ||
+                                             particles.vel_y[i] != 0.f);
+      const bool still =
+          !poked && dx * dx + dy * dy < max_move * max_move &&
+          std::fabs(density - this->sleep_density[i]) <=
+              sleep.density_change * this->sleep_density[i];
+
+      this->still_steps[i] =
+          still ? std::min<uint32_t>(this->still_steps[i] + 1, 255) : 0;
+      this->sleep_pos_x[i] = particles.pos_x[i];
+      this->sleep_pos_y[i] = particles.pos_y[i];
+      this->sleep_density[i] = density;
+    }
+  };
+  if (sleep.enabled) {
+    job_system.parallelFor(0, count, cpu_compute_chunk, still_pass);
+  }
+
+  // Cells are runs of spatial_indicies. Two sweeps over them: mark the awake
+  // ones and their lowest time bin, then keep the due particles of every run
+  // with an awake cell in its 3x3 stencil. Both are a few operations per
+  // particle, so they run serially.
+  const std::vector<uint64_t> &keys = spatial_grid.spatial_keys;
+  const std::vector<int32_t> &indicies = spatial_grid.spatial_indicies;
+  const uint32_t delay = std::min<uint32_t>(sleep.delay, 255);
+  const uint8_t max_bin = this->time_bin_params.bin_count - 1;
+
+  for (uint32_t start = 0, end; start < count; start = end) {
+    bool awake = !sleep.enabled;
+    uint8_t min_bin = max_bin;
+    for (end = start; end < count && keys[end] == keys[start]; end++) {
+      const int32_t p_i = indicies[end];
+      awake = awake || this->still_steps[p_i] < delay;
+      min_bin = std::min(min_bin, this->time_bins[p_i]);
+    }
+    // A sleeping cell doesn't hold its neighbours back.
+    std::fill(this->cell_awake.begin() + start,
+              this->cell_awake.begin() + end, awake);
+    std::fill(this->cell_min_bin.begin() + start,
+              this->cell_min_bin.begin() + end, awake ? min_bin : max_bin);
+  }
+
+  uint32_t active_count = 0;
+  uint64_t candidates = 0;
+  for (uint32_t start = 0, end; start < count; start = end) {
+    for (end = start; end < count && keys[end] == keys[start]; end++) {
+    }
+
+    const int32_t *ranges = &this->neighbour_ranges[18 * indicies[start]];
+    bool disturbed = false;
+    uint8_t bin_limit = max_bin;
+    uint32_t cell_candidates = 0;
+    for (uint32_t cell = 0; cell < 9; cell++) {
+      const int32_t first = ranges[2 * cell];
+      if (first < ranges[2 * cell + 1]) {
+        disturbed = disturbed || this->cell_awake[first];
+        bin_limit = std::min<uint8_t>(bin_limit, this->cell_min_bin[first] + 1);
+        cell_candidates += ranges[2 * cell + 1] - first;
+      }
+    }
+    const int32_t stencil = this->boundary_particles != nullptr
+                                ? this->boundary_stencils[indicies[start]]
+                                : -1;
+    if (stencil >= 0) {
+      const int32_t *boundary = &this->boundary_ranges[36 * stencil];
+      for (uint32_t range = 0; range < 18; range++) {
+        const int32_t count = boundary[2 * range + 1] - boundary[2 * range];
+        cell_candidates += count;
+        // A rigid body nearby keeps the cell awake and in the fastest bin,
+        // so the fluid answers it every step.
+        if (range >= 9 && count > 0) {
+          disturbed = true;
+          bin_limit = 0;
+        }
+      }
+    }
+
+    for (uint32_t i = start; i < end; i++) {
+      const int32_t p_i = indicies[i];
+      this->frozen[p_i] = !disturbed;
+      if (disturbed) {
+        // Due on its own schedule, or now if a faster neighbour has turned
+        // up since its bin was picked.
+        uint8_t &bin = this->time_bins[p_i];
+        const bool demoted = bin > bin_limit;
+        bin = std::min(bin, bin_limit);
+        if (demoted || this->base_step % (1u << bin) == 0) {
+          this->active_particles[active_count++] = p_i;
+          candidates += cell_candidates;
+        } else if (this->force_intervals[p_i] > 0) {
+          const uint32_t interval = this->force_intervals[p_i];
+          const float t =
+              (float)std::min<uint64_t>(
+                  this->base_step - this->force_steps[p_i], interval) /
+              interval;
+          particles.force_x[p_i] =
+              this->held_force_x[p_i] + t * this->force_change_x[p_i];
+          particles.force_y[p_i] =
+              this->held_force_y[p_i] + t * this->force_change_y[p_i];
+        }
+      } else {
+        // Evaluated as soon as it wakes.
+        this->time_bins[p_i] = 0;
+        this->force_steps[p_i] = UINT64_MAX;
+        this->force_intervals[p_i] = 0;
+        particles.vel_x[p_i] = particles.vel_y[p_i] = 0.f;
+        particles.force_x[p_i] = particles.force_y[p_i] = 0.f;
+      }
+    }
+  }
+
+  this->active_count = active_count;
+  return candidates;
+}
+
+void CpuCompute::assignTimeBins(Particles &particles,
+                                const FluidParams &params,
+                                const float step_dt, JobSystem &job_system) {
+  const TimeBinParams &time_bins = this->time_bin_params;
+  // The next evaluation, 2^b steps on, has to land on a multiple of 2^b so
+  // that bins stay nested.
+  const uint32_t aligned_bin =
+      this->base_step == 0 ? 31 : __builtin_ctzll(this->base_step);
+  const uint32_t max_bin = std::min(time_bins.bin_count - 1, aligned_bin);
+
+  auto bin_pass = [&](const uint32_t begin, const uint32_t end) {
+    for (uint32_t slot = begin; slot < end; slot++) {
+      const int32_t p_i = this->active_particles[slot];
+      const float force_x = particles.force_x[p_i];
+      const float force_y = particles.force_y[p_i];
+      if (this->force_steps[p_i] != UINT64_MAX) {
+        this->force_change_x[p_i] = force_x - this->held_force_x[p_i];
+        this->force_change_y[p_i] = force_y - this->held_force_y[p_i];
+        this->force_intervals[p_i] = this->base_step - this->force_steps[p_i];
+      }
+      this->held_force_x[p_i] = force_x;
+      this->held_force_y[p_i] = force_y;
+      this->force_steps[p_i] = this->base_step;
+      const float speed =
+          std::hypot(particles.vel_x[p_i], particles.vel_y[p_i]);
+      const float accel =
+          std::hypot(particles.force_x[p_i], particles.force_y[p_i]) /
+          particles.density[p_i];
+
+      float dt = INFINITY;
+      if (speed > 0.f) {
+        dt = time_bins.courant * params.h / speed;
+      }
+      if (accel > 0.f) {
+        dt = std::min(dt, time_bins.force_factor * std::sqrt(params.h / accel));
+      }
+
+      uint32_t bin = 0;
+      while (bin < max_bin && dt >= step_dt * (2u << bin)) {
+        bin++;
+      }
+      this->time_bins[p_i] = bin;
+    }
+  };
+  job_system.parallelFor(0, this->active_count, cpu_compute_chunk, bin_pass);
+}
+
+static uint32_t ulpDistance(const float a, const float b) {
+  // Map the float bit patterns onto a monotonic integer line.
+  int32_t ia, ib;
+  std::memcpy(&ia, &a, sizeof(float));
+  std::memcpy(&ib, &b, sizeof(float));
+  if (ia < 0) {
+    ia = INT32_MIN - ia;
+  }
+  if (ib < 0) {
+    ib = INT32_MIN - ib;
+  }
+  return (uint32_t)std::abs((int64_t)ia - (int64_t)ib);
+}
+
+bool CpuCompute::verifyKernels(Particles &particles,
+                               SpatialGrid &spatial_grid,
+                               const FluidParams &params) {
+  const uint32_t count = particles.particle_count;
+  this->gatherNeighbourRanges(spatial_grid, 0, count);
+  CpuKernelArgs args = this->kernelArgs(particles, spatial_grid, params);
+
+  scalar_kernels.calcDensity(args, 0, count);
+  scalar_kernels.applyFluidForces(args, 0, count);
+  const AlignedVector<float> ref_density = particles.density;
+  const AlignedVector<float> ref_force_x = particles.force_x;
+  const AlignedVector<float> ref_force_y = particles.force_y;
+
+  // Pressure terms cancel, so a particle's net force can be tiny compared to
+  // the terms summed into it. Force errors are measured in ULP of the largest
+  // force in the step instead.
+  float max_force = 0.f;
+  for (uint32_t i = 0; i < count; i++) {
+    max_force = std::max(max_force, std::hypot(ref_force_x[i], ref_force_y[i]));
+  }
+  const float force_ulp_size = std::nextafter(max_force, INFINITY) - max_force;
+
+  bool ok = true;
+  for (const CpuKernelTable *kernels :
+       {&sse4_kernels, &avx2_kernels, &avx512_kernels}) {
+    if (!cpuSupportsKernels(*kernels)) {
+      std::cout << kernels->name << ": not supported on this CPU\n";
+      continue;
+    }
+
+    uint32_t density_ulp = 0, force_ulp = 0;
+
+    kernels->calcDensity(args, 0, count);
+    for (uint32_t i = 0; i < count; i++) {
+      density_ulp = std::max(density_ulp,
+                             ulpDistance(ref_density[i], particles.density[i]));
+    }
+
+    // Forces are computed from the reference densities, so the two passes
+    // are checked independently.
+    particles.density = ref_density;
+    kernels->applyFluidForces(args, 0, count);
+    for (uint32_t i = 0; i < count; i++) {
+      const float error =
+          std::max(std::fabs(ref_force_x[i] - particles.force_x[i]),
+                   std::fabs(ref_force_y[i] - particles.force_y[i]));
+      force_ulp = std::max(force_ulp, (uint32_t)(error / force_ulp_size));
+    }
+
+    const bool passed = density_ulp <= cpu_kernel_ulp_tolerance &&
+                        force_ulp <= cpu_kernel_ulp_tolerance;
+    std::cout << kernels->name << ": density " << density_ulp
+              << " ULP, force " << force_ulp << " ULP"
+              << (passed ? "" : "  <-- exceeds tolerance") << "\n";
+    ok = ok && passed;
+  }
+
+  return ok;
+}
+
+template void CpuCompute::calcDensities<2>(ParticlesT<2> &, SpatialGridT<2> &,
+                                           const FluidParams &, const float,
+                                           const uint32_t, JobSystem &);
+template void CpuCompute::calcDensities<3>(ParticlesT<3> &, SpatialGridT<3> &,
+                                           const FluidParams &, const float,
+                                           const uint32_t, JobSystem &);
+template void CpuCompute::applyFluidForces<2>(ParticlesT<2> &,
+                                              SpatialGridT<2> &,
+                                              const FluidParams &, const float,
+                                              const uint32_t, JobSystem &);
+template void CpuCompute::applyFluidForces<3>(ParticlesT<3> &,
+                                              SpatialGridT<3> &,
+                                              const FluidParams &, const float,
+                                              const uint32_t, JobSystem &);
+template void CpuCompute::integrateInBox<2>(ParticlesT<2> &, const glm::vec2,
+                                            const float, const float,
+                                            const uint32_t, JobSystem &);
+template void CpuCompute::integrateInBox<3>(ParticlesT<3> &, const glm::vec3,
+                                            const float, const float,
+                                            const uint32_t, JobSystem &);
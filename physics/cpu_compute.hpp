@@ -0,0 +1,269 @@
+#pragma once
+#include <atomic>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <vector>
+
+#include "boundary_particles.hpp"
+#include "cpu_kernels.hpp"
+#include "dimension.hpp"
+#include "fluid_params.hpp"
+#include "granular_cells.hpp"
+#include "job_system.hpp"
+#include "neighbour_list.hpp"
+#include "multi_level_grid.hpp"
+#include "particles.hpp"
+#include "spatial_grid.hpp"
+#include "sweep_and_prune.hpp"
+
+// Particles per job. A multiple of every SIMD width so only the last chunk has
+// a tail.
+constexpr uint32_t cpu_compute_chunk = 256;
+
+// Cells of fluid at rest are put to sleep by the SPH passes and their
+// particles skipped until an awake neighbour cell disturbs them. A particle is
+// still once it moves slower than 'speed' and its density changes by less
+// than 'density_change' (relative) per step; a cell sleeps once every particle
+// in it has been still for 'delay' steps. A sleeping particle is frozen, so
+// its velocity and force are zeroed; giving it a velocity from outside the
+// solver wakes its cell.
+struct SleepParams {
+  bool enabled = false;
+  float speed = 10.f;
+  float density_change = 1e-3f;
+  uint32_t delay = 30;
+};
+
+// Off unless SPH_SLEEP=1.
+inline SleepParams sleepParamsFromEnv() {
+  SleepParams sleep;
+  const char *requested = std::getenv("SPH_SLEEP");
+  sleep.enabled = requested != nullptr && std::strcmp(requested, "1") == 0;
+  return sleep;
+}
+
+// Multi-rate stepping for the CPU SPH path. Each particle sits in a time bin
+// b < bin_count and only has its density and force evaluated every 2^b base
+// steps. In between, its force carries on along the line through its last
+// two evaluations, at most one interval past the last, and its density is
+// held. A particle's bin is picked when
+// it is evaluated, from the larger of
+//   courant * h / |v|  and  force_factor * sqrt(h / |a|)
+// over the base step, and is never more than one above the lowest bin in
+// the cells around it; a particle over that limit is evaluated straight away.
+struct TimeBinParams {
+  uint32_t bin_count = 1; // 1 evaluates every particle every step.
+  float courant = 0.02f;
+  float force_factor = 0.1f;
+};
+
+// Off unless SPH_TIME_BINS=n sets bin_count, capped at 8.
+inline TimeBinParams timeBinParamsFromEnv() {
+  TimeBinParams time_bins;
+  const char *requested = std::getenv("SPH_TIME_BINS");
+  if (requested != nullptr) {
+    const int32_t bin_count = std::atoi(requested);
+    time_bins.bin_count = bin_count < 1 ? 1 : bin_count > 8 ? 8 : bin_count;
+  }
+  return time_bins;
+}
+
+// CPU counterpart of the GL compute shader path, running the SIMD kernels in
+// cpu_kernels_*.cpp on the SoA particle streams.
+//
+// The SPH passes also run in 3D, on ParticlesT<3> and SpatialGridT<3> with
+// 27 cell stencils, for a CpuCompute made with Dimension<3>::stencil_cells.
+// Sleeping, time bins, boundary samples and the other solvers are 2D only.
+struct CpuCompute {
+  const CpuKernelTable &kernels;
+  // Particles every per-particle array has room for.
+  uint32_t capacity = 0;
+  // 9 in 2D, 27 in 3D.
+  const uint32_t stencil_cells;
+  // stencil_cells [start, end) cell ranges per particle, gathered once per
+  // step and shared by the density and force passes.
+  std::vector<int32_t> neighbour_ranges;
+  // Boundary samples the SPH passes add in, or nullptr. Each particle's
+  // stencil into boundary_ranges, which holds the 18 cell ranges into their
+  // grids at the first slot of each fluid cell with any samples around it
+  // (see CpuKernelArgs).
+  BoundaryParticles *boundary_particles = nullptr;
+  std::vector<int32_t> boundary_stencils;
+  std::vector<int32_t> boundary_ranges;
+  // Sleeping, SolverMode::SPH only. Position and density each particle had
+  // at the last check, how many steps it has been still, whether it was
+  // frozen last step, and per entry of spatial_indicies whether its cell is
+  // awake.
+  SleepParams sleep_params;
+  AlignedVector<float> sleep_pos_x, sleep_pos_y, sleep_density;
+  std::vector<uint8_t> still_steps;
+  std::vector<uint8_t> frozen;
+  std::vector<uint8_t> cell_awake;
+  // Multi-rate stepping. Each particle's bin, the lowest bin of any awake
+  // particle per entry of spatial_indicies' cell, and the base step count.
+  TimeBinParams time_bin_params;
+  std::vector<uint8_t> time_bins;
+  std::vector<uint8_t> cell_min_bin;
+  uint64_t base_step = 0;
+  // Each particle's force at its last evaluation, the base step of it, and
+  // how much it changed from the evaluation before over how many steps. A
+  // step of UINT64_MAX is no evaluation yet, and an interval of 0 holds the
+  // force.
+  AlignedVector<float> held_force_x, held_force_y;
+  AlignedVector<float> force_change_x, force_change_y;
+  std::vector<uint64_t> force_steps;
+  std::vector<uint32_t> force_intervals;
+  // Particles the SPH passes run on this step, in spatial_indicies order.
+  std::vector<int32_t> active_particles;
+  uint32_t active_count = 0;
+  // Candidates the active particles visit in each pass this step.
+  uint64_t active_candidates = 0;
+  // Summed over steps, against the live particles each step.
+  uint64_t active_particle_steps = 0;
+  uint64_t particle_steps = 0;
+
+  // Explicit neighbour lists for the iterative solvers, max_neighbours slots
+  // per particle. Filled by buildNeighbourLists().
+  std::vector<int32_t> neighbour_list;
+  std::vector<uint32_t> neighbour_counts;
+  // SolverMode::PBF: per-particle lambda.
+  AlignedVector<float> pbf_lambda;
+  // SolverMode::IISPH: pressure is kept between steps to warm start the next
+  // solve, the rest is per-step scratch.
+  AlignedVector<float> iisph_pressure;
+  AlignedVector<float> iisph_pressure_next;
+  AlignedVector<float> iisph_d_ii_x, iisph_d_ii_y;
+  AlignedVector<float> iisph_d_ij_p_x, iisph_d_ij_p_y;
+  AlignedVector<float> iisph_a_ii;
+  AlignedVector<float> iisph_density_adv;
+  std::vector<float> iisph_error_partials;
+  // SolverMode::Granular: the grid's cells sorted by colour.
+  GranularCells granular_cells;
+  // GranularBroadphase::SweepAndPrune: the sorted spans, kept between steps.
+  SweepAndPrune sweep_and_prune;
+  // GranularBroadphase::MultiLevel: a grid per size class.
+  MultiLevelGrid multi_level_grid;
+  // Pairs either of them found this step, two indices each.
+  std::vector<uint32_t> granular_pairs;
+
+  // Neighbour pairs visited by every pass so far, and iterations run by the
+  // iterative solvers, so the solvers can be compared on work done.
+  std::atomic<uint64_t> neighbour_evaluations{0};
+  uint64_t solver_iterations = 0;
+  // Average predicted compression left after the last IISPH solve.
+  float iisph_density_error = 0.f;
+
+  CpuCompute(const uint32_t capacity,
+             const uint32_t _stencil_cells = Dimension<2>::stencil_cells);
+
+  // Grows every per-particle array to hold 'capacity' particles.
+  void reserve(const uint32_t capacity);
+
+  // Keep the state carried between steps in line with Particles::add() and
+  // Particles::remove(). A new particle starts awake in the fastest bin.
+  void addParticle(const uint32_t p_i, const glm::vec2 position);
+  void moveParticle(const uint32_t from, const uint32_t to);
+
+  void calcDensitiesAndApplyPressureForce(Particles &particles,
+                                          SpatialGrid &spatial_grid,
+                                          const FluidParams &params,
+                                          const float step_dt,
+                                          JobSystem &job_system);
+
+  // Its two halves, for callers that fill in some densities in between,
+  // e.g. a halo's (see SlabWorker). Only particles [0, count) are evaluated;
+  // any after them are in the grid and read as neighbours. Sleeping and time
+  // bins need count to be every particle.
+  template <int D>
+  void calcDensities(ParticlesT<D> &particles, SpatialGridT<D> &spatial_grid,
+                     const FluidParams &params, const float step_dt,
+                     const uint32_t count, JobSystem &job_system);
+  template <int D>
+  void applyFluidForces(ParticlesT<D> &particles,
+                        SpatialGridT<D> &spatial_grid,
+                        const FluidParams &params, const float step_dt,
+                        const uint32_t count, JobSystem &job_system);
+
+  // Semi-implicit Euler on particles [0, count), then back inside the box
+  // [0, world_size), reflecting the velocity into a wall scaled by
+  // 'wall_damp'.
+  template <int D>
+  void integrateInBox(ParticlesT<D> &particles,
+                      const typename Dimension<D>::vec world_size,
+                      const float wall_damp, const float step_dt,
+                      const uint32_t count, JobSystem &job_system);
+
+  // Force and torque about 'centre', as (x, y, torque), that the fluid puts
+  // on boundary samples [begin, end): the reaction to the mirrored pressure
+  // the force pass gave the fluid from them. Reads this step's densities,
+  // and only the fluid within h of the samples.
+  glm::vec3 boundaryReaction(Particles &particles, SpatialGrid &spatial_grid,
+                             const FluidParams &params, const uint32_t begin,
+                             const uint32_t end, const glm::vec2 centre);
+
+  // Updates the still counters and cell states, and fills active_particles
+  // with the particles in or next to an awake cell whose time bin is due,
+  // freezing the ones that are asleep. Needs neighbour_ranges for this step.
+  // Returns the number of candidates the active particles will visit.
+  uint64_t selectActiveParticles(Particles &particles,
+                                 SpatialGrid &spatial_grid,
+                                 const float step_dt, JobSystem &job_system);
+
+  // Records the freshly evaluated force of every active particle, and picks
+  // its next time bin from it and its velocity.
+  void assignTimeBins(Particles &particles, const FluidParams &params,
+                      const float step_dt, JobSystem &job_system);
+
+  // One Position Based Fluids step on predicted positions: constraint
+  // iterations, then XSPH. Velocities come back as (x - x_old) / dt.
+  // Defined in cpu_pbf.cpp.
+  void solvePbf(Particles &particles, SpatialGrid &spatial_grid,
+                const FluidParams &params, const PbfParams &pbf,
+                const glm::vec2 min_pos, const glm::vec2 max_pos,
+                JobSystem &job_system);
+
+  // Projects every overlapping pair of discs apart, granular.iterations
+  // times: colour by colour so no two jobs move the same disc, or with
+  // sweep and prune or the multi-level grid in one pass over the pairs they
+  // found. Velocities take
+  // the moves as (x - x_old) / dt. Defined in cpu_granular.cpp.
+  void solveGranular(Particles &particles, SpatialGrid &spatial_grid,
+                     const GranularParams &granular, JobSystem &job_system);
+
+  // Implicit incompressible SPH step (Ihmsen et al. 2014): pressure is
+  // solved with relaxed Jacobi until the average predicted compression is
+  // under iisph.density_error_tolerance, then positions are advanced.
+  // Returns the number of iterations. Defined in cpu_iisph.cpp.
+  uint32_t solveIisph(Particles &particles, SpatialGrid &spatial_grid,
+                      const FluidParams &params, const IisphParams &iisph,
+                      JobSystem &job_system);
+
+  // Fills neighbour_ranges (and in 2D the boundary stencils) for the cells
+  // whose runs start in [begin, end) of spatial_grid.spatial_indicies.
+  // Returns the number of candidates the particles in those runs will visit.
+  template <int D>
+  uint64_t gatherNeighbourRanges(SpatialGridT<D> &spatial_grid,
+                                 const uint32_t begin, const uint32_t end);
+
+  // Fills neighbour_list and neighbour_counts with every particle within
+  // 'radius', including itself. Anything past max_neighbours is dropped.
+  // Returns the number of listed pairs.
+  uint64_t buildNeighbourLists(Particles &particles, SpatialGrid &spatial_grid,
+                               const float radius, JobSystem &job_system);
+
+  template <int D>
+  CpuKernelArgs kernelArgs(ParticlesT<D> &particles,
+                           SpatialGridT<D> &spatial_grid,
+                           const FluidParams &params);
+
+  // Runs every supported variant on the current state and prints the worst
+  // deviation from the scalar reference, in ULP. Returns false if any variant
+  // is outside cpu_kernel_ulp_tolerance.
+  bool verifyKernels(Particles &particles, SpatialGrid &spatial_grid,
+                     const FluidParams &params);
+};
+
+// 1 / W(s_corr_delta_q * h) with W the 2D poly6, the artificial pressure's
+// scale, for PbfParams::s_corr_scale. Defined in cpu_pbf.cpp.
+float pbfSCorrScale(const PbfParams &pbf, const float h);
@@ -0,0 +1,125 @@
+#include "cpu_compute.hpp"
+
+#include <algorithm>
+#include <cmath>
+
+// Granular discs on the SoA streams: Gauss-Seidel projection, run in
+// parallel without races. Each overlapping pair is projected by the cell of
+// one of its discs, against the discs after it in the same cell and those in
+// the four cells ahead of it:
+//   (-1, 1) (0, 1) (1, 1)
+//           (0, 0) (1, 0)
+// so a cell only ever moves discs in the block from (-1, 0) to (1, 1).
+// Cells are coloured by (x mod 3, y mod 2). Two cells of one colour are a
+// multiple of 3 apart across or of 2 apart up, so their blocks never share a
+// disc, and every cell of a colour can be projected at once. Grid cells are
+// the largest contact distance wide, so no overlap is missed.
+//
+// With GranularBroadphase::SweepAndPrune or MultiLevel the pairs are found
+// once per step instead, widened by granular_pair_skin so the ones the
+// corrections push into contact are still there, and projected in the order
+// they were found on one thread.
+
+namespace {
+
+// Fraction of each radius sweep and prune pairs are widened by.
+constexpr float granular_pair_skin = 0.25f;
+
+} // namespace
+
+void CpuCompute::solveGranular(Particles &particles,
+                               SpatialGrid &spatial_grid,
+                               const GranularParams &granular,
+                               JobSystem &job_system) {
+  const int32_t *indicies = spatial_grid.spatial_indicies.data();
+  float *pos_x = particles.pos_x.data();
+  float *pos_y = particles.pos_y.data();
+  float *vel_x = particles.vel_x.data();
+  float *vel_y = particles.vel_y.data();
+  const float *radii = particles.radii.data();
+
+  const float inv_dt = 1.f / granular.step_dt;
+  auto project = [&](const uint32_t a, const uint32_t b) {
+    const float dx = pos_x[a] - pos_x[b];
+    const float dy = pos_y[a] - pos_y[b];
+    const float contact = radii[a] + radii[b];
+    const float r2 = dx * dx + dy * dy;
+    if (r2 >= contact * contact || r2 == 0.f) {
+      return;
+    }
+    // Split by inverse mass, with mass going with area.
+    const float r = std::sqrt(r2);
+    const float w_a = 1.f / (radii[a] * radii[a]);
+    const float w_b = 1.f / (radii[b] * radii[b]);
+    const float s = granular.stiffness * (contact - r) / (r * (w_a + w_b));
+    pos_x[a] += w_a * s * dx;
+    pos_y[a] += w_a * s * dy;
+    pos_x[b] -= w_b * s * dx;
+    pos_y[b] -= w_b * s * dy;
+    vel_x[a] += w_a * s * dx * inv_dt;
+    vel_y[a] += w_a * s * dy * inv_dt;
+    vel_x[b] -= w_b * s * dx * inv_dt;
+    vel_y[b] -= w_b * s * dy * inv_dt;
+  };
+
+  if (granular.broadphase != GranularBroadphase::Grid) {
+    const uint32_t count = particles.particle_count;
+    auto add_pair = [&](const uint32_t a, const uint32_t b) {
+      this->granular_pairs.push_back(a);
+      this->granular_pairs.push_back(b);
+    };
+    this->granular_pairs.clear();
+    uint64_t candidates;
+    if (granular.broadphase == GranularBroadphase::SweepAndPrune) {
+      this->sweep_and_prune.update(pos_x, radii, count, granular_pair_skin);
+      candidates = this->sweep_and_prune.forEachPair(
+          pos_x, pos_y, radii, granular_pair_skin, add_pair);
+    } else {
+      this->multi_level_grid.update(pos_x, pos_y, radii, count);
+      candidates = this->multi_level_grid.forEachPair(
+          pos_x, pos_y, radii, granular_pair_skin, add_pair);
+    }
+    for (uint32_t iteration = 0; iteration < granular.iterations;
+         iteration++) {
+      for (uint32_t i = 0; i < this->granular_pairs.size(); i += 2) {
+        project(this->granular_pairs[i], this->granular_pairs[i + 1]);
+      }
+    }
+    this->neighbour_evaluations +=
+        candidates + granular.iterations * this->granular_pairs.size() / 2;
+    this->solver_iterations += granular.iterations;
+    return;
+  }
+
+  const uint64_t candidates =
+      this->granular_cells.update(spatial_grid, job_system);
+  const uint32_t *starts = this->granular_cells.colour_starts;
+
+  auto colour_pass = [&](const uint32_t begin, const uint32_t end) {
+    for (uint32_t c = begin; c < end; c++) {
+      const int32_t *ranges = &this->granular_cells.ranges[10 * c];
+      for (int32_t i = ranges[0]; i < ranges[1]; i++) {
+        const uint32_t p_i = indicies[i];
+        for (int32_t j = i + 1; j < ranges[1]; j++) {
+          project(p_i, indicies[j]);
+        }
+        for (uint32_t cell = 1; cell < 5; cell++) {
+          for (int32_t j = ranges[2 * cell]; j < ranges[2 * cell + 1]; j++) {
+            project(p_i, indicies[j]);
+          }
+        }
+      }
+    }
+  };
+
+  for (uint32_t iteration = 0; iteration < granular.iterations;
+       iteration++) {
+    for (uint32_t colour = 0; colour < granular_colours; colour++) {
+      job_system.parallelFor(starts[colour], starts[colour + 1],
+                             granular_chunk, colour_pass);
+    }
+  }
+
+  this->neighbour_evaluations += granular.iterations * candidates;
+  this->solver_iterations += granular.iterations;
+}
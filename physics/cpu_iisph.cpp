@@ -0,0 +1,269 @@
+#include "cpu_compute.hpp"
+
+#include <algorithm>
+#include <cmath>
+#include <utility>
+
+// Implicit incompressible SPH (Ihmsen et al. 2014) on the SoA streams, with
+// the same poly6 density and spiky gradient as the PBF solver. Positions only
+// move once the pressure is solved, so the neighbour lists are built at h and
+// stay exact for the whole step. Scratch use of the streams:
+//   density            rho_i at the start of the step
+//   force_x, force_y   advected velocity, before pressure
+//   iisph_*            see cpu_compute.hpp
+
+namespace {
+
+constexpr float iisph_pi = 3.14159265359f;
+
+struct IisphKernels {
+  float h, h2;
+  float poly6; // 4 / (pi h^8)
+  float spiky; // -30 / (pi h^5), dW/dr = spiky * (h - r)^2
+  float mass;
+};
+
+IisphKernels iisphKernels(const FluidParams &params) {
+  IisphKernels k;
+  k.h = params.h;
+  k.h2 = params.h * params.h;
+  k.poly6 = KernelConstants<2>::poly6 / (iisph_pi * std::pow(params.h, 8.f));
+  k.spiky =
+      -3.f * KernelConstants<2>::spiky / (iisph_pi * std::pow(params.h, 5.f));
+  k.mass = params.particle_mass;
+  return k;
+}
+
+} // namespace
+
+uint32_t CpuCompute::solveIisph(Particles &particles, SpatialGrid &spatial_grid,
+                                const FluidParams &params,
+                                const IisphParams &iisph,
+                                JobSystem &job_system) {
+  const uint32_t count = particles.particle_count;
+  const IisphKernels k = iisphKernels(params);
+  const float dt = iisph.step_dt;
+  const float dt2 = dt * dt;
+  const float rest_density = iisph.rest_density;
+
+  float *pos_x = particles.pos_x.data();
+  float *pos_y = particles.pos_y.data();
+  float *vel_x = particles.vel_x.data();
+  float *vel_y = particles.vel_y.data();
+  float *adv_x = particles.force_x.data();
+  float *adv_y = particles.force_y.data();
+  float *density = particles.density.data();
+  float *d_ii_x = this->iisph_d_ii_x.data();
+  float *d_ii_y = this->iisph_d_ii_y.data();
+  float *d_ij_p_x = this->iisph_d_ij_p_x.data();
+  float *d_ij_p_y = this->iisph_d_ij_p_y.data();
+  float *a_ii = this->iisph_a_ii.data();
+  float *density_adv = this->iisph_density_adv.data();
+  float *error_partials = this->iisph_error_partials.data();
+
+  const uint64_t pairs =
+      this->buildNeighbourLists(particles, spatial_grid, k.h, job_system);
+  const int32_t *neighbours = this->neighbour_list.data();
+  const uint32_t *neighbour_counts = this->neighbour_counts.data();
+
+  // Calls fn(n_i, grad_x, grad_y) for every neighbour of p_i other than
+  // itself, with grad = grad_i W(x_i - x_j).
+  auto for_each_gradient = [&](const uint32_t p_i, auto &&fn) {
+    const int32_t *list = neighbours + max_neighbours * p_i;
+    for (uint32_t i = 0; i < neighbour_counts[p_i]; i++) {
+      const uint32_t n_i = list[i];
+      const float dx = pos_x[p_i] - pos_x[n_i];
+      const float dy = pos_y[p_i] - pos_y[n_i];
+      const float r = std::sqrt(dx * dx + dy * dy);
+      if (r == 0.f) {
+        continue;
+      }
+      const float w = k.spiky * (k.h - r) * (k.h - r) / r;
+      fn(n_i, w * dx, w * dy);
+    }
+  };
+
+  auto density_pass = [&](const uint32_t begin, const uint32_t end) {
+    for (uint32_t p_i = begin; p_i < end; p_i++) {
+      const int32_t *list = neighbours + max_neighbours * p_i;
+      float rho = 0.f;
+      for (uint32_t i = 0; i < neighbour_counts[p_i]; i++) {
+        const float dx = pos_x[p_i] - pos_x[list[i]];
+        const float dy = pos_y[p_i] - pos_y[list[i]];
+        const float x = k.h2 - dx * dx - dy * dy;
+        rho += k.mass * k.poly6 * x * x * x;
+      }
+      density[p_i] = rho;
+    }
+  };
+
+  // Velocity under gravity and XSPH viscosity, and
+  // d_ii = -dt^2 sum_j m / rho_i^2 grad W_ij.
+  auto advect_pass = [&](const uint32_t begin, const uint32_t end) {
+    for (uint32_t p_i = begin; p_i < end; p_i++) {
+      const float inv_rho2 = 1.f / (density[p_i] * density[p_i]);
+      float dv_x = 0.f, dv_y = 0.f;
+      float d_x = 0.f, d_y = 0.f;
+
+      const int32_t *list = neighbours + max_neighbours * p_i;
+      for (uint32_t i = 0; i < neighbour_counts[p_i]; i++) {
+        const uint32_t n_i = list[i];
+        const float dx = pos_x[p_i] - pos_x[n_i];
+        const float dy = pos_y[p_i] - pos_y[n_i];
+        const float r2 = dx * dx + dy * dy;
+        const float x = k.h2 - r2;
+        const float w = k.mass / density[n_i] * k.poly6 * x * x * x;
+        dv_x += (vel_x[n_i] - vel_x[p_i]) * w;
+        dv_y += (vel_y[n_i] - vel_y[p_i]) * w;
+
+        const float r = std::sqrt(r2);
+        if (r == 0.f) {
+          continue;
+        }
+        const float grad = k.spiky * (k.h - r) * (k.h - r) / r;
+        d_x -= dt2 * k.mass * inv_rho2 * grad * dx;
+        d_y -= dt2 * k.mass * inv_rho2 * grad * dy;
+      }
+
+      adv_x[p_i] = vel_x[p_i] + iisph.xsph_viscosity * dv_x;
+      adv_y[p_i] =
+          vel_y[p_i] + iisph.xsph_viscosity * dv_y + iisph.gravity * dt;
+      d_ii_x[p_i] = d_x;
+      d_ii_y[p_i] = d_y;
+    }
+  };
+
+  // Density after advection, the diagonal a_ii, and the warm start.
+  auto diagonal_pass = [&](const uint32_t begin, const uint32_t end) {
+    for (uint32_t p_i = begin; p_i < end; p_i++) {
+      const float d_ji_scale = dt2 * k.mass / (density[p_i] * density[p_i]);
+      float rho = density[p_i];
+      float a = 0.f;
+
+      for_each_gradient(p_i, [&](const uint32_t n_i, const float grad_x,
+                                 const float grad_y) {
+        rho += dt * k.mass *
+               ((adv_x[p_i] - adv_x[n_i]) * grad_x +
+                (adv_y[p_i] - adv_y[n_i]) * grad_y);
+        a += k.mass * ((d_ii_x[p_i] - d_ji_scale * grad_x) * grad_x +
+                       (d_ii_y[p_i] - d_ji_scale * grad_y) * grad_y);
+      });
+
+      density_adv[p_i] = rho;
+      a_ii[p_i] = a;
+      this->iisph_pressure[p_i] *= 0.5f;
+    }
+  };
+
+  // sum_j d_ij p_j = -dt^2 sum_j m p_j / rho_j^2 grad W_ij
+  auto d_ij_p_pass = [&](const uint32_t begin, const uint32_t end) {
+    const float *pressure = this->iisph_pressure.data();
+    for (uint32_t p_i = begin; p_i < end; p_i++) {
+      float sum_x = 0.f, sum_y = 0.f;
+      for_each_gradient(p_i, [&](const uint32_t n_i, const float grad_x,
+                                 const float grad_y) {
+        const float scale = -dt2 * k.mass * pressure[n_i] /
+                            (density[n_i] * density[n_i]);
+        sum_x += scale * grad_x;
+        sum_y += scale * grad_y;
+      });
+      d_ij_p_x[p_i] = sum_x;
+      d_ij_p_y[p_i] = sum_y;
+    }
+  };
+
+  // Relaxed Jacobi update into iisph_pressure_next. Also sums the
+  // compression the current pressures would leave, per chunk.
+  const uint32_t chunk = cpu_compute_chunk;
+  auto pressure_pass = [&](const uint32_t begin, const uint32_t end) {
+    const float *pressure = this->iisph_pressure.data();
+    float *pressure_next = this->iisph_pressure_next.data();
+    for (uint32_t p_i = begin; p_i < end; p_i++) {
+      const float d_ji_scale = dt2 * k.mass / (density[p_i] * density[p_i]);
+      const float p = pressure[p_i];
+      float sum = 0.f;
+
+      for_each_gradient(p_i, [&](const uint32_t n_i, const float grad_x,
+                                 const float grad_y) {
+        // d_ij p_j summed over i's neighbours, minus d_jj p_j, minus the part
+        // of j's own sum that involves p_i.
+        const float x = d_ij_p_x[p_i] - d_ii_x[n_i] * pressure[n_i] -
+                        (d_ij_p_x[n_i] - d_ji_scale * grad_x * p);
+        const float y = d_ij_p_y[p_i] - d_ii_y[n_i] * pressure[n_i] -
+                        (d_ij_p_y[n_i] - d_ji_scale * grad_y * p);
+        sum += k.mass * (x * grad_x + y * grad_y);
+      });
+
+      const float predicted = density_adv[p_i] + a_ii[p_i] * p + sum;
+      error_partials[p_i / chunk] += std::max(predicted - rest_density, 0.f);
+
+      // Clamped at zero so the free surface isn't pulled together.
+      float next = 0.f;
+      if (a_ii[p_i] < 0.f) {
+        next = (1.f - iisph.relaxation) * p +
+               iisph.relaxation *
+                   (rest_density - density_adv[p_i] - sum) / a_ii[p_i];
+      }
+      pressure_next[p_i] = std::max(next, 0.f);
+    }
+  };
+
+  // v = v_adv - dt sum_j m (p_i / rho_i^2 + p_j / rho_j^2) grad W_ij
+  auto pressure_force_pass = [&](const uint32_t begin, const uint32_t end) {
+    const float *pressure = this->iisph_pressure.data();
+    for (uint32_t p_i = begin; p_i < end; p_i++) {
+      const float p_i_term = pressure[p_i] / (density[p_i] * density[p_i]);
+      float acc_x = 0.f, acc_y = 0.f;
+      for_each_gradient(p_i, [&](const uint32_t n_i, const float grad_x,
+                                 const float grad_y) {
+        const float scale =
+            -k.mass *
+            (p_i_term + pressure[n_i] / (density[n_i] * density[n_i]));
+        acc_x += scale * grad_x;
+        acc_y += scale * grad_y;
+      });
+      vel_x[p_i] = adv_x[p_i] + dt * acc_x;
+      vel_y[p_i] = adv_y[p_i] + dt * acc_y;
+    }
+  };
+
+  auto move_pass = [&](const uint32_t begin, const uint32_t end) {
+    for (uint32_t p_i = begin; p_i < end; p_i++) {
+      pos_x[p_i] += dt * vel_x[p_i];
+      pos_y[p_i] += dt * vel_y[p_i];
+    }
+  };
+
+  job_system.parallelFor(0, count, chunk, density_pass);
+  job_system.parallelFor(0, count, chunk, advect_pass);
+  job_system.parallelFor(0, count, chunk, diagonal_pass);
+
+  uint32_t iteration = 0;
+  while (iteration < iisph.max_iterations) {
+    std::fill(this->iisph_error_partials.begin(),
+              this->iisph_error_partials.end(), 0.f);
+    job_system.parallelFor(0, count, chunk, d_ij_p_pass);
+    job_system.parallelFor(0, count, chunk, pressure_pass);
+    std::swap(this->iisph_pressure, this->iisph_pressure_next);
+    iteration++;
+
+    float error = 0.f;
+    for (const float partial : this->iisph_error_partials) {
+      error += partial;
+    }
+    this->iisph_density_error =
+        count > 0 ? error / count / rest_density : 0.f;
+    if (iteration >= iisph.min_iterations &&
+        this->iisph_density_error <= iisph.density_error_tolerance) {
+      break;
+    }
+  }
+
+  job_system.parallelFor(0, count, chunk, pressure_force_pass);
+  job_system.parallelFor(0, count, chunk, move_pass);
+
+  // Density, advection, diagonal and pressure force, plus two per iteration.
+  this->neighbour_evaluations += (4 + 2 * iteration) * pairs;
+  this->solver_iterations += iteration;
+  return iteration;
+}
@@ -0,0 +1,88 @@
+#pragma once
+#include <cstdint>
+
+#include "fluid_params.hpp"
+
+// Plain pointers into the SoA particle streams and the spatial grid. The SIMD
+// variants are compiled for different instruction sets, so they only see
+// this header and never instantiate anything shared with the rest of the
+// program.
+struct CpuKernelArgs {
+  // The z streams are only read in 3D.
+  const float *pos_x, *pos_y, *pos_z;
+  const float *vel_x, *vel_y, *vel_z;
+  float *density;
+  float *force_x, *force_y, *force_z;
+  const int32_t *spatial_indicies;
+  // [start, end) into spatial_indicies for each of the 3^D cells around each
+  // particle, i.e. 18 ints per particle in 2D and 54 in 3D.
+  const int32_t *neighbour_ranges;
+  // If set, the passes work on active_particles[begin, end) instead of the
+  // particles [begin, end) themselves.
+  const int32_t *active_particles;
+  // Boundary samples (see BoundaryParticles), 2D only. Few particles have
+  // any in range, so rather than 36 more ints each, a particle's
+  // boundary_stencils entry is -1, or s for the 18 [start, end) ranges into
+  // boundary_indicies at boundary_ranges + 36 * s, the static samples' 9
+  // then the moving samples'. Left out when boundary_stencils is null.
+  const float *boundary_x, *boundary_y;
+  const float *boundary_psi;
+  const int32_t *boundary_indicies;
+  const int32_t *boundary_stencils;
+  const int32_t *boundary_ranges;
+  FluidParams params;
+};
+
+// The boundary signed distance field (see SdfGrid) and the streams it
+// constrains.
+struct CpuSdfArgs {
+  float *pos_x, *pos_y;
+  float *vel_x, *vel_y;
+  const float *distances;
+  float origin_x, origin_y;
+  float inv_cell_size;
+  uint32_t width, height;
+  // Particles are kept this far from the surface.
+  float radius;
+  // Fraction of the velocity into the surface that comes back out.
+  float damp;
+};
+
+// One implementation of the density and pressure+viscosity+gravity passes,
+// with any boundary samples adding density and mirrored pressure, and the
+// same two passes in 3D. All work on the particle range [begin, end), or
+// that range of active_particles.
+// constrainToSdf works on [begin, end) with 'begin' a multiple of the width,
+// and may read (but not write) past 'end' up to the next multiple.
+struct CpuKernelTable {
+  const char *name;
+  uint32_t width;
+  void (*calcDensity)(const CpuKernelArgs &args, const uint32_t begin,
+                      const uint32_t end);
+  void (*applyFluidForces)(const CpuKernelArgs &args, const uint32_t begin,
+                           const uint32_t end);
+  void (*calcDensity3d)(const CpuKernelArgs &args, const uint32_t begin,
+                        const uint32_t end);
+  void (*applyFluidForces3d)(const CpuKernelArgs &args, const uint32_t begin,
+                             const uint32_t end);
+  void (*constrainToSdf)(const CpuSdfArgs &args, const uint32_t begin,
+                         const uint32_t end);
+};
+
+extern const CpuKernelTable scalar_kernels;
+extern const CpuKernelTable sse4_kernels;
+extern const CpuKernelTable avx2_kernels;
+extern const CpuKernelTable avx512_kernels;
+
+// Vector variants sum neighbours in a different order to the scalar
+// reference (and may contract into FMAs), so results are not bitwise equal.
+// Densities stay within this many ULP of the scalar result. Force components
+// are measured in ULP of the largest force in the step, since pressure terms
+// cancel and a small net force has no meaningful ULP of its own.
+constexpr uint32_t cpu_kernel_ulp_tolerance = 64;
+
+// Picks the widest variant the CPU supports, via cpuid. Setting
+// SPH_CPU_KERNELS to scalar/sse4/avx2/avx512 overrides the choice.
+const CpuKernelTable &selectCpuKernels();
+
+bool cpuSupportsKernels(const CpuKernelTable &kernels);
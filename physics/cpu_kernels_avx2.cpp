@@ -0,0 +1,76 @@
+// AVX2 variant. The target pragma must come before any include so every
+// function in this file is compiled for AVX2; nothing here is shared with
+// other translation units.
+#pragma GCC target("avx2,fma")
+#include <immintrin.h>
+
+#include "cpu_kernels_impl.hpp"
+
+namespace {
+
+struct Avx2 {
+  static constexpr uint32_t width = 8;
+  using F = __m256;
+  using I = __m256i;
+  using M = __m256;
+
+  static F set1(const float x) { return _mm256_set1_ps(x); }
+  static F add(const F a, const F b) { return _mm256_add_ps(a, b); }
+  static F sub(const F a, const F b) { return _mm256_sub_ps(a, b); }
+  static F mul(const F a, const F b) { return _mm256_mul_ps(a, b); }
+  static F div(const F a, const F b) { return _mm256_div_ps(a, b); }
+  static F sqrt(const F a) { return _mm256_sqrt_ps(a); }
+  static M lt(const F a, const F b) { return _mm256_cmp_ps(a, b, _CMP_LT_OQ); }
+  static M gt(const F a, const F b) { return _mm256_cmp_ps(a, b, _CMP_GT_OQ); }
+  static M maskAnd(const M a, const M b) { return _mm256_and_ps(a, b); }
+
+  static M laneMask(const uint32_t n) {
+    const I lanes = _mm256_setr_epi32(0, 1, 2, 3, 4, 5, 6, 7);
+    return _mm256_castsi256_ps(_mm256_cmpgt_epi32(_mm256_set1_epi32(n), lanes));
+  }
+
+  static I loadIndices(const int32_t *ptr, const uint32_t n) {
+    return _mm256_maskload_epi32(ptr, _mm256_castps_si256(laneMask(n)));
+  }
+
+  static M notEqual(const I a, const int32_t b) {
+    return _mm256_castsi256_ps(
+        _mm256_xor_si256(_mm256_cmpeq_epi32(a, _mm256_set1_epi32(b)),
+                         _mm256_set1_epi32(-1)));
+  }
+
+  static F gather(const float *base, const I idx) {
+    return _mm256_i32gather_ps(base, idx, 4);
+  }
+
+  static F select(const M mask, const F a) { return _mm256_and_ps(mask, a); }
+  static bool none(const M mask) { return _mm256_movemask_ps(mask) == 0; }
+
+  static float sum(const F a) {
+    const __m128 lo = _mm256_castps256_ps128(a);
+    const __m128 hi = _mm256_extractf128_ps(a, 1);
+    const __m128 quad = _mm_add_ps(lo, hi);
+    const __m128 shuf = _mm_movehdup_ps(quad);
+    const __m128 sums = _mm_add_ps(quad, shuf);
+    return _mm_cvtss_f32(_mm_add_ss(sums, _mm_movehl_ps(shuf, sums)));
+  }
+
+  static F load(const float *ptr) { return _mm256_loadu_ps(ptr); }
+  static void store(float *ptr, const F a) { _mm256_storeu_ps(ptr, a); }
+  static void storeFirst(float *ptr, const F a, const uint32_t n) {
+    _mm256_maskstore_ps(ptr, _mm256_castps_si256(laneMask(n)), a);
+  }
+  static F floor(const F a) { return _mm256_floor_ps(a); }
+  static F min(const F a, const F b) { return _mm256_min_ps(a, b); }
+  static F max(const F a, const F b) { return _mm256_max_ps(a, b); }
+  static I toIndex(const F a) { return _mm256_cvttps_epi32(a); }
+};
+
+} // namespace
+
+const CpuKernelTable avx2_kernels = {"avx2", Avx2::width,
+                                     calcDensityRange<Avx2, 2>,
+                                     applyFluidForcesRange<Avx2, 2>,
+                                     calcDensityRange<Avx2, 3>,
+                                     applyFluidForcesRange<Avx2, 3>,
+                                     constrainToSdfRange<Avx2>};
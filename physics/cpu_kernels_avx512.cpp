@@ -0,0 +1,70 @@
+// AVX-512 variant. The target pragma must come before any include so every
+// function in this file is compiled for AVX-512F; nothing here is shared with
+// other translation units.
+#pragma GCC target("avx512f")
+#include <immintrin.h>
+
+#include "cpu_kernels_impl.hpp"
+
+namespace {
+
+struct Avx512 {
+  static constexpr uint32_t width = 16;
+  using F = __m512;
+  using I = __m512i;
+  using M = __mmask16;
+
+  static F set1(const float x) { return _mm512_set1_ps(x); }
+  static F add(const F a, const F b) { return _mm512_add_ps(a, b); }
+  static F sub(const F a, const F b) { return _mm512_sub_ps(a, b); }
+  static F mul(const F a, const F b) { return _mm512_mul_ps(a, b); }
+  static F div(const F a, const F b) { return _mm512_div_ps(a, b); }
+  static F sqrt(const F a) { return _mm512_sqrt_ps(a); }
+  static M lt(const F a, const F b) {
+    return _mm512_cmp_ps_mask(a, b, _CMP_LT_OQ);
+  }
+  static M gt(const F a, const F b) {
+    return _mm512_cmp_ps_mask(a, b, _CMP_GT_OQ);
+  }
+  static M maskAnd(const M a, const M b) { return a & b; }
+  static M laneMask(const uint32_t n) { return (M)((1u << n) - 1); }
+
+  static I loadIndices(const int32_t *ptr, const uint32_t n) {
+    return _mm512_maskz_loadu_epi32(laneMask(n), ptr);
+  }
+
+  static M notEqual(const I a, const int32_t b) {
+    return _mm512_cmpneq_epi32_mask(a, _mm512_set1_epi32(b));
+  }
+
+  static F gather(const float *base, const I idx) {
+    return _mm512_i32gather_ps(idx, base, 4);
+  }
+
+  static F select(const M mask, const F a) {
+    return _mm512_maskz_mov_ps(mask, a);
+  }
+  static bool none(const M mask) { return mask == 0; }
+  static float sum(const F a) { return _mm512_reduce_add_ps(a); }
+
+  static F load(const float *ptr) { return _mm512_loadu_ps(ptr); }
+  static void store(float *ptr, const F a) { _mm512_storeu_ps(ptr, a); }
+  static void storeFirst(float *ptr, const F a, const uint32_t n) {
+    _mm512_mask_storeu_ps(ptr, laneMask(n), a);
+  }
+  static F floor(const F a) {
+    return _mm512_roundscale_ps(a, _MM_FROUND_TO_NEG_INF);
+  }
+  static F min(const F a, const F b) { return _mm512_min_ps(a, b); }
+  static F max(const F a, const F b) { return _mm512_max_ps(a, b); }
+  static I toIndex(const F a) { return _mm512_cvttps_epi32(a); }
+};
+
+} // namespace
+
+const CpuKernelTable avx512_kernels = {"avx512", Avx512::width,
+                                       calcDensityRange<Avx512, 2>,
+                                       applyFluidForcesRange<Avx512, 2>,
+                                       calcDensityRange<Avx512, 3>,
+                                       applyFluidForcesRange<Avx512, 3>,
+                                       constrainToSdfRange<Avx512>};
@@ -0,0 +1,365 @@
+#pragma once
+// Shared body of the CPU SPH kernels, instantiated once per SIMD wrapper in
+// cpu_kernels_*.cpp. Must only be included from those files, and everything
+// here stays in an anonymous namespace so no instantiation compiled for one
+// instruction set can be picked by the linker for another.
+//
+// A wrapper V provides:
+//   width, F (float vector), I (index vector), M (lane mask)
+//   set1, add, sub, mul, div, sqrt, lt, gt, maskAnd
+//   laneMask(n)              first n lanes set
+//   loadIndices(ptr, n)      first n indices, zero in the other lanes
+//   notEqual(I, int32_t)     lanes whose index differs
+//   gather(base, I)
+//   select(M, F)             F where set, zero elsewhere
+//   none(M)                  no lane set
+//   sum(F)                   horizontal add
+//   load(ptr), store(ptr, F) unaligned
+//   storeFirst(ptr, F, n)    first n lanes only, nothing past them
+//   floor, min, max
+//   toIndex(F)               truncate to an index vector
+
+#include <cstdint>
+
+#include "cpu_kernels.hpp"
+
+namespace {
+
+constexpr float kernel_pi = 3.14159265359f;
+
+// Calls fn(idx, dx, dy, r2, mask) for every vector of boundary samples in
+// the 9 cells around p_i, with mask set on the ones within h. 2D only.
+template <typename V, typename Fn>
+void forEachBoundaryVector(const CpuKernelArgs &args, const uint32_t p_i,
+                           const typename V::F pos_x,
+                           const typename V::F pos_y, Fn &&fn) {
+  using F = typename V::F;
+  using I = typename V::I;
+  using M = typename V::M;
+
+  if (args.boundary_stencils == nullptr || args.boundary_stencils[p_i] < 0) {
+    return;
+  }
+  const F h2_v = V::set1(args.params.h * args.params.h);
+  const int32_t *ranges =
+      args.boundary_ranges + 36 * args.boundary_stencils[p_i];
+  for (uint32_t range = 0; range < 18; range++) {
+    const int32_t start = ranges[2 * range];
+    const int32_t stop = ranges[2 * range + 1];
+
+    for (int32_t k = start; k < stop; k += V::width) {
+      const uint32_t n = stop - k < (int32_t)V::width ? stop - k : V::width;
+      const I idx = V::loadIndices(args.boundary_indicies + k, n);
+
+      const F dx = V::sub(V::gather(args.boundary_x, idx), pos_x);
+      const F dy = V::sub(V::gather(args.boundary_y, idx), pos_y);
+      const F r2 = V::add(V::mul(dx, dx), V::mul(dy, dy));
+      const M mask = V::maskAnd(V::laneMask(n), V::lt(r2, h2_v));
+      fn(idx, dx, dy, r2, mask);
+    }
+  }
+}
+
+// Particles per stencil: 9 cells in 2D, 27 in 3D.
+template <int D> constexpr uint32_t stencil_cells = D == 3 ? 27 : 9;
+
+// The D offsets from 'pos' to the particles at 'idx', and the squared
+// distance, summed as dx^2 + dy^2 first so 2D rounds as it always has.
+template <typename V, int D>
+typename V::F neighbourOffsets(const float *const *streams,
+                               const typename V::F *pos,
+                               const typename V::I idx, typename V::F *d) {
+  for (int32_t axis = 0; axis < D; axis++) {
+    d[axis] = V::sub(V::gather(streams[axis], idx), pos[axis]);
+  }
+  typename V::F r2 = V::add(V::mul(d[0], d[0]), V::mul(d[1], d[1]));
+  if constexpr (D == 3) {
+    r2 = V::add(r2, V::mul(d[2], d[2]));
+  }
+  return r2;
+}
+
+template <typename V, int D>
+void calcDensityRange(const CpuKernelArgs &args, const uint32_t begin,
+                      const uint32_t end) {
+  using F = typename V::F;
+  using I = typename V::I;
+  using M = typename V::M;
+
+  const float h = args.params.h;
+  const float h2 = h * h;
+  // poly6: 4 / (pi h^8) * (h^2 - r^2)^3 in 2D, 315 / (64 pi h^9) in 3D, with
+  // the mass folded in.
+  const float h4 = h2 * h2;
+  const float h_power = D == 3 ? h4 * h4 * h : h4 * h4;
+  const float poly6 = args.params.particle_mass * KernelConstants<D>::poly6 /
+                      (kernel_pi * h_power);
+  // Boundary samples carry their own psi in place of the mass.
+  const float boundary_poly6 =
+      KernelConstants<D>::poly6 / (kernel_pi * h_power);
+  const F h2_v = V::set1(h2);
+  const float *const pos_streams[3] = {args.pos_x, args.pos_y, args.pos_z};
+
+  for (uint32_t slot = begin; slot < end; slot++) {
+    const uint32_t p_i =
+        args.active_particles != nullptr ? args.active_particles[slot] : slot;
+    F pos[D];
+    for (int32_t axis = 0; axis < D; axis++) {
+      pos[axis] = V::set1(pos_streams[axis][p_i]);
+    }
+    F density = V::set1(0.f);
+
+    const int32_t *ranges =
+        args.neighbour_ranges + 2 * stencil_cells<D> * p_i;
+    for (uint32_t cell = 0; cell < stencil_cells<D>; cell++) {
+      const int32_t start = ranges[2 * cell];
+      const int32_t stop = ranges[2 * cell + 1];
+
+      for (int32_t k = start; k < stop; k += V::width) {
+        const uint32_t n = stop - k < (int32_t)V::width ? stop - k : V::width;
+        const I idx = V::loadIndices(args.spatial_indicies + k, n);
+
+        F d[D];
+        const F r2 = neighbourOffsets<V, D>(pos_streams, pos, idx, d);
+        const M mask = V::maskAnd(V::laneMask(n), V::lt(r2, h2_v));
+
+        const F x = V::sub(h2_v, r2);
+        density = V::add(density, V::select(mask, V::mul(V::mul(x, x), x)));
+      }
+    }
+
+    F boundary_density = V::set1(0.f);
+    if constexpr (D == 2) {
+      forEachBoundaryVector<V>(
+          args, p_i, pos[0], pos[1],
+          [&](const I idx, const F, const F, const F r2, const M mask) {
+            const F x = V::sub(h2_v, r2);
+            const F psi = V::gather(args.boundary_psi, idx);
+            boundary_density = V::add(
+                boundary_density,
+                V::select(mask, V::mul(psi, V::mul(V::mul(x, x), x))));
+          });
+    }
+
+    args.density[p_i] =
+        poly6 * V::sum(density) + boundary_poly6 * V::sum(boundary_density);
+  }
+}
+
+template <typename V, int D>
+void applyFluidForcesRange(const CpuKernelArgs &args, const uint32_t begin,
+                           const uint32_t end) {
+  using F = typename V::F;
+  using I = typename V::I;
+  using M = typename V::M;
+
+  const FluidParams &params = args.params;
+  const float h = params.h;
+  // h^5 in 2D, h^6 in 3D, for both the spiky gradient and the viscosity
+  // laplacian.
+  const float h5 = h * h * h * h * h;
+  const float h_power = D == 3 ? h5 * h : h5;
+  const float spiky = -KernelConstants<D>::spiky / (h_power * kernel_pi);
+  const float laplacian =
+      KernelConstants<D>::laplacian / (h_power * kernel_pi);
+
+  const F h_v = V::set1(h);
+  const F h2_v = V::set1(h * h);
+  const F zero = V::set1(0.f);
+  const F one = V::set1(1.f);
+  const F mass = V::set1(params.particle_mass);
+  const F target_density = V::set1(params.target_density);
+  const F pressure_multiplier = V::set1(params.pressure_multiplier);
+  const float *const pos_streams[3] = {args.pos_x, args.pos_y, args.pos_z};
+  const float *const vel_streams[3] = {args.vel_x, args.vel_y, args.vel_z};
+  float *const force_streams[3] = {args.force_x, args.force_y, args.force_z};
+
+  for (uint32_t slot = begin; slot < end; slot++) {
+    const uint32_t p_i =
+        args.active_particles != nullptr ? args.active_particles[slot] : slot;
+    F pos[D], vel[D];
+    for (int32_t axis = 0; axis < D; axis++) {
+      pos[axis] = V::set1(pos_streams[axis][p_i]);
+      vel[axis] = V::set1(vel_streams[axis][p_i]);
+    }
+
+    const float curr_density = args.density[p_i];
+    const float curr_pressure =
+        (curr_density - params.target_density) * params.pressure_multiplier;
+    const F curr_pressure_v = V::set1(curr_pressure);
+
+    F pressure_sum[D], visc_sum[D];
+    for (int32_t axis = 0; axis < D; axis++) {
+      pressure_sum[axis] = visc_sum[axis] = zero;
+    }
+
+    const int32_t *ranges =
+        args.neighbour_ranges + 2 * stencil_cells<D> * p_i;
+    for (uint32_t cell = 0; cell < stencil_cells<D>; cell++) {
+      const int32_t start = ranges[2 * cell];
+      const int32_t stop = ranges[2 * cell + 1];
+
+      for (int32_t k = start; k < stop; k += V::width) {
+        const uint32_t n = stop - k < (int32_t)V::width ? stop - k : V::width;
+        const I idx = V::loadIndices(args.spatial_indicies + k, n);
+
+        F d[D];
+        const F r2 = neighbourOffsets<V, D>(pos_streams, pos, idx, d);
+        // Skip self
+        const M mask = V::maskAnd(V::maskAnd(V::laneMask(n), V::lt(r2, h2_v)),
+                                  V::notEqual(idx, (int32_t)p_i));
+        if (V::none(mask)) {
+          continue;
+        }
+
+        const F r = V::sqrt(r2);
+        // Coincident particles get no pressure direction instead of a NaN.
+        const F inv_r = V::select(V::gt(r2, zero), V::div(one, r));
+        const F q = V::sub(h_v, r);
+
+        const F neighbour_density = V::gather(args.density, idx);
+        const F neighbour_pressure = V::mul(
+            V::sub(neighbour_density, target_density), pressure_multiplier);
+        const F shared_pressure =
+            V::mul(V::set1(0.5f), V::add(curr_pressure_v, neighbour_pressure));
+        const F mass_over_density = V::div(mass, neighbour_density);
+
+        // -dir * m * spiky(r) * shared_pressure / rho_j, with dir = d / r.
+        const F spiky_term = V::mul(V::set1(-spiky), V::mul(V::mul(q, q), q));
+        const F pressure = V::select(
+            mask, V::mul(V::mul(spiky_term, shared_pressure),
+                         V::mul(mass_over_density, inv_r)));
+
+        // m * laplacian(r) * (v_j - v_i) / rho_j
+        const F visc = V::select(
+            mask, V::mul(V::mul(V::set1(laplacian), q), mass_over_density));
+        for (int32_t axis = 0; axis < D; axis++) {
+          pressure_sum[axis] =
+              V::add(pressure_sum[axis], V::mul(pressure, d[axis]));
+          visc_sum[axis] = V::add(
+              visc_sum[axis],
+              V::mul(visc, V::sub(V::gather(vel_streams[axis], idx),
+                                  vel[axis])));
+        }
+      }
+    }
+
+    // Boundary samples push back with p_i's own pressure, standing in for
+    // psi_b of mass at p_i's density.
+    if constexpr (D == 2) {
+      const F psi_scale = V::set1(curr_pressure / curr_density);
+      forEachBoundaryVector<V>(
+          args, p_i, pos[0], pos[1],
+          [&](const I idx, const F dx, const F dy, const F r2, const M mask) {
+            const F r = V::sqrt(r2);
+            const F inv_r = V::select(V::gt(r2, zero), V::div(one, r));
+            const F q = V::sub(h_v, r);
+            const F spiky_term =
+                V::mul(V::set1(-spiky), V::mul(V::mul(q, q), q));
+            const F psi = V::gather(args.boundary_psi, idx);
+            const F pressure = V::select(
+                mask,
+                V::mul(V::mul(spiky_term, psi_scale), V::mul(psi, inv_r)));
+            pressure_sum[0] = V::add(pressure_sum[0], V::mul(pressure, dx));
+            pressure_sum[1] = V::add(pressure_sum[1], V::mul(pressure, dy));
+          });
+    }
+
+    const float grav = -9.81f * params.particle_mass / curr_density;
+    for (int32_t axis = 0; axis < D; axis++) {
+      float force = V::sum(pressure_sum[axis]) +
+                    params.viscosity_strength * V::sum(visc_sum[axis]);
+      if (axis == 1) {
+        force += grav;
+      }
+      force_streams[axis][p_i] = force;
+    }
+  }
+}
+
+// Pushes particles that are closer than args.radius to the boundary back out
+// along the SDF gradient, and reflects (damped) any velocity into it. Whole
+// vectors of consecutive particles, without branches.
+template <typename V>
+void constrainToSdfRange(const CpuSdfArgs &args, const uint32_t begin,
+                         const uint32_t end) {
+  using F = typename V::F;
+  using I = typename V::I;
+  using M = typename V::M;
+
+  const F zero = V::set1(0.f);
+  const F one = V::set1(1.f);
+  const F origin_x = V::set1(args.origin_x);
+  const F origin_y = V::set1(args.origin_y);
+  const F inv_cell_size = V::set1(args.inv_cell_size);
+  // Clamped so all four corners of the lookup are inside the grid.
+  const F max_x = V::set1(args.width - 1.001f);
+  const F max_y = V::set1(args.height - 1.001f);
+  const F row = V::set1((float)args.width);
+  const F radius = V::set1(args.radius);
+  const F bounce = V::set1(1.f + args.damp);
+  const float *d00 = args.distances;
+  const float *d10 = args.distances + 1;
+  const float *d01 = args.distances + args.width;
+  const float *d11 = args.distances + args.width + 1;
+
+  for (uint32_t i = begin; i < end; i += V::width) {
+    const uint32_t n = end - i < V::width ? end - i : V::width;
+    F pos_x = V::load(args.pos_x + i);
+    F pos_y = V::load(args.pos_y + i);
+    F vel_x = V::load(args.vel_x + i);
+    F vel_y = V::load(args.vel_y + i);
+
+    const F gx = V::min(
+        V::max(V::mul(V::sub(pos_x, origin_x), inv_cell_size), zero), max_x);
+    const F gy = V::min(
+        V::max(V::mul(V::sub(pos_y, origin_y), inv_cell_size), zero), max_y);
+    const F cell_x = V::floor(gx);
+    const F cell_y = V::floor(gy);
+    const F fx = V::sub(gx, cell_x);
+    const F fy = V::sub(gy, cell_y);
+    const F tx = V::sub(one, fx);
+    const F ty = V::sub(one, fy);
+    // Exact in float for any grid under 2^24 samples.
+    const I idx = V::toIndex(V::add(V::mul(cell_y, row), cell_x));
+
+    const F s00 = V::gather(d00, idx);
+    const F s10 = V::gather(d10, idx);
+    const F s01 = V::gather(d01, idx);
+    const F s11 = V::gather(d11, idx);
+    const F distance =
+        V::add(V::mul(V::add(V::mul(s00, tx), V::mul(s10, fx)), ty),
+               V::mul(V::add(V::mul(s01, tx), V::mul(s11, fx)), fy));
+    const F grad_x = V::add(V::mul(V::sub(s10, s00), ty),
+                            V::mul(V::sub(s11, s01), fy));
+    const F grad_y = V::add(V::mul(V::sub(s01, s00), tx),
+                            V::mul(V::sub(s11, s10), fx));
+    const F grad2 = V::add(V::mul(grad_x, grad_x), V::mul(grad_y, grad_y));
+
+    // The normal is zero in every lane that isn't touching, which leaves
+    // those lanes unchanged below.
+    const M touching = V::maskAnd(
+        V::maskAnd(V::laneMask(n), V::lt(distance, radius)),
+        V::gt(grad2, zero));
+    const F inv_grad = V::select(touching, V::div(one, V::sqrt(grad2)));
+    const F normal_x = V::mul(grad_x, inv_grad);
+    const F normal_y = V::mul(grad_y, inv_grad);
+
+    const F push = V::sub(radius, distance);
+    pos_x = V::add(pos_x, V::mul(push, normal_x));
+    pos_y = V::add(pos_y, V::mul(push, normal_y));
+
+    const F into = V::add(V::mul(vel_x, normal_x), V::mul(vel_y, normal_y));
+    const F reflect = V::select(V::lt(into, zero), V::mul(bounce, into));
+    vel_x = V::sub(vel_x, V::mul(reflect, normal_x));
+    vel_y = V::sub(vel_y, V::mul(reflect, normal_y));
+
+    // Nothing past 'end' is written, as CpuKernelTable promises.
+    V::storeFirst(args.pos_x + i, pos_x, n);
+    V::storeFirst(args.pos_y + i, pos_y, n);
+    V::storeFirst(args.vel_x + i, vel_x, n);
+    V::storeFirst(args.vel_y + i, vel_y, n);
+  }
+}
+
+} // namespace
@@ -0,0 +1,50 @@
+// Scalar reference: the shared kernels with a one lane "vector".
+#include <cmath>
+
+#include "cpu_kernels_impl.hpp"
+
+namespace {
+
+struct Scalar {
+  static constexpr uint32_t width = 1;
+  using F = float;
+  using I = int32_t;
+  using M = bool;
+
+  static F set1(const float x) { return x; }
+  static F add(const F a, const F b) { return a + b; }
+  static F sub(const F a, const F b) { return a - b; }
+  static F mul(const F a, const F b) { return a * b; }
+  static F div(const F a, const F b) { return a / b; }
+  static F sqrt(const F a) { return std::sqrt(a); }
+  static M lt(const F a, const F b) { return a < b; }
+  static M gt(const F a, const F b) { return a > b; }
+  static M maskAnd(const M a, const M b) { return a && b; }
+  static M laneMask(const uint32_t n) { return n > 0; }
+  static I loadIndices(const int32_t *ptr, const uint32_t) { return *ptr; }
+  static M notEqual(const I a, const int32_t b) { return a != b; }
+  static F gather(const float *base, const I idx) { return base[idx]; }
+  static F select(const M mask, const F a) { return mask ? a : 0.f; }
+  static bool none(const M mask) { return !mask; }
+  static float sum(const F a) { return a; }
+  static F load(const float *ptr) { return *ptr; }
+  static void store(float *ptr, const F a) { *ptr = a; }
+  static void storeFirst(float *ptr, const F a, const uint32_t n) {
+    if (n > 0) {
+      *ptr = a;
+    }
+  }
+  static F floor(const F a) { return std::floor(a); }
+  static F min(const F a, const F b) { return a < b ? a : b; }
+  static F max(const F a, const F b) { return a > b ? a : b; }
+  static I toIndex(const F a) { return (I)a; }
+};
+
+} // namespace
+
+const CpuKernelTable scalar_kernels = {"scalar", Scalar::width,
+                                       calcDensityRange<Scalar, 2>,
+                                       applyFluidForcesRange<Scalar, 2>,
+                                       calcDensityRange<Scalar, 3>,
+                                       applyFluidForcesRange<Scalar, 3>,
+                                       constrainToSdfRange<Scalar>};
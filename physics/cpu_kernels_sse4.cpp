@@ -0,0 +1,93 @@
+// SSE4.1 variant. The target pragma must come before any include so every
+// function in this file is compiled for SSE4.1; nothing here is shared with
+// other translation units.
+#pragma GCC target("sse4.1")
+#include <immintrin.h>
+
+#include "cpu_kernels_impl.hpp"
+
+namespace {
+
+struct Sse4 {
+  static constexpr uint32_t width = 4;
+  using F = __m128;
+  using I = __m128i;
+  using M = __m128;
+
+  static F set1(const float x) { return _mm_set1_ps(x); }
+  static F add(const F a, const F b) { return _mm_add_ps(a, b); }
+  static F sub(const F a, const F b) { return _mm_sub_ps(a, b); }
+  static F mul(const F a, const F b) { return _mm_mul_ps(a, b); }
+  static F div(const F a, const F b) { return _mm_div_ps(a, b); }
+  static F sqrt(const F a) { return _mm_sqrt_ps(a); }
+  static M lt(const F a, const F b) { return _mm_cmplt_ps(a, b); }
+  static M gt(const F a, const F b) { return _mm_cmpgt_ps(a, b); }
+  static M maskAnd(const M a, const M b) { return _mm_and_ps(a, b); }
+
+  static M laneMask(const uint32_t n) {
+    const I lanes = _mm_setr_epi32(0, 1, 2, 3);
+    return _mm_castsi128_ps(_mm_cmplt_epi32(lanes, _mm_set1_epi32(n)));
+  }
+
+  static I loadIndices(const int32_t *ptr, const uint32_t n) {
+    // No masked integer load in SSE; avoid reading past the end instead.
+    if (n == width) {
+      return _mm_loadu_si128((const __m128i *)ptr);
+    }
+    int32_t tail[4] = {0, 0, 0, 0};
+    for (uint32_t i = 0; i < n; i++) {
+      tail[i] = ptr[i];
+    }
+    return _mm_loadu_si128((const __m128i *)tail);
+  }
+
+  static M notEqual(const I a, const int32_t b) {
+    return _mm_castsi128_ps(
+        _mm_xor_si128(_mm_cmpeq_epi32(a, _mm_set1_epi32(b)),
+                      _mm_set1_epi32(-1)));
+  }
+
+  static F gather(const float *base, const I idx) {
+    return _mm_setr_ps(base[_mm_extract_epi32(idx, 0)],
+                       base[_mm_extract_epi32(idx, 1)],
+                       base[_mm_extract_epi32(idx, 2)],
+                       base[_mm_extract_epi32(idx, 3)]);
+  }
+
+  static F select(const M mask, const F a) { return _mm_and_ps(mask, a); }
+  static bool none(const M mask) { return _mm_movemask_ps(mask) == 0; }
+
+  static float sum(const F a) {
+    const F shuf = _mm_movehdup_ps(a);
+    const F sums = _mm_add_ps(a, shuf);
+    return _mm_cvtss_f32(_mm_add_ss(sums, _mm_movehl_ps(shuf, sums)));
+  }
+
+  static F load(const float *ptr) { return _mm_loadu_ps(ptr); }
+  static void store(float *ptr, const F a) { _mm_storeu_ps(ptr, a); }
+  static void storeFirst(float *ptr, const F a, const uint32_t n) {
+    // No masked store in SSE short of the non-temporal maskmov.
+    if (n == width) {
+      _mm_storeu_ps(ptr, a);
+      return;
+    }
+    float lanes[4];
+    _mm_storeu_ps(lanes, a);
+    for (uint32_t i = 0; i < n; i++) {
+      ptr[i] = lanes[i];
+    }
+  }
+  static F floor(const F a) { return _mm_floor_ps(a); }
+  static F min(const F a, const F b) { return _mm_min_ps(a, b); }
+  static F max(const F a, const F b) { return _mm_max_ps(a, b); }
+  static I toIndex(const F a) { return _mm_cvttps_epi32(a); }
+};
+
+} // namespace
+
+const CpuKernelTable sse4_kernels = {"sse4", Sse4::width,
+                                     calcDensityRange<Sse4, 2>,
+                                     applyFluidForcesRange<Sse4, 2>,
+                                     calcDensityRange<Sse4, 3>,
+                                     applyFluidForcesRange<Sse4, 3>,
+                                     constrainToSdfRange<Sse4>};
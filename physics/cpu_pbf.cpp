@@ -0,0 +1,204 @@
+#include "cpu_compute.hpp"
+
+#include <algorithm>
+#include <cmath>
+
+// Position Based Fluids on the SoA streams. Neighbours are found once from
+// the predicted positions and kept for every iteration, as in the paper, with
+// a skin of PbfParams::neighbour_skin * h so that particles pushed into range
+// by the corrections are still seen.
+// Scratch use of the streams:
+//   density            rho_i of the last iteration, for statistics
+//   force_x, force_y   position correction, then XSPH velocities
+//   pbf_lambda         lambda_i
+
+namespace {
+
+constexpr float pbf_pi = 3.14159265359f;
+
+struct PbfKernels {
+  float h, h2;
+  float list_radius; // h * (1 + skin)
+  float poly6;     // 4 / (pi h^8)
+  float spiky;     // -30 / (pi h^5), dW/dr = spiky * (h - r)^2
+  float volume;    // m / rho0
+  float inv_rest_density;
+  float particle_mass;
+};
+
+PbfKernels pbfKernels(const FluidParams &params, const PbfParams &pbf) {
+  PbfKernels k;
+  k.h = params.h;
+  k.h2 = params.h * params.h;
+  k.list_radius = params.h * (1.f + pbf.neighbour_skin);
+  k.poly6 = KernelConstants<2>::poly6 / (pbf_pi * std::pow(params.h, 8.f));
+  k.spiky =
+      -3.f * KernelConstants<2>::spiky / (pbf_pi * std::pow(params.h, 5.f));
+  k.volume = params.particle_mass / pbf.rest_density;
+  k.inv_rest_density = 1.f / pbf.rest_density;
+  k.particle_mass = params.particle_mass;
+  return k;
+}
+
+// 2D poly6.
+float pbfPoly6(const float r, const float h) {
+  const float x = h * h - r * r;
+  return KernelConstants<2>::poly6 / (pbf_pi * std::pow(h, 8.f)) * x * x * x;
+}
+
+} // namespace
+
+float pbfSCorrScale(const PbfParams &pbf, const float h) {
+  return 1.f / pbfPoly6(pbf.s_corr_delta_q * h, h);
+}
+
+void CpuCompute::solvePbf(Particles &particles, SpatialGrid &spatial_grid,
+                          const FluidParams &params, const PbfParams &pbf,
+                          const glm::vec2 min_pos, const glm::vec2 max_pos,
+                          JobSystem &job_system) {
+  const uint32_t count = particles.particle_count;
+  const PbfKernels k = pbfKernels(params, pbf);
+  float *pos_x = particles.pos_x.data();
+  float *pos_y = particles.pos_y.data();
+  float *vel_x = particles.vel_x.data();
+  float *vel_y = particles.vel_y.data();
+  float *scratch_x = particles.force_x.data();
+  float *scratch_y = particles.force_y.data();
+  float *density = particles.density.data();
+  float *lambda = this->pbf_lambda.data();
+
+  // Most grid candidates are well out of range, so filter them once here
+  // rather than in every pass.
+  const uint64_t pairs = this->buildNeighbourLists(
+      particles, spatial_grid, k.list_radius, job_system);
+  const int32_t *neighbours = this->neighbour_list.data();
+  const uint32_t *neighbour_counts = this->neighbour_counts.data();
+
+  // Calls fn(n_i) for every listed neighbour of p_i, including itself.
+  auto for_each_neighbour = [&](const uint32_t p_i, auto &&fn) {
+    const int32_t *list = neighbours + max_neighbours * p_i;
+    for (uint32_t i = 0; i < neighbour_counts[p_i]; i++) {
+      fn((uint32_t)list[i]);
+    }
+  };
+
+  auto lambda_pass = [&](const uint32_t begin, const uint32_t end) {
+    for (uint32_t p_i = begin; p_i < end; p_i++) {
+      float rho = 0.f;
+      float grad_i_x = 0.f, grad_i_y = 0.f, grad_sum = 0.f;
+
+      for_each_neighbour(p_i, [&](const uint32_t n_i) {
+        const float dx = pos_x[p_i] - pos_x[n_i];
+        const float dy = pos_y[p_i] - pos_y[n_i];
+        const float r2 = dx * dx + dy * dy;
+        if (r2 >= k.h2) {
+          return;
+        }
+        const float x = k.h2 - r2;
+        rho += k.particle_mass * k.poly6 * x * x * x;
+
+        const float r = std::sqrt(r2);
+        if (r == 0.f) {
+          return;
+        }
+        const float w = k.volume * k.spiky * (k.h - r) * (k.h - r) / r;
+        grad_i_x += w * dx;
+        grad_i_y += w * dy;
+        grad_sum += w * w * r2;
+      });
+      grad_sum += grad_i_x * grad_i_x + grad_i_y * grad_i_y;
+
+      // Only push apart; a free surface is allowed to be under-dense.
+      const float constraint = std::max(rho * k.inv_rest_density - 1.f, 0.f);
+      density[p_i] = rho;
+      lambda[p_i] = -constraint / (grad_sum + pbf.relaxation);
+    }
+  };
+
+  auto delta_pass = [&](const uint32_t begin, const uint32_t end) {
+    for (uint32_t p_i = begin; p_i < end; p_i++) {
+      float delta_x = 0.f, delta_y = 0.f;
+
+      for_each_neighbour(p_i, [&](const uint32_t n_i) {
+        const float dx = pos_x[p_i] - pos_x[n_i];
+        const float dy = pos_y[p_i] - pos_y[n_i];
+        const float r2 = dx * dx + dy * dy;
+        if (r2 >= k.h2 || n_i == p_i) {
+          return;
+        }
+        const float r = std::sqrt(r2);
+        if (r == 0.f) {
+          return;
+        }
+
+        const float x = k.h2 - r2;
+        const float ratio = k.poly6 * x * x * x * pbf.s_corr_scale;
+        const float s_corr = -pbf.s_corr_k * ratio * ratio * ratio * ratio;
+
+        const float w = (lambda[p_i] + lambda[n_i] + s_corr) * k.volume *
+                        k.spiky * (k.h - r) * (k.h - r) / r;
+        delta_x += w * dx;
+        delta_y += w * dy;
+      });
+
+      scratch_x[p_i] = delta_x;
+      scratch_y[p_i] = delta_y;
+    }
+  };
+
+  // Move by the correction, clamped to the world, and fold what was actually
+  // applied into the velocity so v ends up as (x - x_old) / dt.
+  const float inv_dt = 1.f / pbf.step_dt;
+  auto apply_pass = [&](const uint32_t begin, const uint32_t end) {
+    for (uint32_t p_i = begin; p_i < end; p_i++) {
+      const float x =
+          std::clamp(pos_x[p_i] + scratch_x[p_i], min_pos.x, max_pos.x);
+      const float y =
+          std::clamp(pos_y[p_i] + scratch_y[p_i], min_pos.y, max_pos.y);
+      vel_x[p_i] += (x - pos_x[p_i]) * inv_dt;
+      vel_y[p_i] += (y - pos_y[p_i]) * inv_dt;
+      pos_x[p_i] = x;
+      pos_y[p_i] = y;
+    }
+  };
+
+  for (uint32_t iteration = 0; iteration < pbf.iterations; iteration++) {
+    job_system.parallelFor(0, count, cpu_compute_chunk, lambda_pass);
+    job_system.parallelFor(0, count, cpu_compute_chunk, delta_pass);
+    job_system.parallelFor(0, count, cpu_compute_chunk, apply_pass);
+  }
+
+  // XSPH viscosity, into scratch first so every particle sees the same
+  // velocities.
+  auto xsph_pass = [&](const uint32_t begin, const uint32_t end) {
+    for (uint32_t p_i = begin; p_i < end; p_i++) {
+      float dv_x = 0.f, dv_y = 0.f;
+
+      for_each_neighbour(p_i, [&](const uint32_t n_i) {
+        const float dx = pos_x[p_i] - pos_x[n_i];
+        const float dy = pos_y[p_i] - pos_y[n_i];
+        const float r2 = dx * dx + dy * dy;
+        if (r2 >= k.h2) {
+          return;
+        }
+        const float x = k.h2 - r2;
+        const float w = k.volume * k.poly6 * x * x * x;
+        dv_x += (vel_x[n_i] - vel_x[p_i]) * w;
+        dv_y += (vel_y[n_i] - vel_y[p_i]) * w;
+      });
+
+      scratch_x[p_i] = vel_x[p_i] + pbf.xsph_viscosity * dv_x;
+      scratch_y[p_i] = vel_y[p_i] + pbf.xsph_viscosity * dv_y;
+    }
+  };
+  auto copy_pass = [&](const uint32_t begin, const uint32_t end) {
+    std::copy(scratch_x + begin, scratch_x + end, vel_x + begin);
+    std::copy(scratch_y + begin, scratch_y + end, vel_y + begin);
+  };
+  job_system.parallelFor(0, count, cpu_compute_chunk, xsph_pass);
+  job_system.parallelFor(0, count, cpu_compute_chunk, copy_pass);
+
+  // Lambda and delta per iteration, plus XSPH.
+  this->neighbour_evaluations += (2 * pbf.iterations + 1) * pairs;
+  this->solver_iterations += pbf.iterations;
+}
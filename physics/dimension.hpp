@@ -0,0 +1,115 @@
+#pragma once
+#include <cstdint>
+
+#include <glm/glm.hpp>
+
+// What the particle containers and the spatial grid need to know about the
+// space they live in, for D = 2 or 3. Everything here is resolved at compile
+// time, so the 2D instantiations compile to what hand-written 2D code would.
+//
+//   vec, ivec         positions and cell coordinates
+//   stencil_cells     cells in the block around a cell, 3^D
+//   stencilOffset(i)  the i'th of them, x fastest
+//   cellKey           a cell coordinate packed into 64 bits, and back
+//   hash32            the prime xor hash behind CellKeyMode::Hash32
+//   morton            cell coordinates bit-interleaved, so sorting by it
+//                     keeps cells that are close in space close in memory
+template <int D> struct Dimension;
+
+template <> struct Dimension<2> {
+  using vec = glm::vec2;
+  using ivec = glm::ivec2;
+  static constexpr uint32_t stencil_cells = 9;
+
+  static ivec stencilOffset(const uint32_t i) {
+    return ivec(i % 3 - 1, i / 3 - 1);
+  }
+
+  // 32 bits a coordinate.
+  static uint64_t cellKey(const ivec cell_coord) {
+    return (uint64_t)(uint32_t)cell_coord.x << 32 | (uint32_t)cell_coord.y;
+  }
+
+  static ivec keyToCellCoord(const uint64_t key) {
+    return ivec((int32_t)(uint32_t)(key >> 32), (int32_t)(uint32_t)key);
+  }
+
+  static uint32_t hash32(const ivec cell_coord) {
+    const uint32_t prime1 = 15823;
+    const uint32_t prime2 = 9737333;
+    return ((uint32_t)cell_coord.x * prime1) ^
+           ((uint32_t)cell_coord.y * prime2);
+  }
+
+  // Spreads the low 32 bits of 'v' over the even bits.
+  static uint64_t spreadBits(uint64_t v) {
+    v &= 0xffffffffull;
+    v = (v | v << 16) & 0x0000ffff0000ffffull;
+    v = (v | v << 8) & 0x00ff00ff00ff00ffull;
+    v = (v | v << 4) & 0x0f0f0f0f0f0f0f0full;
+    v = (v | v << 2) & 0x3333333333333333ull;
+    v = (v | v << 1) & 0x5555555555555555ull;
+    return v;
+  }
+
+  // Coordinates are offset by 2^31 so negative cells sort before positive.
+  static uint64_t morton(const ivec cell_coord) {
+    return spreadBits((uint32_t)cell_coord.x ^ 0x80000000u) |
+           spreadBits((uint32_t)cell_coord.y ^ 0x80000000u) << 1;
+  }
+};
+
+template <> struct Dimension<3> {
+  using vec = glm::vec3;
+  using ivec = glm::ivec3;
+  static constexpr uint32_t stencil_cells = 27;
+
+  static ivec stencilOffset(const uint32_t i) {
+    return ivec(i % 3 - 1, i / 3 % 3 - 1, i / 9 - 1);
+  }
+
+  // 21 bits a coordinate, so cells within a million of the origin each
+  // side.
+  static uint64_t cellKey(const ivec cell_coord) {
+    const uint64_t mask = (1ull << 21) - 1;
+    return ((uint64_t)(uint32_t)cell_coord.x & mask) << 42 |
+           ((uint64_t)(uint32_t)cell_coord.y & mask) << 21 |
+           ((uint64_t)(uint32_t)cell_coord.z & mask);
+  }
+
+  static ivec keyToCellCoord(const uint64_t key) {
+    // Shifted up to the top of 64 bits and back, to sign extend.
+    return ivec((int32_t)((int64_t)(key << 1) >> 43),
+                (int32_t)((int64_t)(key << 22) >> 43),
+                (int32_t)((int64_t)(key << 43) >> 43));
+  }
+
+  // Teschner et al. 2003, with the 2D primes for x and y.
+  static uint32_t hash32(const ivec cell_coord) {
+    const uint32_t prime1 = 15823;
+    const uint32_t prime2 = 9737333;
+    const uint32_t prime3 = 83492791;
+    return ((uint32_t)cell_coord.x * prime1) ^
+           ((uint32_t)cell_coord.y * prime2) ^
+           ((uint32_t)cell_coord.z * prime3);
+  }
+
+  // Spreads the low 21 bits of 'v' over every third bit.
+  static uint64_t spreadBits(uint64_t v) {
+    v &= 0x1fffffull;
+    v = (v | v << 32) & 0x001f00000000ffffull;
+    v = (v | v << 16) & 0x001f0000ff0000ffull;
+    v = (v | v << 8) & 0x100f00f00f00f00full;
+    v = (v | v << 4) & 0x10c30c30c30c30c3ull;
+    v = (v | v << 2) & 0x1249249249249249ull;
+    return v;
+  }
+
+  // Coordinates are offset by 2^20 so negative cells sort before positive.
+  static uint64_t morton(const ivec cell_coord) {
+    const uint32_t bias = 1u << 20;
+    return spreadBits((uint32_t)cell_coord.x + bias) |
+           spreadBits((uint32_t)cell_coord.y + bias) << 1 |
+           spreadBits((uint32_t)cell_coord.z + bias) << 2;
+  }
+};
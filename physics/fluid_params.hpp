@@ -0,0 +1,123 @@
+#pragma once
+#include <cstdint>
+
+// SPH constants shared by every compute backend.
+struct FluidParams {
+  float h; // smoothing_radius
+  float particle_mass;
+  float target_density = 300.f;
+  float pressure_multiplier = 2000.f;
+  float near_pressure_multiplier = 3000.f;
+  float viscosity_strength = 200.f;
+};
+
+// Smoothing kernel normalisations for D = 2 or 3 dimensions, each
+// k / (pi h^n) with k and n given here:
+//   poly6      (h^2 - r^2)^3, for density
+//   spiky      (h - r)^3, for pressure; its gradient is -3x it at (h - r)^2
+//   laplacian  (h - r), the viscosity kernel's Laplacian
+// Only constants, so the SIMD kernels can read them without sharing code
+// with the rest of the program.
+template <int D> struct KernelConstants;
+
+template <> struct KernelConstants<2> {
+  static constexpr float poly6 = 4.f;
+  static constexpr int poly6_power = 8;
+  static constexpr float spiky = 10.f;
+  static constexpr int spiky_power = 5;
+  static constexpr float laplacian = 40.f;
+  static constexpr int laplacian_power = 5;
+};
+
+template <> struct KernelConstants<3> {
+  static constexpr float poly6 = 315.f / 64.f;
+  static constexpr int poly6_power = 9;
+  static constexpr float spiky = 15.f;
+  static constexpr int spiky_power = 6;
+  static constexpr float laplacian = 45.f;
+  static constexpr int laplacian_power = 6;
+};
+
+// How the fluid is advanced each step.
+//
+//   SPH: explicit weakly compressible SPH. Needs step_dt = 0.0007 to stay
+//        stable.
+//   PBF: Position Based Fluids (Macklin & Mueller 2013). Projects a density
+//        constraint on predicted positions, so it stays stable at 15x
+//        the SPH timestep.
+//   IISPH: implicit incompressible SPH. Solves for the pressure that brings
+//        every particle back to rest density, to a set tolerance. CPU
+//        backend only.
+//   Granular: discs with no fluid forces at all, projected apart wherever
+//        they overlap.
+enum class SolverMode { SPH, PBF, IISPH, Granular };
+
+// Position Based Fluids constants, shared by every compute backend.
+struct PbfParams {
+  float step_dt = 0.0105f; // 15x the SPH step
+  uint32_t iterations = 4;
+  // Worked out from the particle spacing in PhysicSolver.
+  float rest_density = 0.f;
+  // Constraint force mixing, keeps lambda finite when a particle has few
+  // neighbours.
+  float relaxation = 1e-3f;
+  // Artificial pressure: s_corr = -k * (W(r) / W(delta_q))^4.
+  float s_corr_k = 1e-3f;
+  float s_corr_delta_q = 0.2f; // As a fraction of h.
+  // 1 / W(s_corr_delta_q * h), worked out with rest_density.
+  float s_corr_scale = 0.f;
+  float xsph_viscosity = 0.01f;
+  float gravity = -2000.f;
+  // Neighbours are listed once a step out to (1 + neighbour_skin) * h, so
+  // particles the corrections push into range are still seen.
+  float neighbour_skin = 0.25f;
+};
+
+// Implicit incompressible SPH constants (CPU backend only).
+struct IisphParams {
+  float step_dt = 0.005f; // 7x the SPH step
+  // Stop once the average predicted compression is below this fraction of
+  // rest density...
+  float density_error_tolerance = 0.01f;
+  // ...after at least min_iterations, and never run more than max_iterations.
+  uint32_t min_iterations = 2;
+  uint32_t max_iterations = 100;
+  // Relaxed Jacobi weight.
+  float relaxation = 0.5f;
+  // Worked out from the particle spacing in PhysicSolver.
+  float rest_density = 0.f;
+  float xsph_viscosity = 0.01f;
+  float gravity = -2000.f;
+  // Neighbours are listed once a step out to (1 + neighbour_skin) * h, so
+  // particles the corrections push into range are still seen.
+  float neighbour_skin = 0.25f;
+};
+
+// How the CPU granular solver finds the discs that touch.
+//
+//   Grid:          the spatial grid, with cells as wide as the largest disc.
+//                  Fast while discs are about one size, but a few big discs
+//                  make every cell big.
+//   SweepAndPrune: discs sorted along x by where they start, so a disc only
+//                  meets the discs that reach into its span whatever their
+//                  sizes. See SweepAndPrune.
+//   MultiLevel:    a grid per size class, each disc filed in the one whose
+//                  cells fit it. See MultiLevelGrid.
+enum class GranularBroadphase { Grid, SweepAndPrune, MultiLevel };
+
+// Granular disc constants, shared by every compute backend. Each overlapping
+// pair is pushed apart along the line between their centres, split by
+// inverse mass (mass goes with area), and the move is folded into the
+// velocities. Discs can have their own radius, up to the solver's
+// particle_radius.
+struct GranularParams {
+  // 3x the SPH step. Much longer and falling discs pass through each other
+  // within a step.
+  float step_dt = 0.002f;
+  uint32_t iterations = 4;
+  // Fraction of an overlap each projection removes.
+  float stiffness = 1.f;
+  float gravity = -2000.f;
+  // CPU backend only; the GPU kernels always walk the grid.
+  GranularBroadphase broadphase = GranularBroadphase::Grid;
+};
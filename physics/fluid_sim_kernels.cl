@@ -1,127 +1,449 @@
-__constant float pi = 3.14159265f;
+// OpenCL port of renderer/shaders/fluid_sim.cs.glsl. Both backends must give
+// the same answer, so keep the two in step when changing either.
 
-__constant float h = 50.0f; // Smoothing radius
-__constant float h2 = h * h;
-__constant float h3 = h2 * h;
-__constant float h5 = h3 * h2;
+__constant float pi = 3.14159265359f;
 
-__constant unsigned int particle_count = 1000;
-__constant unsigned int spatial_bucket_count = particle_count+1;
+// See physics/neighbour_list.hpp for the two neighbour list layouts.
+#define MAX_NEIGHBOURS 64
+#define NEIGHBOUR_LAYOUT_FIXED_STRIDE 0
+#define NEIGHBOUR_LAYOUT_COMPACT 1
 
-__constant float target_density = 10.0f;
-__constant float pressure_multiplier = 10.0f;
+float poly6Kernel(float r, float h) {
+    return 4.0f / (pi * pown(h, 8)) * pown(h * h - r * r, 3);
+}
 
-int smoothingWeight(float r) {
-    float x = 1.0f - r * r / h2;
-    return 315.0f / (64.0f * pi * h3) * x * x * x;
+float spikyGradKernel(float r, float h) {
+    return -10.0f / (pown(h, 5) * pi) * pown(h - r, 3);
 }
 
-int smoothingWeightDerivative(float r) {
-    float x = 1.0f - r * r / h2;
-    return -945.0f / (32.0f * pi * h3 * h5) * r * x * x;
+float laplacianKernel(float r, float h) {
+    return 40.0f / (pown(h, 5) * pi) * (h - r);
 }
 
-float2 gradient(float r, float2 dir_to_center) {
-    return -smoothingWeightDerivative(r) * dir_to_center;
+#define CELL_KEY_MODE_HASH32 0
+#define CELL_KEY_MODE_PACKED64 1
+
+int2 positionToCellCoord(float2 pos, float cell_width) {
+    return convert_int2(floor(pos / cell_width));
 }
 
-int2 positionToCellCoord(float2 pos) {
-    const float cell_width = 2 * h; 
-    int2 cell_coord; 
+// Must match SpatialGrid::cellCoordToHash.
+int cellCoordToHash(int2 cell_coord, uint bucket_count, uint cell_key_mode) {
+    if (cell_key_mode == CELL_KEY_MODE_HASH32) {
+        uint prime1 = 15823;
+        uint prime2 = 9737333;
 
-    cell_coord.x = convert_int(pos.x / cell_width); 
-    cell_coord.y = convert_int(pos.x / cell_width);
+        uint hash = ((uint)cell_coord.x * prime1) ^ ((uint)cell_coord.y * prime2);
+        return hash % bucket_count;
+    }
 
-    return cell_coord;
-}
+    // murmur3 fmix64 of the packed (x, y) key
+    ulong key = (ulong)(uint)cell_coord.x << 32 | (uint)cell_coord.y;
+    key ^= key >> 33;
+    key *= 0xff51afd7ed558ccdUL;
+    key ^= key >> 33;
+    key *= 0xc4ceb9fe1a85ec53UL;
+    key ^= key >> 33;
 
-int cellCoordToHash(int2 cell_coord) {
-    int prime1 = 15823;
-    int prime2 = 9737333;
+    return (int)(((key >> 32) * bucket_count) >> 32);
+}
 
-    int hash = (cell_coord.x * prime1) ^ (cell_coord.y * prime2);
-    
-    // Subtract 1 for the overflow cell.
-    return hash % (spatial_bucket_count - 1);
+float2 densityToPressure(float density, float near_density, float target_density,
+                         float pressure_multiplier, float near_pressure_multiplier) {
+    float pressure = (density - target_density) * pressure_multiplier;
+    float near_pressure = near_density * near_pressure_multiplier;
+    return (float2)(pressure, near_pressure);
 }
 
-__kernel void calcDensity(__global float2 *positions, __global float *densities, __global int *spatial_lookup, __global int *spatial_indicies) {  
-    int query[particle_count]; 
-    unsigned int query_size = 0;
+// neighbour_total holds the slots handed out, then the particles that didn't
+// fit.
+__kernel void calcDensity(__global const float2 *positions,
+                          __global float2 *densities,
+                          __global const int *spatial_lookup,
+                          __global const int *spatial_indicies,
+                          __global int *neighbour_list,
+                          __global int2 *neighbour_offsets,
+                          __global uint *neighbour_total,
+                          uint particle_count, uint bucket_count,
+                          uint cell_key_mode, float h,
+                          float particle_mass, uint neighbour_layout,
+                          uint neighbour_capacity) {
+    int p_i = get_global_id(0);
+    if (p_i >= particle_count)
+        return;
+
+    float2 pos = positions[p_i];
+    int2 cell_coord = positionToCellCoord(pos, 2.0f * h);
 
-    unsigned int p_i = get_global_id(0);
-    int2 cell_coord = positionToCellCoord(positions[p_i]); 
-    int hash = cellCoordToHash(cell_coord);
+    int neighbours[MAX_NEIGHBOURS];
+    uint neighbour_count = 0;
+    bool overflow = false;
+
+    float density = 0.0f;
+    float density_near = 0.0f;
 
-    // Get neighbours
+    // Walk the neighbouring cells once, keeping everything within h for the
+    // force pass. Two cells of the stencil can share a bucket, so walk each
+    // bucket only once.
+    int visited[9];
+    int visited_count = 0;
     for (int y = cell_coord.y - 1; y <= cell_coord.y + 1; y++) {
         for (int x = cell_coord.x - 1; x <= cell_coord.x + 1; x++) {
-            int2 curr_cell_coord = (int2)(x, y);
-            int curr_hash = cellCoordToHash(curr_cell_coord);
+            int curr_hash =
+                cellCoordToHash((int2)(x, y), bucket_count, cell_key_mode);
+            bool seen = false;
+            for (int v = 0; v < visited_count; v++)
+                seen = seen || visited[v] == curr_hash;
+            if (seen)
+                continue;
+            visited[visited_count++] = curr_hash;
 
             int start = spatial_lookup[curr_hash];
-            int end = spatial_lookup[curr_hash+1];
+            int end = spatial_lookup[curr_hash + 1];
 
-            for (int i = start; i <= end; i++) {
-                 query[query_size] = spatial_indicies[i];
-                 query_size++;
+            for (int i = start; i < end; i++) {
+                int n_i = spatial_indicies[i];
+                const float r = distance(pos, positions[n_i]);
+                if (r < h) {
+                    density += particle_mass * poly6Kernel(r, h);
+                    if (neighbour_count < MAX_NEIGHBOURS) {
+                        neighbours[neighbour_count++] = n_i;
+                    } else {
+                        overflow = true;
+                    }
+                }
             }
         }
     }
 
-    float density = 0.0f;
+    densities[p_i] = (float2)(density, density_near);
 
-    // Note that mass = 1
-    for (int i = 0; i < query_size; i++) {
-        const float dist = distance(positions[p_i], positions[query[i]]);
-        if (dist < h) {
-            density += densities[query[i]] * smoothingWeight(dist); 
-        }
+    uint offset = (uint)p_i * MAX_NEIGHBOURS;
+    if (neighbour_layout == NEIGHBOUR_LAYOUT_COMPACT && !overflow) {
+        offset = atomic_add(neighbour_total, neighbour_count);
+        overflow = offset + neighbour_count > neighbour_capacity;
+    }
+    if (overflow) {
+        neighbour_offsets[p_i] = (int2)(0, -1);
+        atomic_inc(neighbour_total + 1);
+        return;
     }
 
-    densities[p_i] = density;
+    for (uint i = 0; i < neighbour_count; i++) {
+        neighbour_list[offset + i] = neighbours[i];
+    }
+    neighbour_offsets[p_i] = (int2)(offset, neighbour_count);
 }
 
-float densityToPressure(float density) {
-    return (density - target_density) * pressure_multiplier; 
+void addNeighbourForce(int p_i, int n_i, float2 pos, float2 curr_dual_pressure,
+                       __global const float2 *positions,
+                       __global const float2 *velocities,
+                       __global const float2 *densities, float h,
+                       float particle_mass, float target_density,
+                       float pressure_multiplier,
+                       float near_pressure_multiplier, float2 *pressure_force,
+                       float2 *visc_force) {
+    // Skip self
+    if (n_i == p_i)
+        return;
+
+    const float r = distance(pos, positions[n_i]);
+    if (r < h) {
+        float neighbour_density = densities[n_i].x;
+        float2 neighbour_dual_pressure = densityToPressure(
+            neighbour_density, densities[n_i].y, target_density,
+            pressure_multiplier, near_pressure_multiplier);
+
+        float shared_pressure =
+            0.5f * (curr_dual_pressure.x + neighbour_dual_pressure.x);
+
+        float2 rij = normalize(positions[n_i] - pos);
+
+        *pressure_force += -rij * particle_mass * spikyGradKernel(r, h) *
+                           shared_pressure / neighbour_density;
+        *visc_force += particle_mass * laplacianKernel(r, h) *
+                       (velocities[n_i] - velocities[p_i]) / neighbour_density;
+    }
 }
 
-__kernel void applyPressureForce(__global float2 *positions, __global float2 *velocities, __global float *densities, __global int *spatial_lookup, __global int *spatial_indicies, float dt) {
-    int query[particle_count]; 
-    unsigned int query_size = 0;
+__kernel void applyFluidForces(__global const float2 *positions,
+                               __global const float2 *velocities,
+                               __global float2 *forces,
+                               __global const float2 *densities,
+                               __global const int *spatial_lookup,
+                               __global const int *spatial_indicies,
+                               __global const int *neighbour_list,
+                               __global const int2 *neighbour_offsets,
+                               uint particle_count, uint bucket_count,
+                               uint cell_key_mode, float h,
+                               float particle_mass, float target_density,
+                               float pressure_multiplier,
+                               float near_pressure_multiplier,
+                               float viscosity_strength) {
+    int p_i = get_global_id(0);
+    if (p_i >= particle_count)
+        return;
+
+    float2 pos = positions[p_i];
+
+    float2 pressure_force = (float2)(0.0f, 0.0f);
+    float2 visc_force = (float2)(0.0f, 0.0f);
+
+    float curr_density = densities[p_i].x;
+    float2 curr_dual_pressure = densityToPressure(
+        curr_density, densities[p_i].y, target_density, pressure_multiplier,
+        near_pressure_multiplier);
+
+    int2 neighbour_offset = neighbour_offsets[p_i];
+    if (neighbour_offset.y >= 0) {
+        // Use the list calcDensity left behind.
+        int end = neighbour_offset.x + neighbour_offset.y;
+        for (int i = neighbour_offset.x; i < end; i++) {
+            addNeighbourForce(p_i, neighbour_list[i], pos, curr_dual_pressure,
+                              positions, velocities, densities, h,
+                              particle_mass, target_density,
+                              pressure_multiplier, near_pressure_multiplier,
+                              &pressure_force, &visc_force);
+        }
+    } else {
+        // Didn't fit in the list; walk the grid instead.
+        int2 cell_coord = positionToCellCoord(pos, 2.0f * h);
+        // Two cells of the stencil can share a bucket; walk each bucket once.
+        int visited[9];
+        int visited_count = 0;
+        for (int y = cell_coord.y - 1; y <= cell_coord.y + 1; y++) {
+            for (int x = cell_coord.x - 1; x <= cell_coord.x + 1; x++) {
+                int curr_hash =
+                    cellCoordToHash((int2)(x, y), bucket_count, cell_key_mode);
+                bool seen = false;
+                for (int v = 0; v < visited_count; v++)
+                    seen = seen || visited[v] == curr_hash;
+                if (seen)
+                    continue;
+                visited[visited_count++] = curr_hash;
+
+                int start = spatial_lookup[curr_hash];
+                int end = spatial_lookup[curr_hash + 1];
 
-    unsigned int p_i = get_global_id(0);
-    int2 cell_coord = positionToCellCoord(positions[p_i]); 
-    int hash = cellCoordToHash(cell_coord);
+                for (int i = start; i < end; i++) {
+                    addNeighbourForce(
+                        p_i, spatial_indicies[i], pos, curr_dual_pressure,
+                        positions, velocities, densities, h, particle_mass,
+                        target_density, pressure_multiplier,
+                        near_pressure_multiplier, &pressure_force, &visc_force);
+                }
+            }
+        }
+    }
+
+    visc_force *= viscosity_strength;
 
-    // Get neighbours
+    float2 grav_force = (float2)(0.0f, -9.81f) * particle_mass / curr_density;
+    forces[p_i] = pressure_force + visc_force + grav_force;
+}
+
+// Distinct buckets of the 3x3 stencil around cell_coord.
+int stencilBuckets(int2 cell_coord, uint bucket_count, uint cell_key_mode,
+                   int *buckets) {
+    int count = 0;
     for (int y = cell_coord.y - 1; y <= cell_coord.y + 1; y++) {
         for (int x = cell_coord.x - 1; x <= cell_coord.x + 1; x++) {
-            int2 curr_cell_coord = (int2)(x, y);
-            int curr_hash = cellCoordToHash(curr_cell_coord);
+            int curr_hash =
+                cellCoordToHash((int2)(x, y), bucket_count, cell_key_mode);
+            bool seen = false;
+            for (int v = 0; v < count; v++)
+                seen = seen || buckets[v] == curr_hash;
+            if (!seen)
+                buckets[count++] = curr_hash;
+        }
+    }
+    return count;
+}
 
-            int start = spatial_lookup[curr_hash];
-            int end = spatial_lookup[curr_hash+1];
+// Position Based Fluids, mirroring the pbf* functions in fluid_sim.cs.glsl.
+// In this mode densities holds (rho, lambda) and forces is scratch.
 
-            for (int i = start; i <= end; i++) {
-                 query[query_size] = spatial_indicies[i];
-                 query_size++;
-            }
+float pbfSpikyGrad(float r, float h) {
+    return -30.0f / (pi * pown(h, 5)) * (h - r) * (h - r);
+}
+
+__kernel void pbfLambda(__global const float2 *positions,
+                        __global float2 *densities,
+                        __global const int *spatial_lookup,
+                        __global const int *spatial_indicies,
+                        uint particle_count, uint bucket_count,
+                        uint cell_key_mode, float h, float particle_mass,
+                        float rest_density, float relaxation) {
+    int p_i = get_global_id(0);
+    if (p_i >= particle_count)
+        return;
+
+    float2 pos = positions[p_i];
+    float volume = particle_mass / rest_density;
+
+    int buckets[9];
+    int stencil_size =
+        stencilBuckets(positionToCellCoord(pos, 2.0f * h), bucket_count,
+                       cell_key_mode, buckets);
+
+    float rho = 0.0f;
+    float2 grad_i = (float2)(0.0f, 0.0f);
+    float grad_sum = 0.0f;
+
+    for (int b = 0; b < stencil_size; b++) {
+        int end = spatial_lookup[buckets[b] + 1];
+        for (int i = spatial_lookup[buckets[b]]; i < end; i++) {
+            float2 d = pos - positions[spatial_indicies[i]];
+            float r = length(d);
+            if (r >= h)
+                continue;
+            rho += particle_mass * poly6Kernel(r, h);
+            if (r == 0.0f)
+                continue;
+            float2 grad_j = volume * pbfSpikyGrad(r, h) * d / r;
+            grad_i += grad_j;
+            grad_sum += dot(grad_j, grad_j);
         }
     }
+    grad_sum += dot(grad_i, grad_i);
 
-    float2 pressure_force = (float2)(0.0f, 0.0f);
+    // Only push apart; a free surface is allowed to be under-dense.
+    float constraint = fmax(rho / rest_density - 1.0f, 0.0f);
+    densities[p_i] = (float2)(rho, -constraint / (grad_sum + relaxation));
+}
+
+__kernel void pbfDelta(__global const float2 *positions,
+                       __global const float2 *densities,
+                       __global float2 *forces,
+                       __global const int *spatial_lookup,
+                       __global const int *spatial_indicies,
+                       uint particle_count, uint bucket_count,
+                       uint cell_key_mode, float h, float particle_mass,
+                       float rest_density, float s_corr_k,
+                       float s_corr_scale) {
+    int p_i = get_global_id(0);
+    if (p_i >= particle_count)
+        return;
 
-    // Note that mass = 1
-    for (int i = 0; i < query_size; i++) {
-        const float dist = distance(positions[p_i], positions[query[i]]);
-        if (dist < h) {
-            float shared_pressure = (densityToPressure(densities[query[i]]) + densityToPressure(densities[p_i])) / 2.0f; 
-            pressure_force += shared_pressure * smoothingWeightDerivative(dist) / densities[query[i]]; 
+    float2 pos = positions[p_i];
+    float volume = particle_mass / rest_density;
+    float lambda = densities[p_i].y;
+
+    int buckets[9];
+    int stencil_size =
+        stencilBuckets(positionToCellCoord(pos, 2.0f * h), bucket_count,
+                       cell_key_mode, buckets);
+
+    float2 delta = (float2)(0.0f, 0.0f);
+    for (int b = 0; b < stencil_size; b++) {
+        int end = spatial_lookup[buckets[b] + 1];
+        for (int i = spatial_lookup[buckets[b]]; i < end; i++) {
+            int n_i = spatial_indicies[i];
+            float2 d = pos - positions[n_i];
+            float r = length(d);
+            if (n_i == p_i || r >= h || r == 0.0f)
+                continue;
+
+            float ratio = poly6Kernel(r, h) * s_corr_scale;
+            float s_corr = -s_corr_k * ratio * ratio * ratio * ratio;
+            delta += (lambda + densities[n_i].y + s_corr) * volume *
+                     pbfSpikyGrad(r, h) * d / r;
         }
     }
+    forces[p_i] = delta;
+}
 
-    // F = ma but here we are finding the force of small volumes of water so we use density (which is the mass per volume) as mass here instead.
-    velocities[p_i] += pressure_force / densities[p_i] * dt;
+__kernel void pbfApply(__global float2 *positions, __global float2 *velocities,
+                       __global const float2 *forces, uint particle_count,
+                       float dt, float2 min_pos, float2 max_pos) {
+    int p_i = get_global_id(0);
+    if (p_i >= particle_count)
+        return;
+
+    float2 pos = clamp(positions[p_i] + forces[p_i], min_pos, max_pos);
+    velocities[p_i] += (pos - positions[p_i]) / dt;
+    positions[p_i] = pos;
+}
+
+__kernel void pbfXsph(__global const float2 *positions,
+                      __global const float2 *velocities,
+                      __global float2 *forces,
+                      __global const int *spatial_lookup,
+                      __global const int *spatial_indicies,
+                      uint particle_count, uint bucket_count,
+                      uint cell_key_mode, float h, float particle_mass,
+                      float rest_density, float xsph_viscosity) {
+    int p_i = get_global_id(0);
+    if (p_i >= particle_count)
+        return;
+
+    float2 pos = positions[p_i];
+    float volume = particle_mass / rest_density;
+
+    int buckets[9];
+    int stencil_size =
+        stencilBuckets(positionToCellCoord(pos, 2.0f * h), bucket_count,
+                       cell_key_mode, buckets);
+
+    float2 dv = (float2)(0.0f, 0.0f);
+    for (int b = 0; b < stencil_size; b++) {
+        int end = spatial_lookup[buckets[b] + 1];
+        for (int i = spatial_lookup[buckets[b]]; i < end; i++) {
+            int n_i = spatial_indicies[i];
+            float r = distance(pos, positions[n_i]);
+            if (r < h)
+                dv += (velocities[n_i] - velocities[p_i]) * volume *
+                      poly6Kernel(r, h);
+        }
+    }
+    forces[p_i] = velocities[p_i] + xsph_viscosity * dv;
 }
 
+// Granular discs, by Jacobi averaging rather than the coloured Gauss-Seidel
+// of the CPU and GL solvers, so it only matches them once converged. Each
+// work-item only writes its own disc's correction into forces, so there are
+// no races, and pbfApply then moves the discs. Unchecked, see
+// uncheckedClKernelsFromEnv.
+__kernel void granularDelta(__global const float2 *positions,
+                            __global const float *radii,
+                            __global float2 *forces,
+                            __global const int *spatial_lookup,
+                            __global const int *spatial_indicies,
+                            uint particle_count, uint bucket_count,
+                            uint cell_key_mode, float cell_width,
+                            float stiffness) {
+    int p_i = get_global_id(0);
+    if (p_i >= particle_count)
+        return;
+
+    float2 pos = positions[p_i];
+    float radius = radii[p_i];
+    float inv_mass = 1.0f / (radius * radius);
+
+    int buckets[9];
+    int stencil_size =
+        stencilBuckets(positionToCellCoord(pos, cell_width), bucket_count,
+                       cell_key_mode, buckets);
+
+    // The mean of its share of every overlap, so a disc pressed from several
+    // sides isn't pushed more than once over.
+    float2 delta = (float2)(0.0f, 0.0f);
+    int contacts = 0;
+    for (int b = 0; b < stencil_size; b++) {
+        int end = spatial_lookup[buckets[b] + 1];
+        for (int i = spatial_lookup[buckets[b]]; i < end; i++) {
+            int n_i = spatial_indicies[i];
+            float2 d = pos - positions[n_i];
+            float r = length(d);
+            float contact = radius + radii[n_i];
+            if (n_i == p_i || r >= contact || r == 0.0f)
+                continue;
+
+            float n_inv_mass = 1.0f / (radii[n_i] * radii[n_i]);
+            delta += inv_mass / (inv_mass + n_inv_mass) * (contact - r) * d / r;
+            contacts++;
+        }
+    }
+    forces[p_i] = contacts > 0 ? stiffness * delta / (float)contacts
+                               : (float2)(0.0f, 0.0f);
+}
@@ -1,11 +1,22 @@
 #include "gpu_compute.hpp"
-#include <CL/cl2.hpp>
+#include <algorithm>
 #include <iostream>
 #include <stdexcept>
 #include <fstream>
 #include <sstream>
 
-GpuCompute::GpuCompute(std::string file_path) {
+#include "../renderer/program_cache.hpp"
+
+static const char *build_options = "";
+
+static uint64_t eventDuration(const cl::Event &event) {
+  return event.getProfilingInfo<CL_PROFILING_COMMAND_END>() -
+         event.getProfilingInfo<CL_PROFILING_COMMAND_START>();
+}
+
+GpuCompute::GpuCompute(std::string file_path, const uint32_t _capacity,
+                       const NeighbourListLayout neighbour_layout)
+    : neighbour_stats(neighbour_layout, 0) {
   // Get the default platform (driver).
   std::vector<cl::Platform> all_platforms;
   cl::Platform::get(&all_platforms);
@@ -16,9 +27,13 @@ GpuCompute::GpuCompute(std::string file_path) {
   std::cout << "Using platform: " << this->platform.getInfo<CL_PLATFORM_NAME>()
             << "\n";
 
-  // Get the default device (gpu) for the default platform.
+  // Prefer a GPU, but fall back to whatever the platform offers (e.g. the
+  // pocl CPU device on GPU-less nodes).
   std::vector<cl::Device> all_devices;
-  this->platform.getDevices(CL_DEVICE_TYPE_ALL, &all_devices);
+  this->platform.getDevices(CL_DEVICE_TYPE_GPU, &all_devices);
+  if (all_devices.size() == 0) {
+    this->platform.getDevices(CL_DEVICE_TYPE_ALL, &all_devices);
+  }
   if (all_devices.size() == 0) {
     throw std::runtime_error("No devices found. Check OpenCL installation!");
   }
@@ -45,17 +60,497 @@ GpuCompute::GpuCompute(std::string file_path) {
   file.close();
 
   std::string source_code = ss.str();
-  sources.push_back({source_code.c_str(), source_code.size()});
 
-  // Compile source to create GPU program.
-  this->program = cl::Program(this->context, sources);
-  if (program.build({this->device}) != CL_SUCCESS) {
-    std::stringstream msg;
-    msg << "Error building: "
-        << program.getBuildInfo<CL_PROGRAM_BUILD_LOG>(this->device);
-    throw std::runtime_error(msg.str());
+  // Reuse a previously built binary for this exact source, device and driver
+  // if there is one; otherwise compile from source and cache the result.
+  const std::string device_id =
+      this->device.getInfo<CL_DEVICE_NAME>() + "\n" +
+      this->device.getInfo<CL_DEVICE_VERSION>() + "\n" +
+      this->device.getInfo<CL_DRIVER_VERSION>() + "\n" + build_options;
+  const std::string cache_path = ProgramCache::path(source_code, device_id);
+
+  if (!this->loadCachedProgram(cache_path)) {
+    sources.push_back({source_code.c_str(), source_code.size()});
+
+    // Compile source to create GPU program.
+    this->program = cl::Program(this->context, sources);
+    if (program.build({this->device}, build_options) != CL_SUCCESS) {
+      std::stringstream msg;
+      msg << "Error building: "
+          << program.getBuildInfo<CL_PROGRAM_BUILD_LOG>(this->device);
+      throw std::runtime_error(msg.str());
+    }
+
+    const std::vector<std::vector<unsigned char>> binaries =
+        this->program.getInfo<CL_PROGRAM_BINARIES>();
+    if (binaries.size() == 1) {
+      ProgramCache::store(cache_path, binaries[0], 0);
+    }
   }
 
+  this->calc_density_kernel = cl::Kernel(this->program, "calcDensity");
+  this->apply_fluid_forces_kernel =
+      cl::Kernel(this->program, "applyFluidForces");
+  this->pbf_lambda_kernel = cl::Kernel(this->program, "pbfLambda");
+  this->pbf_delta_kernel = cl::Kernel(this->program, "pbfDelta");
+  this->pbf_apply_kernel = cl::Kernel(this->program, "pbfApply");
+  this->pbf_xsph_kernel = cl::Kernel(this->program, "pbfXsph");
+  this->granular_delta_kernel = cl::Kernel(this->program, "granularDelta");
+
   // Create queue for sending buffers and running kernels.
-  this->queue = cl::CommandQueue(this->context, this->device);
+  this->queue = cl::CommandQueue(this->context, this->device,
+                                 CL_QUEUE_PROFILING_ENABLE);
+
+  this->reserve(_capacity);
+  this->neighbour_stats.report();
+}
+
+bool GpuCompute::loadCachedProgram(const std::string &cache_path) {
+  std::vector<unsigned char> binary;
+  uint32_t format;
+  if (!ProgramCache::load(cache_path, binary, format)) {
+    return false;
+  }
+
+  // A binary the runtime no longer accepts is treated as a miss.
+  cl_int status = CL_SUCCESS;
+  std::vector<cl_int> binary_status;
+  cl::Program program(this->context, {this->device}, {binary}, &binary_status,
+                      &status);
+  if (status != CL_SUCCESS ||
+      program.build({this->device}, build_options) != CL_SUCCESS) {
+    return false;
+  }
+
+  this->program = program;
+  return true;
+}
+
+void GpuCompute::reserve(const uint32_t capacity) {
+  if (capacity <= this->capacity) {
+    return;
+  }
+  this->capacity = capacity;
+  this->neighbour_stats.particle_count = capacity;
+
+  const size_t vec2_bytes = sizeof(glm::vec2) * capacity;
+  const size_t index_bytes = sizeof(int32_t) * capacity;
+  // Read-write, since SolverMode::PBF updates positions and velocities in
+  // place and uses forces as scratch.
+  this->positions_buffer =
+      cl::Buffer(this->context, CL_MEM_READ_WRITE, vec2_bytes);
+  this->velocities_buffer =
+      cl::Buffer(this->context, CL_MEM_READ_WRITE, vec2_bytes);
+  this->forces_buffer =
+      cl::Buffer(this->context, CL_MEM_READ_WRITE, vec2_bytes);
+  this->densities_buffer =
+      cl::Buffer(this->context, CL_MEM_READ_WRITE, vec2_bytes);
+  this->radii_buffer = cl::Buffer(this->context, CL_MEM_READ_ONLY,
+                                  sizeof(float) * capacity);
+  // One extra bucket for dealing with overflow, as in SpatialGrid.
+  this->spatial_lookup_buffer = cl::Buffer(
+      this->context, CL_MEM_READ_ONLY, index_bytes + sizeof(int32_t));
+  this->spatial_indicies_buffer =
+      cl::Buffer(this->context, CL_MEM_READ_ONLY, index_bytes);
+  this->neighbour_list_buffer =
+      cl::Buffer(this->context, CL_MEM_READ_WRITE,
+                 sizeof(int32_t) * this->neighbour_stats.capacity());
+  this->neighbour_offsets_buffer =
+      cl::Buffer(this->context, CL_MEM_READ_WRITE, 2 * index_bytes);
+  this->neighbour_total_buffer =
+      cl::Buffer(this->context, CL_MEM_READ_WRITE, 2 * sizeof(uint32_t));
+}
+
+void GpuCompute::calcDensitiesAndApplyPressureForce(
+    Particles &particles, SpatialGrid &spatial_grid,
+    const FluidParams &params) {
+  // An empty NDRange is an error, and there is nothing to do anyway.
+  this->particle_count = particles.particle_count;
+  if (this->particle_count == 0) {
+    return;
+  }
+  const size_t vec2_bytes = sizeof(glm::vec2) * this->particle_count;
+  const uint32_t bucket_count = spatial_grid.spatial_lookup.size() - 1;
+
+  // Upload. Writes are non-blocking; the in-order queue keeps them ahead of
+  // the kernels.
+  std::vector<cl::Event> upload_events(4);
+  if (particles.layout == ParticleLayout::SoA) {
+    this->writeInterleaved(this->positions_buffer, particles.pos_x.data(),
+                           particles.pos_y.data(), upload_events[0]);
+    this->writeInterleaved(this->velocities_buffer, particles.vel_x.data(),
+                           particles.vel_y.data(), upload_events[1]);
+  } else {
+    this->queue.enqueueWriteBuffer(this->positions_buffer, CL_FALSE, 0,
+                                   vec2_bytes, particles.positions.data(),
+                                   nullptr, &upload_events[0]);
+    this->queue.enqueueWriteBuffer(this->velocities_buffer, CL_FALSE, 0,
+                                   vec2_bytes, particles.velocities.data(),
+                                   nullptr, &upload_events[1]);
+  }
+  this->queue.enqueueWriteBuffer(
+      this->spatial_lookup_buffer, CL_FALSE, 0,
+      sizeof(int32_t) * spatial_grid.spatial_lookup.size(),
+      spatial_grid.spatial_lookup.data(), nullptr, &upload_events[2]);
+  this->queue.enqueueWriteBuffer(
+      this->spatial_indicies_buffer, CL_FALSE, 0,
+      sizeof(int32_t) * spatial_grid.spatial_indicies.size(),
+      spatial_grid.spatial_indicies.data(), nullptr, &upload_events[3]);
+
+  // The compact neighbour list is handed out from a shared counter.
+  this->neighbour_counters[0] = this->neighbour_counters[1] = 0;
+  this->queue.enqueueWriteBuffer(this->neighbour_total_buffer, CL_FALSE, 0,
+                                 sizeof(this->neighbour_counters),
+                                 this->neighbour_counters);
+
+  // Calculate densities, leaving a neighbour list behind for the force pass
+  cl::Kernel &density = this->calc_density_kernel;
+  density.setArg(0, this->positions_buffer);
+  density.setArg(1, this->densities_buffer);
+  density.setArg(2, this->spatial_lookup_buffer);
+  density.setArg(3, this->spatial_indicies_buffer);
+  density.setArg(4, this->neighbour_list_buffer);
+  density.setArg(5, this->neighbour_offsets_buffer);
+  density.setArg(6, this->neighbour_total_buffer);
+  density.setArg(7, this->particle_count);
+  density.setArg(8, bucket_count);
+  density.setArg(9, (uint32_t)spatial_grid.key_mode);
+  density.setArg(10, params.h);
+  density.setArg(11, params.particle_mass);
+  density.setArg(12, (uint32_t)this->neighbour_stats.layout);
+  density.setArg(13, this->neighbour_stats.capacity());
+
+  cl::Event density_event;
+  this->queue.enqueueNDRangeKernel(density, cl::NullRange,
+                                   cl::NDRange(this->particle_count),
+                                   cl::NullRange, nullptr, &density_event);
+
+  // Apply fluid forces
+  cl::Kernel &forces = this->apply_fluid_forces_kernel;
+  forces.setArg(0, this->positions_buffer);
+  forces.setArg(1, this->velocities_buffer);
+  forces.setArg(2, this->forces_buffer);
+  forces.setArg(3, this->densities_buffer);
+  forces.setArg(4, this->spatial_lookup_buffer);
+  forces.setArg(5, this->spatial_indicies_buffer);
+  forces.setArg(6, this->neighbour_list_buffer);
+  forces.setArg(7, this->neighbour_offsets_buffer);
+  forces.setArg(8, this->particle_count);
+  forces.setArg(9, bucket_count);
+  forces.setArg(10, (uint32_t)spatial_grid.key_mode);
+  forces.setArg(11, params.h);
+  forces.setArg(12, params.particle_mass);
+  forces.setArg(13, params.target_density);
+  forces.setArg(14, params.pressure_multiplier);
+  forces.setArg(15, params.near_pressure_multiplier);
+  forces.setArg(16, params.viscosity_strength);
+
+  cl::Event forces_event;
+  this->queue.enqueueNDRangeKernel(forces, cl::NullRange,
+                                   cl::NDRange(this->particle_count),
+                                   cl::NullRange, nullptr, &forces_event);
+
+  // Extract updated vectors
+  std::vector<cl::Event> download_events(2);
+  if (particles.layout == ParticleLayout::SoA) {
+    this->readInterleaved(this->forces_buffer, particles.force_x.data(),
+                          particles.force_y.data(), download_events[0]);
+    this->readInterleaved(this->densities_buffer, particles.density.data(),
+                          nullptr, download_events[1]);
+  } else {
+    this->queue.enqueueReadBuffer(this->forces_buffer, CL_FALSE, 0,
+                                  vec2_bytes, particles.forces.data(),
+                                  nullptr, &download_events[0]);
+    this->queue.enqueueReadBuffer(this->densities_buffer, CL_FALSE, 0,
+                                  vec2_bytes, particles.densities.data(),
+                                  nullptr, &download_events[1]);
+  }
+  this->queue.enqueueReadBuffer(this->neighbour_total_buffer, CL_FALSE, 0,
+                                sizeof(this->neighbour_counters),
+                                this->neighbour_counters);
+  this->queue.finish();
+
+  if (this->neighbour_stats.record(this->neighbour_counters[0],
+                                   this->neighbour_counters[1])) {
+    this->neighbour_list_buffer =
+        cl::Buffer(this->context, CL_MEM_READ_WRITE,
+                   sizeof(int32_t) * this->neighbour_stats.capacity());
+  }
+
+  for (const cl::Event &event : upload_events) {
+    this->upload_ns += eventDuration(event);
+  }
+  this->calc_density_ns += eventDuration(density_event);
+  this->apply_fluid_forces_ns += eventDuration(forces_event);
+  for (const cl::Event &event : download_events) {
+    this->download_ns += eventDuration(event);
+  }
+  this->profiled_steps++;
+}
+
+void GpuCompute::solvePbf(Particles &particles, SpatialGrid &spatial_grid,
+                          const FluidParams &params, const PbfParams &pbf,
+                          const glm::vec2 min_pos, const glm::vec2 max_pos) {
+  this->particle_count = particles.particle_count;
+  if (this->particle_count == 0) {
+    return;
+  }
+  const size_t vec2_bytes = sizeof(glm::vec2) * this->particle_count;
+  const uint32_t bucket_count = spatial_grid.spatial_lookup.size() - 1;
+  const uint32_t key_mode = (uint32_t)spatial_grid.key_mode;
+  const cl::NDRange global(this->particle_count);
+
+  std::vector<cl::Event> upload_events(4);
+  if (particles.layout == ParticleLayout::SoA) {
+    this->writeInterleaved(this->positions_buffer, particles.pos_x.data(),
+                           particles.pos_y.data(), upload_events[0]);
+    this->writeInterleaved(this->velocities_buffer, particles.vel_x.data(),
+                           particles.vel_y.data(), upload_events[1]);
+  } else {
+    this->queue.enqueueWriteBuffer(this->positions_buffer, CL_FALSE, 0,
+                                   vec2_bytes, particles.positions.data(),
+                                   nullptr, &upload_events[0]);
+    this->queue.enqueueWriteBuffer(this->velocities_buffer, CL_FALSE, 0,
+                                   vec2_bytes, particles.velocities.data(),
+                                   nullptr, &upload_events[1]);
+  }
+  this->queue.enqueueWriteBuffer(
+      this->spatial_lookup_buffer, CL_FALSE, 0,
+      sizeof(int32_t) * spatial_grid.spatial_lookup.size(),
+      spatial_grid.spatial_lookup.data(), nullptr, &upload_events[2]);
+  this->queue.enqueueWriteBuffer(
+      this->spatial_indicies_buffer, CL_FALSE, 0,
+      sizeof(int32_t) * spatial_grid.spatial_indicies.size(),
+      spatial_grid.spatial_indicies.data(), nullptr, &upload_events[3]);
+
+  cl::Kernel &lambda = this->pbf_lambda_kernel;
+  lambda.setArg(0, this->positions_buffer);
+  lambda.setArg(1, this->densities_buffer);
+  lambda.setArg(2, this->spatial_lookup_buffer);
+  lambda.setArg(3, this->spatial_indicies_buffer);
+  lambda.setArg(4, this->particle_count);
+  lambda.setArg(5, bucket_count);
+  lambda.setArg(6, key_mode);
+  lambda.setArg(7, params.h);
+  lambda.setArg(8, params.particle_mass);
+  lambda.setArg(9, pbf.rest_density);
+  lambda.setArg(10, pbf.relaxation);
+
+  cl::Kernel &delta = this->pbf_delta_kernel;
+  delta.setArg(0, this->positions_buffer);
+  delta.setArg(1, this->densities_buffer);
+  delta.setArg(2, this->forces_buffer);
+  delta.setArg(3, this->spatial_lookup_buffer);
+  delta.setArg(4, this->spatial_indicies_buffer);
+  delta.setArg(5, this->particle_count);
+  delta.setArg(6, bucket_count);
+  delta.setArg(7, key_mode);
+  delta.setArg(8, params.h);
+  delta.setArg(9, params.particle_mass);
+  delta.setArg(10, pbf.rest_density);
+  delta.setArg(11, pbf.s_corr_k);
+  delta.setArg(12, pbf.s_corr_scale);
+
+  const cl_float2 min_arg = {{min_pos.x, min_pos.y}};
+  const cl_float2 max_arg = {{max_pos.x, max_pos.y}};
+  cl::Kernel &apply = this->pbf_apply_kernel;
+  apply.setArg(0, this->positions_buffer);
+  apply.setArg(1, this->velocities_buffer);
+  apply.setArg(2, this->forces_buffer);
+  apply.setArg(3, this->particle_count);
+  apply.setArg(4, pbf.step_dt);
+  apply.setArg(5, min_arg);
+  apply.setArg(6, max_arg);
+
+  cl::Kernel &xsph = this->pbf_xsph_kernel;
+  xsph.setArg(0, this->positions_buffer);
+  xsph.setArg(1, this->velocities_buffer);
+  xsph.setArg(2, this->forces_buffer);
+  xsph.setArg(3, this->spatial_lookup_buffer);
+  xsph.setArg(4, this->spatial_indicies_buffer);
+  xsph.setArg(5, this->particle_count);
+  xsph.setArg(6, bucket_count);
+  xsph.setArg(7, key_mode);
+  xsph.setArg(8, params.h);
+  xsph.setArg(9, params.particle_mass);
+  xsph.setArg(10, pbf.rest_density);
+  xsph.setArg(11, pbf.xsph_viscosity);
+
+  // The in-order queue serialises the passes, so no events are needed
+  // between them.
+  for (uint32_t iteration = 0; iteration < pbf.iterations; iteration++) {
+    this->queue.enqueueNDRangeKernel(lambda, cl::NullRange, global);
+    this->queue.enqueueNDRangeKernel(delta, cl::NullRange, global);
+    this->queue.enqueueNDRangeKernel(apply, cl::NullRange, global);
+  }
+  this->queue.enqueueNDRangeKernel(xsph, cl::NullRange, global);
+
+  // XSPH leaves the new velocities in the forces buffer.
+  std::vector<cl::Event> download_events(3);
+  if (particles.layout == ParticleLayout::SoA) {
+    this->readInterleaved(this->positions_buffer, particles.pos_x.data(),
+                          particles.pos_y.data(), download_events[0]);
+    this->readInterleaved(this->forces_buffer, particles.vel_x.data(),
+                          particles.vel_y.data(), download_events[1]);
+    this->readInterleaved(this->densities_buffer, particles.density.data(),
+                          nullptr, download_events[2]);
+  } else {
+    this->queue.enqueueReadBuffer(this->positions_buffer, CL_FALSE, 0,
+                                  vec2_bytes, particles.positions.data(),
+                                  nullptr, &download_events[0]);
+    this->queue.enqueueReadBuffer(this->forces_buffer, CL_FALSE, 0,
+                                  vec2_bytes, particles.velocities.data(),
+                                  nullptr, &download_events[1]);
+    this->queue.enqueueReadBuffer(this->densities_buffer, CL_FALSE, 0,
+                                  vec2_bytes, particles.densities.data(),
+                                  nullptr, &download_events[2]);
+  }
+  this->queue.finish();
+
+  for (const cl::Event &event : upload_events) {
+    this->upload_ns += eventDuration(event);
+  }
+  for (const cl::Event &event : download_events) {
+    this->download_ns += eventDuration(event);
+  }
+  this->profiled_steps++;
+}
+
+void GpuCompute::solveGranular(Particles &particles,
+                               SpatialGrid &spatial_grid,
+                               const GranularParams &granular,
+                               const glm::vec2 min_pos,
+                               const glm::vec2 max_pos) {
+  this->particle_count = particles.particle_count;
+  if (this->particle_count == 0) {
+    return;
+  }
+  const size_t vec2_bytes = sizeof(glm::vec2) * this->particle_count;
+  const uint32_t bucket_count = spatial_grid.spatial_lookup.size() - 1;
+  const uint32_t key_mode = (uint32_t)spatial_grid.key_mode;
+  const cl::NDRange global(this->particle_count);
+
+  std::vector<cl::Event> upload_events(5);
+  if (particles.layout == ParticleLayout::SoA) {
+    this->writeInterleaved(this->positions_buffer, particles.pos_x.data(),
+                           particles.pos_y.data(), upload_events[0]);
+    this->writeInterleaved(this->velocities_buffer, particles.vel_x.data(),
+                           particles.vel_y.data(), upload_events[1]);
+  } else {
+    this->queue.enqueueWriteBuffer(this->positions_buffer, CL_FALSE, 0,
+                                   vec2_bytes, particles.positions.data(),
+                                   nullptr, &upload_events[0]);
+    this->queue.enqueueWriteBuffer(this->velocities_buffer, CL_FALSE, 0,
+                                   vec2_bytes, particles.velocities.data(),
+                                   nullptr, &upload_events[1]);
+  }
+  this->queue.enqueueWriteBuffer(
+      this->spatial_lookup_buffer, CL_FALSE, 0,
+      sizeof(int32_t) * spatial_grid.spatial_lookup.size(),
+      spatial_grid.spatial_lookup.data(), nullptr, &upload_events[2]);
+  this->queue.enqueueWriteBuffer(
+      this->spatial_indicies_buffer, CL_FALSE, 0,
+      sizeof(int32_t) * spatial_grid.spatial_indicies.size(),
+      spatial_grid.spatial_indicies.data(), nullptr, &upload_events[3]);
+  this->queue.enqueueWriteBuffer(
+      this->radii_buffer, CL_FALSE, 0, sizeof(float) * this->particle_count,
+      particles.radii.data(), nullptr, &upload_events[4]);
+
+  cl::Kernel &delta = this->granular_delta_kernel;
+  delta.setArg(0, this->positions_buffer);
+  delta.setArg(1, this->radii_buffer);
+  delta.setArg(2, this->forces_buffer);
+  delta.setArg(3, this->spatial_lookup_buffer);
+  delta.setArg(4, this->spatial_indicies_buffer);
+  delta.setArg(5, this->particle_count);
+  delta.setArg(6, bucket_count);
+  delta.setArg(7, key_mode);
+  delta.setArg(8, spatial_grid.cell_width);
+  delta.setArg(9, granular.stiffness);
+
+  // pbfApply moves by the correction and folds it into the velocity.
+  const cl_float2 min_arg = {{min_pos.x, min_pos.y}};
+  const cl_float2 max_arg = {{max_pos.x, max_pos.y}};
+  cl::Kernel &apply = this->pbf_apply_kernel;
+  apply.setArg(0, this->positions_buffer);
+  apply.setArg(1, this->velocities_buffer);
+  apply.setArg(2, this->forces_buffer);
+  apply.setArg(3, this->particle_count);
+  apply.setArg(4, granular.step_dt);
+  apply.setArg(5, min_arg);
+  apply.setArg(6, max_arg);
+
+  for (uint32_t iteration = 0; iteration < granular.iterations;
+       iteration++) {
+    this->queue.enqueueNDRangeKernel(delta, cl::NullRange, global);
+    this->queue.enqueueNDRangeKernel(apply, cl::NullRange, global);
+  }
+
+  std::vector<cl::Event> download_events(2);
+  if (particles.layout == ParticleLayout::SoA) {
+    this->readInterleaved(this->positions_buffer, particles.pos_x.data(),
+                          particles.pos_y.data(), download_events[0]);
+    this->readInterleaved(this->velocities_buffer, particles.vel_x.data(),
+                          particles.vel_y.data(), download_events[1]);
+  } else {
+    this->queue.enqueueReadBuffer(this->positions_buffer, CL_FALSE, 0,
+                                  vec2_bytes, particles.positions.data(),
+                                  nullptr, &download_events[0]);
+    this->queue.enqueueReadBuffer(this->velocities_buffer, CL_FALSE, 0,
+                                  vec2_bytes, particles.velocities.data(),
+                                  nullptr, &download_events[1]);
+  }
+  this->queue.finish();
+
+  for (const cl::Event &event : upload_events) {
+    this->upload_ns += eventDuration(event);
+  }
+  for (const cl::Event &event : download_events) {
+    this->download_ns += eventDuration(event);
+  }
+  this->profiled_steps++;
+}
+
+void GpuCompute::writeInterleaved(cl::Buffer &buffer, const float *x,
+                                  const float *y, cl::Event &event) {
+  // Pack straight into the mapped buffer rather than through an AoS copy.
+  float *mapped = (float *)this->queue.enqueueMapBuffer(
+      buffer, CL_TRUE, CL_MAP_WRITE_INVALIDATE_REGION, 0,
+      sizeof(glm::vec2) * this->particle_count);
+  for (uint32_t i = 0; i < this->particle_count; i++) {
+    mapped[2 * i] = x[i];
+    mapped[2 * i + 1] = y[i];
+  }
+  this->queue.enqueueUnmapMemObject(buffer, mapped, nullptr, &event);
+}
+
+void GpuCompute::readInterleaved(cl::Buffer &buffer, float *x, float *y,
+                                 cl::Event &event) {
+  const float *mapped = (const float *)this->queue.enqueueMapBuffer(
+      buffer, CL_TRUE, CL_MAP_READ, 0, sizeof(glm::vec2) * this->particle_count,
+      nullptr, &event);
+  for (uint32_t i = 0; i < this->particle_count; i++) {
+    x[i] = mapped[2 * i];
+    if (y != nullptr) {
+      y[i] = mapped[2 * i + 1];
+    }
+  }
+  this->queue.enqueueUnmapMemObject(buffer, (void *)mapped);
+}
+
+void GpuCompute::reportProfile() {
+  if (this->profiled_steps == 0) {
+    return;
+  }
+
+  const double to_ms = 1e-6 / this->profiled_steps;
+  std::cout << "OpenCL average per step over " << this->profiled_steps
+            << " steps (ms):\n"
+            << "  upload:             " << this->upload_ns * to_ms << "\n"
+            << "  calcDensity:        " << this->calc_density_ns * to_ms
+            << "\n"
+            << "  applyFluidForces:   " << this->apply_fluid_forces_ns * to_ms
+            << "\n"
+            << "  download:           " << this->download_ns * to_ms << "\n";
+  this->neighbour_stats.report();
 }
@@ -1,7 +1,18 @@
 #pragma once
+#define CL_HPP_MINIMUM_OPENCL_VERSION 120
 #define CL_HPP_TARGET_OPENCL_VERSION 210
 #include <CL/cl2.hpp>
 
+#include <cstdint>
+#include <string>
+
+#include "fluid_params.hpp"
+#include "neighbour_list.hpp"
+#include "particles.hpp"
+#include "spatial_grid.hpp"
+
+// OpenCL counterpart of the GL compute shader path. Works on any OpenCL
+// device, including pocl on machines without a GPU.
 struct GpuCompute {
   cl::Platform platform;
   cl::Device device;
@@ -9,5 +20,73 @@ struct GpuCompute {
   cl::Program program;
   cl::CommandQueue queue;
 
-  GpuCompute(std::string file_path);
+  cl::Kernel calc_density_kernel;
+  cl::Kernel apply_fluid_forces_kernel;
+  cl::Kernel pbf_lambda_kernel;
+  cl::Kernel pbf_delta_kernel;
+  cl::Kernel pbf_apply_kernel;
+  cl::Kernel pbf_xsph_kernel;
+  cl::Kernel granular_delta_kernel;
+
+  // Allocated for 'capacity' particles and reused every step, until
+  // reserve() grows them. Each step uploads and runs over the live
+  // particle_count only.
+  uint32_t capacity = 0;
+  uint32_t particle_count = 0;
+  cl::Buffer positions_buffer;
+  cl::Buffer velocities_buffer;
+  cl::Buffer forces_buffer;
+  cl::Buffer densities_buffer;
+  cl::Buffer radii_buffer;
+  cl::Buffer spatial_lookup_buffer;
+  cl::Buffer spatial_indicies_buffer;
+  cl::Buffer neighbour_list_buffer;
+  cl::Buffer neighbour_offsets_buffer;
+  cl::Buffer neighbour_total_buffer;
+  NeighbourListStats neighbour_stats;
+  // Host side of neighbour_total_buffer, reset before and read after a step:
+  // slots handed out, then particles that didn't fit.
+  uint32_t neighbour_counters[2] = {0, 0};
+
+  // Accumulated device time in nanoseconds, from event profiling.
+  uint64_t upload_ns = 0;
+  uint64_t calc_density_ns = 0;
+  uint64_t apply_fluid_forces_ns = 0;
+  uint64_t download_ns = 0;
+  uint64_t profiled_steps = 0;
+
+  GpuCompute(std::string file_path, const uint32_t _capacity,
+             const NeighbourListLayout neighbour_layout =
+                 NeighbourListLayout::Compact);
+
+  bool loadCachedProgram(const std::string &cache_path);
+
+  // Reallocates the buffers for at least 'capacity' particles. Their
+  // contents don't survive, but nothing is kept on the device between steps.
+  void reserve(const uint32_t capacity);
+
+  void calcDensitiesAndApplyPressureForce(Particles &particles,
+                                          SpatialGrid &spatial_grid,
+                                          const FluidParams &params);
+
+  // One Position Based Fluids step on predicted positions, mirroring
+  // CpuCompute::solvePbf.
+  void solvePbf(Particles &particles, SpatialGrid &spatial_grid,
+                const FluidParams &params, const PbfParams &pbf,
+                const glm::vec2 min_pos, const glm::vec2 max_pos);
+
+  // Projects overlapping discs apart, as CpuCompute::solveGranular but with
+  // Jacobi iterations rather than coloured Gauss-Seidel.
+  void solveGranular(Particles &particles, SpatialGrid &spatial_grid,
+                     const GranularParams &granular, const glm::vec2 min_pos,
+                     const glm::vec2 max_pos);
+
+  // Map-based packing between float streams and float2 buffers, for
+  // ParticleLayout::SoA.
+  void writeInterleaved(cl::Buffer &buffer, const float *x, const float *y,
+                        cl::Event &event);
+  void readInterleaved(cl::Buffer &buffer, float *x, float *y,
+                       cl::Event &event);
+
+  void reportProfile();
 };
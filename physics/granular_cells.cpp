@@ -0,0 +1,66 @@
+#include "granular_cells.hpp"
+
+#include <algorithm>
+#include <atomic>
+
+namespace {
+
+constexpr int32_t granular_ahead[4][2] = {{1, 0}, {-1, 1}, {0, 1}, {1, 1}};
+
+uint32_t granularColour(const glm::ivec2 cell_coord) {
+  return (cell_coord.x % 3 + 3) % 3 + 3 * (cell_coord.y & 1);
+}
+
+} // namespace
+
+uint64_t GranularCells::update(SpatialGrid &spatial_grid,
+                               JobSystem &job_system) {
+  const std::vector<uint64_t> &keys = spatial_grid.spatial_keys;
+
+  // Colour the cells, and sort them by colour with a counting sort.
+  uint32_t *starts = this->colour_starts;
+  std::fill(starts, starts + granular_colours + 1, 0);
+  this->runs.clear();
+  for (uint32_t i = 0; i < keys.size(); i++) {
+    if (i == 0 || keys[i] != keys[i - 1]) {
+      this->runs.push_back(i);
+      starts[granularColour(SpatialGrid::keyToCellCoord(keys[i])) + 1]++;
+    }
+  }
+  for (uint32_t colour = 0; colour < granular_colours; colour++) {
+    starts[colour + 1] += starts[colour];
+  }
+  const uint32_t cell_count = this->runs.size();
+  this->cells.resize(cell_count);
+  uint32_t next[granular_colours];
+  std::copy(starts, starts + granular_colours, next);
+  for (const int32_t run : this->runs) {
+    const glm::ivec2 cell_coord = SpatialGrid::keyToCellCoord(keys[run]);
+    this->cells[next[granularColour(cell_coord)]++] = run;
+  }
+
+  std::atomic<uint64_t> candidates{0};
+  this->ranges.resize(5 * 2 * cell_count);
+  auto range_pass = [&](const uint32_t begin, const uint32_t end) {
+    uint64_t chunk_candidates = 0;
+    for (uint32_t c = begin; c < end; c++) {
+      const glm::ivec2 cell_coord =
+          SpatialGrid::keyToCellCoord(keys[this->cells[c]]);
+      int32_t *cell_ranges = &this->ranges[10 * c];
+      spatial_grid.cellRange(cell_coord, cell_ranges[0], cell_ranges[1]);
+      const uint64_t own = cell_ranges[1] - cell_ranges[0];
+      uint64_t ahead = 0;
+      for (uint32_t cell = 1; cell < 5; cell++) {
+        const glm::ivec2 offset(granular_ahead[cell - 1][0],
+                                granular_ahead[cell - 1][1]);
+        spatial_grid.cellRange(cell_coord + offset, cell_ranges[2 * cell],
+                               cell_ranges[2 * cell + 1]);
+        ahead += cell_ranges[2 * cell + 1] - cell_ranges[2 * cell];
+      }
+      chunk_candidates += own * (own - 1) / 2 + own * ahead;
+    }
+    candidates.fetch_add(chunk_candidates, std::memory_order_relaxed);
+  };
+  job_system.parallelFor(0, cell_count, granular_chunk, range_pass);
+  return candidates;
+}
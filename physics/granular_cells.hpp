@@ -0,0 +1,31 @@
+#pragma once
+#include <cstdint>
+#include <vector>
+
+#include "job_system.hpp"
+#include "spatial_grid.hpp"
+
+// Colours of the cells the granular solver projects at once, see
+// cpu_granular.cpp.
+constexpr uint32_t granular_colours = 6;
+// Cells per job.
+constexpr uint32_t granular_chunk = 64;
+
+// A grid's occupied cells sorted by colour for the granular solver, with
+// the ranges of spatial_indicies each cell projects against. Both the CPU
+// and the GL backend project from it, so they visit the same pairs in the
+// same order.
+struct GranularCells {
+  // The start of every cell's run in spatial_indicies, then the same sorted
+  // by colour, with colour c at [colour_starts[c], colour_starts[c + 1]).
+  // Each sorted cell has 5 [start, end) ranges in 'ranges': itself, then the
+  // cells ahead of it.
+  std::vector<int32_t> runs;
+  std::vector<int32_t> cells;
+  std::vector<int32_t> ranges;
+  uint32_t colour_starts[granular_colours + 1];
+
+  // Rebuilds everything from the grid's current keys. Returns the number of
+  // candidate pairs one pass over the ranges tests.
+  uint64_t update(SpatialGrid &spatial_grid, JobSystem &job_system);
+};
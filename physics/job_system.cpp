@@ -0,0 +1,249 @@
+#include "job_system.hpp"
+
+#include <cstdlib>
+#include <stdexcept>
+
+#include "numa.hpp"
+
+// The JobSystem the calling thread works for, if any, and its deque there.
+// Every other thread, including the one that owns a JobSystem, uses that
+// system's deque 0, so a worker of one system calling into another never
+// indexes it with its own index.
+static thread_local const JobSystem *worker_owner = nullptr;
+static thread_local uint32_t worker_index = 0;
+
+uint32_t JobSystem::currentWorker() const {
+  return worker_owner == this ? worker_index : 0;
+}
+
+static void lock(std::atomic_flag &flag) {
+  while (flag.test_and_set(std::memory_order_acquire)) {
+    std::this_thread::yield();
+  }
+}
+
+static void unlock(std::atomic_flag &flag) {
+  flag.clear(std::memory_order_release);
+}
+
+bool JobDeque::push(const Job &job) {
+  lock(this->spin);
+  const bool has_space = this->tail - this->head < capacity;
+  if (has_space) {
+    this->jobs[this->tail % capacity] = job;
+    this->tail++;
+  }
+  unlock(this->spin);
+  return has_space;
+}
+
+bool JobDeque::pop(Job &job) {
+  lock(this->spin);
+  const bool has_job = this->tail != this->head;
+  if (has_job) {
+    this->tail--;
+    job = this->jobs[this->tail % capacity];
+  }
+  unlock(this->spin);
+  return has_job;
+}
+
+bool JobDeque::steal(Job &job) {
+  lock(this->spin);
+  const bool has_job = this->tail != this->head;
+  if (has_job) {
+    job = this->jobs[this->head % capacity];
+    this->head++;
+  }
+  unlock(this->spin);
+  return has_job;
+}
+
+JobSystem::JobSystem(uint32_t _thread_count) {
+  if (_thread_count == 0) {
+    const char *requested = std::getenv("SPH_THREADS");
+    _thread_count = requested != nullptr ? std::atoi(requested)
+                                         : std::thread::hardware_concurrency();
+  }
+  this->thread_count = _thread_count > 0 ? _thread_count : 1;
+
+  this->deques = std::vector<JobDeque>(this->thread_count);
+  if (threadPinningFromEnv() && this->thread_count > 1) {
+    const std::vector<uint32_t> cpus = NumaTopology().cpus();
+    for (uint32_t i = 1; i < this->thread_count; i++) {
+      this->worker_cpus.push_back(cpus[(i - 1) % cpus.size()]);
+    }
+  }
+  for (uint32_t i = 1; i < this->thread_count; i++) {
+    this->threads.emplace_back(&JobSystem::workerLoop, this, i);
+  }
+  // Each worker pins itself first thing; wait so pinned_count is final.
+  while (!this->worker_cpus.empty() &&
+         this->pin_attempts.load() < this->worker_cpus.size()) {
+    std::this_thread::yield();
+  }
+}
+
+JobSystem::~JobSystem() {
+  {
+    std::lock_guard<std::mutex> guard(this->sleep_mutex);
+    this->stopping = true;
+  }
+  this->sleep_cv.notify_all();
+  for (std::thread &thread : this->threads) {
+    thread.join();
+  }
+}
+
+void JobSystem::push(const Job &job) {
+  // Count before publishing so thieves never see more jobs than 'queued'.
+  // Sequentially consistent, paired with 'sleeping', so a worker going to
+  // sleep either sees the job or gets woken.
+  this->queued.fetch_add(1);
+  if (!this->deques[this->currentWorker()].push(job)) {
+    // Deque full; just do it now.
+    this->queued.fetch_sub(1, std::memory_order_relaxed);
+    job.fn(job.ctx, job.begin, job.end);
+    if (job.counter != nullptr) {
+      job.counter->fetch_sub(1, std::memory_order_release);
+    }
+    return;
+  }
+
+  if (this->sleeping.load() > 0) {
+    std::lock_guard<std::mutex> guard(this->sleep_mutex);
+    this->sleep_cv.notify_one();
+  }
+}
+
+bool JobSystem::runOne() {
+  Job job;
+  const uint32_t index = this->currentWorker();
+  bool found = this->deques[index].pop(job);
+
+  for (uint32_t i = 1; !found && i < this->thread_count; i++) {
+    found = this->deques[(index + i) % this->thread_count].steal(job);
+  }
+  if (!found) {
+    return false;
+  }
+
+  this->queued.fetch_sub(1, std::memory_order_relaxed);
+  job.fn(job.ctx, job.begin, job.end);
+  if (job.counter != nullptr) {
+    job.counter->fetch_sub(1, std::memory_order_release);
+  }
+  return true;
+}
+
+void JobSystem::wait(std::atomic<uint32_t> &counter) {
+  while (counter.load(std::memory_order_acquire) > 0) {
+    if (!this->runOne()) {
+      std::this_thread::yield();
+    }
+  }
+}
+
+void JobSystem::workerLoop(const uint32_t index) {
+  worker_owner = this;
+  worker_index = index;
+  if (!this->worker_cpus.empty()) {
+    if (pinCurrentThread({this->worker_cpus[index - 1]})) {
+      this->pinned_count++;
+    }
+    this->pin_attempts++;
+  }
+
+  uint32_t idle_spins = 0;
+  while (!this->stopping.load(std::memory_order_acquire)) {
+    if (this->runOne()) {
+      idle_spins = 0;
+      continue;
+    }
+
+    // Spin briefly between steps, then sleep until more work is pushed.
+    if (++idle_spins < 64) {
+      std::this_thread::yield();
+      continue;
+    }
+
+    std::unique_lock<std::mutex> guard(this->sleep_mutex);
+    this->sleeping++;
+    this->sleep_cv.wait(guard, [this] {
+      return this->stopping.load() || this->queued.load() > 0;
+    });
+    this->sleeping--;
+    idle_spins = 0;
+  }
+}
+
+void TaskGraph::addDependency(const uint32_t before, const uint32_t after) {
+  if (before >= this->node_count || after >= this->node_count) {
+    throw std::out_of_range("TaskGraph::addDependency on a missing node");
+  }
+  Node &node = this->nodes[before];
+  if (node.dependent_count == max_dependents) {
+    throw std::length_error("TaskGraph: more than max_dependents");
+  }
+  node.dependents[node.dependent_count++] = after;
+  this->nodes[after].dependency_count++;
+}
+
+void TaskGraph::run(JobSystem &job_system) {
+  this->jobs = &job_system;
+  this->main_queue_head = 0;
+  this->main_queue_tail = 0;
+  this->remaining.store(this->node_count, std::memory_order_relaxed);
+  for (uint32_t i = 0; i < this->node_count; i++) {
+    this->nodes[i].pending.store(this->nodes[i].dependency_count,
+                                 std::memory_order_relaxed);
+  }
+
+  for (uint32_t i = 0; i < this->node_count; i++) {
+    if (this->nodes[i].dependency_count == 0) {
+      this->schedule(i);
+    }
+  }
+
+  // Run main-thread-only nodes as they become ready, and help with
+  // everything else in between.
+  while (this->remaining.load(std::memory_order_acquire) > 0) {
+    uint32_t node_index = max_nodes;
+    lock(this->main_queue_lock);
+    if (this->main_queue_head != this->main_queue_tail) {
+      node_index = this->main_queue[this->main_queue_head++];
+    }
+    unlock(this->main_queue_lock);
+
+    if (node_index != max_nodes) {
+      runNode(this, node_index, 0);
+    } else if (!job_system.runOne()) {
+      std::this_thread::yield();
+    }
+  }
+}
+
+void TaskGraph::schedule(const uint32_t node_index) {
+  if (this->nodes[node_index].main_thread_only) {
+    lock(this->main_queue_lock);
+    this->main_queue[this->main_queue_tail++] = node_index;
+    unlock(this->main_queue_lock);
+    return;
+  }
+  this->jobs->push({&TaskGraph::runNode, this, node_index, 0, nullptr});
+}
+
+void TaskGraph::runNode(void *graph, const uint32_t node_index,
+                        const uint32_t) {
+  TaskGraph &self = *(TaskGraph *)graph;
+  Node &node = self.nodes[node_index];
+  node.fn(node.obj);
+
+  for (uint32_t i = 0; i < node.dependent_count; i++) {
+    Node &dependent = self.nodes[node.dependents[i]];
+    if (dependent.pending.fetch_sub(1, std::memory_order_acq_rel) == 1) {
+      self.schedule(node.dependents[i]);
+    }
+  }
+  self.remaining.fetch_sub(1, std::memory_order_acq_rel);
+}
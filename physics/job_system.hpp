@@ -0,0 +1,160 @@
+#pragma once
+#include <atomic>
+#include <condition_variable>
+#include <cstdint>
+#include <mutex>
+#include <stdexcept>
+#include <thread>
+#include <vector>
+
+// A unit of work. Plain function pointer plus context so that scheduling never
+// allocates; 'ctx' must outlive the job.
+struct Job {
+  void (*fn)(void *ctx, uint32_t begin, uint32_t end);
+  void *ctx;
+  uint32_t begin;
+  uint32_t end;
+  // Decremented once the job has run, if set.
+  std::atomic<uint32_t> *counter;
+};
+
+// Fixed capacity deque. The owning thread pushes and pops at the back,
+// thieves take from the front.
+struct JobDeque {
+  static constexpr uint32_t capacity = 4096;
+
+  Job jobs[capacity];
+  uint32_t head = 0; // Front, where thieves steal.
+  uint32_t tail = 0; // Back, owned end.
+  std::atomic_flag spin = ATOMIC_FLAG_INIT;
+
+  bool push(const Job &job);
+  bool pop(Job &job);
+  bool steal(Job &job);
+};
+
+// Work-stealing thread pool. The thread that creates it is worker 0 and takes
+// part in the work whenever it waits.
+struct JobSystem {
+  uint32_t thread_count;
+  std::vector<JobDeque> deques;
+  std::vector<std::thread> threads;
+
+  std::atomic<uint32_t> queued{0};
+  std::atomic<bool> stopping{false};
+  std::mutex sleep_mutex;
+  std::condition_variable sleep_cv;
+  std::atomic<uint32_t> sleeping{0};
+  // The CPU each spawned worker, from worker 1 on, is asked to pin to, node
+  // by node (see NumaTopology), or empty when unpinned. The creating thread
+  // keeps whatever affinity it had.
+  std::vector<uint32_t> worker_cpus;
+  // Of those, how many the OS let pin; final once the constructor returns.
+  std::atomic<uint32_t> pinned_count{0};
+  std::atomic<uint32_t> pin_attempts{0};
+
+  // 0 picks one thread per hardware thread, or SPH_THREADS if set.
+  // SPH_PIN=1 pins each spawned worker to its own CPU, so the memory it
+  // first touches stays on its node.
+  JobSystem(uint32_t _thread_count = 0);
+  ~JobSystem();
+
+  void push(const Job &job);
+
+  // The calling thread's deque: its own if it is one of this system's
+  // workers, otherwise 0.
+  uint32_t currentWorker() const;
+
+  // Run one queued job, preferring the caller's own deque. Returns false if
+  // there was nothing to do.
+  bool runOne();
+
+  // Help out until 'counter' reaches zero.
+  void wait(std::atomic<uint32_t> &counter);
+
+  // Split [begin, end) into chunks of at most 'chunk' and run 'fn(begin, end)'
+  // on each, returning once all are done. 'fn' lives on the caller's stack.
+  template <typename F>
+  void parallelFor(const uint32_t begin, const uint32_t end,
+                   const uint32_t chunk, F &fn) {
+    if (end <= begin) {
+      return;
+    }
+    const uint32_t chunk_count = (end - begin + chunk - 1) / chunk;
+    if (chunk_count == 1 || this->thread_count == 1) {
+      fn(begin, end);
+      return;
+    }
+
+    std::atomic<uint32_t> counter(chunk_count);
+    for (uint32_t b = begin; b < end; b += chunk) {
+      const uint32_t e = end - b < chunk ? end : b + chunk;
+      this->push({&JobSystem::invoke<F>, &fn, b, e, &counter});
+    }
+    this->wait(counter);
+  }
+
+  template <typename F>
+  static void invoke(void *ctx, const uint32_t begin, const uint32_t end) {
+    (*(F *)ctx)(begin, end);
+  }
+
+  void workerLoop(const uint32_t index);
+};
+
+// Dependency graph of the tasks in one solver step. Built once and run every
+// step; running it does not allocate.
+struct TaskGraph {
+  static constexpr uint32_t max_nodes = 32;
+  static constexpr uint32_t max_dependents = 8;
+
+  struct Node {
+    void (*fn)(void *obj);
+    void *obj;
+    // Must run on the thread that calls run(), e.g. anything touching GL.
+    bool main_thread_only;
+    uint32_t dependency_count = 0;
+    uint32_t dependents[max_dependents];
+    uint32_t dependent_count = 0;
+    std::atomic<uint32_t> pending{0};
+  };
+
+  Node nodes[max_nodes];
+  uint32_t node_count = 0;
+
+  std::atomic<uint32_t> remaining{0};
+  // Ready main-thread-only nodes. Each node becomes ready once per run, so
+  // this never wraps.
+  uint32_t main_queue[max_nodes];
+  uint32_t main_queue_head = 0;
+  uint32_t main_queue_tail = 0;
+  std::atomic_flag main_queue_lock = ATOMIC_FLAG_INIT;
+
+  JobSystem *jobs = nullptr;
+
+  // Adds a node that calls obj->Method().
+  template <typename T, void (T::*Method)()>
+  uint32_t addNode(T *obj, const bool main_thread_only = false) {
+    if (this->node_count == max_nodes) {
+      throw std::length_error("TaskGraph: more than max_nodes");
+    }
+    Node &node = this->nodes[this->node_count];
+    node.fn = &TaskGraph::call<T, Method>;
+    node.obj = obj;
+    node.main_thread_only = main_thread_only;
+    return this->node_count++;
+  }
+
+  template <typename T, void (T::*Method)()> static void call(void *obj) {
+    (((T *)obj)->*Method)();
+  }
+
+  // 'after' only starts once 'before' has finished.
+  void addDependency(const uint32_t before, const uint32_t after);
+
+  void run(JobSystem &job_system);
+
+  void schedule(const uint32_t node_index);
+
+  static void runNode(void *graph, const uint32_t node_index, const uint32_t);
+};
@@ -0,0 +1,70 @@
+#include "multi_level_grid.hpp"
+
+#include <stdexcept>
+
+MultiLevelGrid::~MultiLevelGrid() {
+  for (Level *level : this->levels) {
+    delete level;
+  }
+}
+
+uint32_t MultiLevelGrid::levelFor(const float radius) const {
+  uint32_t level = 0;
+  float cell_width = this->levels[0]->grid.cell_width;
+  while (level + 1 < this->levels.size() && cell_width < 2.f * radius) {
+    cell_width *= 2.f;
+    level++;
+  }
+  return level;
+}
+
+void MultiLevelGrid::update(const float *pos_x, const float *pos_y,
+                            const float *radii, const uint32_t count) {
+  if (count == 0) {
+    this->particle_levels.clear();
+    return;
+  }
+
+  float min_radius = radii[0], max_radius = radii[0];
+  for (uint32_t p_i = 1; p_i < count; p_i++) {
+    min_radius = std::min(min_radius, radii[p_i]);
+    max_radius = std::max(max_radius, radii[p_i]);
+  }
+  // Level 0's cells would be 0 wide, and the levels would never reach the
+  // largest radius.
+  if (!(min_radius > 0.f)) {
+    throw std::invalid_argument("MultiLevelGrid: radii must be positive");
+  }
+  uint32_t level_count = 1;
+  for (float width = 2.f * min_radius; width < 2.f * max_radius;
+       width *= 2.f) {
+    level_count++;
+  }
+  if (this->levels.empty() ||
+      this->levels[0]->grid.cell_width != 2.f * min_radius ||
+      this->levels.size() != level_count) {
+    for (Level *level : this->levels) {
+      delete level;
+    }
+    this->levels.clear();
+    float width = 2.f * min_radius;
+    for (uint32_t l = 0; l < level_count; l++, width *= 2.f) {
+      this->levels.push_back(new Level(width));
+    }
+  }
+
+  for (Level *level : this->levels) {
+    level->positions.clear();
+    level->indices.clear();
+  }
+  this->particle_levels.resize(count);
+  for (uint32_t p_i = 0; p_i < count; p_i++) {
+    const uint32_t l = this->levelFor(radii[p_i]);
+    this->particle_levels[p_i] = l;
+    this->levels[l]->positions.push_back(glm::vec2(pos_x[p_i], pos_y[p_i]));
+    this->levels[l]->indices.push_back(p_i);
+  }
+  for (Level *level : this->levels) {
+    level->grid.update();
+  }
+}
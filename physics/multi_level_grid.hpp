@@ -0,0 +1,98 @@
+#pragma once
+#include <algorithm>
+#include <cstdint>
+#include <vector>
+
+#include <glm/glm.hpp>
+
+#include "spatial_grid.hpp"
+
+// Particles with their own radius, each filed in a SpatialGrid whose cells
+// fit it: level L's cells are twice as wide as level L - 1's, and a particle
+// goes in the finest level whose cells are at least its diameter. Two
+// particles are candidates when they are closer than the sum of their
+// radii. It is the granular broadphase for discs of mixed sizes (see
+// GranularBroadphase); the SPH passes share one h, so they keep the one
+// SpatialGrid sized for it.
+//
+// A particle only looks for neighbours at its own level and coarser ones,
+// where every neighbour is at most a cell's half width across, and only in
+// the cells its reach overlaps there: no more than 3x3 without a skin,
+// however big or small the cells are. Pairs with smaller particles are
+// found from the smaller particle's side. Small particles never search
+// cells sized for the biggest, as they would in one grid.
+struct MultiLevelGrid {
+  struct Level {
+    // Positions and the particle index of each, of the particles filed here.
+    std::vector<glm::vec2> positions;
+    std::vector<uint32_t> indices;
+    SpatialGrid grid;
+
+    Level(const float cell_width) : grid(positions, 0.5f * cell_width) {}
+  };
+  // Level 0's cells are the smallest particle's diameter.
+  std::vector<Level *> levels;
+  // Level of each particle.
+  std::vector<uint8_t> particle_levels;
+
+  MultiLevelGrid() = default;
+  MultiLevelGrid(const MultiLevelGrid &) = delete;
+  MultiLevelGrid &operator=(const MultiLevelGrid &) = delete;
+  ~MultiLevelGrid();
+
+  // Refiles every particle from the current positions. Levels are made
+  // again only when the spread of radii needs different ones. Throws
+  // std::invalid_argument unless every radius is positive.
+  void update(const float *pos_x, const float *pos_y, const float *radii,
+              const uint32_t count);
+
+  uint32_t levelFor(const float radius) const;
+
+  // Calls fn(a, b) once for every pair closer than the sum of their radii,
+  // each widened by 'skin' times itself. Returns the number of candidates
+  // looked at.
+  template <typename F>
+  uint64_t forEachPair(const float *pos_x, const float *pos_y,
+                       const float *radii, const float skin, F &&fn) const {
+    uint64_t candidates = 0;
+    const float scale = 1.f + skin;
+    for (uint32_t a = 0; a < this->particle_levels.size(); a++) {
+      const glm::vec2 position(pos_x[a], pos_y[a]);
+      for (uint32_t l = this->particle_levels[a]; l < this->levels.size();
+           l++) {
+        Level &level = *this->levels[l];
+        if (level.positions.empty()) {
+          continue;
+        }
+        // Nothing filed here is wider than a cell.
+        const float reach =
+            scale * (radii[a] + 0.5f * level.grid.cell_width);
+        const glm::ivec2 low =
+            level.grid.positionToCellCoord(position - reach);
+        const glm::ivec2 high =
+            level.grid.positionToCellCoord(position + reach);
+        for (int32_t y = low.y; y <= high.y; y++) {
+          for (int32_t x = low.x; x <= high.x; x++) {
+            int32_t start, end;
+            level.grid.cellRange(glm::ivec2(x, y), start, end);
+            candidates += end - start;
+            for (int32_t i = start; i < end; i++) {
+              const uint32_t b = level.indices[level.grid.spatial_indicies[i]];
+              // Same level pairs are seen from both sides.
+              if (l == this->particle_levels[a] && b <= a) {
+                continue;
+              }
+              const float contact = scale * (radii[a] + radii[b]);
+              const float dx = pos_x[a] - pos_x[b];
+              const float dy = pos_y[a] - pos_y[b];
+              if (dx * dx + dy * dy < contact * contact) {
+                fn(a, b);
+              }
+            }
+          }
+        }
+      }
+    }
+    return candidates;
+  }
+};
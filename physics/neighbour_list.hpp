@@ -0,0 +1,98 @@
+#pragma once
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <iostream>
+
+// How the GPU density pass stores each particle's neighbours (those within h)
+// for the force pass, which then reads the list instead of walking the grid
+// again. Must match the constants in fluid_sim.cs.glsl and
+// fluid_sim_kernels.cl.
+//
+//   FixedStride: max_neighbours slots per particle, so no atomics, but most
+//                slots sit empty.
+//   Compact:     each particle reserves exactly what it found from a shared
+//                counter, in a buffer budgeted at compact_neighbour_budget per
+//                particle on average to start with. A step that runs past
+//                the end widens the budget for the next (see grow()).
+//
+// A particle whose neighbours don't fit is marked with a count of -1, and
+// counted in the second shared counter, and the force pass falls back to
+// walking the grid for it.
+enum class NeighbourListLayout { FixedStride, Compact };
+
+constexpr uint32_t max_neighbours = 64;
+constexpr uint32_t compact_neighbour_budget = 32;
+
+// Compact unless SPH_NEIGHBOUR_LAYOUT=fixed.
+inline NeighbourListLayout neighbourListLayoutFromEnv() {
+  const char *requested = std::getenv("SPH_NEIGHBOUR_LAYOUT");
+  if (requested != nullptr && std::strcmp(requested, "fixed") == 0) {
+    return NeighbourListLayout::FixedStride;
+  }
+  return NeighbourListLayout::Compact;
+}
+
+struct NeighbourListStats {
+  NeighbourListLayout layout;
+  uint32_t particle_count;
+  // Slots per particle, compact layout only.
+  uint32_t budget = compact_neighbour_budget;
+  // Highest shared counter value seen, compact layout only, and the most
+  // particles that didn't fit in one step.
+  uint32_t peak_used = 0;
+  uint32_t peak_overflowed = 0;
+
+  NeighbourListStats(const NeighbourListLayout _layout,
+                     const uint32_t _particle_count)
+      : layout(_layout), particle_count(_particle_count) {}
+
+  // Number of int slots in the list buffer.
+  uint32_t capacity() const {
+    return this->particle_count * (this->layout == NeighbourListLayout::Compact
+                                       ? this->budget
+                                       : max_neighbours);
+  }
+
+  // Records a step that handed out 'used' slots and had 'overflowed'
+  // particles not fit. Returns true if the compact budget grew to fit
+  // 'used' with an eighth to spare, so the list buffer has to be made again
+  // at capacity().
+  bool record(const uint32_t used, const uint32_t overflowed) {
+    this->peak_used = std::max(this->peak_used, used);
+    this->peak_overflowed = std::max(this->peak_overflowed, overflowed);
+    if (this->layout != NeighbourListLayout::Compact ||
+        used <= this->capacity() || this->budget >= max_neighbours) {
+      return false;
+    }
+    const uint32_t needed =
+        (used + used / 8 + this->particle_count - 1) / this->particle_count;
+    this->budget = std::min(max_neighbours, std::max(this->budget + 1, needed));
+    return true;
+  }
+
+  // List plus the per-particle (offset, count) pairs, plus the counters.
+  size_t bytes() const {
+    return sizeof(int32_t) * this->capacity() +
+           2 * sizeof(int32_t) * this->particle_count + 2 * sizeof(uint32_t);
+  }
+
+  void report() const {
+    const bool compact = this->layout == NeighbourListLayout::Compact;
+    std::cout << "Neighbour list (" << (compact ? "compact" : "fixed stride")
+              << "): " << this->bytes() / 1024.0 << " KiB allocated";
+    if (compact && this->peak_used > 0) {
+      std::cout << ", peak " << sizeof(int32_t) * this->peak_used / 1024.0
+                << " KiB used ("
+                << (float)this->peak_used / this->particle_count
+                << " neighbours per particle, budget " << this->budget << ")";
+    }
+    if (this->peak_overflowed > 0) {
+      std::cout << ", up to " << this->peak_overflowed
+                << " particles a step walked the grid again";
+    }
+    std::cout << "\n";
+  }
+};
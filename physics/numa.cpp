@@ -0,0 +1,85 @@
+#include "numa.hpp"
+
+#include <algorithm>
+#include <fstream>
+#include <pthread.h>
+#include <sched.h>
+#include <string>
+
+std::vector<uint32_t> parseCpuList(const char *list) {
+  std::vector<uint32_t> cpus;
+  const char *at = list;
+  while (*at >= '0' && *at <= '9') {
+    char *end;
+    const uint32_t first = std::strtoul(at, &end, 10);
+    uint32_t last = first;
+    if (*end == '-') {
+      last = std::strtoul(end + 1, &end, 10);
+    }
+    for (uint32_t cpu = first; cpu <= last; cpu++) {
+      cpus.push_back(cpu);
+    }
+    at = *end == ',' ? end + 1 : end;
+  }
+  return cpus;
+}
+
+NumaTopology::NumaTopology() {
+  cpu_set_t allowed;
+  CPU_ZERO(&allowed);
+  if (sched_getaffinity(0, sizeof(allowed), &allowed) != 0) {
+    for (uint32_t cpu = 0; cpu < CPU_SETSIZE; cpu++) {
+      CPU_SET(cpu, &allowed);
+    }
+  }
+
+  // Node numbers can have gaps, e.g. with memory-only nodes.
+  std::ifstream online("/sys/devices/system/node/online");
+  std::string nodes;
+  if (std::getline(online, nodes)) {
+    for (const uint32_t node : parseCpuList(nodes.c_str())) {
+      std::ifstream file("/sys/devices/system/node/node" +
+                         std::to_string(node) + "/cpulist");
+      std::string list;
+      std::getline(file, list);
+      std::vector<uint32_t> cpus;
+      for (const uint32_t cpu : parseCpuList(list.c_str())) {
+        if (cpu < CPU_SETSIZE && CPU_ISSET(cpu, &allowed)) {
+          cpus.push_back(cpu);
+        }
+      }
+      if (!cpus.empty()) {
+        this->node_cpus.push_back(cpus);
+      }
+    }
+  }
+
+  if (this->node_cpus.empty()) {
+    std::vector<uint32_t> cpus;
+    for (uint32_t cpu = 0; cpu < CPU_SETSIZE; cpu++) {
+      if (CPU_ISSET(cpu, &allowed)) {
+        cpus.push_back(cpu);
+      }
+    }
+    this->node_cpus.push_back(cpus);
+  }
+}
+
+std::vector<uint32_t> NumaTopology::cpus() const {
+  std::vector<uint32_t> cpus;
+  for (const std::vector<uint32_t> &node : this->node_cpus) {
+    cpus.insert(cpus.end(), node.begin(), node.end());
+  }
+  return cpus;
+}
+
+bool pinCurrentThread(const std::vector<uint32_t> &cpus) {
+  cpu_set_t set;
+  CPU_ZERO(&set);
+  for (const uint32_t cpu : cpus) {
+    if (cpu < CPU_SETSIZE) {
+      CPU_SET(cpu, &set);
+    }
+  }
+  return pthread_setaffinity_np(pthread_self(), sizeof(set), &set) == 0;
+}
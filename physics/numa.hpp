@@ -0,0 +1,36 @@
+#pragma once
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <vector>
+
+// The machine's NUMA nodes and the CPUs on each, read from sysfs. Without
+// sysfs, or on a machine without NUMA, it is one node with every CPU.
+//
+// Linux places a page on the node of the thread that first writes it, so a
+// thread pinned to a node before it fills an array gets the array on its
+// own node. Reading another node's memory costs a socket crossing, up to
+// half the bandwidth on two-socket machines; 'headless numa' measures it.
+struct NumaTopology {
+  // Only CPUs the process may run on, in ascending order.
+  std::vector<std::vector<uint32_t>> node_cpus;
+
+  NumaTopology();
+
+  uint32_t nodeCount() const { return this->node_cpus.size(); }
+
+  // Every allowed CPU, node by node, so neighbouring entries share a node.
+  std::vector<uint32_t> cpus() const;
+};
+
+// Restricts the calling thread to 'cpus'. Returns false if the OS refused.
+bool pinCurrentThread(const std::vector<uint32_t> &cpus);
+
+// "0-3,8,10-11", as sysfs writes CPU lists.
+std::vector<uint32_t> parseCpuList(const char *list);
+
+// Off unless SPH_PIN=1.
+inline bool threadPinningFromEnv() {
+  const char *requested = std::getenv("SPH_PIN");
+  return requested != nullptr && std::strcmp(requested, "1") == 0;
+}
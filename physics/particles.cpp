@@ -1,6 +1,220 @@
 #include "particles.hpp"
 
-Particles::Particles(const uint32_t _particle_count)
-    : particle_count(_particle_count), positions(_particle_count),
-      velocities(_particle_count), forces(_particle_count),
-      densities(_particle_count), colours(_particle_count){};
+#include <algorithm>
+#include <cmath>
+#include <stdexcept>
+
+static uint32_t padToSimdWidth(const uint32_t count) {
+  return (count + simd_width - 1) / simd_width * simd_width;
+}
+
+template <int D>
+ParticlesT<D>::ParticlesT(const uint32_t _particle_count,
+                          const ParticleLayout _layout)
+    : particle_count(_particle_count), layout(_layout),
+      padded_count(padToSimdWidth(_particle_count)),
+      capacity(std::max(padToSimdWidth(_particle_count), simd_width)),
+      positions(_particle_count), radii(_particle_count),
+      colours(_particle_count) {
+  this->positions.reserve(this->capacity);
+  this->radii.reserve(this->capacity);
+  this->colours.reserve(this->capacity);
+  if (this->layout == ParticleLayout::AoS) {
+    for (std::vector<vec> *array : {&this->velocities, &this->forces}) {
+      array->reserve(this->capacity);
+      array->resize(this->particle_count);
+    }
+    this->densities.reserve(this->capacity);
+    this->densities.resize(this->particle_count);
+    return;
+  }
+
+  this->forEachStream([&](AlignedVector<float> &stream) {
+    stream.assign(this->capacity, 0.f);
+  });
+  this->density.assign(this->capacity, 1.f);
+}
+
+template <int D> void ParticlesT<D>::loadPositions() {
+  for (uint32_t i = 0; i < this->particle_count; i++) {
+    this->pos_x[i] = this->positions[i].x;
+    this->pos_y[i] = this->positions[i].y;
+    if constexpr (D == 3) {
+      this->pos_z[i] = this->positions[i].z;
+    }
+  }
+}
+
+template <int D> void ParticlesT<D>::storePositions() {
+  for (uint32_t i = 0; i < this->particle_count; i++) {
+    if constexpr (D == 3) {
+      this->positions[i] =
+          vec(this->pos_x[i], this->pos_y[i], this->pos_z[i]);
+    } else {
+      this->positions[i] = vec(this->pos_x[i], this->pos_y[i]);
+    }
+  }
+}
+
+template <int D> bool ParticlesT<D>::reserve(const uint32_t count) {
+  if (count <= this->capacity) {
+    return false;
+  }
+  while (this->capacity < count) {
+    this->capacity *= 2;
+  }
+
+  this->positions.reserve(this->capacity);
+  this->radii.reserve(this->capacity);
+  this->colours.reserve(this->capacity);
+  if (this->layout == ParticleLayout::AoS) {
+    this->velocities.reserve(this->capacity);
+    this->forces.reserve(this->capacity);
+    this->densities.reserve(this->capacity);
+    return true;
+  }
+
+  // New slots are padding until particles are added into them.
+  this->forEachStream([&](AlignedVector<float> &stream) {
+    stream.resize(this->capacity, 0.f);
+  });
+  this->density.resize(this->capacity, 1.f);
+  return true;
+}
+
+template <int D>
+uint32_t ParticlesT<D>::add(const vec position, const vec velocity,
+                            const glm::vec3 colour, const float radius) {
+  if (this->particle_count == this->capacity) {
+    throw std::length_error("Particles::add past capacity");
+  }
+
+  const uint32_t p_i = this->particle_count++;
+  this->padded_count = padToSimdWidth(this->particle_count);
+  this->positions.push_back(position);
+  this->radii.push_back(radius);
+  this->colours.push_back(colour);
+  if (this->layout == ParticleLayout::AoS) {
+    this->velocities.push_back(velocity);
+    this->forces.push_back(vec(0.f));
+    this->densities.push_back(glm::vec2(0.f));
+    return p_i;
+  }
+
+  // The slot holds padding values, so only the state that differs is set.
+  this->pos_x[p_i] = position.x;
+  this->pos_y[p_i] = position.y;
+  this->vel_x[p_i] = velocity.x;
+  this->vel_y[p_i] = velocity.y;
+  if constexpr (D == 3) {
+    this->pos_z[p_i] = position.z;
+    this->vel_z[p_i] = velocity.z;
+  }
+  return p_i;
+}
+
+template <int D> uint32_t ParticlesT<D>::remove(const uint32_t p_i) {
+  const uint32_t last = --this->particle_count;
+  this->padded_count = padToSimdWidth(this->particle_count);
+
+  this->positions[p_i] = this->positions[last];
+  this->radii[p_i] = this->radii[last];
+  this->colours[p_i] = this->colours[last];
+  this->positions.pop_back();
+  this->radii.pop_back();
+  this->colours.pop_back();
+  if (this->layout == ParticleLayout::AoS) {
+    for (std::vector<vec> *array : {&this->velocities, &this->forces}) {
+      (*array)[p_i] = (*array)[last];
+      array->pop_back();
+    }
+    this->densities[p_i] = this->densities[last];
+    this->densities.pop_back();
+    return last;
+  }
+
+  // Move the last particle down and put padding back in its old slot.
+  this->forEachStream([&](AlignedVector<float> &stream) {
+    stream[p_i] = stream[last];
+    stream[last] = 0.f;
+  });
+  this->density[p_i] = this->density[last];
+  this->density[last] = 1.f;
+  return last;
+}
+
+template <int D> uint32_t ParticlesT<D>::latticeSide(const uint32_t count) {
+  uint32_t side = 1;
+  while (std::pow((float)side, (float)D) < count) {
+    side++;
+  }
+  return side;
+}
+
+template <int D> void ParticlesT<D>::fillLattice(const float spacing) {
+  const uint32_t side = latticeSide(this->particle_count);
+  for (uint32_t p_i = 0; p_i < this->particle_count; p_i++) {
+    uint32_t lattice = p_i;
+    for (int32_t axis = 0; axis < D; axis++) {
+      this->positions[p_i][axis] = spacing * (0.5f + lattice % side);
+      lattice /= side;
+    }
+    this->colours[p_i] = glm::vec3(1.f);
+    this->radii[p_i] = 0.5f * spacing;
+  }
+
+  if (this->layout == ParticleLayout::AoS) {
+    std::fill(this->velocities.begin(), this->velocities.end(), vec(0.f));
+    return;
+  }
+  this->loadPositions();
+  for (AlignedVector<float> *stream : {&this->vel_x, &this->vel_y}) {
+    std::fill(stream->begin(), stream->end(), 0.f);
+  }
+  if constexpr (D == 3) {
+    std::fill(this->vel_z.begin(), this->vel_z.end(), 0.f);
+  }
+}
+
+template <int D>
+void ParticlesT<D>::sortByMorton(const float cell_width,
+                                 const uint32_t count) {
+  std::vector<uint64_t> codes(count);
+  std::vector<uint32_t> order(count);
+  for (uint32_t p_i = 0; p_i < count; p_i++) {
+    const typename Dimension<D>::ivec cell_coord(
+        glm::floor(this->positions[p_i] / cell_width));
+    codes[p_i] = Dimension<D>::morton(cell_coord);
+    order[p_i] = p_i;
+  }
+  std::sort(order.begin(), order.end(),
+            [&](const uint32_t a, const uint32_t b) {
+              return codes[a] < codes[b];
+            });
+
+  auto permute = [&](auto &array) {
+    auto sorted = array;
+    for (uint32_t i = 0; i < count; i++) {
+      sorted[i] = array[order[i]];
+    }
+    array.swap(sorted);
+  };
+  permute(this->positions);
+  permute(this->colours);
+  permute(this->radii);
+  if (this->layout == ParticleLayout::AoS) {
+    permute(this->velocities);
+    return;
+  }
+  for (AlignedVector<float> *stream : {&this->pos_x, &this->pos_y,
+                                       &this->vel_x, &this->vel_y}) {
+    permute(*stream);
+  }
+  if constexpr (D == 3) {
+    permute(this->pos_z);
+    permute(this->vel_z);
+  }
+}
+
+template struct ParticlesT<2>;
+template struct ParticlesT<3>;
@@ -1,22 +1,161 @@
 #pragma once
 
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
 #include <glm/glm.hpp>
+#include <new>
 #include <vector>
 
-struct Particles {
+#include "dimension.hpp"
+
+// Widest SIMD target is AVX-512: 16 floats in one 64 byte register.
+constexpr uint32_t simd_width = 16;
+constexpr size_t simd_alignment = 64;
+
+template <typename T> struct AlignedAllocator {
+  using value_type = T;
+
+  AlignedAllocator() = default;
+  template <typename U> AlignedAllocator(const AlignedAllocator<U> &) {}
+
+  T *allocate(const size_t n) {
+    // aligned_alloc needs the size to be a multiple of the alignment.
+    const size_t bytes =
+        (n * sizeof(T) + simd_alignment - 1) / simd_alignment * simd_alignment;
+    void *ptr = std::aligned_alloc(simd_alignment, bytes);
+    if (ptr == nullptr) {
+      throw std::bad_alloc();
+    }
+    return (T *)ptr;
+  }
+
+  void deallocate(T *ptr, const size_t) { std::free(ptr); }
+
+  template <typename U> bool operator==(const AlignedAllocator<U> &) const {
+    return true;
+  }
+  template <typename U> bool operator!=(const AlignedAllocator<U> &) const {
+    return false;
+  }
+};
+
+template <typename T>
+using AlignedVector = std::vector<T, AlignedAllocator<T>>;
+
+// AoS keeps one glm::vec2 per particle. SoA additionally keeps each component
+// in its own 64 byte aligned float stream, padded to a multiple of simd_width,
+// so CPU kernels can load 8 or 16 particles per instruction. In SoA layout the
+// streams hold the simulation state and only 'positions' is kept in AoS form,
+// for the spatial grid and renderer.
+enum class ParticleLayout { AoS, SoA };
+
+// The z streams, which only 3D particles have. Empty in 2D, where as a base
+// it takes no space.
+template <int D> struct ParticleStreamsZ {};
+template <> struct ParticleStreamsZ<3> {
+  AlignedVector<float> pos_z, vel_z, force_z;
+};
+
+// Particles can be added and removed at runtime. Live particles always fill
+// the first particle_count slots: removing one moves the last particle into
+// its place, so every array stays dense and nothing is reallocated until the
+// capacity runs out.
+//
+// In D = 2 or 3 dimensions. The 2D and 3D containers are compiled in
+// particles.cpp; everything else uses Particles, the 2D one.
+template <int D> struct ParticlesT : ParticleStreamsZ<D> {
+  using vec = typename Dimension<D>::vec;
+
   // Misc
-  const uint32_t particle_count;
+  uint32_t particle_count;
+  const ParticleLayout layout;
+  // particle_count rounded up to a multiple of simd_width (SoA only).
+  uint32_t padded_count;
+  // Slots allocated in every array, a multiple of simd_width. The AoS vectors
+  // hold particle_count elements with this much reserved; the SoA streams
+  // hold all of it, with padding values past particle_count.
+  uint32_t capacity;
 
   // Physics
-  std::vector<glm::vec2> positions;
+  std::vector<vec> positions;
   // std::vector<glm::vec2> prev_positions;
   // std::vector<glm::vec2> proj_positions;
-  std::vector<glm::vec2> velocities;
-  std::vector<glm::vec2> forces;
+  std::vector<vec> velocities;
+  std::vector<vec> forces;
+  // Density and near density.
   std::vector<glm::vec2> densities;
 
+  // SoA streams. Near density is always zero, so density is a single stream.
+  // Padding lanes hold zeros (density one) so whole vectors can be processed.
+  AlignedVector<float> pos_x, pos_y;
+  AlignedVector<float> vel_x, vel_y;
+  AlignedVector<float> force_x, force_y;
+  AlignedVector<float> density;
+
+  // Disc radius, only read by SolverMode::Granular. Kept in every layout.
+  std::vector<float> radii;
+
   // Appearance
   std::vector<glm::vec3> colours;
 
-  Particles(const uint32_t _particle_count);
+  ParticlesT(const uint32_t _particle_count,
+             const ParticleLayout _layout = ParticleLayout::AoS);
+
+  // Copy AoS positions into the streams, e.g. after spawning.
+  void loadPositions();
+
+  // Publish stream positions back to the AoS 'positions'.
+  void storePositions();
+
+  // Makes room for at least 'count' particles, doubling the capacity until
+  // it fits. Returns true if the arrays were reallocated.
+  bool reserve(const uint32_t count);
+
+  // Appends a particle with no force on it. Needs a free slot; see
+  // reserve().
+  // Returns its index.
+  uint32_t add(const vec position, const vec velocity, const glm::vec3 colour,
+               const float radius);
+
+  // Removes particle 'p_i' by moving the last particle into its slot.
+  // Returns the index the moved particle had, which is 'p_i' itself if it
+  // was the last one.
+  uint32_t remove(const uint32_t p_i);
+
+  // Puts every particle at rest on a 'spacing' lattice in the corner at the
+  // origin, x fastest, with a radius of half the spacing.
+  void fillLattice(const float spacing);
+  // Points along each side of that lattice for 'count' particles.
+  static uint32_t latticeSide(const uint32_t count);
+
+  // Sorts particles [0, count) by the Morton code of the 'cell_width' cell
+  // they're in, so a stencil's neighbours sit close together in memory.
+  // Positions, velocities and looks move; forces and densities are left for
+  // the next step to recompute. Sorts by the AoS positions, so SoA callers
+  // storePositions() first.
+  void sortByMorton(const float cell_width, const uint32_t count);
+
+  // Calls fn on every SoA stream that moves with a particle and pads with
+  // zeros, i.e. all but density.
+  template <typename F> void forEachStream(F &&fn) {
+    for (AlignedVector<float> *stream :
+         {&this->pos_x, &this->pos_y, &this->vel_x, &this->vel_y,
+          &this->force_x, &this->force_y}) {
+      fn(*stream);
+    }
+    if constexpr (D == 3) {
+      fn(this->pos_z);
+      fn(this->vel_z);
+      fn(this->force_z);
+    }
+  }
 };
+
+using Particles = ParticlesT<2>;
+
+// On unless SPH_MORTON=0.
+inline bool mortonOrderFromEnv() {
+  const char *requested = std::getenv("SPH_MORTON");
+  return requested == nullptr || std::strcmp(requested, "0") != 0;
+}
@@ -1,83 +1,687 @@
 #include "physics.hpp"
+#include "numa.hpp"
 #include "spatial_grid.hpp"
 
+#include <algorithm>
 #include <cmath>
 #include <glm/geometric.hpp>
 #include <glm/glm.hpp>
 
 #include <iostream>
+#include <stdexcept>
 
 PhysicSolver::PhysicSolver(glm::vec2 _screen_size,
                            const uint32_t _particle_count,
                            const float _particle_radius,
                            const float _particle_mass, const uint8_t _sub_steps,
-                           const float _smoothing_radius)
-    : particles(_particle_count), world_size(_screen_size),
+                           const float _smoothing_radius,
+                           const ComputeBackend _backend,
+                           const ParticleLayout _layout,
+                           const SolverMode _mode)
+    : particles(_particle_count, _layout), world_size(_screen_size),
       sub_steps(_sub_steps), particle_count(_particle_count),
       particle_radius(_particle_radius), particle_mass(_particle_mass),
       smoothing_radius(_smoothing_radius),
-      compute_shader("./renderer/shaders/fluid_sim.cs.glsl") {
+      fluid_params{_smoothing_radius, _particle_mass},
+      boundary(_screen_size, _particle_radius),
+      boundary_kernels(selectCpuKernels()),
+      boundary_particles(_smoothing_radius), mode(_mode),
+      backend(_backend),
+      neighbour_stats(neighbourListLayoutFromEnv(), 0) {
 
-  // WARNING: particle_count must be square
-  const glm::ivec2 spawn_grid_size((int32_t)sqrt(this->particle_count),
-                                   (int32_t)sqrt(this->particle_count));
+  // Spawn on a square grid, with a partial last row if the count isn't
+  // square.
+  const uint32_t spawn_columns =
+      std::max<uint32_t>((uint32_t)std::ceil(std::sqrt(this->particle_count)),
+                         1);
   const float spawn_grid_spacing = 5.f;
   const glm::vec2 spawn_grid_top_left(0.0f, this->world_size.y);
 
-  for (int32_t y = 0; y < spawn_grid_size.y; y++) {
-    for (int32_t x = 0; x < spawn_grid_size.x; x++) {
-      const uint32_t p_i = y * spawn_grid_size.x + x;
-      this->particles.positions[p_i] =
-          spawn_grid_top_left +
-          glm::vec2((x + 1) * (2 * this->particle_radius + spawn_grid_spacing),
-                    -(y + 1) *
-                        (2 * this->particle_radius + spawn_grid_spacing));
-      this->particles.colours[p_i] = glm::vec3(35.f, 137.f, 218.f) / 255.f;
+  for (uint32_t p_i = 0; p_i < this->particle_count; p_i++) {
+    const float x = p_i % spawn_columns;
+    const float y = p_i / spawn_columns;
+    this->particles.positions[p_i] =
+        spawn_grid_top_left +
+        glm::vec2((x + 1) * (2 * this->particle_radius + spawn_grid_spacing),
+                  -(y + 1) * (2 * this->particle_radius + spawn_grid_spacing));
+    this->particles.radii[p_i] = this->particle_radius;
+    this->particles.colours[p_i] = glm::vec3(35.f, 137.f, 218.f) / 255.f;
+  }
+  if (this->particles.layout == ParticleLayout::SoA) {
+    this->particles.loadPositions();
+  }
+
+  for (RenderFrame &frame : this->frames.slots) {
+    frame.positions = this->particles.positions;
+    frame.radii = this->particles.radii;
+    frame.colours = this->particles.colours;
+  }
+
+  // The GPU kernels only know the hashed cell keys.
+  CellKeyMode key_mode = cellKeyModeFromEnv();
+  if (key_mode == CellKeyMode::Blocks && this->backend != ComputeBackend::CPU) {
+    std::cout << "Block cell keys need the CPU backend, using packed64\n";
+    key_mode = CellKeyMode::Packed64;
+  } else if (key_mode == CellKeyMode::Blocks) {
+    std::cout << "Cell keys: blocks\n";
+  } else if (key_mode == CellKeyMode::Hash32) {
+    std::cout << "Cell keys: hash32\n";
+  }
+  // Discs only touch within two radii, so their cells can be that small.
+  this->spatial_grid = new SpatialGrid(this->particles.positions,
+                                       this->mode == SolverMode::Granular
+                                           ? this->particle_radius
+                                           : this->smoothing_radius,
+                                       key_mode);
+
+  // PBF and IISPH push the fluid towards particles just touching.
+  this->pbf_params.rest_density =
+      this->latticeDensity(2 * this->particle_radius);
+  this->iisph_params.rest_density = this->pbf_params.rest_density;
+  this->pbf_params.s_corr_scale =
+      pbfSCorrScale(this->pbf_params, this->smoothing_radius);
+
+  if (this->mode == SolverMode::IISPH &&
+      this->backend != ComputeBackend::CPU) {
+    throw std::invalid_argument("SolverMode::IISPH needs the CPU backend");
+  }
+  if (this->backend == ComputeBackend::OpenCL &&
+      !uncheckedClKernelsFromEnv()) {
+    throw std::invalid_argument(
+        "The OpenCL kernels are unchecked, see uncheckedClKernelsFromEnv");
+  }
+
+  this->job_system = new JobSystem();
+  const uint32_t pinned = this->job_system->pinned_count.load();
+  if (pinned > 0) {
+    std::cout << "Pinned " << pinned << " worker threads over "
+              << NumaTopology().nodeCount() << " NUMA nodes\n";
+  }
+  if (pinned < this->job_system->worker_cpus.size()) {
+    std::cout << "Could not pin "
+              << this->job_system->worker_cpus.size() - pinned
+              << " worker threads\n";
+  }
+  this->buildStepGraph();
+
+  if (this->backend == ComputeBackend::OpenGL) {
+    this->compute_shader =
+        new ComputeShader("./renderer/shaders/fluid_sim.cs.glsl");
+    this->print_density_stats = densityStatsFromEnv();
+    // pbfNeighbours keeps max_neighbours slots for every particle.
+    if (this->mode == SolverMode::PBF) {
+      this->neighbour_stats.layout = NeighbourListLayout::FixedStride;
+    }
+    this->reserveBackend();
+    this->neighbour_total_ssbo =
+        this->compute_shader->allocateBuffer(2 * sizeof(uint32_t), 8);
+    this->neighbour_stats.report();
+  } else if (this->backend == ComputeBackend::CPU) {
+    if (this->particles.layout != ParticleLayout::SoA) {
+      throw std::invalid_argument("CPU backend needs ParticleLayout::SoA");
+    }
+    this->cpu_compute = new CpuCompute(this->particles.capacity);
+    this->granular_params.broadphase = granularBroadphaseFromEnv();
+    if (this->mode == SolverMode::Granular &&
+        this->granular_params.broadphase ==
+            GranularBroadphase::SweepAndPrune) {
+      std::cout << "Granular broadphase: sweep and prune\n";
+    } else if (this->mode == SolverMode::Granular &&
+               this->granular_params.broadphase ==
+                   GranularBroadphase::MultiLevel) {
+      std::cout << "Granular broadphase: multi-level grid\n";
+    }
+    // Only the SPH passes step by time bin.
+    if (this->mode == SolverMode::SPH &&
+        this->cpu_compute->time_bin_params.bin_count > 1) {
+      std::cout << "Multi-rate stepping over "
+                << this->cpu_compute->time_bin_params.bin_count
+                << " time bins\n";
+    }
+    if (this->mode == SolverMode::SPH && !boundaryParticlesFromEnv()) {
+      std::cout << "Boundary particles disabled\n";
+    } else if (this->mode == SolverMode::SPH) {
+      this->cpu_compute->boundary_particles = &this->boundary_particles;
+      this->buildBoundaryParticles();
     }
+  } else {
+#ifdef USE_OPENCL
+    this->gpu_compute = new GpuCompute("./physics/fluid_sim_kernels.cl",
+                                       this->particles.capacity,
+                                       this->neighbour_stats.layout);
+#else
+    throw std::runtime_error(
+        "OpenCL backend requested but built without USE_OPENCL");
+#endif
   }
-  this->spatial_grid =
-      new SpatialGrid(this->particles.positions, this->smoothing_radius);
 }
 
-PhysicSolver::~PhysicSolver() { delete this->spatial_grid; }
+PhysicSolver::~PhysicSolver() {
+  if (this->backend == ComputeBackend::OpenGL) {
+    this->neighbour_stats.report();
+    const uint32_t neighbour_ssbos[] = {this->neighbour_list_ssbo,
+                                        this->neighbour_offsets_ssbo,
+                                        this->neighbour_total_ssbo};
+    glDeleteBuffers(3, neighbour_ssbos);
+    glDeleteBuffers(1, &this->boundary_ssbo);
+  }
+  delete this->spatial_grid;
+  delete this->compute_shader;
+  delete this->density_readback;
+  delete this->cpu_compute;
+#ifdef USE_OPENCL
+  delete this->gpu_compute;
+#endif
+  delete this->job_system;
+}
 
-void PhysicSolver::update(const float dt) {
+void PhysicSolver::update(const float) {
   // const float step_dt = dt / this->sub_steps;
   // const float step_dt = (1 / 60.f) / this->sub_steps;
-  const float step_dt = 0.0007f;
+  this->step_dt =
+      this->mode == SolverMode::PBF        ? this->pbf_params.step_dt
+      : this->mode == SolverMode::IISPH    ? this->iisph_params.step_dt
+      : this->mode == SolverMode::Granular ? this->granular_params.step_dt
+                                           : 0.0007f;
 
   for (int32_t i = 0; i < this->sub_steps; i++) {
-    // applyGravity(step_dt);
+    this->step_graph.run(*this->job_system);
+  }
+  this->publishFrame();
+}
+
+void PhysicSolver::publishFrame() {
+  // Frames keep their allocation, so this only reallocates when the count
+  // passes the largest one the slot has held.
+  RenderFrame &frame = this->frames.writeSlot();
+  frame.positions.assign(this->particles.positions.begin(),
+                         this->particles.positions.end());
+  frame.radii.assign(this->particles.radii.begin(),
+                     this->particles.radii.end());
+  frame.colours.assign(this->particles.colours.begin(),
+                       this->particles.colours.end());
+  this->frames.publish();
+}
+
+void PhysicSolver::addEmitter(const ParticleEmitter &emitter) {
+  this->emitters.push_back(emitter);
+}
+
+void PhysicSolver::addSink(const ParticleSink &sink) {
+  this->sinks.push_back(sink);
+}
+
+void PhysicSolver::reserveBackend() {
+  const uint32_t capacity = this->particles.capacity;
+  if (this->backend == ComputeBackend::CPU) {
+    this->cpu_compute->reserve(capacity);
+    return;
+  }
+#ifdef USE_OPENCL
+  if (this->backend == ComputeBackend::OpenCL) {
+    this->gpu_compute->reserve(capacity);
+    return;
+  }
+#endif
+
+  // Every step uploads the live particles into fresh buffers, so only the
+  // buffers kept across steps are sized from the capacity.
+  if (this->neighbour_list_ssbo != 0) {
+    const uint32_t neighbour_ssbos[] = {this->neighbour_list_ssbo,
+                                        this->neighbour_offsets_ssbo};
+    glDeleteBuffers(2, neighbour_ssbos);
+  }
+  this->neighbour_stats.particle_count = capacity;
+  this->neighbour_list_ssbo = this->compute_shader->allocateBuffer(
+      sizeof(int32_t) * this->neighbour_stats.capacity(), 6);
+  this->neighbour_offsets_ssbo = this->compute_shader->allocateBuffer(
+      2 * sizeof(int32_t) * capacity, 7);
+
+  delete this->density_readback;
+  this->density_readback = new AsyncReadback(sizeof(glm::vec2) * capacity);
+}
+
+void PhysicSolver::drainSinks() {
+  if (this->sinks.empty()) {
+    return;
+  }
+  Particles &p = this->particles;
+  SpatialGrid &grid = *this->spatial_grid;
+  const bool soa = p.layout == ParticleLayout::SoA;
+
+  // The grid is from an earlier step, but nothing has been renumbered since
+  // and nothing has moved more than h from where it was filed.
+  const glm::vec2 margin(this->smoothing_radius);
+  this->drained.clear();
+  for (const ParticleSink &sink : this->sinks) {
+    const glm::ivec2 lo = grid.positionToCellCoord(sink.min - margin);
+    const glm::ivec2 hi = grid.positionToCellCoord(sink.max + margin);
+    for (int32_t y = lo.y; y <= hi.y; y++) {
+      for (int32_t x = lo.x; x <= hi.x; x++) {
+        int32_t start, end;
+        grid.cellRange(glm::ivec2(x, y), start, end);
+        for (int32_t i = start; i < end; i++) {
+          const uint32_t p_i = grid.spatial_indicies[i];
+          const glm::vec2 pos =
+              soa ? glm::vec2(p.pos_x[p_i], p.pos_y[p_i]) : p.positions[p_i];
+          if (pos.x >= sink.min.x && pos.y >= sink.min.y &&
+              pos.x <= sink.max.x && pos.y <= sink.max.y) {
+            this->drained.push_back(p_i);
+          }
+        }
+      }
+    }
+  }
+  if (this->drained.empty()) {
+    return;
+  }
+
+  // Highest index first, so the particle moved into a freed slot is never
+  // one still waiting to be removed. Overlapping sinks can list a particle
+  // twice.
+  std::sort(this->drained.begin(), this->drained.end(),
+            std::greater<uint32_t>());
+  this->drained.erase(
+      std::unique(this->drained.begin(), this->drained.end()),
+      this->drained.end());
+  for (const uint32_t p_i : this->drained) {
+    const uint32_t moved = p.remove(p_i);
+    if (this->cpu_compute != nullptr) {
+      this->cpu_compute->moveParticle(moved, p_i);
+    }
+  }
+  this->drained_count += this->drained.size();
+  grid.invalidate();
+}
+
+void PhysicSolver::runEmitters() {
+  if (this->emitters.empty()) {
+    return;
+  }
+  Particles &p = this->particles;
 
-    this->spatial_grid->update();
-    // this->calcDensities(step_dt);
-    this->calcDensitiesAndApplyPressureForce(step_dt);
-    // Integrate
-    for (int32_t i = 0; i < this->particle_count; i++) {
-      glm::vec2 acc =
-          this->particles.forces[i] / this->particles.densities[i].x;
-      this->particles.velocities[i] += acc * step_dt;
-      this->particles.positions[i] += this->particles.velocities[i] * step_dt;
+  // Make room for everything this substep adds up front, so the arrays are
+  // reallocated at most once.
+  uint32_t pending = 0;
+  for (ParticleEmitter &emitter : this->emitters) {
+    emitter.travelled += glm::length(emitter.velocity) * this->step_dt;
+    const uint32_t rows = (uint32_t)(emitter.travelled / emitter.spacing);
+    const uint32_t columns = (uint32_t)(emitter.width / emitter.spacing) + 1;
+    pending += rows * columns;
+  }
+  if (pending == 0) {
+    return;
+  }
+  if (p.reserve(p.particle_count + pending)) {
+    this->reserveBackend();
+  }
+
+  for (ParticleEmitter &emitter : this->emitters) {
+    const glm::vec2 direction = glm::normalize(emitter.velocity);
+    const glm::vec2 across(-direction.y, direction.x);
+    const uint32_t columns = (uint32_t)(emitter.width / emitter.spacing) + 1;
+    const float first = -0.5f * (columns - 1) * emitter.spacing;
+    // Exactly the rows counted above, so float rounding in the remainder
+    // can't add one the reservation has no room for.
+    const uint32_t rows = (uint32_t)(emitter.travelled / emitter.spacing);
+
+    for (uint32_t row = 0; row < rows; row++) {
+      // Rows that went out earlier in the substep are further along.
+      const float along = emitter.travelled - (row + 1) * emitter.spacing;
+      for (uint32_t column = 0; column < columns; column++) {
+        const glm::vec2 position =
+            emitter.position + direction * along +
+            across * (first + column * emitter.spacing);
+        const uint32_t p_i =
+            p.add(position, emitter.velocity, emitter.colour,
+                  this->particle_radius);
+        if (this->cpu_compute != nullptr) {
+          this->cpu_compute->addParticle(p_i, position);
+        }
+      }
+    }
+    emitter.travelled =
+        std::max(0.f, emitter.travelled - rows * emitter.spacing);
+  }
+  this->emitted_count += pending;
+  this->spatial_grid->invalidate();
+}
+
+float PhysicSolver::latticeDensity(const float spacing) {
+  const float h = this->smoothing_radius;
+  const int32_t extent = (int32_t)std::ceil(h / spacing);
+  // 2D poly6.
+  const float poly6 =
+      KernelConstants<2>::poly6 / (3.14159265359f * std::pow(h, 8.f));
+
+  float density = 0.f;
+  for (int32_t y = -extent; y <= extent; y++) {
+    for (int32_t x = -extent; x <= extent; x++) {
+      const float r = spacing * std::sqrt((float)(x * x + y * y));
+      if (r < h) {
+        const float w = h * h - r * r;
+        density += this->particle_mass * (poly6 * w * w * w);
+      }
+    }
+  }
+  return density;
+}
+
+void PhysicSolver::buildStepGraph() {
+  TaskGraph &graph = this->step_graph;
+  // GL calls have to stay on the thread that owns the context.
+  const bool on_gl = this->backend == ComputeBackend::OpenGL;
+  // Growing the GL buffers needs the context too.
+  const uint32_t emit =
+      graph.addNode<PhysicSolver, &PhysicSolver::stepEmitAndDrain>(this,
+                                                                   on_gl);
+
+  if (this->mode == SolverMode::PBF) {
+    const uint32_t predict =
+        graph.addNode<PhysicSolver, &PhysicSolver::stepPredictPositions>(this);
+    const uint32_t grid =
+        graph.addNode<PhysicSolver, &PhysicSolver::stepUpdateGrid>(this);
+    const uint32_t solve =
+        graph.addNode<PhysicSolver, &PhysicSolver::stepSolvePbf>(this, on_gl);
+    const uint32_t constrain =
+        graph.addNode<PhysicSolver, &PhysicSolver::stepConstrain>(this,
+                                                                  on_gl);
+    const uint32_t publish =
+        graph.addNode<PhysicSolver, &PhysicSolver::stepPublishPositions>(
+            this);
+    const uint32_t density_stats =
+        graph.addNode<PhysicSolver, &PhysicSolver::stepDensityStats>(this);
+
+    graph.addDependency(emit, predict);
+    graph.addDependency(predict, grid);
+    graph.addDependency(grid, solve);
+    graph.addDependency(solve, constrain);
+    graph.addDependency(constrain, publish);
+    graph.addDependency(solve, density_stats);
+    return;
+  }
+
+  if (this->mode == SolverMode::Granular) {
+    // No densities, so no statistics either.
+    const uint32_t predict =
+        graph.addNode<PhysicSolver, &PhysicSolver::stepPredictPositions>(this);
+    const uint32_t grid =
+        graph.addNode<PhysicSolver, &PhysicSolver::stepUpdateGrid>(this);
+    const uint32_t solve =
+        graph.addNode<PhysicSolver, &PhysicSolver::stepSolveGranular>(this,
+                                                                      on_gl);
+    const uint32_t constrain =
+        graph.addNode<PhysicSolver, &PhysicSolver::stepConstrain>(this,
+                                                                  on_gl);
+    const uint32_t publish =
+        graph.addNode<PhysicSolver, &PhysicSolver::stepPublishPositions>(
+            this);
+
+    graph.addDependency(emit, predict);
+    graph.addDependency(predict, grid);
+    graph.addDependency(grid, solve);
+    graph.addDependency(solve, constrain);
+    graph.addDependency(constrain, publish);
+    return;
+  }
+
+  if (this->mode == SolverMode::IISPH) {
+    const uint32_t grid =
+        graph.addNode<PhysicSolver, &PhysicSolver::stepUpdateGrid>(this);
+    const uint32_t solve =
+        graph.addNode<PhysicSolver, &PhysicSolver::stepSolveIisph>(this);
+    const uint32_t constrain =
+        graph.addNode<PhysicSolver, &PhysicSolver::stepConstrain>(this);
+    const uint32_t publish =
+        graph.addNode<PhysicSolver, &PhysicSolver::stepPublishPositions>(
+            this);
+    const uint32_t density_stats =
+        graph.addNode<PhysicSolver, &PhysicSolver::stepDensityStats>(this);
+
+    graph.addDependency(emit, grid);
+    graph.addDependency(grid, solve);
+    graph.addDependency(solve, constrain);
+    graph.addDependency(constrain, publish);
+    graph.addDependency(solve, density_stats);
+    return;
+  }
+
+  const uint32_t grid =
+      graph.addNode<PhysicSolver, &PhysicSolver::stepUpdateGrid>(this);
+  const uint32_t fluid_forces =
+      graph.addNode<PhysicSolver, &PhysicSolver::stepFluidForces>(this,
+                                                                  on_gl);
+  const uint32_t integrate =
+      graph.addNode<PhysicSolver, &PhysicSolver::stepIntegrate>(this);
+  const uint32_t constrain =
+      graph.addNode<PhysicSolver, &PhysicSolver::stepConstrain>(this, on_gl);
+  const uint32_t publish =
+      graph.addNode<PhysicSolver, &PhysicSolver::stepPublishPositions>(this);
+
+  graph.addDependency(emit, grid);
+  graph.addDependency(grid, fluid_forces);
+  graph.addDependency(integrate, constrain);
+  graph.addDependency(constrain, publish);
+
+  // On GL the fluid forces node fills average_density from the async
+  // readback instead (see collectDensityStats).
+  if (on_gl) {
+    graph.addDependency(fluid_forces, integrate);
+    return;
+  }
+  // Only reads densities, so it overlaps with integration.
+  const uint32_t density_stats =
+      graph.addNode<PhysicSolver, &PhysicSolver::stepDensityStats>(this);
+  graph.addDependency(fluid_forces, density_stats);
+
+  if (this->backend != ComputeBackend::CPU) {
+    graph.addDependency(fluid_forces, integrate);
+    return;
+  }
+  // Bodies read the fluid before it moves, and fall as the fluid does at
+  // its average density.
+  const uint32_t rigid_bodies =
+      graph.addNode<PhysicSolver, &PhysicSolver::stepRigidBodies>(this);
+  graph.addDependency(fluid_forces, rigid_bodies);
+  graph.addDependency(density_stats, rigid_bodies);
+  graph.addDependency(rigid_bodies, integrate);
+}
+
+void PhysicSolver::stepRigidBodies() {
+  if (this->rigid_bodies.empty()) {
+    return;
+  }
+  BoundaryParticles &samples = this->boundary_particles;
+  // What SPH's gravity term comes to per unit mass at that density.
+  const float density = this->average_density > 0.f
+                            ? this->average_density
+                            : this->pbf_params.rest_density;
+  const glm::vec2 gravity(
+      0.f, -9.81f * this->particle_mass / (density * density));
+
+  for (RigidBody &body : this->rigid_bodies) {
+    // The fluid's reaction, reduced over the body's samples in chunks.
+    const uint32_t first = body.first_sample;
+    const uint32_t count = body.local_samples.size();
+    const uint32_t chunk = std::max<uint32_t>(
+        (count + max_stat_chunks - 1) / max_stat_chunks, 16);
+    auto reduce = [&](const uint32_t begin, const uint32_t end) {
+      this->body_partials[(begin - first) / chunk] =
+          this->cpu_compute->boundaryReaction(
+              this->particles, *this->spatial_grid, this->fluid_params,
+              begin, end, body.position);
+    };
+    std::fill(std::begin(this->body_partials),
+              std::end(this->body_partials), glm::vec3(0.f));
+    this->job_system->parallelFor(first, first + count, chunk, reduce);
+
+    glm::vec3 total(0.f);
+    for (const glm::vec3 &partial : this->body_partials) {
+      total += partial;
+    }
+    body.force = glm::vec2(total);
+    body.torque = total.z;
+
+    body.integrate(gravity, this->step_dt);
+    body.collide(this->boundary, this->particle_radius, this->boundary_damp);
+    for (uint32_t i = 0; i < count; i++) {
+      samples.moving_positions[first - samples.static_count + i] =
+          body.toWorld(body.local_samples[i]);
     }
+  }
+  samples.updateMoving();
+}
 
-    this->constrainParticlesToScreen(step_dt);
+void PhysicSolver::stepEmitAndDrain() {
+  this->drainSinks();
+  this->runEmitters();
+  this->particle_count = this->particles.particle_count;
+}
+
+void PhysicSolver::stepUpdateGrid() {
+  // The CPU SPH passes start their queries from the cell each particle was
+  // filed under, so they can keep using the grid until something has
+  // drifted h / 2. The GPU kernels look up the current cell, and PBF and
+  // IISPH move particles too far per step, so those rebuild every step.
+  if (this->backend == ComputeBackend::CPU && this->mode == SolverMode::SPH) {
+    this->spatial_grid->updateIfMoved(0.5f * this->smoothing_radius);
+    return;
   }
+  this->spatial_grid->update();
+}
+
+void PhysicSolver::stepFluidForces() {
+  this->calcDensitiesAndApplyPressureForce(this->step_dt);
+}
+
+void PhysicSolver::stepIntegrate() { this->integrate(this->step_dt); }
+
+void PhysicSolver::stepConstrain() {
+  this->constrainParticles();
+}
+
+void PhysicSolver::stepPublishPositions() {
+  if (this->particles.layout == ParticleLayout::SoA) {
+    this->particles.storePositions();
+  }
+}
+
+// Explicit gravity step to the predicted positions the PBF constraints, or
+// the granular contacts, are solved on.
+void PhysicSolver::stepPredictPositions() {
+  Particles &p = this->particles;
+  const float dt = this->step_dt;
+  const float gravity = this->mode == SolverMode::Granular
+                            ? this->granular_params.gravity
+                            : this->pbf_params.gravity;
+
+  if (p.layout == ParticleLayout::SoA) {
+    auto predict = [&](const uint32_t begin, const uint32_t end) {
+      for (uint32_t i = begin; i < end; i++) {
+        p.vel_y[i] += gravity * dt;
+        p.pos_x[i] += p.vel_x[i] * dt;
+        p.pos_y[i] += p.vel_y[i] * dt;
+      }
+    };
+    this->job_system->parallelFor(0, this->particle_count, 4096, predict);
+    // The grid reads the AoS positions.
+    p.storePositions();
+    return;
+  }
+
+  auto predict = [&](const uint32_t begin, const uint32_t end) {
+    for (uint32_t i = begin; i < end; i++) {
+      p.velocities[i].y += gravity * dt;
+      p.positions[i] += p.velocities[i] * dt;
+    }
+  };
+  this->job_system->parallelFor(0, this->particle_count, 4096, predict);
+}
+
+void PhysicSolver::stepSolvePbf() { this->solvePbf(); }
+
+void PhysicSolver::stepSolveGranular() { this->solveGranular(); }
+
+void PhysicSolver::stepSolveIisph() {
+  this->cpu_compute->solveIisph(this->particles, *this->spatial_grid,
+                                this->fluid_params, this->iisph_params,
+                                *this->job_system);
+}
+
+void PhysicSolver::stepDensityStats() {
+  const uint32_t count = this->particle_count;
+  const uint32_t chunk = (count + max_stat_chunks - 1) / max_stat_chunks;
+  Particles &p = this->particles;
+
+  auto reduce = [&](const uint32_t begin, const uint32_t end) {
+    float total = 0.f;
+    for (uint32_t i = begin; i < end; i++) {
+      total += p.layout == ParticleLayout::SoA ? p.density[i]
+                                               : p.densities[i].x;
+    }
+    this->density_partials[begin / chunk] = total;
+  };
+  std::fill(std::begin(this->density_partials),
+            std::end(this->density_partials), 0.f);
+  this->job_system->parallelFor(0, count, chunk, reduce);
+
+  float total = 0.f;
+  for (const float partial : this->density_partials) {
+    total += partial;
+  }
+  this->average_density = count > 0 ? total / count : 0.f;
+}
+
+void PhysicSolver::integrate(const float step_dt) {
+  Particles &p = this->particles;
+  const uint32_t chunk = 4096;
+
+  if (p.layout == ParticleLayout::SoA) {
+    // Runs over the padding too, so the loop vectorises without a tail.
+    auto integrate_range = [&](const uint32_t begin, const uint32_t end) {
+      float *__restrict pos_x = p.pos_x.data();
+      float *__restrict pos_y = p.pos_y.data();
+      float *__restrict vel_x = p.vel_x.data();
+      float *__restrict vel_y = p.vel_y.data();
+      const float *__restrict force_x = p.force_x.data();
+      const float *__restrict force_y = p.force_y.data();
+      const float *__restrict density = p.density.data();
+      for (uint32_t i = begin; i < end; i++) {
+        vel_x[i] += force_x[i] / density[i] * step_dt;
+        vel_y[i] += force_y[i] / density[i] * step_dt;
+        pos_x[i] += vel_x[i] * step_dt;
+        pos_y[i] += vel_y[i] * step_dt;
+      }
+    };
+    this->job_system->parallelFor(0, p.padded_count, chunk, integrate_range);
+    return;
+  }
+
+  auto integrate_range = [&](const uint32_t begin, const uint32_t end) {
+    for (uint32_t i = begin; i < end; i++) {
+      glm::vec2 acc = p.forces[i] / p.densities[i].x;
+      p.velocities[i] += acc * step_dt;
+      p.positions[i] += p.velocities[i] * step_dt;
+    }
+  };
+  this->job_system->parallelFor(0, this->particle_count, chunk,
+                                integrate_range);
 }
 
 void PhysicSolver::applyGravity(float step_dt) {
   glm::vec2 G(0.0f, -9.81f);
-  for (int32_t i = 0; i < this->particle_count; i++) {
+  for (uint32_t i = 0; i < this->particle_count; i++) {
     this->particles.velocities[i] += G * step_dt;
   }
 }
 
-void PhysicSolver::calcDensities(const float step_dt) {
+void PhysicSolver::calcDensities() {
   const float h = this->smoothing_radius;
   const float pi = 3.14159265f;
-  const float POLY6 = 4.f / (pi * glm::pow(h, 8.f));
-  for (int32_t i = 0; i < this->particle_count; i++) {
+  const float POLY6 = KernelConstants<2>::poly6 / (pi * glm::pow(h, 8.f));
+  for (uint32_t i = 0; i < this->particle_count; i++) {
     float density = 0.f;
-    for (int32_t j = 0; j < this->particle_count; j++) {
+    for (uint32_t j = 0; j < this->particle_count; j++) {
       glm::vec2 rij =
           this->particles.positions[j] - this->particles.positions[i];
       const float r = glm::length(rij);
@@ -90,80 +694,457 @@ void PhysicSolver::calcDensities(const float step_dt) {
 }
 
 void PhysicSolver::calcDensitiesAndApplyPressureForce(const float step_dt) {
-  this->compute_shader.use();
+  if (this->backend == ComputeBackend::CPU) {
+    this->cpu_compute->calcDensitiesAndApplyPressureForce(
+        this->particles, *this->spatial_grid, this->fluid_params, step_dt,
+        *this->job_system);
+    return;
+  }
+#ifdef USE_OPENCL
+  if (this->backend == ComputeBackend::OpenCL) {
+    this->gpu_compute->calcDensitiesAndApplyPressureForce(
+        this->particles, *this->spatial_grid, this->fluid_params);
+    return;
+  }
+#endif
 
-  this->compute_shader.setVector(this->particles.positions, 0);
-  this->compute_shader.setVector(this->particles.velocities, 1);
-  const uint32_t forces_ssbo_id =
-      this->compute_shader.setVector(this->particles.forces, 2);
-  const uint32_t densities_ssbo_id =
-      this->compute_shader.setVector(this->particles.densities, 3);
-  this->compute_shader.setVector(this->spatial_grid->spatial_lookup, 4);
-  this->compute_shader.setVector(this->spatial_grid->spatial_indicies, 5);
-
-  this->compute_shader.setFloat(step_dt, "dt");
-  this->compute_shader.setUnsignedInt(this->particle_count, "particle_count");
-  this->compute_shader.setUnsignedInt(
-      this->spatial_grid->spatial_lookup.size() - 1, "bucket_count");
-  this->compute_shader.setFloat(this->smoothing_radius, "h");
-  this->compute_shader.setFloat(this->particle_mass, "particle_mass");
-  this->compute_shader.setFloat(300.f, "target_density");
-  this->compute_shader.setFloat(2000.f, "pressure_multiplier");
-  this->compute_shader.setFloat(3000.f, "near_pressure_multiplier");
-  this->compute_shader.setFloat(200.f, "viscosity_strength");
+  ComputeShader &compute_shader = *this->compute_shader;
+  compute_shader.use();
+
+  Particles &p = this->particles;
+  uint32_t forces_ssbo_id, densities_ssbo_id;
+  if (p.layout == ParticleLayout::SoA) {
+    const size_t vec2_size = sizeof(glm::vec2) * this->particle_count;
+    compute_shader.setInterleaved(p.pos_x.data(), p.pos_y.data(),
+                                  this->particle_count, 0);
+    compute_shader.setInterleaved(p.vel_x.data(), p.vel_y.data(),
+                                  this->particle_count, 1);
+    forces_ssbo_id = compute_shader.allocateBuffer(vec2_size, 2);
+    densities_ssbo_id = compute_shader.allocateBuffer(vec2_size, 3);
+  } else {
+    compute_shader.setVector(p.positions, 0);
+    compute_shader.setVector(p.velocities, 1);
+    forces_ssbo_id = compute_shader.setVector(p.forces, 2);
+    densities_ssbo_id = compute_shader.setVector(p.densities, 3);
+  }
+  compute_shader.setVector(this->spatial_grid->spatial_lookup, 4);
+  compute_shader.setVector(this->spatial_grid->spatial_indicies, 5);
+  compute_shader.bindBuffer(this->neighbour_list_ssbo, 6);
+  compute_shader.bindBuffer(this->neighbour_offsets_ssbo, 7);
+  compute_shader.bindBuffer(this->neighbour_total_ssbo, 8);
+
+  // The compact neighbour list is handed out from a shared counter, next to
+  // a count of the particles that didn't fit.
+  uint32_t neighbour_counters[2] = {0, 0};
+  compute_shader.writeBuffer(this->neighbour_total_ssbo, neighbour_counters,
+                             sizeof(neighbour_counters));
+
+  compute_shader.setFloat(step_dt, "dt");
+  compute_shader.setUnsignedInt(this->particle_count, "particle_count");
+  compute_shader.setUnsignedInt(this->spatial_grid->spatial_lookup.size() - 1,
+                               "bucket_count");
+  compute_shader.setUnsignedInt((uint32_t)this->spatial_grid->key_mode,
+                                "cell_key_mode");
+  compute_shader.setFloat(this->fluid_params.h, "h");
+  compute_shader.setFloat(this->fluid_params.particle_mass, "particle_mass");
+  compute_shader.setFloat(this->fluid_params.target_density,
+                          "target_density");
+  compute_shader.setFloat(this->fluid_params.pressure_multiplier,
+                          "pressure_multiplier");
+  compute_shader.setFloat(this->fluid_params.near_pressure_multiplier,
+                          "near_pressure_multiplier");
+  compute_shader.setFloat(this->fluid_params.viscosity_strength,
+                          "viscosity_strength");
+  compute_shader.setUnsignedInt((uint32_t)this->neighbour_stats.layout,
+                                "neighbour_layout");
+  compute_shader.setUnsignedInt(this->neighbour_stats.capacity(),
+                                "neighbour_capacity");
 
   const uint32_t calc_density_kernel_id = 0;
   const uint32_t apply_fluid_forces_kernel_id = 1;
 
-  // Calculate densities
-  this->compute_shader.setUnsignedInt(calc_density_kernel_id, "kernel_id");
-  this->compute_shader.executeSync(this->particle_count);
+  // Calculate densities, leaving a neighbour list behind for the force pass
+  compute_shader.setUnsignedInt(calc_density_kernel_id, "kernel_id");
+  compute_shader.executeSync(this->particle_count);
 
   // Apply fluid forces
-  this->compute_shader.setUnsignedInt(apply_fluid_forces_kernel_id,
-                                      "kernel_id");
-  this->compute_shader.executeSync(this->particle_count);
+  compute_shader.setUnsignedInt(apply_fluid_forces_kernel_id, "kernel_id");
+  compute_shader.executeSync(this->particle_count);
+
+  compute_shader.readBuffer(this->neighbour_total_ssbo, neighbour_counters,
+                            sizeof(neighbour_counters));
+  if (this->neighbour_stats.record(neighbour_counters[0],
+                                   neighbour_counters[1])) {
+    glDeleteBuffers(1, &this->neighbour_list_ssbo);
+    this->neighbour_list_ssbo = compute_shader.allocateBuffer(
+        sizeof(int32_t) * this->neighbour_stats.capacity(), 6);
+  }
 
   // Extract updated vectors
-  this->compute_shader.extractVector(forces_ssbo_id, this->particles.forces);
-  this->compute_shader.extractVector(densities_ssbo_id,
-                                     this->particles.densities);
+  if (p.layout == ParticleLayout::SoA) {
+    compute_shader.extractInterleaved(forces_ssbo_id, p.force_x.data(),
+                                      p.force_y.data(), this->particle_count);
+    compute_shader.extractInterleaved(densities_ssbo_id, p.density.data(),
+                                      nullptr, this->particle_count);
+  } else {
+    compute_shader.extractVector(forces_ssbo_id, p.forces);
+    compute_shader.extractVector(densities_ssbo_id, p.densities);
+  }
+
+  // Statistics don't need to be in lock step with the simulation, so they
+  // are read back asynchronously instead of stalling on the GPU.
+  this->density_readback->request(densities_ssbo_id,
+                                  sizeof(glm::vec2) * this->particle_count,
+                                  this->step_count);
+  this->step_count++;
+  this->collectDensityStats();
+}
+
+void PhysicSolver::solvePbf() {
+  const glm::vec2 min_pos(this->particle_radius);
+  const glm::vec2 max_pos = this->world_size - this->particle_radius;
+
+  if (this->backend == ComputeBackend::CPU) {
+    this->cpu_compute->solvePbf(this->particles, *this->spatial_grid,
+                                this->fluid_params, this->pbf_params, min_pos,
+                                max_pos, *this->job_system);
+    return;
+  }
+#ifdef USE_OPENCL
+  if (this->backend == ComputeBackend::OpenCL) {
+    this->gpu_compute->solvePbf(this->particles, *this->spatial_grid,
+                                this->fluid_params, this->pbf_params, min_pos,
+                                max_pos);
+    return;
+  }
+#endif
 
-  for (int32_t i = 0; i < this->particle_count; i++) {
-    // std::cout << this->particles.velocities[i].x << " "
-    // << this->particles.velocities[i].y << "\n";
-    std::cout << this->particles.densities[i].x << "\n";
+  ComputeShader &compute_shader = *this->compute_shader;
+  compute_shader.use();
 
-    // std::cout << this->spatial_grid->spatial_lookup[i] << " ";
+  // Same buffers as the SPH path. densities holds (rho, lambda), forces is
+  // scratch, ending up with the XSPH velocities, and the neighbour list is
+  // filled once from the predicted positions.
+  Particles &p = this->particles;
+  const size_t vec2_size = sizeof(glm::vec2) * this->particle_count;
+  uint32_t positions_ssbo_id, velocities_ssbo_id;
+  if (p.layout == ParticleLayout::SoA) {
+    positions_ssbo_id = compute_shader.setInterleaved(
+        p.pos_x.data(), p.pos_y.data(), this->particle_count, 0);
+    velocities_ssbo_id = compute_shader.setInterleaved(
+        p.vel_x.data(), p.vel_y.data(), this->particle_count, 1);
+  } else {
+    positions_ssbo_id = compute_shader.setVector(p.positions, 0);
+    velocities_ssbo_id = compute_shader.setVector(p.velocities, 1);
   }
-  // std::cout << "\n";
+  const uint32_t forces_ssbo_id = compute_shader.allocateBuffer(vec2_size, 2);
+  const uint32_t densities_ssbo_id =
+      compute_shader.allocateBuffer(vec2_size, 3);
+  const uint32_t lookup_ssbo_id =
+      compute_shader.setVector(this->spatial_grid->spatial_lookup, 4);
+  const uint32_t indicies_ssbo_id =
+      compute_shader.setVector(this->spatial_grid->spatial_indicies, 5);
+  compute_shader.bindBuffer(this->neighbour_list_ssbo, 6);
+  compute_shader.bindBuffer(this->neighbour_offsets_ssbo, 7);
+
+  compute_shader.setFloat(this->step_dt, "dt");
+  compute_shader.setUnsignedInt(this->particle_count, "particle_count");
+  compute_shader.setUnsignedInt(this->spatial_grid->spatial_lookup.size() - 1,
+                                "bucket_count");
+  compute_shader.setUnsignedInt((uint32_t)this->spatial_grid->key_mode,
+                                "cell_key_mode");
+  compute_shader.setFloat(this->fluid_params.h, "h");
+  compute_shader.setFloat(this->fluid_params.particle_mass, "particle_mass");
+  compute_shader.setFloat(this->pbf_params.rest_density, "rest_density");
+  compute_shader.setFloat(this->pbf_params.relaxation, "pbf_relaxation");
+  compute_shader.setFloat(this->pbf_params.s_corr_k, "s_corr_k");
+  compute_shader.setFloat(this->pbf_params.s_corr_scale, "s_corr_scale");
+  compute_shader.setFloat(this->pbf_params.xsph_viscosity, "xsph_viscosity");
+  compute_shader.setFloat(this->fluid_params.h *
+                              (1.f + this->pbf_params.neighbour_skin),
+                          "pbf_list_radius");
+  compute_shader.setVec2(min_pos, "min_pos");
+  compute_shader.setVec2(max_pos, "max_pos");
+
+  const uint32_t pbf_neighbours_kernel_id = 8;
+  const uint32_t pbf_lambda_kernel_id = 2;
+  const uint32_t pbf_delta_kernel_id = 3;
+  const uint32_t pbf_apply_kernel_id = 4;
+  const uint32_t pbf_xsph_kernel_id = 5;
+
+  compute_shader.setUnsignedInt(pbf_neighbours_kernel_id, "kernel_id");
+  compute_shader.executeSync(this->particle_count);
+  for (uint32_t i = 0; i < this->pbf_params.iterations; i++) {
+    compute_shader.setUnsignedInt(pbf_lambda_kernel_id, "kernel_id");
+    compute_shader.executeSync(this->particle_count);
+    compute_shader.setUnsignedInt(pbf_delta_kernel_id, "kernel_id");
+    compute_shader.executeSync(this->particle_count);
+    compute_shader.setUnsignedInt(pbf_apply_kernel_id, "kernel_id");
+    compute_shader.executeSync(this->particle_count);
+  }
+  compute_shader.setUnsignedInt(pbf_xsph_kernel_id, "kernel_id");
+  compute_shader.executeSync(this->particle_count);
+
+  if (p.layout == ParticleLayout::SoA) {
+    compute_shader.extractInterleaved(positions_ssbo_id, p.pos_x.data(),
+                                      p.pos_y.data(), this->particle_count);
+    compute_shader.extractInterleaved(forces_ssbo_id, p.vel_x.data(),
+                                      p.vel_y.data(), this->particle_count);
+    compute_shader.extractInterleaved(densities_ssbo_id, p.density.data(),
+                                      nullptr, this->particle_count);
+  } else {
+    compute_shader.extractVector(positions_ssbo_id, p.positions);
+    compute_shader.extractVector(forces_ssbo_id, p.velocities);
+    compute_shader.extractVector(densities_ssbo_id, p.densities);
+  }
+  const uint32_t ssbos[] = {positions_ssbo_id, velocities_ssbo_id,
+                            forces_ssbo_id, densities_ssbo_id, lookup_ssbo_id,
+                            indicies_ssbo_id};
+  glDeleteBuffers(6, ssbos);
 }
 
-void PhysicSolver::constrainParticlesToScreen(const float step_dt) {
+void PhysicSolver::solveGranular() {
+  if (this->backend == ComputeBackend::CPU) {
+    this->cpu_compute->solveGranular(this->particles, *this->spatial_grid,
+                                     this->granular_params,
+                                     *this->job_system);
+    return;
+  }
+#ifdef USE_OPENCL
+  if (this->backend == ComputeBackend::OpenCL) {
+    const glm::vec2 min_pos(this->particle_radius);
+    const glm::vec2 max_pos = this->world_size - this->particle_radius;
+    this->gpu_compute->solveGranular(this->particles, *this->spatial_grid,
+                                     this->granular_params, min_pos,
+                                     max_pos);
+    return;
+  }
+#endif
+
+  ComputeShader &compute_shader = *this->compute_shader;
+  compute_shader.use();
 
-  const float damp = 0.5f;
+  // The same colouring the CPU projects by, one dispatch per colour.
+  this->granular_cells.update(*this->spatial_grid, *this->job_system);
+  Particles &p = this->particles;
+  uint32_t positions_ssbo_id, velocities_ssbo_id;
+  if (p.layout == ParticleLayout::SoA) {
+    positions_ssbo_id = compute_shader.setInterleaved(
+        p.pos_x.data(), p.pos_y.data(), this->particle_count, 0);
+    velocities_ssbo_id = compute_shader.setInterleaved(
+        p.vel_x.data(), p.vel_y.data(), this->particle_count, 1);
+  } else {
+    positions_ssbo_id = compute_shader.setVector(p.positions, 0);
+    velocities_ssbo_id = compute_shader.setVector(p.velocities, 1);
+  }
+  const uint32_t indicies_ssbo_id =
+      compute_shader.setVector(this->spatial_grid->spatial_indicies, 5);
+  const uint32_t radii_ssbo_id = compute_shader.setVector(p.radii, 10);
+  const uint32_t ranges_ssbo_id =
+      compute_shader.setVector(this->granular_cells.ranges, 11);
+
+  compute_shader.setFloat(this->step_dt, "dt");
+  compute_shader.setFloat(this->granular_params.stiffness,
+                          "granular_stiffness");
 
-  // Right/left
-  for (int32_t i = 0; i < this->particle_count; i++) {
-    if (this->particles.positions[i].x + this->particle_radius >
-        this->world_size.x) {
-      this->particles.positions[i].x =
-          this->world_size.x - this->particle_radius;
-      this->particles.velocities[i].x *= -1 * damp;
-    } else if (this->particles.positions[i].x - this->particle_radius < 0.0f) {
-      this->particles.positions[i].x = this->particle_radius;
-      this->particles.velocities[i].x *= -1 * damp;
+  const uint32_t granular_project_kernel_id = 7;
+  compute_shader.setUnsignedInt(granular_project_kernel_id, "kernel_id");
+  const uint32_t *starts = this->granular_cells.colour_starts;
+  for (uint32_t i = 0; i < this->granular_params.iterations; i++) {
+    for (uint32_t colour = 0; colour < granular_colours; colour++) {
+      const uint32_t cell_count = starts[colour + 1] - starts[colour];
+      if (cell_count == 0) {
+        continue;
+      }
+      compute_shader.setUnsignedInt(starts[colour], "granular_cell_first");
+      compute_shader.setUnsignedInt(cell_count, "granular_cell_count");
+      compute_shader.executeSync(cell_count);
     }
+  }
+
+  if (p.layout == ParticleLayout::SoA) {
+    compute_shader.extractInterleaved(positions_ssbo_id, p.pos_x.data(),
+                                      p.pos_y.data(), this->particle_count);
+    compute_shader.extractInterleaved(velocities_ssbo_id, p.vel_x.data(),
+                                      p.vel_y.data(), this->particle_count);
+  } else {
+    compute_shader.extractVector(positions_ssbo_id, p.positions);
+    compute_shader.extractVector(velocities_ssbo_id, p.velocities);
+  }
+  const uint32_t ssbos[] = {positions_ssbo_id, velocities_ssbo_id,
+                            indicies_ssbo_id, radii_ssbo_id, ranges_ssbo_id};
+  glDeleteBuffers(5, ssbos);
+}
+
+void PhysicSolver::collectDensityStats() {
+  uint64_t step;
+  if (!this->density_readback->pollVector(this->density_stats, &step) ||
+      this->density_stats.empty()) {
+    return;
+  }
+
+  float total = 0.f;
+  for (const glm::vec2 &density : this->density_stats) {
+    total += density.x;
+  }
+  this->average_density = total / this->density_stats.size();
+  this->average_density_step = step;
+  if (this->print_density_stats) {
+    std::cout << "Step " << step
+              << " average density: " << this->average_density << "\n";
+  }
+}
+
+void PhysicSolver::addObstacle(const std::vector<glm::vec2> &polygon) {
+  this->boundary.addPolygon(polygon);
+  this->boundary_dirty = true;
+  this->buildBoundaryParticles();
+}
 
-    // Top/bottom
-    if (this->particles.positions[i].y + this->particle_radius >
-        this->world_size.y) {
-      this->particles.positions[i].y =
-          this->world_size.y - this->particle_radius;
-      this->particles.velocities[i].y *= -1 * damp;
-    } else if (this->particles.positions[i].y - this->particle_radius < 0.0f) {
-      this->particles.positions[i].y = this->particle_radius;
-      this->particles.velocities[i].y *= -1 * damp;
+void PhysicSolver::addObstacleImage(const std::vector<uint8_t> &solid,
+                                    const uint32_t image_width,
+                                    const uint32_t image_height,
+                                    const glm::vec2 min, const glm::vec2 max) {
+  this->boundary.addImage(solid, image_width, image_height, min, max);
+  this->boundary_dirty = true;
+  this->buildBoundaryParticles();
+}
+
+uint32_t PhysicSolver::addRigidBody(const std::vector<glm::vec2> &polygon,
+                                    const float density) {
+  if (this->cpu_compute == nullptr ||
+      this->cpu_compute->boundary_particles == nullptr) {
+    throw std::invalid_argument("Rigid bodies need the CPU backend, "
+                                "SolverMode::SPH and boundary particles");
+  }
+  RigidBody body(polygon, density, 2 * this->particle_radius,
+                 this->smoothing_radius);
+  body.first_sample = this->boundary_particles.addMoving(
+      body.worldSamples(), this->pbf_params.rest_density);
+  this->rigid_bodies.push_back(body);
+  return this->rigid_bodies.size() - 1;
+}
+
+void PhysicSolver::buildBoundaryParticles() {
+  if (this->cpu_compute == nullptr ||
+      this->cpu_compute->boundary_particles == nullptr) {
+    return;
+  }
+  // Sampled at the spacing the rest density is worked out for, so psi
+  // comes out close to a particle's mass on a flat wall.
+  this->boundary_particles.build(this->boundary, this->world_size,
+                                 2 * this->particle_radius,
+                                 this->pbf_params.rest_density);
+  for (RigidBody &body : this->rigid_bodies) {
+    body.first_sample = this->boundary_particles.addMoving(
+        body.worldSamples(), this->pbf_params.rest_density);
+  }
+  std::cout << this->boundary_particles.count() << " boundary particles\n";
+}
+
+CpuSdfArgs PhysicSolver::boundaryArgs() {
+  Particles &p = this->particles;
+  CpuSdfArgs args;
+  args.pos_x = p.pos_x.data();
+  args.pos_y = p.pos_y.data();
+  args.vel_x = p.vel_x.data();
+  args.vel_y = p.vel_y.data();
+  args.distances = this->boundary.distances.data();
+  args.origin_x = this->boundary.origin.x;
+  args.origin_y = this->boundary.origin.y;
+  args.inv_cell_size = 1.f / this->boundary.cell_size;
+  args.width = this->boundary.width;
+  args.height = this->boundary.height;
+  args.radius = this->particle_radius;
+  args.damp = this->boundary_damp;
+  return args;
+}
+
+void PhysicSolver::constrainParticles() {
+  if (this->backend == ComputeBackend::OpenGL) {
+    this->constrainParticlesGpu();
+    return;
+  }
+
+  Particles &p = this->particles;
+  if (p.layout == ParticleLayout::SoA) {
+    const CpuSdfArgs args = this->boundaryArgs();
+    auto constrain_range = [&](const uint32_t begin, const uint32_t end) {
+      this->boundary_kernels.constrainToSdf(args, begin, end);
+    };
+    this->job_system->parallelFor(0, this->particle_count, 4096,
+                                  constrain_range);
+    return;
+  }
+
+  auto constrain_range = [&](const uint32_t begin, const uint32_t end) {
+    for (uint32_t i = begin; i < end; i++) {
+      glm::vec2 gradient;
+      const float distance = this->boundary.sample(p.positions[i], gradient);
+      if (distance >= this->particle_radius || gradient == glm::vec2(0.f)) {
+        continue;
+      }
+      const glm::vec2 normal = glm::normalize(gradient);
+      p.positions[i] += (this->particle_radius - distance) * normal;
+      const float into = glm::dot(p.velocities[i], normal);
+      if (into < 0.f) {
+        p.velocities[i] -= (1.f + this->boundary_damp) * into * normal;
+      }
     }
+  };
+  this->job_system->parallelFor(0, this->particle_count, 4096,
+                                constrain_range);
+}
+
+void PhysicSolver::constrainParticlesGpu() {
+  ComputeShader &compute_shader = *this->compute_shader;
+  compute_shader.use();
+
+  // The field only changes when an obstacle is added.
+  if (this->boundary_dirty) {
+    const size_t size = sizeof(float) * this->boundary.distances.size();
+    glDeleteBuffers(1, &this->boundary_ssbo);
+    this->boundary_ssbo = compute_shader.allocateBuffer(size, 9);
+    compute_shader.writeBuffer(this->boundary_ssbo,
+                               this->boundary.distances.data(), size);
+    this->boundary_dirty = false;
+  }
+
+  Particles &p = this->particles;
+  uint32_t positions_ssbo_id, velocities_ssbo_id;
+  if (p.layout == ParticleLayout::SoA) {
+    positions_ssbo_id = compute_shader.setInterleaved(
+        p.pos_x.data(), p.pos_y.data(), this->particle_count, 0);
+    velocities_ssbo_id = compute_shader.setInterleaved(
+        p.vel_x.data(), p.vel_y.data(), this->particle_count, 1);
+  } else {
+    positions_ssbo_id = compute_shader.setVector(p.positions, 0);
+    velocities_ssbo_id = compute_shader.setVector(p.velocities, 1);
+  }
+  compute_shader.bindBuffer(this->boundary_ssbo, 9);
+
+  compute_shader.setUnsignedInt(this->particle_count, "particle_count");
+  compute_shader.setFloat(this->particle_radius, "particle_radius");
+  compute_shader.setFloat(this->boundary_damp, "boundary_damp");
+  compute_shader.setVec2(this->boundary.origin, "sdf_origin");
+  compute_shader.setFloat(1.f / this->boundary.cell_size,
+                          "sdf_inv_cell_size");
+  compute_shader.setUnsignedInt(this->boundary.width, "sdf_width");
+  compute_shader.setUnsignedInt(this->boundary.height, "sdf_height");
+
+  const uint32_t constrain_to_sdf_kernel_id = 6;
+  compute_shader.setUnsignedInt(constrain_to_sdf_kernel_id, "kernel_id");
+  compute_shader.executeSync(this->particle_count);
+
+  if (p.layout == ParticleLayout::SoA) {
+    compute_shader.extractInterleaved(positions_ssbo_id, p.pos_x.data(),
+                                      p.pos_y.data(), this->particle_count);
+    compute_shader.extractInterleaved(velocities_ssbo_id, p.vel_x.data(),
+                                      p.vel_y.data(), this->particle_count);
+  } else {
+    compute_shader.extractVector(positions_ssbo_id, p.positions);
+    compute_shader.extractVector(velocities_ssbo_id, p.velocities);
   }
+  const uint32_t ssbos[] = {positions_ssbo_id, velocities_ssbo_id};
+  glDeleteBuffers(2, ssbos);
 }
@@ -1,14 +1,61 @@
 #pragma once
 
 #include <cstdint>
+#include <cstdlib>
+#include <cstring>
 
 #include <glm/glm.hpp>
 
-// #include "gpu_compute.hpp"
+#include "boundary_particles.hpp"
+#include "cpu_compute.hpp"
+#include "fluid_params.hpp"
+#include "granular_cells.hpp"
+#include "job_system.hpp"
+#include "neighbour_list.hpp"
 #include "particles.hpp"
+#include "rigid_body.hpp"
+#include "sdf.hpp"
 #include "spatial_grid.hpp"
+#include "triple_buffer.hpp"
+#include "../renderer/async_readback.hpp"
 #include "../renderer/compute_shader.hpp"
 
+#ifdef USE_OPENCL
+#include "gpu_compute.hpp"
+#endif
+
+// Where density and force evaluation runs. The OpenCL backend is only
+// available when built with USE_OPENCL, and the CPU backend needs
+// ParticleLayout::SoA.
+enum class ComputeBackend { OpenGL, OpenCL, CPU };
+
+// Snapshot of what the renderer needs, published once per update().
+struct RenderFrame {
+  std::vector<glm::vec2> positions;
+  std::vector<float> radii;
+  std::vector<glm::vec3> colours;
+};
+
+// Adds rows of particles across a nozzle 'width' wide, centred on 'position'
+// and facing along 'velocity'. A new row goes out each time the last one has
+// travelled 'spacing', so the stream leaves at the spacing it was laid out
+// with whatever the speed.
+struct ParticleEmitter {
+  glm::vec2 position;
+  glm::vec2 velocity;
+  float width = 40.f;
+  float spacing = 10.f;
+  glm::vec3 colour = glm::vec3(218.f, 137.f, 35.f) / 255.f;
+  // Distance the last row has travelled since it was added.
+  float travelled = 0.f;
+};
+
+// Removes every particle that enters the box [min, max].
+struct ParticleSink {
+  glm::vec2 min;
+  glm::vec2 max;
+};
+
 struct PhysicSolver {
   Particles particles;
   glm::vec2 world_size;
@@ -17,22 +64,179 @@ struct PhysicSolver {
   float particle_radius;
   float particle_mass;
   float smoothing_radius;
+  FluidParams fluid_params;
+  // Walls and obstacles. Starts as the world box. Cells are one particle
+  // radius, so the bilinear lookup can't round the box's corners into the
+  // space a particle is allowed to sit in.
+  SdfGrid boundary;
+  // Fraction of the velocity into a wall that bounces back out.
+  float boundary_damp = 0.5f;
+  // SIMD variant of the boundary pass on the CPU, whatever the backend.
+  const CpuKernelTable &boundary_kernels;
+  // GL copy of boundary.distances, re-uploaded after obstacles change.
+  uint32_t boundary_ssbo = 0;
+  bool boundary_dirty = true;
+  // Samples of the boundary for the CPU SPH passes, rebuilt with it. Empty
+  // on the other backends and solvers, which only have the SDF pass.
+  BoundaryParticles boundary_particles;
+  // Two-way coupled with the fluid through their samples in
+  // boundary_particles. CPU SPH only.
+  std::vector<RigidBody> rigid_bodies;
+  SolverMode mode;
+  PbfParams pbf_params;
+  IisphParams iisph_params;
+  GranularParams granular_params;
+  ComputeBackend backend;
   SpatialGrid *spatial_grid;
-  ComputeShader compute_shader;
+  // Only created for the backend in use, so the OpenCL backend runs without a
+  // GL context.
+  ComputeShader *compute_shader = nullptr;
+  AsyncReadback *density_readback = nullptr;
+  // Neighbour list the GL density pass leaves for the force pass.
+  NeighbourListStats neighbour_stats;
+  uint32_t neighbour_list_ssbo = 0;
+  uint32_t neighbour_offsets_ssbo = 0;
+  uint32_t neighbour_total_ssbo = 0;
+  // The GL granular solver's cells, which the CPU one keeps in cpu_compute.
+  GranularCells granular_cells;
+#ifdef USE_OPENCL
+  GpuCompute *gpu_compute = nullptr;
+#endif
+  CpuCompute *cpu_compute = nullptr;
+  std::vector<glm::vec2> density_stats;
+
+  // Run at the start of every substep, before anything else touches the
+  // particles.
+  std::vector<ParticleEmitter> emitters;
+  std::vector<ParticleSink> sinks;
+  // Scratch list of particles to remove this substep.
+  std::vector<uint32_t> drained;
+  uint64_t emitted_count = 0;
+  uint64_t drained_count = 0;
+  uint64_t step_count = 0;
+
+  // Each substep runs as a dependency graph on the job system, so work that
+  // doesn't depend on each other (e.g. statistics and integration) overlaps.
+  JobSystem *job_system;
+  TaskGraph step_graph;
+  float step_dt;
+  static constexpr uint32_t max_stat_chunks = 64;
+  float density_partials[max_stat_chunks];
+  // (force x, force y, torque) per chunk of a body's samples.
+  glm::vec3 body_partials[max_stat_chunks];
+  // Reduced every step, except on the GL SPH path, where it is the latest
+  // async readback (see collectDensityStats).
+  float average_density = 0.f;
+  // Step the GL backend's average_density is from, a frame or two behind.
+  uint64_t average_density_step = 0;
+  // SPH_DENSITY_STATS=1 prints each GL density readback as it lands.
+  bool print_density_stats = false;
+
+  // Completed frames for the renderer, which may be on another thread.
+  TripleBuffer<RenderFrame> frames;
 
   PhysicSolver(glm::vec2 _screen_size, const uint32_t _particle_count,
                const float _particle_radius, const float _particle_mass,
-               const uint8_t _sub_steps, const float _smoothing_radius);
+               const uint8_t _sub_steps, const float _smoothing_radius,
+               const ComputeBackend _backend = ComputeBackend::OpenGL,
+               const ParticleLayout _layout = ParticleLayout::AoS,
+               const SolverMode _mode = SolverMode::SPH);
 
   ~PhysicSolver();
 
   void update(const float dt);
 
+  void buildStepGraph();
+
+  // Add solid obstacles to the boundary. Both visit every sample of the
+  // field, and rebuild the boundary particles, so they are meant for setup
+  // rather than every step.
+  void addObstacle(const std::vector<glm::vec2> &polygon);
+  void addObstacleImage(const std::vector<uint8_t> &solid,
+                        const uint32_t image_width,
+                        const uint32_t image_height, const glm::vec2 min,
+                        const glm::vec2 max);
+
+  // Adds a body of 'density' (mass per unit area, in the units of the
+  // fluid's density) over the polygon, and returns its index. Needs the CPU
+  // backend, SolverMode::SPH and boundary particles.
+  uint32_t addRigidBody(const std::vector<glm::vec2> &polygon,
+                        const float density);
+
+  void addEmitter(const ParticleEmitter &emitter);
+  void addSink(const ParticleSink &sink);
+
+  // Grows every backend's per-particle storage to the particles' capacity.
+  void reserveBackend();
+
+  // Particles in a sink are found through the grid, so the cost follows the
+  // particles near the sinks and the particles emitted, not the whole fluid.
+  void drainSinks();
+  void runEmitters();
+
+  // Density of a particle inside a square lattice with the given spacing.
+  float latticeDensity(const float spacing);
+
+  // Step graph nodes.
+  void stepEmitAndDrain();
+  void stepUpdateGrid();
+  void stepFluidForces();
+  void stepIntegrate();
+  void stepConstrain();
+  void stepPublishPositions();
+  void stepDensityStats();
+  void stepPredictPositions();
+  void stepSolvePbf();
+  void stepSolveIisph();
+  void stepSolveGranular();
+  void stepRigidBodies();
+
+  void publishFrame();
+
   void applyGravity(float step_dt);
 
-  void calcDensities(const float step_dt);
+  void calcDensities();
 
   void calcDensitiesAndApplyPressureForce(const float step_dt);
 
-  void constrainParticlesToScreen(const float step_dt);
+  // Picks up the latest density readback on the GL backend, if one has
+  // landed, into average_density.
+  void collectDensityStats();
+
+  void integrate(const float step_dt);
+
+  void solvePbf();
+
+  // Projects overlapping discs apart on the predicted positions:
+  // cell-coloured Gauss-Seidel on the CPU, Jacobi on the GPU backends.
+  void solveGranular();
+
+  // Keeps every particle particle_radius clear of the boundary, in one
+  // pass of SDF lookups: the SIMD kernel on the CPU, or kernel 6 of the
+  // compute shader on the GL backend.
+  void constrainParticles();
+
+  void constrainParticlesGpu();
+
+  CpuSdfArgs boundaryArgs();
+
+  // Resamples boundary_particles from the boundary, if the CPU SPH passes
+  // use them.
+  void buildBoundaryParticles();
 };
+
+// Off unless SPH_DENSITY_STATS=1.
+inline bool densityStatsFromEnv() {
+  const char *requested = std::getenv("SPH_DENSITY_STATS");
+  return requested != nullptr && std::strcmp(requested, "1") == 0;
+}
+
+// None of the OpenCL kernels, SPH included, have been run against the CPU
+// reference on any device, and the granular one is still Jacobi where the
+// CPU and GL solvers are Gauss-Seidel, so the OpenCL backend is off unless
+// SPH_UNCHECKED_CL=1. 'headless <steps> clcheck [pbf|granular]' checks them
+// on a machine with an OpenCL device, e.g. pocl.
+inline bool uncheckedClKernelsFromEnv() {
+  const char *requested = std::getenv("SPH_UNCHECKED_CL");
+  return requested != nullptr && std::strcmp(requested, "1") == 0;
+}
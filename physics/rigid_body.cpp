@@ -0,0 +1,161 @@
+#include "rigid_body.hpp"
+
+#include <algorithm>
+#include <cmath>
+#include <stdexcept>
+
+// Distance from 'p' to the polygon's nearest edge, and whether it's inside.
+static float edgeDistance(const std::vector<glm::vec2> &vertices,
+                          const glm::vec2 p, bool &inside) {
+  float nearest2 = INFINITY;
+  inside = false;
+  for (size_t i = 0, j = vertices.size() - 1; i < vertices.size(); j = i++) {
+    const glm::vec2 e = vertices[j] - vertices[i];
+    const glm::vec2 w = p - vertices[i];
+    const float t = glm::clamp(glm::dot(w, e) / glm::dot(e, e), 0.f, 1.f);
+    const glm::vec2 b = w - e * t;
+    nearest2 = std::min(nearest2, glm::dot(b, b));
+
+    if ((vertices[i].y > p.y) != (vertices[j].y > p.y) &&
+        p.x < vertices[i].x + e.x * (p.y - vertices[i].y) / e.y) {
+      inside = !inside;
+    }
+  }
+  return std::sqrt(nearest2);
+}
+
+RigidBody::RigidBody(const std::vector<glm::vec2> &polygon,
+                     const float density, const float spacing,
+                     const float h) {
+  if (polygon.size() < 3) {
+    throw std::invalid_argument("RigidBody needs 3+ vertices");
+  }
+
+  // Area and centroid, summed over the triangles each edge makes with the
+  // origin. Signed by the winding, which cancels out.
+  float area = 0.f;
+  glm::vec2 centroid(0.f);
+  for (size_t i = 0, j = polygon.size() - 1; i < polygon.size(); j = i++) {
+    const glm::vec2 a = polygon[j], b = polygon[i];
+    const float cross = a.x * b.y - b.x * a.y;
+    area += 0.5f * cross;
+    centroid += cross * (a + b);
+  }
+  if (std::fabs(area) < 1e-6f) {
+    throw std::invalid_argument("RigidBody polygon has no area");
+  }
+  centroid /= 6.f * area;
+  this->position = centroid;
+  this->mass = density * std::fabs(area);
+
+  // Second moment the same way, about the centroid rather than the origin,
+  // which in floats would cancel most of its digits away.
+  float moment = 0.f;
+  for (size_t i = 0, j = polygon.size() - 1; i < polygon.size(); j = i++) {
+    const glm::vec2 a = polygon[j] - centroid, b = polygon[i] - centroid;
+    const float cross = a.x * b.y - b.x * a.y;
+    moment += cross * (glm::dot(a, a) + glm::dot(a, b) + glm::dot(b, b));
+  }
+  this->inertia = density * std::fabs(moment) / 12.f;
+
+  for (const glm::vec2 &vertex : polygon) {
+    this->local_vertices.push_back(vertex - centroid);
+  }
+
+  // The surface itself, so the fluid can't slip between lattice points...
+  for (size_t i = 0, j = polygon.size() - 1; i < polygon.size(); j = i++) {
+    const glm::vec2 edge = polygon[i] - polygon[j];
+    const uint32_t steps =
+        std::max<uint32_t>(std::ceil(glm::length(edge) / spacing), 1);
+    for (uint32_t step = 0; step < steps; step++) {
+      const glm::vec2 sample = polygon[j] + edge * ((float)step / steps);
+      this->local_samples.push_back(sample - centroid);
+    }
+  }
+
+  // ...then the lattice inside, from half a spacing to h deep.
+  glm::vec2 min = polygon[0], max = polygon[0];
+  for (const glm::vec2 &vertex : polygon) {
+    min = glm::min(min, vertex);
+    max = glm::max(max, vertex);
+  }
+  for (float y = min.y + 0.5f * spacing; y < max.y; y += spacing) {
+    for (float x = min.x + 0.5f * spacing; x < max.x; x += spacing) {
+      bool inside;
+      const float depth = edgeDistance(polygon, glm::vec2(x, y), inside);
+      if (inside && depth >= 0.5f * spacing && depth < h) {
+        this->local_samples.push_back(glm::vec2(x, y) - centroid);
+      }
+    }
+  }
+}
+
+glm::vec2 RigidBody::toWorld(const glm::vec2 local) const {
+  const float c = std::cos(this->angle), s = std::sin(this->angle);
+  return this->position +
+         glm::vec2(c * local.x - s * local.y, s * local.x + c * local.y);
+}
+
+std::vector<glm::vec2> RigidBody::worldSamples() const {
+  std::vector<glm::vec2> samples;
+  for (const glm::vec2 &local : this->local_samples) {
+    samples.push_back(this->toWorld(local));
+  }
+  return samples;
+}
+
+void RigidBody::integrate(const glm::vec2 gravity, const float dt) {
+  this->velocity += (this->force / this->mass + gravity) * dt;
+  this->angular_velocity += this->torque / this->inertia * dt;
+  this->position += this->velocity * dt;
+  this->angle += this->angular_velocity * dt;
+}
+
+void RigidBody::collide(const SdfGrid &sdf, const float radius,
+                        const float restitution) {
+  // Contacts are merged into one, at their mean point along their mean
+  // normal. Resolved one by one, whichever end of a flat face came first
+  // would take the whole impulse and set the body spinning. Only the
+  // deepest contact moves the body, so contacts along a face don't add up
+  // to several times the overlap.
+  float deepest = 0.f;
+  glm::vec2 push(0.f), arm_sum(0.f), normal_sum(0.f);
+  uint32_t contacts = 0;
+  for (const glm::vec2 &local : this->local_samples) {
+    const glm::vec2 world = this->toWorld(local);
+    glm::vec2 gradient;
+    const float distance = sdf.sample(world, gradient);
+    const float length = glm::length(gradient);
+    if (distance >= radius || length == 0.f) {
+      continue;
+    }
+    const glm::vec2 normal = gradient / length;
+    if (radius - distance > deepest) {
+      deepest = radius - distance;
+      push = deepest * normal;
+    }
+    arm_sum += world - this->position;
+    normal_sum += normal;
+    contacts++;
+  }
+  if (contacts == 0 || glm::dot(normal_sum, normal_sum) == 0.f) {
+    return;
+  }
+  this->position += push;
+
+  // Impulse on the contact point's velocity into the surface.
+  const glm::vec2 arm = arm_sum / (float)contacts;
+  const glm::vec2 normal = glm::normalize(normal_sum);
+  const glm::vec2 contact_velocity =
+      this->velocity + this->angular_velocity * glm::vec2(-arm.y, arm.x);
+  const float into = glm::dot(contact_velocity, normal);
+  if (into >= 0.f) {
+    return;
+  }
+  const float arm_cross_normal = arm.x * normal.y - arm.y * normal.x;
+  const float impulse =
+      -(1.f + restitution) * into /
+      (1.f / this->mass + arm_cross_normal * arm_cross_normal / this->inertia);
+  this->velocity += impulse / this->mass * normal;
+  this->angular_velocity += impulse * arm_cross_normal / this->inertia;
+}
@@ -0,0 +1,49 @@
+#pragma once
+#include <cstdint>
+#include <vector>
+
+#include <glm/glm.hpp>
+
+#include "sdf.hpp"
+
+// A solid polygon moving through the fluid under gravity and the fluid's
+// pressure. The fluid only sees it as boundary samples (BoundaryParticles)
+// over the band within h inside its surface, moved with the body every step,
+// and the fluid's reaction is summed over just those samples. A body costs
+// its surface, never a scan of the fluid.
+struct RigidBody {
+  // Centre of mass, and rotation about it.
+  glm::vec2 position;
+  float angle = 0.f;
+  glm::vec2 velocity = glm::vec2(0.f);
+  float angular_velocity = 0.f;
+  float mass, inertia;
+  // Relative to the centre of mass at angle 0.
+  std::vector<glm::vec2> local_vertices;
+  std::vector<glm::vec2> local_samples;
+  // Index of the body's first sample in BoundaryParticles.
+  uint32_t first_sample = 0;
+  // Fluid force and torque over the last step.
+  glm::vec2 force = glm::vec2(0.f);
+  float torque = 0.f;
+
+  // 'density' is mass per unit area, in the units of the fluid's density.
+  // Samples sit every 'spacing' along the edges, and on a 'spacing' lattice
+  // inside them down to 'h' deep. Vertices in either winding; the last joins
+  // back to the first.
+  RigidBody(const std::vector<glm::vec2> &polygon, const float density,
+            const float spacing, const float h);
+
+  // Body space to world space.
+  glm::vec2 toWorld(const glm::vec2 local) const;
+  std::vector<glm::vec2> worldSamples() const;
+
+  // Semi-implicit Euler under force, torque and the acceleration 'gravity'.
+  void integrate(const glm::vec2 gravity, const float dt);
+
+  // Pushes the body out of the solid parts of 'sdf' wherever a sample is
+  // closer than 'radius', and bounces the velocity of the contact back out,
+  // keeping 'restitution' of it.
+  void collide(const SdfGrid &sdf, const float radius,
+               const float restitution);
+};
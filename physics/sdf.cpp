@@ -0,0 +1,181 @@
+#include "sdf.hpp"
+
+#include <algorithm>
+#include <cmath>
+#include <stdexcept>
+
+SdfGrid::SdfGrid(const glm::vec2 world_size, const float _cell_size)
+    : origin(-_cell_size), cell_size(_cell_size) {
+  if (this->cell_size <= 0.f) {
+    throw std::invalid_argument("SdfGrid needs a positive cell size");
+  }
+  this->width = (uint32_t)std::ceil(world_size.x / this->cell_size) + 3;
+  this->height = (uint32_t)std::ceil(world_size.y / this->cell_size) + 3;
+  this->distances.resize(this->width * this->height);
+
+  // Exact distance to the inside of the world box.
+  const glm::vec2 centre = 0.5f * world_size;
+  for (uint32_t y = 0; y < this->height; y++) {
+    for (uint32_t x = 0; x < this->width; x++) {
+      const glm::vec2 q =
+          glm::abs(this->samplePosition(x, y) - centre) - centre;
+      const float outside = glm::length(glm::max(q, glm::vec2(0.f))) +
+                            std::min(std::max(q.x, q.y), 0.f);
+      this->distances[y * this->width + x] = -outside;
+    }
+  }
+}
+
+glm::vec2 SdfGrid::samplePosition(const uint32_t x, const uint32_t y) const {
+  return this->origin + this->cell_size * glm::vec2(x, y);
+}
+
+void SdfGrid::addPolygon(const std::vector<glm::vec2> &vertices) {
+  if (vertices.size() < 3) {
+    throw std::invalid_argument("SdfGrid::addPolygon needs 3+ vertices");
+  }
+
+  for (uint32_t y = 0; y < this->height; y++) {
+    for (uint32_t x = 0; x < this->width; x++) {
+      const glm::vec2 p = this->samplePosition(x, y);
+
+      // Nearest edge for the distance, crossings of a ray along +x for the
+      // sign.
+      float nearest2 = INFINITY;
+      bool inside = false;
+      for (size_t i = 0, j = vertices.size() - 1; i < vertices.size();
+           j = i++) {
+        const glm::vec2 e = vertices[j] - vertices[i];
+        const glm::vec2 w = p - vertices[i];
+        const float t =
+            glm::clamp(glm::dot(w, e) / glm::dot(e, e), 0.f, 1.f);
+        const glm::vec2 b = w - e * t;
+        nearest2 = std::min(nearest2, glm::dot(b, b));
+
+        if ((vertices[i].y > p.y) != (vertices[j].y > p.y) &&
+            p.x < vertices[i].x + e.x * (p.y - vertices[i].y) / e.y) {
+          inside = !inside;
+        }
+      }
+
+      const float distance = std::sqrt(nearest2);
+      float &sample = this->distances[y * this->width + x];
+      sample = std::min(sample, inside ? -distance : distance);
+    }
+  }
+}
+
+// Distance in cells from every sample to the nearest seed, by propagating
+// nearest-seed offsets in two raster passes (8SSEDT). Exact to within a
+// fraction of a cell, which is all the bilinear lookup can resolve anyway.
+static std::vector<float> distanceToSeeds(const std::vector<uint8_t> &seeds,
+                                          const uint32_t width,
+                                          const uint32_t height) {
+  const int32_t far = 1 << 14;
+  std::vector<glm::ivec2> offsets(seeds.size());
+  for (size_t i = 0; i < seeds.size(); i++) {
+    offsets[i] = seeds[i] ? glm::ivec2(0) : glm::ivec2(far);
+  }
+
+  auto length2 = [](const glm::ivec2 o) {
+    return (int64_t)o.x * o.x + (int64_t)o.y * o.y;
+  };
+  auto compare = [&](const int32_t x, const int32_t y, const int32_t dx,
+                     const int32_t dy) {
+    if (x + dx < 0 || x + dx >= (int32_t)width || y + dy < 0 ||
+        y + dy >= (int32_t)height) {
+      return;
+    }
+    glm::ivec2 &offset = offsets[y * width + x];
+    const glm::ivec2 candidate =
+        offsets[(y + dy) * width + x + dx] + glm::ivec2(dx, dy);
+    if (length2(candidate) < length2(offset)) {
+      offset = candidate;
+    }
+  };
+
+  for (int32_t y = 0; y < (int32_t)height; y++) {
+    for (int32_t x = 0; x < (int32_t)width; x++) {
+      compare(x, y, -1, 0);
+      compare(x, y, 0, -1);
+      compare(x, y, -1, -1);
+      compare(x, y, 1, -1);
+    }
+    for (int32_t x = width - 1; x >= 0; x--) {
+      compare(x, y, 1, 0);
+    }
+  }
+  for (int32_t y = height - 1; y >= 0; y--) {
+    for (int32_t x = width - 1; x >= 0; x--) {
+      compare(x, y, 1, 0);
+      compare(x, y, 0, 1);
+      compare(x, y, -1, 1);
+      compare(x, y, 1, 1);
+    }
+    for (int32_t x = 0; x < (int32_t)width; x++) {
+      compare(x, y, -1, 0);
+    }
+  }
+
+  std::vector<float> distances(seeds.size());
+  for (size_t i = 0; i < seeds.size(); i++) {
+    distances[i] = std::sqrt((float)length2(offsets[i]));
+  }
+  return distances;
+}
+
+void SdfGrid::addImage(const std::vector<uint8_t> &solid,
+                       const uint32_t image_width,
+                       const uint32_t image_height, const glm::vec2 min,
+                       const glm::vec2 max) {
+  if (solid.size() != (size_t)image_width * image_height) {
+    throw std::invalid_argument("SdfGrid::addImage mask has the wrong size");
+  }
+
+  // Point sample the mask at every grid sample.
+  std::vector<uint8_t> inside(this->distances.size());
+  std::vector<uint8_t> outside(this->distances.size());
+  for (uint32_t y = 0; y < this->height; y++) {
+    for (uint32_t x = 0; x < this->width; x++) {
+      const glm::vec2 uv =
+          (this->samplePosition(x, y) - min) / (max - min);
+      const int32_t u = (int32_t)std::floor(uv.x * image_width);
+      const int32_t v = (int32_t)std::floor((1.f - uv.y) * image_height);
+      const bool is_solid = u >= 0 && u < (int32_t)image_width && v >= 0 &&
+                            v < (int32_t)image_height &&
+                            solid[v * image_width + u] != 0;
+      inside[y * this->width + x] = is_solid;
+      outside[y * this->width + x] = !is_solid;
+    }
+  }
+
+  // The surface lies half a cell between a solid and an open sample.
+  const std::vector<float> to_solid =
+      distanceToSeeds(inside, this->width, this->height);
+  const std::vector<float> to_open =
+      distanceToSeeds(outside, this->width, this->height);
+  for (size_t i = 0; i < this->distances.size(); i++) {
+    const float cells =
+        inside[i] ? 0.5f - to_open[i] : to_solid[i] - 0.5f;
+    this->distances[i] =
+        std::min(this->distances[i], cells * this->cell_size);
+  }
+}
+
+float SdfGrid::sample(const glm::vec2 pos, glm::vec2 &gradient) const {
+  // Clamped so all four corners are inside the grid.
+  const glm::vec2 g = glm::clamp(
+      (pos - this->origin) / this->cell_size, glm::vec2(0.f),
+      glm::vec2(this->width - 1.001f, this->height - 1.001f));
+  const glm::vec2 cell = glm::floor(g);
+  const glm::vec2 f = g - cell;
+  const float *d =
+      &this->distances[(uint32_t)cell.y * this->width + (uint32_t)cell.x];
+
+  const float d00 = d[0], d10 = d[1];
+  const float d01 = d[this->width], d11 = d[this->width + 1];
+  gradient.x = (d10 - d00) * (1.f - f.y) + (d11 - d01) * f.y;
+  gradient.y = (d01 - d00) * (1.f - f.x) + (d11 - d10) * f.x;
+  return (d00 * (1.f - f.x) + d10 * f.x) * (1.f - f.y) +
+         (d01 * (1.f - f.x) + d11 * f.x) * f.y;
+}
@@ -0,0 +1,42 @@
+#pragma once
+#include <cstdint>
+#include <vector>
+
+#include <glm/glm.hpp>
+
+#include "particles.hpp"
+
+// Static boundaries as a signed distance field sampled on a regular grid, in
+// world units: positive in open space, negative inside walls and obstacles.
+// Particles closer than their radius are pushed out along the gradient, so
+// enforcing the boundary is one bilinear lookup per particle however many
+// obstacles went into the field.
+struct SdfGrid {
+  // World position of sample (0, 0); sample (x, y) sits at
+  // origin + cell_size * (x, y).
+  glm::vec2 origin;
+  float cell_size;
+  uint32_t width, height;
+  // width * height samples, row by row from the bottom.
+  AlignedVector<float> distances;
+
+  // Covers the world [0, world_size] plus a cell either side, open inside
+  // the world and solid outside it.
+  SdfGrid(const glm::vec2 world_size, const float _cell_size);
+
+  glm::vec2 samplePosition(const uint32_t x, const uint32_t y) const;
+
+  // Adds a solid polygon. Vertices in either winding; the last joins back
+  // to the first.
+  void addPolygon(const std::vector<glm::vec2> &vertices);
+
+  // Adds the non-zero pixels of an 'image_width' x 'image_height' mask, top
+  // row first, stretched over the box [min, max].
+  void addImage(const std::vector<uint8_t> &solid, const uint32_t image_width,
+                const uint32_t image_height, const glm::vec2 min,
+                const glm::vec2 max);
+
+  // Bilinear distance at 'pos', clamped to the grid, and its (unnormalised)
+  // gradient. Matches the CPU kernel and the compute shader.
+  float sample(const glm::vec2 pos, glm::vec2 &gradient) const;
+};
@@ -0,0 +1,133 @@
+#include "shm_ring.hpp"
+
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <fcntl.h>
+#include <new>
+#include <stdexcept>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <thread>
+#include <unistd.h>
+
+// Spins briefly, then gives the core away, until 'ready' holds or the ring
+// is aborted.
+template <typename F>
+static void waitUntil(const ShmRing &ring, F &&ready) {
+  for (uint32_t spins = 0; !ready(); spins++) {
+    if (ring.header->aborted.load(std::memory_order_acquire) != 0) {
+      throw std::runtime_error("ShmRing: " + ring.name + " aborted");
+    }
+    if (spins >= 64) {
+      std::this_thread::yield();
+    }
+  }
+}
+
+ShmRing::ShmRing(const std::string &_name, const size_t capacity)
+    : name(_name), owner(true) {
+  const int fd = shm_open(this->name.c_str(), O_CREAT | O_EXCL | O_RDWR, 0600);
+  if (fd < 0) {
+    throw std::runtime_error("ShmRing: cannot create " + this->name + ": " +
+                             std::strerror(errno));
+  }
+  this->mapped_bytes = sizeof(Header) + capacity;
+  if (ftruncate(fd, this->mapped_bytes) != 0) {
+    close(fd);
+    shm_unlink(this->name.c_str());
+    throw std::runtime_error("ShmRing: cannot size " + this->name);
+  }
+  this->map(fd);
+  new (this->header) Header();
+  this->header->head.store(0, std::memory_order_relaxed);
+  this->header->tail.store(0, std::memory_order_relaxed);
+  this->header->capacity = capacity;
+  this->header->aborted.store(0, std::memory_order_relaxed);
+}
+
+ShmRing::ShmRing(const std::string &_name) : name(_name), owner(false) {
+  const int fd = shm_open(this->name.c_str(), O_RDWR, 0600);
+  if (fd < 0) {
+    throw std::runtime_error("ShmRing: cannot open " + this->name + ": " +
+                             std::strerror(errno));
+  }
+  struct stat info;
+  if (fstat(fd, &info) != 0 || (size_t)info.st_size < sizeof(Header)) {
+    close(fd);
+    throw std::runtime_error("ShmRing: " + this->name + " is not a ring");
+  }
+  this->mapped_bytes = info.st_size;
+  this->map(fd);
+}
+
+ShmRing::~ShmRing() {
+  munmap(this->header, this->mapped_bytes);
+  if (this->owner) {
+    shm_unlink(this->name.c_str());
+  }
+}
+
+void ShmRing::map(const int fd) {
+  void *memory = mmap(nullptr, this->mapped_bytes, PROT_READ | PROT_WRITE,
+                      MAP_SHARED, fd, 0);
+  close(fd);
+  if (memory == MAP_FAILED) {
+    if (this->owner) {
+      shm_unlink(this->name.c_str());
+    }
+    throw std::runtime_error("ShmRing: cannot map " + this->name);
+  }
+  this->header = (Header *)memory;
+  this->data = (uint8_t *)memory + sizeof(Header);
+}
+
+void ShmRing::copyIn(uint64_t at, const void *bytes, const size_t size) {
+  const uint64_t capacity = this->header->capacity;
+  const size_t offset = at % capacity;
+  const size_t first = std::min(size, (size_t)(capacity - offset));
+  std::memcpy(this->data + offset, bytes, first);
+  std::memcpy(this->data, (const uint8_t *)bytes + first, size - first);
+}
+
+void ShmRing::copyOut(uint64_t at, void *bytes, const size_t size) const {
+  const uint64_t capacity = this->header->capacity;
+  const size_t offset = at % capacity;
+  const size_t first = std::min(size, (size_t)(capacity - offset));
+  std::memcpy(bytes, this->data + offset, first);
+  std::memcpy((uint8_t *)bytes + first, this->data, size - first);
+}
+
+void ShmRing::send(const void *bytes, const uint32_t size) {
+  const uint64_t needed = sizeof(uint32_t) + (uint64_t)size;
+  if (needed > this->header->capacity) {
+    throw std::invalid_argument("ShmRing: message larger than " + this->name);
+  }
+  // Only this end moves head.
+  const uint64_t head = this->header->head.load(std::memory_order_relaxed);
+  waitUntil(*this, [&] {
+    const uint64_t tail = this->header->tail.load(std::memory_order_acquire);
+    return head + needed - tail <= this->header->capacity;
+  });
+  this->copyIn(head, &size, sizeof(uint32_t));
+  this->copyIn(head + sizeof(uint32_t), bytes, size);
+  this->header->head.store(head + needed, std::memory_order_release);
+}
+
+void ShmRing::receive(std::vector<uint8_t> &message) {
+  // Only this end moves tail, and a message is published whole.
+  const uint64_t tail = this->header->tail.load(std::memory_order_relaxed);
+  waitUntil(*this, [&] {
+    return this->header->head.load(std::memory_order_acquire) != tail;
+  });
+  uint32_t size;
+  this->copyOut(tail, &size, sizeof(uint32_t));
+  message.resize(size);
+  this->copyOut(tail + sizeof(uint32_t), message.data(), size);
+  this->header->tail.store(tail + sizeof(uint32_t) + size,
+                           std::memory_order_release);
+}
+
+void ShmRing::abort() {
+  this->header->aborted.store(1, std::memory_order_release);
+}
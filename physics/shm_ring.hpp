@@ -0,0 +1,58 @@
+#pragma once
+#include <atomic>
+#include <cstdint>
+#include <string>
+#include <vector>
+
+// One direction of a link between two processes: a single producer, single
+// consumer byte ring in POSIX shared memory, carrying whole messages. It
+// stands in for a network link between domains on one machine.
+//
+// The creating process owns the segment and unlinks it when done; the other
+// end opens it by name. send() waits while the ring is full and receive()
+// while it is empty, spinning then yielding, so both ends should be busy
+// processes rather than ones that wait long. Once either end, or whoever
+// made the ring, calls abort(), both throw rather than wait.
+struct ShmRing {
+  // At the start of the segment. 'head' and 'tail' count bytes written and
+  // read since creation, so head - tail is what is waiting.
+  struct Header {
+    std::atomic<uint64_t> head;
+    alignas(64) std::atomic<uint64_t> tail;
+    alignas(64) uint64_t capacity;
+    std::atomic<uint32_t> aborted;
+  };
+  static_assert(std::atomic<uint64_t>::is_always_lock_free,
+                "ring counters must be lock free to be shared");
+
+  std::string name;
+  Header *header;
+  uint8_t *data;
+  size_t mapped_bytes;
+  bool owner;
+
+  // Creates the segment 'name' (e.g. "/sph-ring-0"), with room for
+  // 'capacity' bytes of messages.
+  ShmRing(const std::string &_name, const size_t capacity);
+  // Opens a segment another process created.
+  ShmRing(const std::string &_name);
+  ShmRing(const ShmRing &) = delete;
+  ShmRing &operator=(const ShmRing &) = delete;
+  ~ShmRing();
+
+  // Copies 'size' bytes in as one message.
+  void send(const void *bytes, const uint32_t size);
+
+  // Waits for the next message and copies it out.
+  void receive(std::vector<uint8_t> &message);
+
+  // Makes every wait on the ring, now or later, at either end, throw
+  // std::runtime_error, e.g. once the process at the other end has died.
+  void abort();
+
+  // Maps the segment behind 'fd' and closes it.
+  void map(const int fd);
+  // Copy across the end of the ring as needed; 'at' is a byte count.
+  void copyIn(uint64_t at, const void *bytes, const size_t size);
+  void copyOut(uint64_t at, void *bytes, const size_t size) const;
+};
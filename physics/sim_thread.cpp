@@ -0,0 +1,28 @@
+#include "sim_thread.hpp"
+
+#include <chrono>
+#include <stdexcept>
+
+SimThread::SimThread(PhysicSolver &_solver) : solver(_solver) {
+  if (this->solver.backend == ComputeBackend::OpenGL) {
+    throw std::invalid_argument(
+        "SimThread can't drive the OpenGL backend off the GL thread");
+  }
+  this->thread = std::thread(&SimThread::loop, this);
+}
+
+SimThread::~SimThread() {
+  this->running = false;
+  this->thread.join();
+}
+
+void SimThread::loop() {
+  auto prev_time = std::chrono::steady_clock::now();
+  while (this->running.load(std::memory_order_relaxed)) {
+    const auto curr_time = std::chrono::steady_clock::now();
+    const std::chrono::duration<float> dt = curr_time - prev_time;
+    prev_time = curr_time;
+
+    this->solver.update(dt.count());
+  }
+}
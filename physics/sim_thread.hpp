@@ -0,0 +1,22 @@
+#pragma once
+#include <atomic>
+#include <thread>
+
+#include "physics.hpp"
+
+// Steps a solver on its own thread as fast as it can go, so physics doesn't
+// wait on vsync and the render loop doesn't wait on physics. Finished frames
+// reach the renderer through PhysicSolver::frames.
+//
+// Not for ComputeBackend::OpenGL, whose dispatches have to come from the
+// thread that owns the GL context.
+struct SimThread {
+  PhysicSolver &solver;
+  std::atomic<bool> running{true};
+  std::thread thread;
+
+  SimThread(PhysicSolver &_solver);
+  ~SimThread();
+
+  void loop();
+};
@@ -0,0 +1,322 @@
+#include "slab_worker.hpp"
+
+#include <algorithm>
+#include <cstring>
+#include <stdexcept>
+
+SlabWorker::SlabWorker(const uint32_t _rank, const uint32_t _worker_count,
+                       const float _x_min, const float _x_max,
+                       const glm::vec2 _world_size,
+                       const uint32_t particle_count, const float spacing,
+                       const float h, const float particle_mass,
+                       JobSystem &_job_system, const std::string &ring_prefix)
+    : rank(_rank), worker_count(_worker_count), x_min(_x_min),
+      x_max(_x_max), particles(0, ParticleLayout::SoA),
+      grid(particles.positions, h), compute(particles.capacity),
+      params{h, particle_mass}, world_size(_world_size),
+      particle_radius(0.5f * spacing), job_system(_job_system) {
+  if (this->x_max - this->x_min < 2.f * h) {
+    throw std::invalid_argument("SlabWorker: slab narrower than 2h");
+  }
+  // Both pick particles by the whole fluid, which a slab doesn't see.
+  this->compute.sleep_params.enabled = false;
+  this->compute.time_bin_params.bin_count = 1;
+
+  // Only this slab's columns of the lattice Particles::fillLattice() would
+  // make, so the particles are first written here, on this worker's node.
+  const uint32_t side = Particles::latticeSide(particle_count);
+  auto column_rows = [&](const uint32_t column) {
+    return column < particle_count
+               ? (particle_count - column + side - 1) / side
+               : 0u;
+  };
+  uint32_t owned = 0;
+  for (uint32_t column = 0; column < side; column++) {
+    if (this->owns(spacing * (0.5f + column))) {
+      owned += column_rows(column);
+    }
+  }
+  this->reserve(owned);
+  for (uint32_t column = 0; column < side; column++) {
+    const float x = spacing * (0.5f + column);
+    if (!this->owns(x)) {
+      continue;
+    }
+    for (uint32_t row = 0; row < column_rows(column); row++) {
+      this->particles.add(glm::vec2(x, spacing * (0.5f + row)),
+                          glm::vec2(0.f), glm::vec3(1.f),
+                          this->particle_radius);
+    }
+  }
+
+  if (this->rank > 0) {
+    this->to_left =
+        new ShmRing(ringName(ring_prefix, this->rank, this->rank - 1));
+    this->from_left =
+        new ShmRing(ringName(ring_prefix, this->rank - 1, this->rank));
+  }
+  if (this->rank + 1 < this->worker_count) {
+    this->to_right =
+        new ShmRing(ringName(ring_prefix, this->rank, this->rank + 1));
+    this->from_right =
+        new ShmRing(ringName(ring_prefix, this->rank + 1, this->rank));
+  }
+}
+
+SlabWorker::~SlabWorker() {
+  delete this->to_left;
+  delete this->from_left;
+  delete this->to_right;
+  delete this->from_right;
+}
+
+std::string SlabWorker::ringName(const std::string &ring_prefix,
+                                 const uint32_t from, const uint32_t to) {
+  return ring_prefix + "-" + std::to_string(from) + "-" + std::to_string(to);
+}
+
+std::vector<ShmRing *> SlabWorker::ringsFor(const std::string &ring_prefix,
+                                            const uint32_t worker_count,
+                                            const size_t capacity) {
+  std::vector<ShmRing *> rings;
+  for (uint32_t rank = 0; rank + 1 < worker_count; rank++) {
+    rings.push_back(
+        new ShmRing(ringName(ring_prefix, rank, rank + 1), capacity));
+    rings.push_back(
+        new ShmRing(ringName(ring_prefix, rank + 1, rank), capacity));
+  }
+  return rings;
+}
+
+bool SlabWorker::owns(const float x) const {
+  return (this->rank == 0 || x >= this->x_min) &&
+         (this->rank + 1 == this->worker_count || x < this->x_max);
+}
+
+void SlabWorker::reserve(const uint32_t count) {
+  this->particles.reserve(count);
+  this->compute.reserve(this->particles.capacity);
+}
+
+void SlabWorker::step() {
+  Particles &p = this->particles;
+  this->dropHalo();
+  this->migrate();
+  // The grid and the sort read the AoS positions.
+  p.storePositions();
+  // Before the halo goes out, since sorting renumbers what was sent.
+  if (this->morton_interval > 0 &&
+      this->step_count % this->morton_interval == 0) {
+    p.sortByMorton(this->grid.cell_width, this->ownedCount());
+  }
+
+  Summary left, right;
+  this->exchangeHalo(left, right);
+  if (this->rebalance_interval > 0 &&
+      this->step_count % this->rebalance_interval == 0) {
+    this->rebalance(left, right);
+  }
+  this->step_count++;
+
+  const uint32_t owned = this->ownedCount();
+  this->grid.update();
+  this->compute.calcDensities(p, this->grid, this->params, this->step_dt,
+                              owned, this->job_system);
+  this->exchangeHaloDensities();
+  this->compute.applyFluidForces(p, this->grid, this->params, this->step_dt,
+                                 owned, this->job_system);
+  this->compute.integrateInBox(p, this->world_size, this->wall_damp,
+                               this->step_dt, owned, this->job_system);
+}
+
+void SlabWorker::dropHalo() {
+  Particles &p = this->particles;
+  for (; this->halo_count > 0; this->halo_count--) {
+    p.remove(p.particle_count - 1);
+  }
+  this->halo_from_left = 0;
+}
+
+void SlabWorker::sendPackets(ShmRing *ring, const void *header,
+                             const uint32_t header_size) {
+  if (ring == nullptr) {
+    return;
+  }
+  const uint32_t size =
+      header_size + (uint32_t)(this->packets.size() * sizeof(Packet));
+  this->message.resize(size);
+  std::memcpy(this->message.data(), header, header_size);
+  std::memcpy(this->message.data() + header_size, this->packets.data(),
+              this->packets.size() * sizeof(Packet));
+  ring->send(this->message.data(), size);
+  this->bytes_sent += size;
+}
+
+void SlabWorker::receivePackets(ShmRing *ring, void *header,
+                                const uint32_t header_size) {
+  this->packets.clear();
+  if (ring == nullptr) {
+    return;
+  }
+  ring->receive(this->message);
+  if (this->message.size() < header_size ||
+      (this->message.size() - header_size) % sizeof(Packet) != 0) {
+    throw std::runtime_error("SlabWorker: malformed message on " +
+                             ring->name);
+  }
+  std::memcpy(header, this->message.data(), header_size);
+  this->packets.resize((this->message.size() - header_size) /
+                       sizeof(Packet));
+  std::memcpy(this->packets.data(), this->message.data() + header_size,
+              this->packets.size() * sizeof(Packet));
+}
+
+void SlabWorker::migrate() {
+  Particles &p = this->particles;
+  std::vector<Packet> leaving_left, leaving_right;
+  // Backwards, so the particle remove() moves in has been looked at.
+  for (uint32_t p_i = p.particle_count; p_i-- > 0;) {
+    const float x = p.pos_x[p_i];
+    if (this->owns(x)) {
+      continue;
+    }
+    const Packet packet{glm::vec2(p.pos_x[p_i], p.pos_y[p_i]),
+                        glm::vec2(p.vel_x[p_i], p.vel_y[p_i])};
+    (x < this->x_min ? leaving_left : leaving_right).push_back(packet);
+    p.remove(p_i);
+  }
+  this->migrated_count += leaving_left.size() + leaving_right.size();
+
+  const uint32_t no_header = 0;
+  this->packets.swap(leaving_left);
+  this->sendPackets(this->to_left, &no_header, sizeof(no_header));
+  this->packets.swap(leaving_right);
+  this->sendPackets(this->to_right, &no_header, sizeof(no_header));
+
+  uint32_t ignored;
+  for (ShmRing *ring : {this->from_left, this->from_right}) {
+    this->receivePackets(ring, &ignored, sizeof(ignored));
+    this->reserve(p.particle_count + this->packets.size());
+    for (const Packet &packet : this->packets) {
+      p.add(packet.position, packet.velocity, glm::vec3(1.f),
+            this->particle_radius);
+    }
+  }
+}
+
+void SlabWorker::exchangeHalo(Summary &left, Summary &right) {
+  Particles &p = this->particles;
+  const float h = this->params.h;
+  const Summary own{this->ownedCount(), this->x_min, this->x_max};
+
+  this->sent_left.clear();
+  this->sent_right.clear();
+  for (uint32_t p_i = 0; p_i < p.particle_count; p_i++) {
+    const float x = p.pos_x[p_i];
+    if (this->to_left != nullptr && x < this->x_min + h) {
+      this->sent_left.push_back(p_i);
+    }
+    if (this->to_right != nullptr && x >= this->x_max - h) {
+      this->sent_right.push_back(p_i);
+    }
+  }
+  for (const auto &[ring, sent] :
+       {std::make_pair(this->to_left, &this->sent_left),
+        std::make_pair(this->to_right, &this->sent_right)}) {
+    this->packets.clear();
+    for (const uint32_t p_i : *sent) {
+      this->packets.push_back({glm::vec2(p.pos_x[p_i], p.pos_y[p_i]),
+                               glm::vec2(p.vel_x[p_i], p.vel_y[p_i])});
+    }
+    this->sendPackets(ring, &own, sizeof(own));
+  }
+
+  // A missing neighbour reads as an empty slab.
+  left = right = Summary{0, 0.f, 0.f};
+  for (const auto &[ring, summary] :
+       {std::make_pair(this->from_left, &left),
+        std::make_pair(this->from_right, &right)}) {
+    this->receivePackets(ring, summary, sizeof(Summary));
+    this->reserve(p.particle_count + this->packets.size());
+    for (const Packet &packet : this->packets) {
+      p.add(packet.position, packet.velocity, glm::vec3(1.f),
+            this->particle_radius);
+    }
+    this->halo_count += this->packets.size();
+    if (ring == this->from_left) {
+      this->halo_from_left = this->halo_count;
+    }
+  }
+  this->halo_total += this->halo_count;
+}
+
+void SlabWorker::exchangeHaloDensities() {
+  Particles &p = this->particles;
+  std::vector<float> densities;
+  for (const auto &[ring, sent] :
+       {std::make_pair(this->to_left, &this->sent_left),
+        std::make_pair(this->to_right, &this->sent_right)}) {
+    if (ring == nullptr) {
+      continue;
+    }
+    densities.clear();
+    for (const uint32_t p_i : *sent) {
+      densities.push_back(p.density[p_i]);
+    }
+    ring->send(densities.data(), densities.size() * sizeof(float));
+    this->bytes_sent += densities.size() * sizeof(float);
+  }
+
+  // The halo is in the order it was sent, left's first.
+  const uint32_t halo_start = this->ownedCount();
+  const uint32_t halo_counts[2] = {
+      this->halo_from_left, this->halo_count - this->halo_from_left};
+  const uint32_t firsts[2] = {halo_start, halo_start + this->halo_from_left};
+  ShmRing *rings[2] = {this->from_left, this->from_right};
+  for (uint32_t side = 0; side < 2; side++) {
+    if (rings[side] == nullptr) {
+      continue;
+    }
+    rings[side]->receive(this->message);
+    if (this->message.size() != halo_counts[side] * sizeof(float)) {
+      throw std::runtime_error("SlabWorker: halo densities out of step on " +
+                               rings[side]->name);
+    }
+    const float *received = (const float *)this->message.data();
+    for (uint32_t i = 0; i < halo_counts[side]; i++) {
+      p.density[firsts[side] + i] = received[i];
+    }
+  }
+}
+
+float slabBorderShift(const SlabWorker::Summary &left,
+                      const SlabWorker::Summary &right, const float max_shift,
+                      const float min_width) {
+  const float total = (float)left.owned_count + (float)right.owned_count;
+  if (total == 0.f) {
+    return 0.f;
+  }
+  const float left_width = left.x_max - left.x_min;
+  const float right_width = right.x_max - right.x_min;
+  const float per_unit = total / (left_width + right_width);
+  // Positive moves the border right, giving the left slab more.
+  const float even =
+      0.5f * ((float)right.owned_count - (float)left.owned_count) / per_unit;
+  const float shift = glm::clamp(0.5f * even, -max_shift, max_shift);
+  return glm::clamp(shift, -std::max(0.f, left_width - min_width),
+                    std::max(0.f, right_width - min_width));
+}
+
+void SlabWorker::rebalance(const Summary &left, const Summary &right) {
+  const float h = this->params.h;
+  const Summary own{this->ownedCount(), this->x_min, this->x_max};
+  // Either border may move by h / 2, so 2.5h keeps every slab 2h wide.
+  const float max_shift = 0.5f * h;
+  const float min_width = 2.5f * h;
+  if (this->from_left != nullptr) {
+    this->x_min += slabBorderShift(left, own, max_shift, min_width);
+  }
+  if (this->from_right != nullptr) {
+    this->x_max += slabBorderShift(own, right, max_shift, min_width);
+  }
+}
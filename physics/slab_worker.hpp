@@ -0,0 +1,144 @@
+#pragma once
+#include <cstdint>
+#include <string>
+#include <vector>
+
+#include <glm/glm.hpp>
+
+#include "cpu_compute.hpp"
+#include "fluid_params.hpp"
+#include "job_system.hpp"
+#include "particles.hpp"
+#include "shm_ring.hpp"
+#include "spatial_grid.hpp"
+
+// One process's share of 2D SPH in a box whose world is cut along x into
+// slabs, one a process, talking to the slabs either side over ShmRings. The
+// passes are CpuCompute's, without sleeping or time bins.
+// Each step:
+//   1. particles that left the slab go to the neighbour they moved into;
+//   2. owned particles within h of a border go to that neighbour, which
+//      keeps them as a read-only halo, the last halo_count particles, for
+//      the step;
+//   3. densities are computed, and the halo's densities follow it across,
+//      since the pressure force reads its neighbours' densities;
+//   4. forces and integration, on the owned particles alone.
+// Slabs are at least 2h wide, so a particle's neighbours are all in its own
+// slab or the next, and every step's motion is far below a slab. With each
+// worker pinned to a NUMA node before it is made, its particles are on its
+// node and the halo is all it reads from another. Every morton_interval
+// steps the owned particles are re-sorted by the Morton code of their cell.
+//
+// Every rebalance_interval steps, each border moves toward the slab with
+// the fewer particles, both sides working out the same move from the counts
+// and extents that lead the halo message. A move is at most h / 2, keeping
+// halos valid, and particles the move gave away migrate the next step.
+struct SlabWorker {
+  // What crosses a border for one particle.
+  struct Packet {
+    glm::vec2 position;
+    glm::vec2 velocity;
+  };
+  // Leads each halo message.
+  struct Summary {
+    uint32_t owned_count;
+    float x_min;
+    float x_max;
+  };
+
+  uint32_t rank;
+  uint32_t worker_count;
+  // The slab. The first and last slab also own whatever is past them.
+  float x_min;
+  float x_max;
+  Particles particles;
+  SpatialGrid grid;
+  CpuCompute compute;
+  FluidParams params;
+  glm::vec2 world_size;
+  float step_dt = 0.0007f;
+  // Fraction of the velocity into a wall that comes back out.
+  float wall_damp = 0.5f;
+  float particle_radius;
+  // 0 never sorts.
+  uint32_t morton_interval = 32;
+  // 0 never rebalances.
+  uint32_t rebalance_interval = 20;
+  uint32_t step_count = 0;
+  uint32_t halo_count = 0;
+  JobSystem &job_system;
+
+  // Null at the ends of the world.
+  ShmRing *to_left = nullptr;
+  ShmRing *from_left = nullptr;
+  ShmRing *to_right = nullptr;
+  ShmRing *from_right = nullptr;
+
+  // Owned particles last sent as halo to each side, in the order sent.
+  std::vector<uint32_t> sent_left;
+  std::vector<uint32_t> sent_right;
+  // Of the halo, how many came from the left; they come first.
+  uint32_t halo_from_left = 0;
+
+  // Totals since construction.
+  uint64_t migrated_count = 0;
+  uint64_t halo_total = 0;
+  uint64_t bytes_sent = 0;
+
+  // Scratch.
+  std::vector<Packet> packets;
+  std::vector<uint8_t> message;
+
+  // Slab 'rank' of 'worker_count', spanning [_x_min, _x_max), starting with
+  // its part of a 'particle_count' lattice in the corner of the world (see
+  // Particles::fillLattice). Opens the rings ringsFor() made.
+  SlabWorker(const uint32_t _rank, const uint32_t _worker_count,
+             const float _x_min, const float _x_max,
+             const glm::vec2 _world_size, const uint32_t particle_count,
+             const float spacing, const float h, const float particle_mass,
+             JobSystem &_job_system, const std::string &ring_prefix);
+  SlabWorker(const SlabWorker &) = delete;
+  SlabWorker &operator=(const SlabWorker &) = delete;
+  ~SlabWorker();
+
+  // Creates every ring between 'worker_count' slabs, each with room for
+  // 'capacity' bytes, to be deleted by the caller once the workers are done.
+  static std::vector<ShmRing *> ringsFor(const std::string &ring_prefix,
+                                         const uint32_t worker_count,
+                                         const size_t capacity);
+  static std::string ringName(const std::string &ring_prefix,
+                              const uint32_t from, const uint32_t to);
+
+  bool owns(const float x) const;
+  // Particles the passes update, i.e. all but the halo.
+  uint32_t ownedCount() const {
+    return this->particles.particle_count - this->halo_count;
+  }
+
+  // Room for 'count' particles, in the particles and the passes.
+  void reserve(const uint32_t count);
+
+  void step();
+
+  // The steps above, each one exchange with both neighbours.
+  void dropHalo();
+  void migrate();
+  void exchangeHalo(Summary &left, Summary &right);
+  void exchangeHaloDensities();
+  void rebalance(const Summary &left, const Summary &right);
+
+  // Sends 'header' then 'packets' to one side; null sends nothing.
+  void sendPackets(ShmRing *ring, const void *header,
+                   const uint32_t header_size);
+  // Receives from one side into 'packets', copying out 'header' first.
+  void receivePackets(ShmRing *ring, void *header,
+                      const uint32_t header_size);
+};
+
+// Where the border between two slabs should move, from the two slabs'
+// summaries: by half the distance that would even their counts at their
+// mean density along x, at most 'max_shift', keeping both at least
+// 'min_width' wide. Both neighbours call it with the same arguments.
+float slabBorderShift(const SlabWorker::Summary &left,
+                      const SlabWorker::Summary &right, const float max_shift,
+                      const float min_width);
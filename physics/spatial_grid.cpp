@@ -1,22 +1,60 @@
 #include "spatial_grid.hpp"
 #include <algorithm>
+#include <cmath>
+#include <unordered_map>
 
 #include <iostream>
 
-SpatialGrid::SpatialGrid(std::vector<glm::vec2> &_positions,
-                         const float smoothing_radius)
-    : spatial_lookup(_positions.size() + 1),
-      spatial_indicies(_positions.size()), cell_width(2 * smoothing_radius),
-      positions(_positions){};
+// murmur3 fmix64.
+static uint64_t mix64(uint64_t key) {
+  key ^= key >> 33;
+  key *= 0xff51afd7ed558ccdull;
+  key ^= key >> 33;
+  key *= 0xc4ceb9fe1a85ec53ull;
+  key ^= key >> 33;
+  return key;
+}
+
+template <int D>
+SpatialGridT<D>::SpatialGridT(std::vector<vec> &_positions,
+                              const float smoothing_radius,
+                              const CellKeyMode _key_mode)
+    : cell_width(2 * smoothing_radius), key_mode(_key_mode),
+      positions(_positions) {
+  this->resize();
+}
+
+template <int D> void SpatialGridT<D>::resize() {
+  const size_t count = this->positions.size();
+  // At least one bucket, so hashing never divides by zero. Blocks have no
+  // buckets at all.
+  this->spatial_lookup.resize(
+      this->key_mode == CellKeyMode::Blocks ? 2
+                                            : std::max<size_t>(count, 1) + 1);
+  this->spatial_indicies.resize(count);
+  this->spatial_keys.resize(count);
+  this->particle_hashes.resize(count);
+  this->particle_keys.resize(count);
+}
+
+template <int D> void SpatialGridT<D>::update() {
+  if (this->spatial_indicies.size() != this->positions.size()) {
+    this->resize();
+  }
+  if (this->key_mode == CellKeyMode::Blocks) {
+    this->updateBlocks();
+    return;
+  }
 
-void SpatialGrid::update() {
   // Reset counts to zero.
   std::fill(this->spatial_lookup.begin(), this->spatial_lookup.end(), 0);
 
   // Find bucket counts
-  for (int32_t i = 0; i < this->positions.size(); i++) {
-    glm::ivec2 cell_coord = this->positionToCellCoord(this->positions[i]);
+  for (uint32_t i = 0; i < this->positions.size(); i++) {
+    ivec cell_coord = this->positionToCellCoord(this->positions[i]);
     int32_t cell_hash = this->cellCoordToHash(cell_coord);
+    this->particle_hashes[i] = cell_hash;
+    this->particle_keys[i] = cellKey(cell_coord);
 
     // #Buckets = #Particles with one extra for dealing with overflow
     // Contains start and end indicies for each group.
@@ -24,31 +62,365 @@ void SpatialGrid::update() {
   }
 
   // Cumulative sum
-  for (int32_t i = 1; i < this->spatial_lookup.size(); i++) {
+  for (uint32_t i = 1; i < this->spatial_lookup.size(); i++) {
     this->spatial_lookup[i] += this->spatial_lookup[i - 1];
   }
 
   // Fill spatial indicies
-  for (int32_t i = 0; i < this->positions.size(); i++) {
-    glm::ivec2 cell_coord = this->positionToCellCoord(this->positions[i]);
-    int32_t cell_hash = this->cellCoordToHash(cell_coord);
+  for (uint32_t i = 0; i < this->positions.size(); i++) {
+    int32_t cell_hash = this->particle_hashes[i];
 
     this->spatial_lookup[cell_hash]--;
     this->spatial_indicies[this->spatial_lookup[cell_hash]] = i;
+    this->spatial_keys[this->spatial_lookup[cell_hash]] =
+        this->particle_keys[i];
+  }
+
+  // Group each bucket by cell key, so every cell is one contiguous run that
+  // cellRange() can hand out on its own. Buckets hold a handful of entries,
+  // so a stable insertion sort is enough.
+  const int32_t bucket_count = this->spatial_lookup.size() - 1;
+  for (int32_t b = 0; b < bucket_count; b++) {
+    const int32_t start = this->spatial_lookup[b];
+    const int32_t end = this->spatial_lookup[b + 1];
+    for (int32_t i = start + 1; i < end; i++) {
+      const uint64_t key = this->spatial_keys[i];
+      const int32_t index = this->spatial_indicies[i];
+      int32_t j = i;
+      for (; j > start && this->spatial_keys[j - 1] > key; j--) {
+        this->spatial_keys[j] = this->spatial_keys[j - 1];
+        this->spatial_indicies[j] = this->spatial_indicies[j - 1];
+      }
+      this->spatial_keys[j] = key;
+      this->spatial_indicies[j] = index;
+    }
+  }
+}
+
+template <int D>
+uint64_t SpatialGridT<D>::blockKey(const ivec cell_coord, uint32_t &local) {
+  // Arithmetic shifts, so the floor of a negative coordinate over
+  // block_side.
+  static_assert(block_side == 8, "the shifts and masks assume 8");
+  ivec block_coord;
+  local = 0;
+  for (int32_t axis = 0, stride = 1; axis < D; axis++, stride *= block_side) {
+    block_coord[axis] = cell_coord[axis] >> 3;
+    local += (cell_coord[axis] & 7) * stride;
+  }
+  return Dimension<D>::cellKey(block_coord);
+}
+
+template <int D>
+uint32_t SpatialGridT<D>::blockSlot(const uint64_t key) const {
+  const uint32_t mask = this->block_table.size() - 1;
+  uint32_t slot = mix64(key) & mask;
+  while (this->block_table[slot] >= 0 &&
+         this->block_keys[this->block_table[slot]] != key) {
+    slot = (slot + 1) & mask;
+  }
+  return slot;
+}
+
+template <int D>
+int32_t SpatialGridT<D>::findBlock(const uint64_t key) const {
+  if (this->block_table.empty()) {
+    return -1;
   }
+  return this->block_table[this->blockSlot(key)];
 }
 
-glm::ivec2 SpatialGrid::positionToCellCoord(glm::vec2 pos) {
-  return glm::ivec2(pos / this->cell_width);
+template <int D>
+int32_t SpatialGridT<D>::acquireBlock(const uint64_t key) {
+  // Keep the table at most half full, so probes stay short.
+  const uint32_t live = this->block_keys.size() - this->free_blocks.size();
+  if (2 * (live + 1) > this->block_table.size()) {
+    std::vector<int32_t> old_table(
+        std::max<size_t>(16, 2 * this->block_table.size()), -1);
+    old_table.swap(this->block_table);
+    for (const int32_t block : old_table) {
+      if (block >= 0) {
+        this->block_table[this->blockSlot(this->block_keys[block])] = block;
+      }
+    }
+  }
+
+  int32_t block;
+  if (!this->free_blocks.empty()) {
+    block = this->free_blocks.back();
+    this->free_blocks.pop_back();
+    this->block_keys[block] = key;
+  } else {
+    block = this->block_keys.size();
+    this->block_keys.push_back(key);
+    this->block_counts.push_back(0);
+    this->block_cell_starts.resize(this->block_keys.size() * block_cells + 1);
+  }
+  this->block_table[this->blockSlot(key)] = block;
+  return block;
 }
 
-int32_t SpatialGrid::cellCoordToHash(glm::ivec2 cell_coord) {
+template <int D> void SpatialGridT<D>::releaseBlock(const int32_t block) {
+  // Backward shift deletion: entries after the hole that could live in it
+  // move up, so no probe chain is ever cut short and no tombstones pile up.
+  const uint32_t mask = this->block_table.size() - 1;
+  uint32_t hole = this->blockSlot(this->block_keys[block]);
+  this->block_table[hole] = -1;
+  for (uint32_t slot = (hole + 1) & mask; this->block_table[slot] >= 0;
+       slot = (slot + 1) & mask) {
+    const uint32_t home =
+        mix64(this->block_keys[this->block_table[slot]]) & mask;
+    if (((slot - home) & mask) >= ((slot - hole) & mask)) {
+      this->block_table[hole] = this->block_table[slot];
+      this->block_table[slot] = -1;
+      hole = slot;
+    }
+  }
+  this->free_blocks.push_back(block);
+}
 
-  const int32_t prime1 = 15823;
-  const int32_t prime2 = 9737333;
+template <int D> void SpatialGridT<D>::updateBlocks() {
+  // Count particles per cell into block_cell_starts, finding or taking a
+  // block for each tile.
+  std::fill(this->block_counts.begin(), this->block_counts.end(), 0);
+  std::fill(this->block_cell_starts.begin(), this->block_cell_starts.end(),
+            0);
+  for (uint32_t i = 0; i < this->positions.size(); i++) {
+    const ivec cell_coord = this->positionToCellCoord(this->positions[i]);
+    uint32_t local;
+    const uint64_t key = blockKey(cell_coord, local);
+    int32_t block = this->findBlock(key);
+    if (block < 0) {
+      block = this->acquireBlock(key);
+    }
+    const int32_t cell = block * block_cells + local;
+    this->particle_hashes[i] = cell;
+    this->particle_keys[i] = cellKey(cell_coord);
+    this->block_counts[block]++;
+    this->block_cell_starts[cell]++;
+  }
 
-  int32_t hash = std::abs((cell_coord.x * prime1) ^ (cell_coord.y * prime2));
-  hash %= (this->spatial_lookup.size() - 1);
+  // Blocks that emptied go back to the pool. A block is in use while the
+  // table points at it.
+  for (int32_t block = 0; block < (int32_t)this->block_keys.size(); block++) {
+    if (this->block_counts[block] == 0 &&
+        this->findBlock(this->block_keys[block]) == block) {
+      this->releaseBlock(block);
+    }
+  }
 
-  return hash;
+  // Cumulative sum, then fill each cell from its end, as update() does the
+  // buckets. Cells end up in pool order, and a block's cells together.
+  for (uint32_t i = 1; i < this->block_cell_starts.size(); i++) {
+    this->block_cell_starts[i] += this->block_cell_starts[i - 1];
+  }
+  for (uint32_t i = 0; i < this->positions.size(); i++) {
+    const int32_t cell = this->particle_hashes[i];
+    this->block_cell_starts[cell]--;
+    this->spatial_indicies[this->block_cell_starts[cell]] = i;
+    this->spatial_keys[this->block_cell_starts[cell]] = this->particle_keys[i];
+  }
 }
+
+template <int D> bool SpatialGridT<D>::updateIfMoved(const float max_drift) {
+  const float max_drift2 = max_drift * max_drift;
+  bool moved = this->built_positions.size() != this->positions.size();
+  for (uint32_t i = 0; i < this->built_positions.size() && !moved; i++) {
+    const vec drift = this->positions[i] - this->built_positions[i];
+    moved = glm::dot(drift, drift) > max_drift2;
+  }
+  if (!moved) {
+    return false;
+  }
+
+  this->update();
+  this->built_positions = this->positions;
+  return true;
+}
+
+template <int D> void SpatialGridT<D>::invalidate() {
+  this->built_positions.clear();
+}
+
+template <int D>
+void SpatialGridT<D>::cellRange(ivec cell_coord, int32_t &start,
+                                int32_t &end) {
+  if (this->key_mode == CellKeyMode::Blocks) {
+    uint32_t local;
+    const int32_t block = this->findBlock(blockKey(cell_coord, local));
+    if (block < 0) {
+      start = end = 0;
+      return;
+    }
+    const int32_t i = block * block_cells + local;
+    start = this->block_cell_starts[i];
+    end = this->block_cell_starts[i + 1];
+    return;
+  }
+
+  const int32_t hash = this->cellCoordToHash(cell_coord);
+  const uint64_t key = cellKey(cell_coord);
+  const int32_t bucket_end = this->spatial_lookup[hash + 1];
+
+  int32_t i = this->spatial_lookup[hash];
+  while (i < bucket_end && this->spatial_keys[i] < key) {
+    i++;
+  }
+  start = i;
+  while (i < bucket_end && this->spatial_keys[i] == key) {
+    i++;
+  }
+  end = i;
+}
+
+template <int D>
+typename SpatialGridT<D>::ivec SpatialGridT<D>::positionToCellCoord(vec pos) {
+  return ivec(glm::floor(pos / this->cell_width));
+}
+
+template <int D> uint64_t SpatialGridT<D>::cellKey(ivec cell_coord) {
+  return Dimension<D>::cellKey(cell_coord);
+}
+
+template <int D>
+typename SpatialGridT<D>::ivec SpatialGridT<D>::keyToCellCoord(uint64_t key) {
+  return Dimension<D>::keyToCellCoord(key);
+}
+
+template <int D> int32_t SpatialGridT<D>::cellCoordToHash(ivec cell_coord) {
+  const uint32_t bucket_count = this->spatial_lookup.size() - 1;
+
+  if (this->key_mode == CellKeyMode::Hash32) {
+    return Dimension<D>::hash32(cell_coord) % bucket_count;
+  }
+
+  const uint64_t key = mix64(cellKey(cell_coord));
+
+  // Scale the top 32 bits onto [0, bucket_count) rather than taking a
+  // 64-bit modulo, which the GL shader has no cheap way to do.
+  return (int32_t)(((key >> 32) * bucket_count) >> 32);
+}
+
+template <int D> void SpatialGridT<D>::reportHashQuality() {
+  if (this->key_mode == CellKeyMode::Blocks) {
+    this->update();
+    uint32_t cells = 0;
+    for (uint32_t i = 0; i + 1 < this->block_cell_starts.size(); i++) {
+      cells += this->block_cell_starts[i + 1] > this->block_cell_starts[i];
+    }
+    const uint32_t live = this->block_keys.size() - this->free_blocks.size();
+    const size_t bytes = sizeof(int32_t) * (this->block_cell_starts.size() +
+                                            this->block_table.size()) +
+                         (sizeof(uint64_t) + sizeof(uint32_t)) *
+                             this->block_keys.size();
+    std::cout << "blocks: " << cells << " cells in " << live << " blocks ("
+              << this->block_keys.size() << " in the pool, "
+              << this->block_table.size() << " table slots), "
+              << (float)cells / std::max<uint32_t>(live, 1)
+              << " occupied cells per block, " << bytes / 1024
+              << " KiB of cell lookup\n";
+    return;
+  }
+
+  const uint32_t bucket_count = this->spatial_lookup.size() - 1;
+  std::vector<uint32_t> occupancy(bucket_count, 0);
+  // Distinct cells that landed in each bucket.
+  std::unordered_map<uint64_t, int32_t> cells;
+
+  for (const vec &position : this->positions) {
+    const ivec cell_coord = this->positionToCellCoord(position);
+    const int32_t hash = this->cellCoordToHash(cell_coord);
+    occupancy[hash]++;
+    cells.emplace(cellKey(cell_coord), hash);
+  }
+
+  std::vector<uint32_t> cells_per_bucket(bucket_count, 0);
+  for (const auto &cell : cells) {
+    cells_per_bucket[cell.second]++;
+  }
+
+  uint32_t occupied = 0, max_occupancy = 0, shared = 0;
+  double total = 0.0, total_squared = 0.0;
+  for (uint32_t i = 0; i < bucket_count; i++) {
+    if (occupancy[i] == 0) {
+      continue;
+    }
+    occupied++;
+    total += occupancy[i];
+    total_squared += (double)occupancy[i] * occupancy[i];
+    max_occupancy = std::max(max_occupancy, occupancy[i]);
+    shared += cells_per_bucket[i] > 1;
+  }
+
+  const double mean = total / occupied;
+  const double variance = total_squared / occupied - mean * mean;
+  std::cout << (this->key_mode == CellKeyMode::Hash32 ? "hash32" : "packed64")
+            << ": " << cells.size() << " cells in " << occupied << "/"
+            << bucket_count << " buckets, " << mean
+            << " particles per occupied bucket (variance " << variance
+            << ", max " << max_occupancy << "), " << shared
+            << " buckets shared by several cells\n";
+}
+
+template <int D> void SpatialGridT<D>::reportQueryWaste() {
+  const float h = this->cell_width / 2;
+  uint64_t bucket_candidates = 0, duplicate_candidates = 0;
+  uint64_t foreign_candidates = 0, cell_candidates = 0, within_h = 0;
+
+  for (const vec &position : this->positions) {
+    const ivec cell_coord = this->positionToCellCoord(position);
+    int32_t visited[Dimension<D>::stencil_cells];
+    uint32_t visited_count = 0;
+
+    for (uint32_t cell = 0; cell < Dimension<D>::stencil_cells; cell++) {
+      const ivec curr_cell_coord =
+          cell_coord + Dimension<D>::stencilOffset(cell);
+      // Whole bucket, as the stencil walked it before cell keys.
+      if (this->key_mode != CellKeyMode::Blocks) {
+        const int32_t hash = this->cellCoordToHash(curr_cell_coord);
+        const int32_t bucket_start = this->spatial_lookup[hash];
+        const int32_t bucket_end = this->spatial_lookup[hash + 1];
+        bucket_candidates += bucket_end - bucket_start;
+        if (std::find(visited, visited + visited_count, hash) !=
+            visited + visited_count) {
+          duplicate_candidates += bucket_end - bucket_start;
+        } else {
+          visited[visited_count++] = hash;
+        }
+      }
+
+      int32_t start, end;
+      this->cellRange(curr_cell_coord, start, end);
+      cell_candidates += end - start;
+      for (int32_t i = start; i < end; i++) {
+        within_h += glm::distance(
+                        position, this->positions[this->spatial_indicies[i]]) <
+                    h;
+      }
+    }
+  }
+  foreign_candidates = bucket_candidates - duplicate_candidates -
+                       cell_candidates;
+
+  const double count = this->positions.size();
+  if (this->key_mode == CellKeyMode::Blocks) {
+    std::cout << "Candidates per particle: " << cell_candidates / count
+              << " by cell, " << within_h / count << " within h. Wasted: "
+              << 100.0 * (cell_candidates - within_h) / cell_candidates
+              << "%\n";
+    return;
+  }
+  std::cout << "Candidates per particle: " << bucket_candidates / count
+            << " walking whole buckets (" << duplicate_candidates / count
+            << " from buckets visited twice, " << foreign_candidates / count
+            << " from other cells), " << cell_candidates / count
+            << " filtered by cell key, " << within_h / count
+            << " within h. Wasted: "
+            << 100.0 * (bucket_candidates - within_h) / bucket_candidates
+            << "% before, "
+            << 100.0 * (cell_candidates - within_h) / cell_candidates
+            << "% after\n";
+}
+
+template struct SpatialGridT<2>;
+template struct SpatialGridT<3>;
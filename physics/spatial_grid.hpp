@@ -1,20 +1,144 @@
 #pragma once
 #include <cstdint>
+#include <cstdlib>
+#include <cstring>
 #include <vector>
 #include <glm/glm.hpp>
 
-struct SpatialGrid {
+#include "dimension.hpp"
+
+// How a cell coordinate becomes a bucket. The GPU kernels mirror the first
+// two, so keep fluid_sim.cs.glsl and fluid_sim_kernels.cl in step with these.
+//
+//   Hash32:   the original prime xor hash, in wrapping unsigned arithmetic.
+//             Cheap, but clusters once coordinates get large.
+//   Packed64: both coordinates packed into one 64-bit key and run through
+//             the murmur3 finaliser, so every input bit reaches the bucket
+//             index no matter how far from the origin the cell is.
+//   Blocks:   no buckets. Cells come in tiles of block_side^D, allocated
+//             from a pool where particles are and found through a small
+//             table of tiles, so memory goes with the space the particles
+//             take up, a stencil mostly reads one tile, and tiles that empty
+//             go back to the pool without rebuilding anything. CPU only.
+enum class CellKeyMode { Hash32, Packed64, Blocks };
+
+// Particles bucketed by the 2h wide cell they're in, in D = 2 or 3
+// dimensions. Stencils are the 3^D cells around a particle's own. The 2D
+// and 3D grids are compiled in spatial_grid.cpp; everything else uses
+// SpatialGrid, the 2D one.
+template <int D> struct SpatialGridT {
+  using vec = typename Dimension<D>::vec;
+  using ivec = typename Dimension<D>::ivec;
+
   float cell_width;
+  CellKeyMode key_mode;
   // <cell_hash, p_i>
-  std::vector<glm::vec2> &positions;
+  std::vector<vec> &positions;
   std::vector<int32_t> spatial_lookup;
   std::vector<int32_t> spatial_indicies;
+  // Cell key of each entry in spatial_indicies. Unrelated cells can share a
+  // bucket, so queries use these to pick out just the cell they asked for.
+  std::vector<uint64_t> spatial_keys;
+  // Each particle's bucket and key, so update() only hashes once per
+  // particle.
+  std::vector<int32_t> particle_hashes;
+  std::vector<uint64_t> particle_keys;
+  // Positions at the last rebuild by updateIfMoved().
+  std::vector<vec> built_positions;
 
-  SpatialGrid(std::vector<glm::vec2> &_positions, const float smoothing_radius);
+  // CellKeyMode::Blocks. Each pool block is block_cells cells; cell c of
+  // block b holds [block_cell_starts[i], block_cell_starts[i + 1]) of
+  // spatial_indicies, i = b * block_cells + c. particle_hashes hold that i.
+  static constexpr int32_t block_side = 8;
+  static constexpr uint32_t block_cells = D == 2 ? 64 : 512;
+  std::vector<int32_t> block_cell_starts;
+  // Per pool block: its key, and particles in it at the last update. Free
+  // blocks have no particles and are listed in free_blocks.
+  std::vector<uint64_t> block_keys;
+  std::vector<uint32_t> block_counts;
+  std::vector<int32_t> free_blocks;
+  // Open addressing from block key to pool block, linear probing, at most
+  // half full. -1 is an empty slot.
+  std::vector<int32_t> block_table;
 
+  SpatialGridT(std::vector<vec> &_positions, const float smoothing_radius,
+               const CellKeyMode _key_mode = CellKeyMode::Packed64);
+
+  // Follows the number of positions, so particles can come and go between
+  // updates.
   void update();
 
-  glm::ivec2 positionToCellCoord(glm::vec2 pos);
+  // Sizes the arrays for the current number of positions, with one bucket
+  // per particle.
+  void resize();
+
+  // Rebuilds only once some particle has moved more than 'max_drift' since
+  // the last rebuild, and returns whether it did. Cells are 2h wide, so a
+  // 3^D stencil around the cell a particle was filed under still holds
+  // every neighbour within h while max_drift <= h / 2. Only valid for
+  // queries that start from spatial_keys rather than current positions.
+  bool updateIfMoved(const float max_drift);
+
+  // Makes the next updateIfMoved() rebuild, e.g. after particles have been
+  // moved to other indices.
+  void invalidate();
+
+  // Floors, so cells -1 and 0 stay apart around the origin.
+  ivec positionToCellCoord(vec pos);
+
+  static uint64_t cellKey(ivec cell_coord);
+
+  static ivec keyToCellCoord(uint64_t key);
+
+  int32_t cellCoordToHash(ivec key);
 
-  int32_t cellCoordToHash(glm::ivec2 key);
+  // The pool block holding the tile 'key', or -1 if no particle is in it.
+  int32_t findBlock(const uint64_t key) const;
+
+  // [start, end) of spatial_indicies holding exactly the particles in
+  // 'cell_coord'. Ranges for different cells never overlap, even when they
+  // share a bucket, so a stencil built from them has no duplicates.
+  void cellRange(ivec cell_coord, int32_t &start, int32_t &end);
+
+  // Prints how evenly the current positions' cells spread over the buckets:
+  // mean and variance of particles per occupied bucket, the fullest bucket,
+  // and how many buckets hold more than one distinct cell. For Blocks, how
+  // many blocks the cells take and what their lookup costs in memory.
+  void reportHashQuality();
+
+  // Prints candidates per particle for a 3^D stencil: walking whole buckets
+  // (split into duplicates from buckets hit twice and entries from other
+  // cells) versus cellRange(), against how many are actually within h.
+  // Blocks have no buckets, so only the cellRange() part.
+  void reportQueryWaste();
+
+  // update() for CellKeyMode::Blocks.
+  void updateBlocks();
+
+  // The tile key of a cell, and the cell's index within the tile.
+  static uint64_t blockKey(const ivec cell_coord, uint32_t &local);
+
+  // Takes a block from the pool for the tile 'key', or grows the pool.
+  int32_t acquireBlock(const uint64_t key);
+
+  // Gives an empty block back to the pool.
+  void releaseBlock(const int32_t block);
+
+  // Slot of 'key' in block_table, or of the empty slot it would go in.
+  uint32_t blockSlot(const uint64_t key) const;
 };
+
+// Packed64 unless SPH_CELL_KEYS is hash32 or blocks. Blocks only works on the
+// CPU backend.
+inline CellKeyMode cellKeyModeFromEnv() {
+  const char *requested = std::getenv("SPH_CELL_KEYS");
+  if (requested != nullptr && std::strcmp(requested, "hash32") == 0) {
+    return CellKeyMode::Hash32;
+  }
+  if (requested != nullptr && std::strcmp(requested, "blocks") == 0) {
+    return CellKeyMode::Blocks;
+  }
+  return CellKeyMode::Packed64;
+}
+
+using SpatialGrid = SpatialGridT<2>;
@@ -0,0 +1,36 @@
+#include "sweep_and_prune.hpp"
+
+#include <algorithm>
+
+void SweepAndPrune::update(const float *pos_x, const float *radii,
+                           const uint32_t count, const float skin) {
+  const bool rebuild = this->spans.size() != count;
+  if (rebuild) {
+    this->spans.resize(count);
+    for (uint32_t p_i = 0; p_i < count; p_i++) {
+      this->spans[p_i].index = p_i;
+    }
+  }
+
+  const float scale = 1.f + skin;
+  for (Span &span : this->spans) {
+    span.start = pos_x[span.index] - scale * radii[span.index];
+    span.end = pos_x[span.index] + scale * radii[span.index];
+  }
+
+  this->swaps = 0;
+  if (rebuild) {
+    std::sort(this->spans.begin(), this->spans.end(),
+              [](const Span &a, const Span &b) { return a.start < b.start; });
+    return;
+  }
+  for (uint32_t i = 1; i < this->spans.size(); i++) {
+    const Span span = this->spans[i];
+    uint32_t j = i;
+    for (; j > 0 && this->spans[j - 1].start > span.start; j--) {
+      this->spans[j] = this->spans[j - 1];
+    }
+    this->spans[j] = span;
+    this->swaps += i - j;
+  }
+}
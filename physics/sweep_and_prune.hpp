@@ -0,0 +1,72 @@
+#pragma once
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <vector>
+
+#include "fluid_params.hpp"
+
+// Sweep and prune broadphase for discs of any mix of sizes. Each disc spans
+// [x - r, x + r] along x; the spans are kept sorted by where they start, and
+// a sweep only tests the pairs whose spans overlap. A big disc costs the
+// discs that reach into its span, not a cell sized for it that every small
+// disc has to search.
+//
+// Discs move little between steps, so the last step's order is nearly
+// sorted and an insertion sort puts it back in close to linear time.
+// Sweeping one axis, a disc's candidates are every disc in its column of the
+// world, so they grow with the world's width; it pays off for wide size
+// ratios and modest counts, where the grid's cells must fit the biggest disc.
+struct SweepAndPrune {
+  struct Span {
+    float start, end;
+    uint32_t index;
+  };
+  // Sorted by start.
+  std::vector<Span> spans;
+  // Swaps the last update() made, which stay low while motion is coherent.
+  uint64_t swaps = 0;
+
+  // Refreshes every span from the current positions, each widened by
+  // 'skin' times its radius, and re-sorts. A change in count starts again
+  // from scratch, since the indices have changed.
+  void update(const float *pos_x, const float *radii, const uint32_t count,
+              const float skin);
+
+  // Calls fn(a, b) once for every pair of discs whose widened discs
+  // overlap. Returns the number of pairs whose spans overlap.
+  template <typename F>
+  uint64_t forEachPair(const float *pos_x, const float *pos_y,
+                       const float *radii, const float skin, F &&fn) const {
+    uint64_t candidates = 0;
+    const float scale = 1.f + skin;
+    for (uint32_t i = 0; i < this->spans.size(); i++) {
+      const Span &span = this->spans[i];
+      const uint32_t a = span.index;
+      for (uint32_t j = i + 1;
+           j < this->spans.size() && this->spans[j].start < span.end; j++) {
+        candidates++;
+        const uint32_t b = this->spans[j].index;
+        const float contact = scale * (radii[a] + radii[b]);
+        const float dx = pos_x[a] - pos_x[b];
+        const float dy = pos_y[a] - pos_y[b];
+        if (dx * dx + dy * dy < contact * contact) {
+          fn(a, b);
+        }
+      }
+    }
+    return candidates;
+  }
+};
+
+// Grid unless GRANULAR_BROADPHASE=sap or levels.
+inline GranularBroadphase granularBroadphaseFromEnv() {
+  const char *requested = std::getenv("GRANULAR_BROADPHASE");
+  if (requested != nullptr && std::strcmp(requested, "sap") == 0) {
+    return GranularBroadphase::SweepAndPrune;
+  }
+  if (requested != nullptr && std::strcmp(requested, "levels") == 0) {
+    return GranularBroadphase::MultiLevel;
+  }
+  return GranularBroadphase::Grid;
+}
@@ -0,0 +1,43 @@
+#pragma once
+#include <atomic>
+#include <cstdint>
+
+// Single producer, single consumer hand-off of whole frames. The producer
+// always has a slot to write into and the consumer always has the latest
+// complete one to read, so neither side ever waits on the other. Frames the
+// consumer didn't get to in time are simply overwritten.
+template <typename T> struct TripleBuffer {
+  static constexpr uint32_t index_mask = 0x3;
+  // Set on 'middle' when it holds a frame the consumer hasn't seen yet.
+  static constexpr uint32_t fresh_bit = 0x4;
+
+  T slots[3];
+  uint32_t back = 0;  // Owned by the producer.
+  std::atomic<uint32_t> middle{1};
+  uint32_t front = 2; // Owned by the consumer.
+
+  // Producer: the slot to fill in next.
+  T &writeSlot() { return this->slots[this->back]; }
+
+  // Producer: hand the filled slot over and take the middle one back.
+  void publish() {
+    this->back = this->middle.exchange(this->back | fresh_bit,
+                                       std::memory_order_acq_rel) &
+                 index_mask;
+  }
+
+  // Consumer: swap in the latest published frame if there is one. Returns
+  // false if nothing new arrived, in which case readSlot() is unchanged.
+  bool acquire() {
+    if ((this->middle.load(std::memory_order_relaxed) & fresh_bit) == 0) {
+      return false;
+    }
+    this->front =
+        this->middle.exchange(this->front, std::memory_order_acq_rel) &
+        index_mask;
+    return true;
+  }
+
+  // Consumer: the most recently acquired frame.
+  const T &readSlot() const { return this->slots[this->front]; }
+};
@@ -0,0 +1,136 @@
+#pragma once
+#include <glad/glad.h>
+#include <cstdint>
+#include <cstring>
+#include <vector>
+
+// Downloads SSBO contents without stalling the pipeline. Each request copies
+// the buffer into the next slot of a ring of persistently mapped staging
+// buffers and drops a fence behind the copy. The CPU picks the data up a
+// frame or two later, once the fence has signalled, so the GPU keeps working
+// in the meantime.
+class AsyncReadback {
+public:
+  struct Slot {
+    uint32_t buffer = 0;
+    void *mapped = nullptr;
+    GLsync fence = nullptr;
+    size_t size = 0;
+    uint64_t tag = 0;
+  };
+
+  std::vector<Slot> slots;
+  size_t capacity;
+  uint32_t head = 0; // Next slot to write into.
+  uint32_t tail = 0; // Oldest slot still waiting to be consumed.
+  uint32_t in_flight = 0;
+
+  AsyncReadback(const size_t _capacity, const uint32_t ring_size = 3)
+      : slots(ring_size), capacity(_capacity) {
+    const GLbitfield flags =
+        GL_MAP_READ_BIT | GL_MAP_PERSISTENT_BIT | GL_MAP_COHERENT_BIT;
+
+    for (Slot &slot : this->slots) {
+      glGenBuffers(1, &slot.buffer);
+      glBindBuffer(GL_COPY_WRITE_BUFFER, slot.buffer);
+      glBufferStorage(GL_COPY_WRITE_BUFFER, this->capacity, nullptr, flags);
+      slot.mapped =
+          glMapBufferRange(GL_COPY_WRITE_BUFFER, 0, this->capacity, flags);
+    }
+    glBindBuffer(GL_COPY_WRITE_BUFFER, 0);
+  }
+
+  // Owns its GL buffers.
+  AsyncReadback(const AsyncReadback &) = delete;
+  AsyncReadback &operator=(const AsyncReadback &) = delete;
+
+  // Queue a copy of the first 'size' bytes of 'ssbo_id'. Returns false if
+  // every slot is still waiting to be consumed, in which case the request is
+  // dropped rather than blocking.
+  bool request(const uint32_t ssbo_id, const size_t size,
+               const uint64_t tag = 0) {
+    if (this->in_flight == this->slots.size() || size > this->capacity) {
+      return false;
+    }
+
+    Slot &slot = this->slots[this->head];
+
+    // Make shader writes visible to the copy below.
+    glMemoryBarrier(GL_BUFFER_UPDATE_BARRIER_BIT);
+
+    glBindBuffer(GL_COPY_READ_BUFFER, ssbo_id);
+    glBindBuffer(GL_COPY_WRITE_BUFFER, slot.buffer);
+    glCopyBufferSubData(GL_COPY_READ_BUFFER, GL_COPY_WRITE_BUFFER, 0, 0, size);
+    glBindBuffer(GL_COPY_READ_BUFFER, 0);
+    glBindBuffer(GL_COPY_WRITE_BUFFER, 0);
+
+    slot.fence = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+    slot.size = size;
+    slot.tag = tag;
+
+    this->head = (this->head + 1) % this->slots.size();
+    this->in_flight++;
+
+    return true;
+  }
+
+  // Non-blocking. Hands the oldest finished copy to the caller, or returns
+  // nullptr if the GPU has not got there yet. The pointer stays valid until
+  // release() is called.
+  const Slot *poll() {
+    if (this->in_flight == 0) {
+      return nullptr;
+    }
+
+    Slot &slot = this->slots[this->tail];
+    // Flush on the first check so the fence is guaranteed to signal
+    // eventually.
+    const GLenum status =
+        glClientWaitSync(slot.fence, GL_SYNC_FLUSH_COMMANDS_BIT, 0);
+    if (status != GL_ALREADY_SIGNALED && status != GL_CONDITION_SATISFIED) {
+      return nullptr;
+    }
+
+    return &slot;
+  }
+
+  // Return the slot handed out by poll() to the ring.
+  void release() {
+    Slot &slot = this->slots[this->tail];
+    glDeleteSync(slot.fence);
+    slot.fence = nullptr;
+
+    this->tail = (this->tail + 1) % this->slots.size();
+    this->in_flight--;
+  }
+
+  // Convenience wrapper around poll()/release() that copies the data out.
+  template <typename T>
+  bool pollVector(std::vector<T> &destination, uint64_t *tag = nullptr) {
+    const Slot *slot = this->poll();
+    if (slot == nullptr) {
+      return false;
+    }
+
+    destination.resize(slot->size / sizeof(T));
+    std::memcpy(destination.data(), slot->mapped, slot->size);
+    if (tag != nullptr) {
+      *tag = slot->tag;
+    }
+
+    this->release();
+    return true;
+  }
+
+  ~AsyncReadback() {
+    for (Slot &slot : this->slots) {
+      if (slot.fence != nullptr) {
+        glDeleteSync(slot.fence);
+      }
+      glBindBuffer(GL_COPY_WRITE_BUFFER, slot.buffer);
+      glUnmapBuffer(GL_COPY_WRITE_BUFFER);
+      glDeleteBuffers(1, &slot.buffer);
+    }
+    glBindBuffer(GL_COPY_WRITE_BUFFER, 0);
+  }
+};
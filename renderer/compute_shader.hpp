@@ -9,6 +9,8 @@
 #include <glm/gtc/matrix_transform.hpp>
 #include <glm/gtc/type_ptr.hpp>
 
+#include "program_cache.hpp"
+
 class ComputeShader {
 public:
   // Program id
@@ -38,6 +40,13 @@ public:
     }
     const char *cShaderCode = computeCode.c_str();
 
+    // Skip compilation entirely if this driver already built this source.
+    const std::string cache_path =
+        ProgramCache::path(computeCode, this->driverId());
+    if (this->loadCachedBinary(cache_path)) {
+      return;
+    }
+
     // OpenGL shader setup
     // -------------------
     // Compile shader
@@ -58,18 +67,73 @@ public:
     // Shader program
     ID = glCreateProgram();
     glAttachShader(ID, cShader);
+    glProgramParameteri(ID, GL_PROGRAM_BINARY_RETRIEVABLE_HINT, GL_TRUE);
     glLinkProgram(ID);
     // Check for linking errors
     glGetProgramiv(ID, GL_LINK_STATUS, &success);
     if (!success) {
       glGetProgramInfoLog(ID, 512, NULL, infoLog);
       std::cout << "ERROR:SHADER:PROGRAM:LINKING_FAILED\n" << infoLog << "\n";
+    } else {
+      this->storeBinary(cache_path);
     }
 
     // Clean up - shader already linked to shader program so no longer needed
     glDeleteShader(cShader);
   }
 
+  // Identifies the driver for the binary cache; binaries are only valid for
+  // the exact vendor/renderer/version that produced them.
+  std::string driverId() {
+    std::string id;
+    for (const GLenum name : {GL_VENDOR, GL_RENDERER, GL_VERSION}) {
+      const GLubyte *value = glGetString(name);
+      id += value != nullptr ? (const char *)value : "";
+      id += "\n";
+    }
+    return id;
+  }
+
+  bool loadCachedBinary(const std::string &cache_path) {
+    int format_count = 0;
+    glGetIntegerv(GL_NUM_PROGRAM_BINARY_FORMATS, &format_count);
+    if (format_count == 0) {
+      return false;
+    }
+
+    std::vector<unsigned char> binary;
+    uint32_t format;
+    if (!ProgramCache::load(cache_path, binary, format)) {
+      return false;
+    }
+
+    ID = glCreateProgram();
+    glProgramBinary(ID, format, binary.data(), binary.size());
+
+    // The driver may still reject a binary it considers stale; fall back to
+    // compiling from source.
+    int success;
+    glGetProgramiv(ID, GL_LINK_STATUS, &success);
+    if (!success) {
+      glDeleteProgram(ID);
+      return false;
+    }
+    return true;
+  }
+
+  void storeBinary(const std::string &cache_path) {
+    int length = 0;
+    glGetProgramiv(ID, GL_PROGRAM_BINARY_LENGTH, &length);
+    if (length == 0) {
+      return;
+    }
+
+    std::vector<unsigned char> binary(length);
+    GLenum format;
+    glGetProgramBinary(ID, length, NULL, &format, binary.data());
+    ProgramCache::store(cache_path, binary, format);
+  }
+
   // Use/activate the shader
   void use() { glUseProgram(ID); }
 
@@ -86,11 +150,68 @@ public:
     return ssbo;
   }
 
+  // Upload two float streams as one interleaved vec2 buffer. The streams are
+  // packed straight into the mapped buffer without an intermediate AoS copy.
+  // 'y' may be null, in which case the second component is zero.
+  uint32_t setInterleaved(const float *x, const float *y, const uint32_t count,
+                          const uint32_t binding_id) {
+    uint32_t ssbo;
+    const size_t size = 2 * sizeof(float) * count;
+
+    glGenBuffers(1, &ssbo);
+    glBindBuffer(GL_SHADER_STORAGE_BUFFER, ssbo);
+    glBufferData(GL_SHADER_STORAGE_BUFFER, size, NULL, GL_STATIC_DRAW);
+    float *mapped = (float *)glMapBufferRange(
+        GL_SHADER_STORAGE_BUFFER, 0, size,
+        GL_MAP_WRITE_BIT | GL_MAP_INVALIDATE_BUFFER_BIT);
+    for (uint32_t i = 0; i < count; i++) {
+      mapped[2 * i] = x[i];
+      mapped[2 * i + 1] = y != nullptr ? y[i] : 0.f;
+    }
+    glUnmapBuffer(GL_SHADER_STORAGE_BUFFER);
+    glBindBufferBase(GL_SHADER_STORAGE_BUFFER, binding_id, ssbo);
+
+    return ssbo;
+  }
+
+  // Allocate an uninitialised buffer for shader output.
+  uint32_t allocateBuffer(const size_t size, const uint32_t binding_id) {
+    uint32_t ssbo;
+
+    glGenBuffers(1, &ssbo);
+    glBindBuffer(GL_SHADER_STORAGE_BUFFER, ssbo);
+    glBufferData(GL_SHADER_STORAGE_BUFFER, size, NULL, GL_STATIC_DRAW);
+    glBindBufferBase(GL_SHADER_STORAGE_BUFFER, binding_id, ssbo);
+
+    return ssbo;
+  }
+
+  // Bind a buffer that lives across steps, e.g. one from allocateBuffer.
+  void bindBuffer(const uint32_t ssbo_id, const uint32_t binding_id) {
+    glBindBufferBase(GL_SHADER_STORAGE_BUFFER, binding_id, ssbo_id);
+  }
+
+  void writeBuffer(const uint32_t ssbo_id, const void *data,
+                   const size_t size) {
+    glBindBuffer(GL_SHADER_STORAGE_BUFFER, ssbo_id);
+    glBufferSubData(GL_SHADER_STORAGE_BUFFER, 0, size, data);
+  }
+
+  void readBuffer(const uint32_t ssbo_id, void *data, const size_t size) {
+    glBindBuffer(GL_SHADER_STORAGE_BUFFER, ssbo_id);
+    glGetBufferSubData(GL_SHADER_STORAGE_BUFFER, 0, size, data);
+  }
+
   void setFloat(const float value, const std::string &name) {
     uint32_t uniform_loc = glGetUniformLocation(this->ID, name.c_str());
     glUniform1f(uniform_loc, value);
   }
 
+  void setVec2(const glm::vec2 &value, const std::string &name) {
+    uint32_t uniform_loc = glGetUniformLocation(this->ID, name.c_str());
+    glUniform2fv(uniform_loc, 1, glm::value_ptr(value));
+  }
+
   void setUnsignedInt(const uint32_t value, const std::string &name) {
     uint32_t uniform_loc = glGetUniformLocation(this->ID, name.c_str());
     glUniform1ui(uniform_loc, value);
@@ -103,6 +224,22 @@ public:
                        sizeof(T) * desintation.size(), desintation.data());
   }
 
+  // Inverse of setInterleaved. 'y' may be null to drop the second component.
+  void extractInterleaved(uint32_t ssbo_id, float *x, float *y,
+                          const uint32_t count) {
+    glBindBuffer(GL_SHADER_STORAGE_BUFFER, ssbo_id);
+    const float *mapped = (const float *)glMapBufferRange(
+        GL_SHADER_STORAGE_BUFFER, 0, 2 * sizeof(float) * count,
+        GL_MAP_READ_BIT);
+    for (uint32_t i = 0; i < count; i++) {
+      x[i] = mapped[2 * i];
+      if (y != nullptr) {
+        y[i] = mapped[2 * i + 1];
+      }
+    }
+    glUnmapBuffer(GL_SHADER_STORAGE_BUFFER);
+  }
+
   void executeSync(const uint32_t work_group_size) {
     // Dispatch workers.
     // Dispatch in multiples of 64 due to 'warp size'.
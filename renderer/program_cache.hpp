@@ -0,0 +1,94 @@
+#pragma once
+#include <cstdint>
+#include <filesystem>
+#include <fstream>
+#include <iomanip>
+#include <sstream>
+#include <string>
+#include <vector>
+#include <unistd.h>
+
+// On-disk cache of compiled program binaries, shared by the GL compute shader
+// and the OpenCL backend. Entries are keyed by a hash of the source plus the
+// device and driver that produced them, so a different GPU or a driver update
+// just misses and falls back to compiling from source.
+struct ProgramCache {
+  static constexpr uint32_t magic = 0x50434348; // "PCCH"
+
+  static uint64_t hash(const std::string &data,
+                       uint64_t hash = 14695981039346656037ull) {
+    // FNV-1a
+    for (const unsigned char c : data) {
+      hash ^= c;
+      hash *= 1099511628211ull;
+    }
+    return hash;
+  }
+
+  // 'device_id' should identify the device, driver version and anything else
+  // (e.g. build options) that changes the binary.
+  static std::string path(const std::string &source,
+                          const std::string &device_id) {
+    std::stringstream ss;
+    ss << "./.program_cache/" << std::hex << std::setw(16)
+       << std::setfill('0') << hash(source) << "-" << std::setw(16)
+       << hash(device_id) << ".bin";
+    return ss.str();
+  }
+
+  // Returns false on a miss or a truncated/foreign file.
+  static bool load(const std::string &path, std::vector<unsigned char> &binary,
+                   uint32_t &format) {
+    std::ifstream file(path, std::ios::binary);
+    if (!file.is_open()) {
+      return false;
+    }
+
+    uint32_t file_magic = 0;
+    uint64_t size = 0;
+    file.read((char *)&file_magic, sizeof(file_magic));
+    file.read((char *)&format, sizeof(format));
+    file.read((char *)&size, sizeof(size));
+    if (!file || file_magic != magic || size == 0) {
+      return false;
+    }
+
+    binary.resize(size);
+    file.read((char *)binary.data(), size);
+    return (bool)file;
+  }
+
+  // Failing to write the cache is not an error; the next run just compiles
+  // again.
+  static void store(const std::string &path,
+                    const std::vector<unsigned char> &binary,
+                    const uint32_t format) {
+    std::error_code error;
+    std::filesystem::create_directories(
+        std::filesystem::path(path).parent_path(), error);
+
+    // Write to a temporary file and rename, so concurrent runs never see a
+    // half written entry.
+    const std::string tmp_path = path + "." + std::to_string(getpid());
+    std::ofstream file(tmp_path, std::ios::binary | std::ios::trunc);
+    if (!file.is_open()) {
+      return;
+    }
+
+    const uint64_t size = binary.size();
+    file.write((const char *)&magic, sizeof(magic));
+    file.write((const char *)&format, sizeof(format));
+    file.write((const char *)&size, sizeof(size));
+    file.write((const char *)binary.data(), size);
+    // Closing flushes, which can fail too.
+    file.close();
+    if (!file) {
+      std::filesystem::remove(tmp_path, error);
+      return;
+    }
+    std::filesystem::rename(tmp_path, path, error);
+    if (error) {
+      std::filesystem::remove(tmp_path, error);
+    }
+  }
+};
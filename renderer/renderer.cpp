@@ -7,35 +7,16 @@
 #include "shader.hpp"
 
 Renderer::Renderer(PhysicSolver &_solver)
-    : solver(_solver), shader("renderer/shaders/circle.vs.glsl",
-                              "renderer/shaders/circle.fs.glsl"){};
+    : solver(_solver),
+      shader("renderer/shaders/circle.vs.glsl",
+             "renderer/shaders/circle.fs.glsl"),
+      vertex_data(_solver.particle_count * 6),
+      drawn_count(_solver.particle_count) {
+  glGenVertexArrays(1, &this->vao);
+  glGenBuffers(1, &this->vbo);
 
-void Renderer::drawParticles() {
-  const uint32_t particle_count = this->solver.particle_count;
-
-  // Vertex data: [pos_x, pos_y, radius, col_y, col_g, col_b];
-  float vertex_data[particle_count * 6];
-
-  for (uint32_t i = 0; i < particle_count; i++) {
-
-    vertex_data[i * 6] = this->solver.particles.positions[i].x;
-    vertex_data[i * 6 + 1] = this->solver.particles.positions[i].y;
-    vertex_data[i * 6 + 2] = this->solver.particle_radius;
-    vertex_data[i * 6 + 3] = this->solver.particles.colours[i].r;
-    vertex_data[i * 6 + 4] = this->solver.particles.colours[i].g;
-    vertex_data[i * 6 + 5] = this->solver.particles.colours[i].b;
-  }
-
-  uint32_t vao, vbo;
-
-  glGenVertexArrays(1, &vao);
-  glGenBuffers(1, &vbo);
-
-  glBindVertexArray(vao);
-
-  glBindBuffer(GL_ARRAY_BUFFER, vbo);
-  glBufferData(GL_ARRAY_BUFFER, sizeof(vertex_data), vertex_data,
-               GL_STATIC_DRAW);
+  glBindVertexArray(this->vao);
+  glBindBuffer(GL_ARRAY_BUFFER, this->vbo);
 
   glVertexAttribPointer(0, 2, GL_FLOAT, GL_FALSE, 6 * sizeof(float), (void *)0);
   glVertexAttribPointer(1, 1, GL_FLOAT, GL_FALSE, 6 * sizeof(float),
@@ -47,6 +28,41 @@ void Renderer::drawParticles() {
   glEnableVertexAttribArray(1);
   glEnableVertexAttribArray(2);
 
+  // The solver seeds every slot with the spawn state.
+  this->uploadFrame(this->solver.frames.readSlot());
+};
+
+Renderer::~Renderer() {
+  glDeleteVertexArrays(1, &this->vao);
+  glDeleteBuffers(1, &this->vbo);
+}
+
+void Renderer::uploadFrame(const RenderFrame &frame) {
+  // The solver may have added or removed particles since the last frame.
+  this->drawn_count = frame.positions.size();
+  this->vertex_data.resize(this->drawn_count * 6);
+  for (uint32_t i = 0; i < this->drawn_count; i++) {
+    this->vertex_data[i * 6] = frame.positions[i].x;
+    this->vertex_data[i * 6 + 1] = frame.positions[i].y;
+    this->vertex_data[i * 6 + 2] = frame.radii[i];
+    this->vertex_data[i * 6 + 3] = frame.colours[i].r;
+    this->vertex_data[i * 6 + 4] = frame.colours[i].g;
+    this->vertex_data[i * 6 + 5] = frame.colours[i].b;
+  }
+
+  glBindBuffer(GL_ARRAY_BUFFER, this->vbo);
+  glBufferData(GL_ARRAY_BUFFER, sizeof(float) * this->vertex_data.size(),
+               this->vertex_data.data(), GL_STREAM_DRAW);
+}
+
+void Renderer::drawParticles() {
+  // Only rebuild the vertex data when a new frame has arrived.
+  if (this->solver.frames.acquire()) {
+    this->uploadFrame(this->solver.frames.readSlot());
+  }
+
+  glBindVertexArray(this->vao);
+
   float default_point_size = 10.0f;
   glEnable(GL_PROGRAM_POINT_SIZE); // Enable point size control in shader
   glPointSize(default_point_size);
@@ -56,5 +72,5 @@ void Renderer::drawParticles() {
   this->shader.use();
   shader.setMat4("projection", projection);
 
-  glDrawArrays(GL_POINTS, 0, particle_count);
+  glDrawArrays(GL_POINTS, 0, this->drawn_count);
 };
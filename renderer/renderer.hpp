@@ -2,9 +2,23 @@
 #include "../physics/physics.hpp"
 #include "shader.hpp"
 
+#include <vector>
+
 struct Renderer {
   PhysicSolver &solver;
   Shader shader;
+  uint32_t vao, vbo;
+  // Vertex data: [pos_x, pos_y, radius, col_y, col_g, col_b];
+  std::vector<float> vertex_data;
+  // Particles in the last uploaded frame.
+  uint32_t drawn_count;
+
   Renderer(PhysicSolver &_solver);
+  ~Renderer();
+
+  // Draws the latest frame the solver has published, or the previous one
+  // again if the solver hasn't finished a new one yet.
   void drawParticles();
+
+  void uploadFrame(const RenderFrame &frame);
 };
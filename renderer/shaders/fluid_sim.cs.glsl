@@ -26,13 +26,55 @@ layout(std430, binding = 5) buffer ssbo6 {
     int spatial_indicies[];
 };
 
+// Written by calcDensity, read by applyFluidForces. See
+// physics/neighbour_list.hpp for the two layouts. PBF writes its own lists
+// here with pbfNeighbours, always max_neighbours apart.
+layout(std430, binding = 6) buffer ssbo7 {
+    int neighbour_list[];
+};
+
+// (offset into neighbour_list, count), count -1 on overflow.
+layout(std430, binding = 7) buffer ssbo8 {
+    ivec2 neighbour_offsets[];
+};
+
+// Slots handed out, and particles that didn't fit.
+layout(std430, binding = 8) buffer ssbo9 {
+    uint neighbour_total;
+    uint neighbour_overflows;
+};
+
+// Boundary signed distance field, see physics/sdf.hpp.
+layout(std430, binding = 9) buffer ssbo10 {
+    float sdf[];
+};
+
+// Disc radii, SolverMode::Granular only.
+layout(std430, binding = 10) buffer ssbo11 {
+    float radii[];
+};
+
+// GranularCells::ranges, 5 [start, end) ranges of spatial_indicies per cell.
+layout(std430, binding = 11) buffer ssbo12 {
+    int granular_ranges[];
+};
+
 // Determines which kernel function is actually executed.
 uniform uint kernel_id;
 
 uniform float dt;
 uniform uint particle_count; 
 uniform uint bucket_count;
-const uint max_neighbour_query_size = 1024;
+const uint max_neighbours = 64;
+const uint neighbour_layout_fixed_stride = 0;
+const uint neighbour_layout_compact = 1;
+
+const uint cell_key_mode_hash32 = 0;
+const uint cell_key_mode_packed64 = 1;
+
+uniform uint neighbour_layout;
+uniform uint cell_key_mode;
+uniform uint neighbour_capacity;
 const float pi = 3.14159265359;
 
 uniform float h; // smoothing_radius
@@ -45,11 +87,48 @@ uniform float pressure_multiplier;
 uniform float near_pressure_multiplier;
 uniform float viscosity_strength;
 
+// Position Based Fluids, see PbfParams.
+uniform float rest_density;
+uniform float pbf_relaxation;
+uniform float s_corr_k;
+uniform float s_corr_scale; // 1 / W(delta_q)
+uniform float xsph_viscosity;
+uniform float pbf_list_radius; // h * (1 + PbfParams::neighbour_skin)
+uniform vec2 min_pos;
+uniform vec2 max_pos;
+
+// Granular discs, see GranularParams. granularProject runs one invocation
+// per cell of one colour, [granular_cell_first, + granular_cell_count).
+uniform float granular_stiffness;
+uniform uint granular_cell_first;
+uniform uint granular_cell_count;
+
+// Boundary, see PhysicSolver::constrainParticles.
+uniform float particle_radius;
+uniform float boundary_damp;
+uniform vec2 sdf_origin;
+uniform float sdf_inv_cell_size;
+uniform uint sdf_width;
+uniform uint sdf_height;
+
 void calcDensity(int p_i);
 void applyFluidForces(int p_i);
+void pbfLambda(int p_i);
+void pbfDelta(int p_i);
+void pbfApply(int p_i);
+void pbfXsph(int p_i);
+void constrainToSdf(int p_i);
+void granularProject(int c);
+void pbfNeighbours(int p_i);
 
 void main() {
     int p_i = int(gl_GlobalInvocationID.x); 
+    // One invocation per cell, not per particle.
+    if (kernel_id == 7) {
+        if (p_i < granular_cell_count)
+            granularProject(int(granular_cell_first) + p_i);
+        return;
+    }
     // Since each work group has 64 local workers, must do range check because particle count is probably not a multiple of 64.
     if (p_i >= particle_count) 
         return;
@@ -60,6 +139,24 @@ void main() {
     else if (kernel_id == 1) {
         applyFluidForces(p_i);
     }
+    else if (kernel_id == 2) {
+        pbfLambda(p_i);
+    }
+    else if (kernel_id == 3) {
+        pbfDelta(p_i);
+    }
+    else if (kernel_id == 4) {
+        pbfApply(p_i);
+    }
+    else if (kernel_id == 5) {
+        pbfXsph(p_i);
+    }
+    else if (kernel_id == 6) {
+        constrainToSdf(p_i);
+    }
+    else if (kernel_id == 8) {
+        pbfNeighbours(p_i);
+    }
 }
 
 float poly6Kernel(float r) {
@@ -75,56 +172,110 @@ float laplacianKernel(float r) {
 }
 
 ivec2 posToCellCoord(vec2 pos) {
-    return ivec2(pos / cell_width);
+    return ivec2(floor(pos / cell_width));
+}
+
+// 64-bit helpers for the packed cell key, as (hi, lo) pairs.
+uvec2 mul64(uvec2 a, uvec2 b) {
+    uint hi, lo;
+    umulExtended(a.y, b.y, hi, lo);
+    hi += a.x * b.y + a.y * b.x;
+    return uvec2(hi, lo);
 }
 
+// x ^= x >> 33
+uvec2 xorShift33(uvec2 x) {
+    return uvec2(x.x, x.y ^ (x.x >> 1));
+}
+
+// Must match SpatialGrid::cellCoordToHash.
 int cellCoordToHash(ivec2 cell_coord) {
-    int prime1 = 15823;
-    int prime2 = 9737333;
+    if (cell_key_mode == cell_key_mode_hash32) {
+        uint prime1 = 15823u;
+        uint prime2 = 9737333u;
 
-    int hash = abs((cell_coord.x * prime1) ^ (cell_coord.y * prime2));
-    hash %= int(bucket_count);
+        uint hash = (uint(cell_coord.x) * prime1) ^ (uint(cell_coord.y) * prime2);
+        return int(hash % bucket_count);
+    }
 
-    return hash;
+    // murmur3 fmix64 of the packed (x, y) key
+    uvec2 key = uvec2(cell_coord);
+    key = xorShift33(key);
+    key = mul64(key, uvec2(0xff51afd7u, 0xed558ccdu));
+    key = xorShift33(key);
+    key = mul64(key, uvec2(0xc4ceb9feu, 0x1a85ec53u));
+    key = xorShift33(key);
+
+    uint bucket, unused;
+    umulExtended(key.x, bucket_count, bucket, unused);
+    return int(bucket);
 }
 
 void calcDensity(int p_i) {
     vec2 pos = positions[p_i];
     ivec2 cell_coord = posToCellCoord(pos);
 
-    int query[max_neighbour_query_size];
-    uint query_size = 0;
+    int neighbours[max_neighbours];
+    uint neighbour_count = 0;
+    bool overflow = false;
+
+    float density =  0.0;
+    float density_near = 0.0;
 
-    // Get neighbours
+    // Walk the neighbouring cells once, keeping everything within h for the
+    // force pass. Two cells of the stencil can share a bucket, so walk each
+    // bucket only once.
+    int visited[9];
+    int visited_count = 0;
     for (int y = cell_coord.y - 1; y <= cell_coord.y + 1; y++) {
         for (int x = cell_coord.x - 1; x <= cell_coord.x + 1; x++) {
             ivec2 curr_cell_coord = ivec2(x, y);
             int curr_hash = cellCoordToHash(curr_cell_coord);
+            bool seen = false;
+            for (int v = 0; v < visited_count; v++)
+                seen = seen || visited[v] == curr_hash;
+            if (seen)
+                continue;
+            visited[visited_count++] = curr_hash;
 
             int start = spatial_lookup[curr_hash];
             int end = spatial_lookup[curr_hash + 1];
 
             for (int i = start; i < end; i++) {
-                query[query_size] = spatial_indicies[i];
-                query_size++;
+                int n_i = spatial_indicies[i];
+                const float r = distance(pos, positions[n_i]);
+                if (r < h) {
+                    density += particle_mass * poly6Kernel(r);
+                    // density_near += a * a * a * kern_near;
+                    if (neighbour_count < max_neighbours) {
+                        neighbours[neighbour_count] = n_i;
+                        neighbour_count++;
+                    } else {
+                        overflow = true;
+                    }
+                }
             }
         }
     }
 
-    float density =  0.0;
-    float density_near = 0.0;
+    densities[p_i][0] = density;
+    densities[p_i][1] = density_near;
 
-    for (int i = 0; i < query_size; i++) {
-        const float r = distance(pos, positions[query[i]]);
-        if (r < h) {
-            density += particle_mass * poly6Kernel(r);
-            // density_near += a * a * a * kern_near;
-        }
+    uint offset = uint(p_i) * max_neighbours;
+    if (neighbour_layout == neighbour_layout_compact && !overflow) {
+        offset = atomicAdd(neighbour_total, neighbour_count);
+        overflow = offset + neighbour_count > neighbour_capacity;
+    }
+    if (overflow) {
+        neighbour_offsets[p_i] = ivec2(0, -1);
+        atomicAdd(neighbour_overflows, 1u);
+        return;
     }
 
-    // densities[p_i][0] = density;
-    densities[p_i][0] = density;
-    densities[p_i][1] = density_near;
+    for (uint i = 0; i < neighbour_count; i++) {
+        neighbour_list[offset + i] = neighbours[i];
+    }
+    neighbour_offsets[p_i] = ivec2(offset, neighbour_count);
 }
 
 vec2 densityToPressure(float density, float near_density) {
@@ -133,29 +284,34 @@ vec2 densityToPressure(float density, float near_density) {
     return vec2(pressure, near_pressure);
 }
 
-void applyFluidForces(int p_i) {
-    vec2 pos = positions[p_i];
-    ivec2 cell_coord = posToCellCoord(pos);
+void addNeighbourForce(int p_i, int n_i, vec2 pos, vec2 curr_dual_pressure,
+                       inout vec2 pressure_force, inout vec2 visc_force) {
+    // Skip self
+    if (n_i == p_i)
+        return;
 
-    int query[max_neighbour_query_size]; 
-    uint query_size = 0;
+    const float r = distance(pos, positions[n_i]);
+    if (r < h) {
+        float neighbour_density = densities[n_i][0];    
+        float neighbour_near_density = densities[n_i][1];    
 
-    // Get neighbours
-    for (int y = cell_coord.y - 1; y <= cell_coord.y + 1; y++) {
-        for (int x = cell_coord.x - 1; x <= cell_coord.x + 1; x++) {
-            ivec2 curr_cell_coord = ivec2(x, y);
-            int curr_hash = cellCoordToHash(curr_cell_coord);
+        vec2 neighbour_dual_pressure = densityToPressure(neighbour_density, neighbour_near_density);
+        float neighbour_pressure = neighbour_dual_pressure[0];
+        float neighbour_near_pressure = neighbour_dual_pressure[1];
 
-            int start = spatial_lookup[curr_hash];
-            int end = spatial_lookup[curr_hash + 1];
+        float shared_pressure = 0.5 * (curr_dual_pressure[0] + neighbour_pressure);
+        float shared_near_pressure = 0.5 * (curr_dual_pressure[1] + neighbour_near_pressure);
 
-            for (int i = start; i < end; i++) {
-                query[query_size] = spatial_indicies[i];
-                query_size++;
-            }
-        }
+        // vec2 rij = r == 0 ? vec2(0.0, 1.0) : normalize(positions[n_i] - pos);
+        vec2 rij = normalize(positions[n_i] - pos);
+
+        pressure_force += -rij * particle_mass * spikyGradKernel(r) * shared_pressure / neighbour_density;
+        visc_force += particle_mass * laplacianKernel(r) * (velocities[n_i] - velocities[p_i]) / neighbour_density;
     }
+}
 
+void applyFluidForces(int p_i) {
+    vec2 pos = positions[p_i];
 
     vec2 pressure_force = vec2(0.0 ,0.0);
     vec2 visc_force = vec2(0.0, 0.0);
@@ -163,39 +319,247 @@ void applyFluidForces(int p_i) {
     float curr_density = densities[p_i][0];
     float curr_near_density = densities[p_i][1];
     vec2 curr_dual_pressure = densityToPressure(curr_density, curr_near_density);
-    float curr_pressure = curr_dual_pressure[0];
-    float curr_near_pressure = curr_dual_pressure[1];
 
-    for (int i = 0; i < query_size; i++) {
-        // Skip self
-        if (query[i] == p_i)
-            continue;
+    ivec2 neighbour_offset = neighbour_offsets[p_i];
+    if (neighbour_offset[1] >= 0) {
+        // Use the list calcDensity left behind.
+        int end = neighbour_offset[0] + neighbour_offset[1];
+        for (int i = neighbour_offset[0]; i < end; i++) {
+            addNeighbourForce(p_i, neighbour_list[i], pos, curr_dual_pressure,
+                              pressure_force, visc_force);
+        }
+    } else {
+        // Didn't fit in the list; walk the grid instead.
+        ivec2 cell_coord = posToCellCoord(pos);
+        // Two cells of the stencil can share a bucket; walk each bucket once.
+        int visited[9];
+        int visited_count = 0;
+        for (int y = cell_coord.y - 1; y <= cell_coord.y + 1; y++) {
+            for (int x = cell_coord.x - 1; x <= cell_coord.x + 1; x++) {
+                ivec2 curr_cell_coord = ivec2(x, y);
+                int curr_hash = cellCoordToHash(curr_cell_coord);
+                bool seen = false;
+                for (int v = 0; v < visited_count; v++)
+                    seen = seen || visited[v] == curr_hash;
+                if (seen)
+                    continue;
+                visited[visited_count++] = curr_hash;
+
+                int start = spatial_lookup[curr_hash];
+                int end = spatial_lookup[curr_hash + 1];
+
+                for (int i = start; i < end; i++) {
+                    addNeighbourForce(p_i, spatial_indicies[i], pos,
+                                      curr_dual_pressure, pressure_force,
+                                      visc_force);
+                }
+            }
+        }
+    }
 
-        const float r = distance(pos, positions[query[i]]);
-        if (r < h) {
-            float neighbour_density = densities[query[i]][0];    
-            float neighbour_near_density = densities[query[i]][1];    
+    visc_force *= viscosity_strength;
 
-            vec2 neighbour_dual_pressure = densityToPressure(neighbour_density, neighbour_near_density);
-            float neighbour_pressure = neighbour_dual_pressure[0];
-            float neighbour_near_pressure = neighbour_dual_pressure[1];
+    vec2 grav_force = vec2(0.0, -9.81) * particle_mass / curr_density;
+    // vec2 grav_force = vec2(0.0, 0.0) * curr_density;
+    forces[p_i] = pressure_force + visc_force + grav_force;
+    // forces[p_i] = grav_force;
+}
 
-            float shared_pressure = 0.5 * (curr_pressure + neighbour_pressure);
-            float shared_near_pressure = 0.5 * (curr_near_pressure + neighbour_near_pressure);
+// Distinct buckets of the 3x3 stencil around cell_coord.
+int stencilBuckets(ivec2 cell_coord, out int buckets[9]) {
+    int count = 0;
+    for (int y = cell_coord.y - 1; y <= cell_coord.y + 1; y++) {
+        for (int x = cell_coord.x - 1; x <= cell_coord.x + 1; x++) {
+            int curr_hash = cellCoordToHash(ivec2(x, y));
+            bool seen = false;
+            for (int v = 0; v < count; v++)
+                seen = seen || buckets[v] == curr_hash;
+            if (!seen) {
+                buckets[count] = curr_hash;
+                count++;
+            }
+        }
+    }
+    return count;
+}
 
-            // vec2 rij = r == 0 ? vec2(0.0, 1.0) : normalize(positions[query[i]] - pos);
-            vec2 rij = normalize(positions[query[i]] - pos);
+// Position Based Fluids, as in CpuCompute::solvePbf: pbfNeighbours lists
+// everyone within pbf_list_radius of the predicted positions once, and every
+// iteration and the XSPH pass read that list, so the GPU sees exactly the
+// CPU's neighbours. In this mode densities holds (rho, lambda) and forces is
+// scratch.
 
-            pressure_force += -rij * particle_mass * spikyGradKernel(r) * shared_pressure / neighbour_density;
-            visc_force += particle_mass * laplacianKernel(r) * (velocities[query[i]] - velocities[p_i]) / neighbour_density;
+float pbfPoly6(float r2) {
+    float x = h2 - r2;
+    return 4.0 / (pi * pow(h, 8)) * x * x * x;
+}
 
+float pbfSpikyGrad(float r) {
+    return -30.0 / (pi * pow(h, 5)) * (h - r) * (h - r);
+}
+
+// Like CpuCompute::buildNeighbourLists, keeping the first max_neighbours.
+void pbfNeighbours(int p_i) {
+    vec2 pos = positions[p_i];
+    float radius2 = pbf_list_radius * pbf_list_radius;
+    uint offset = uint(p_i) * max_neighbours;
+
+    int buckets[9];
+    int bucket_count_in_stencil = stencilBuckets(posToCellCoord(pos), buckets);
+
+    uint count = 0;
+    for (int b = 0; b < bucket_count_in_stencil; b++) {
+        int end = spatial_lookup[buckets[b] + 1];
+        for (int i = spatial_lookup[buckets[b]]; i < end; i++) {
+            int n_i = spatial_indicies[i];
+            vec2 d = pos - positions[n_i];
+            if (dot(d, d) < radius2 && count < max_neighbours) {
+                neighbour_list[offset + count] = n_i;
+                count++;
+            }
         }
     }
+    neighbour_offsets[p_i] = ivec2(offset, count);
+}
 
-    visc_force *= viscosity_strength;
+void pbfLambda(int p_i) {
+    vec2 pos = positions[p_i];
+    float volume = particle_mass / rest_density;
 
-    vec2 grav_force = vec2(0.0, -9.81) * particle_mass / curr_density;
-    // vec2 grav_force = vec2(0.0, 0.0) * curr_density;
-    forces[p_i] = pressure_force + visc_force + grav_force;
-    // forces[p_i] = grav_force;
+    float rho = 0.0;
+    vec2 grad_i = vec2(0.0, 0.0);
+    float grad_sum = 0.0;
+
+    int end = neighbour_offsets[p_i][0] + neighbour_offsets[p_i][1];
+    for (int i = neighbour_offsets[p_i][0]; i < end; i++) {
+        vec2 d = pos - positions[neighbour_list[i]];
+        float r2 = dot(d, d);
+        if (r2 >= h2)
+            continue;
+        rho += particle_mass * pbfPoly6(r2);
+        float r = sqrt(r2);
+        if (r == 0.0)
+            continue;
+        vec2 grad_j = volume * pbfSpikyGrad(r) * d / r;
+        grad_i += grad_j;
+        grad_sum += dot(grad_j, grad_j);
+    }
+    grad_sum += dot(grad_i, grad_i);
+
+    // Only push apart; a free surface is allowed to be under-dense.
+    float constraint = max(rho / rest_density - 1.0, 0.0);
+    densities[p_i] = vec2(rho, -constraint / (grad_sum + pbf_relaxation));
+}
+
+void pbfDelta(int p_i) {
+    vec2 pos = positions[p_i];
+    float volume = particle_mass / rest_density;
+    float lambda = densities[p_i][1];
+
+    vec2 delta = vec2(0.0, 0.0);
+    int end = neighbour_offsets[p_i][0] + neighbour_offsets[p_i][1];
+    for (int i = neighbour_offsets[p_i][0]; i < end; i++) {
+        int n_i = neighbour_list[i];
+        vec2 d = pos - positions[n_i];
+        float r2 = dot(d, d);
+        if (n_i == p_i || r2 >= h2)
+            continue;
+        float r = sqrt(r2);
+        if (r == 0.0)
+            continue;
+
+        float ratio = pbfPoly6(r2) * s_corr_scale;
+        float s_corr = -s_corr_k * ratio * ratio * ratio * ratio;
+        delta += (lambda + densities[n_i][1] + s_corr) * volume *
+                 pbfSpikyGrad(r) * d / r;
+    }
+    forces[p_i] = delta;
+}
+
+// Move by the correction, clamped to the world, and fold what was actually
+// applied into the velocity so it ends up as (x - x_old) / dt.
+void pbfApply(int p_i) {
+    vec2 pos = clamp(positions[p_i] + forces[p_i], min_pos, max_pos);
+    velocities[p_i] += (pos - positions[p_i]) / dt;
+    positions[p_i] = pos;
+}
+
+// XSPH viscosity, into forces so every invocation reads the same velocities.
+void pbfXsph(int p_i) {
+    vec2 pos = positions[p_i];
+    float volume = particle_mass / rest_density;
+
+    vec2 dv = vec2(0.0, 0.0);
+    int end = neighbour_offsets[p_i][0] + neighbour_offsets[p_i][1];
+    for (int i = neighbour_offsets[p_i][0]; i < end; i++) {
+        int n_i = neighbour_list[i];
+        vec2 d = pos - positions[n_i];
+        float r2 = dot(d, d);
+        if (r2 < h2)
+            dv += (velocities[n_i] - velocities[p_i]) * volume * pbfPoly6(r2);
+    }
+    forces[p_i] = velocities[p_i] + xsph_viscosity * dv;
+}
+
+// Push out along the SDF gradient to particle_radius from the surface and
+// reflect any velocity into it, as in constrainToSdfRange.
+void constrainToSdf(int p_i) {
+    vec2 g = clamp((positions[p_i] - sdf_origin) * sdf_inv_cell_size, vec2(0.0),
+                   vec2(float(sdf_width) - 1.001, float(sdf_height) - 1.001));
+    vec2 cell = floor(g);
+    vec2 f = g - cell;
+    uint i = uint(cell.y) * sdf_width + uint(cell.x);
+
+    float d00 = sdf[i];
+    float d10 = sdf[i + 1];
+    float d01 = sdf[i + sdf_width];
+    float d11 = sdf[i + sdf_width + 1];
+    float dist = mix(mix(d00, d10, f.x), mix(d01, d11, f.x), f.y);
+    vec2 gradient = vec2(mix(d10 - d00, d11 - d01, f.y),
+                         mix(d01 - d00, d11 - d10, f.x));
+
+    if (dist >= particle_radius || gradient == vec2(0.0))
+        return;
+    vec2 normal = normalize(gradient);
+    positions[p_i] += (particle_radius - dist) * normal;
+    float into = dot(velocities[p_i], normal);
+    if (into < 0.0)
+        velocities[p_i] -= (1.0 + boundary_damp) * into * normal;
+}
+
+// Gauss-Seidel, as in CpuCompute::solveGranular: projects the pair apart
+// if they overlap, splitting the move by inverse mass, and folds the move
+// into both velocities.
+void granularProjectPair(int a, int b) {
+    vec2 d = positions[a] - positions[b];
+    float contact = radii[a] + radii[b];
+    float r2 = dot(d, d);
+    if (r2 >= contact * contact || r2 == 0.0)
+        return;
+    float r = sqrt(r2);
+    float w_a = 1.0 / (radii[a] * radii[a]);
+    float w_b = 1.0 / (radii[b] * radii[b]);
+    float s = granular_stiffness * (contact - r) / (r * (w_a + w_b));
+    float inv_dt = 1.0 / dt;
+    positions[a] += w_a * s * d;
+    positions[b] -= w_b * s * d;
+    velocities[a] += w_a * s * d * inv_dt;
+    velocities[b] -= w_b * s * d * inv_dt;
+}
+
+// Cell c's discs against the rest of its cell and the cells ahead of it.
+// The cells of one colour never share a disc, so they run at once.
+void granularProject(int c) {
+    int base = 10 * c;
+    int own_end = granular_ranges[base + 1];
+    for (int i = granular_ranges[base]; i < own_end; i++) {
+        int p_i = spatial_indicies[i];
+        for (int j = i + 1; j < own_end; j++)
+            granularProjectPair(p_i, spatial_indicies[j]);
+        for (int cell = 1; cell < 5; cell++) {
+            int end = granular_ranges[base + 2 * cell + 1];
+            for (int j = granular_ranges[base + 2 * cell]; j < end; j++)
+                granularProjectPair(p_i, spatial_indicies[j]);
+        }
+    }
 }
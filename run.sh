@@ -1,2 +1,2 @@
-g++ -g main.cpp physics/spatial_grid.cpp physics/particles.cpp physics/physics.cpp renderer/renderer.cpp glad.c -ldl -lglfw
+g++ -g main.cpp physics/spatial_grid.cpp physics/particles.cpp physics/sdf.cpp physics/boundary_particles.cpp physics/rigid_body.cpp physics/physics.cpp physics/job_system.cpp physics/sim_thread.cpp physics/cpu_compute.cpp physics/cpu_pbf.cpp physics/cpu_iisph.cpp physics/cpu_granular.cpp physics/granular_cells.cpp physics/sweep_and_prune.cpp physics/multi_level_grid.cpp physics/numa.cpp physics/cpu_kernels_scalar.cpp physics/cpu_kernels_sse4.cpp physics/cpu_kernels_avx2.cpp physics/cpu_kernels_avx512.cpp renderer/renderer.cpp glad.c -ldl -lglfw -lpthread
 ./a.out